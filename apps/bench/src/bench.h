@@ -0,0 +1,35 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#ifndef _EVRYTHNG_BENCH_H
+#define _EVRYTHNG_BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+/* Timing helpers shared by the host benchmarks. */
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* CPU time consumed by the process, not affected by scheduling */
+static inline uint64_t bench_cpu_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* keeps the compiler from optimizing a benchmarked result away */
+static inline void bench_consume(const void* p)
+{
+    __asm__ __volatile__("" : : "r"(p) : "memory");
+}
+
+#endif
@@ -0,0 +1,163 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Size and encoding cost of typical payloads as JSON text versus CBOR,
+ * checking that the CBOR converts back to the same JSON. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <evrythng/cbor.h>
+#include <evrythng/json_writer.h>
+
+#include "bench.h"
+
+#define ITERATIONS 1000000
+#define BUF_SIZE 256
+
+static const double samples[] = { 21.5, 22.25, -3.75, 1013.5 };
+
+
+static int property_json(void* buf, int i)
+{
+    return EvrythngJsonPropertyInt(buf, BUF_SIZE, 1000 + i);
+}
+
+
+static int property_cbor(void* buf, int i)
+{
+    return EvrythngCborPropertyInt(buf, BUF_SIZE, 1000 + i);
+}
+
+
+static int action_json(void* buf, int i)
+{
+    evrythng_json_t w;
+
+    EvrythngJsonInit(&w, buf, BUF_SIZE);
+    EvrythngJsonActionBegin(&w, "_led1");
+    EvrythngJsonKey(&w, "status");
+    EvrythngJsonString(&w, i & 1 ? "1" : "0");
+    EvrythngJsonActionEnd(&w);
+
+    return EvrythngJsonFinish(&w) ? (int)w.len : -1;
+}
+
+
+static int action_cbor(void* buf, int i)
+{
+    evrythng_cbor_t w;
+
+    EvrythngCborInit(&w, buf, BUF_SIZE);
+    EvrythngCborMap(&w, 2);
+    EvrythngCborString(&w, "type");
+    EvrythngCborString(&w, "_led1");
+    EvrythngCborString(&w, "customFields");
+    EvrythngCborMap(&w, 1);
+    EvrythngCborString(&w, "status");
+    EvrythngCborString(&w, i & 1 ? "1" : "0");
+
+    return EvrythngCborFinish(&w);
+}
+
+
+/* a sensor batch: [{"value":v0},{"value":v1},...] */
+static int batch_json(void* buf, int i)
+{
+    evrythng_json_t w;
+    unsigned n;
+
+    EvrythngJsonInit(&w, buf, BUF_SIZE);
+    EvrythngJsonArrayBegin(&w);
+    for (n = 0; n < sizeof samples / sizeof samples[0]; n++)
+    {
+        EvrythngJsonObjectBegin(&w);
+        EvrythngJsonKey(&w, "value");
+        EvrythngJsonNumber(&w, samples[n] + (i & 3));
+        EvrythngJsonObjectEnd(&w);
+    }
+    EvrythngJsonArrayEnd(&w);
+
+    return EvrythngJsonFinish(&w) ? (int)w.len : -1;
+}
+
+
+static int batch_cbor(void* buf, int i)
+{
+    evrythng_cbor_t w;
+    unsigned n;
+
+    EvrythngCborInit(&w, buf, BUF_SIZE);
+    EvrythngCborArray(&w, sizeof samples / sizeof samples[0]);
+    for (n = 0; n < sizeof samples / sizeof samples[0]; n++)
+    {
+        EvrythngCborMap(&w, 1);
+        EvrythngCborString(&w, "value");
+        EvrythngCborFloat(&w, samples[n] + (i & 3));
+    }
+
+    return EvrythngCborFinish(&w);
+}
+
+
+static double run(int (*encode)(void*, int), unsigned char* out, int* out_len)
+{
+    unsigned char buf[BUF_SIZE];
+    int i, len = 0;
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        len = encode(buf, i);
+        bench_consume(buf);
+    }
+    uint64_t elapsed = bench_cpu_ns() - start;
+
+    memcpy(out, buf, len > 0 ? len : 0);
+    *out_len = len;
+
+    return (double)elapsed / ITERATIONS;
+}
+
+
+int main()
+{
+    static const struct {
+        const char* name;
+        int (*json)(void*, int);
+        int (*cbor)(void*, int);
+    } cases[] = {
+        { "int property", property_json, property_cbor },
+        { "action", action_json, action_cbor },
+        { "float batch of 4", batch_json, batch_cbor },
+    };
+    unsigned i;
+    int failed = 0;
+
+    printf("%-20s %10s %10s %10s %10s\n", "payload", "json B", "cbor B", "json ns", "cbor ns");
+
+    for (i = 0; i < sizeof cases / sizeof cases[0]; i++)
+    {
+        unsigned char json[BUF_SIZE], cbor[BUF_SIZE];
+        char converted[BUF_SIZE];
+        int json_len, cbor_len;
+
+        double json_ns = run(cases[i].json, json, &json_len);
+        double cbor_ns = run(cases[i].cbor, cbor, &cbor_len);
+
+        if (json_len < 0 || cbor_len < 0 ||
+                EvrythngCborToJson(cbor, cbor_len, converted, sizeof converted) != json_len ||
+                memcmp(converted, json, json_len))
+        {
+            printf("%s: CBOR doesn't convert back to the JSON payload\n", cases[i].name);
+            failed = 1;
+        }
+
+        printf("%-20s %10d %10d %10.1f %10.1f\n", cases[i].name, json_len, cbor_len, json_ns, cbor_ns);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Gateway registry scaling: registration, action routing and round-robin
+ * sending cost and memory per thng for growing numbers of thngs. */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <evrythng/gateway.h>
+
+#include "bench.h"
+
+#define DISPATCHES 1000000
+#define PER_THNG 2
+#define MAX_PENDING 4
+
+static const int thng_counts[] = { 10, 100, 1000, 5000, 20000 };
+
+typedef struct bench_thng_t
+{
+    char id[EVRYTHNG_GATEWAY_ID_SIZE + 1];
+    char action[128];
+    int action_len;
+    uint32_t actions;
+    uint32_t sent;
+} bench_thng_t;
+
+static bench_thng_t* thngs;
+static int thngs_count;
+static int misrouted;
+static int unfair;
+static uint32_t sends;
+
+
+static void on_action(void* ctx, const char* thng_id, const char* json, size_t len)
+{
+    bench_thng_t* t = (bench_thng_t*)ctx;
+    (void)json; (void)len;
+
+    if (strcmp(t->id, thng_id))
+        misrouted++;
+    t->actions++;
+}
+
+
+static evrythng_return_t count_send(void* ctx, const char* thng_id,
+        evrythng_gateway_msg_t type, const char* name, const char* json)
+{
+    (void)ctx; (void)type; (void)name; (void)json;
+
+    /* thng ids end in their index */
+    int i = atoi(thng_id + 8);
+    bench_thng_t* t = &thngs[i];
+
+    /* a thng gets its n-th message out in the n-th round */
+    if (t->sent != sends / thngs_count)
+        unfair++;
+    t->sent++;
+    sends++;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static int run(int n)
+{
+    evrythng_gateway_config_t config = EVRYTHNG_GATEWAY_CONFIG_DEFAULT;
+    evrythng_gateway_stats_t stats;
+    evrythng_gateway_t gw;
+    int i;
+
+    config.max_thngs = n;
+    config.queue_size = n * PER_THNG < 65534 ? n * PER_THNG : 65534;
+    config.max_pending = MAX_PENDING;
+    config.payload_size = 64;
+    config.send = count_send;
+
+    if (EvrythngGatewayCreate(&gw, NULL, &config) != EVRYTHNG_SUCCESS)
+    {
+        printf("failed to create a gateway for %d thngs\n", n);
+        return -1;
+    }
+
+    thngs = (bench_thng_t*)calloc(n, sizeof(bench_thng_t));
+    thngs_count = n;
+    misrouted = unfair = 0;
+    sends = 0;
+
+    for (i = 0; i < n; i++)
+    {
+        bench_thng_t* t = &thngs[i];
+        snprintf(t->id, sizeof t->id, "UEp4rDGs%016d", i);
+        t->action_len = snprintf(t->action, sizeof t->action,
+                "{\"id\":\"U3wAXpSxBgbAQKwwRkM7ntdd\",\"type\":\"_reboot\",\"thng\":\"%s\",\"timestamp\":1471529018045}", t->id);
+    }
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < n; i++)
+        EvrythngGatewayAddThng(gw, thngs[i].id, on_action, &thngs[i]);
+    double add_ns = (double)(bench_cpu_ns() - start) / n;
+
+    /* strided so consecutive lookups don't hit neighbouring records */
+    int k = 0;
+    start = bench_cpu_ns();
+    for (i = 0; i < DISPATCHES; i++)
+    {
+        const bench_thng_t* t = &thngs[k];
+        EvrythngGatewayDispatch(gw, t->action, t->action_len);
+        k = (k + 7919) % n;
+    }
+    double dispatch_ns = (double)(bench_cpu_ns() - start) / DISPATCHES;
+
+    start = bench_cpu_ns();
+    int queued = 0;
+    for (i = 0; i < n * PER_THNG && queued < config.queue_size; i++)
+        if (EvrythngGatewayPubThngProperty(gw, thngs[i % n].id, "temperature", "[{\"value\":21.5}]") == EVRYTHNG_SUCCESS)
+            queued++;
+    int sent = EvrythngGatewaySend(gw, queued);
+    double send_ns = (double)(bench_cpu_ns() - start) / (queued ? queued : 1);
+
+    EvrythngGatewayStats(gw, &stats);
+
+    /* a chatty thng can't take more than its share of the queue */
+    int accepted = 0;
+    for (i = 0; i < 2 * MAX_PENDING; i++)
+        if (EvrythngGatewayPubThngAction(gw, thngs[0].id, "_alarm", "{}") == EVRYTHNG_SUCCESS)
+            accepted++;
+
+    int ok = !misrouted && !unfair && sent == queued && stats.routed == DISPATCHES &&
+        !stats.unrouted && accepted == MAX_PENDING;
+
+    printf("%8d %10.1f %12.1f %10.1f %14.1f %10.1f %6s\n", n, add_ns, dispatch_ns, send_ns,
+            (double)stats.registry_bytes / n, (double)stats.queue_bytes / n, ok ? "ok" : "FAILED");
+
+    EvrythngGatewayDestroy(gw);
+    free(thngs);
+
+    return ok ? 0 : -1;
+}
+
+
+int main()
+{
+    unsigned i;
+    int failed = 0;
+
+    printf("%8s %10s %12s %10s %14s %10s\n", "thngs", "add ns", "dispatch ns", "send ns",
+            "registry B/thng", "queue B/thng");
+
+    for (i = 0; i < sizeof thng_counts / sizeof thng_counts[0]; i++)
+        if (run(thng_counts[i]))
+            failed = 1;
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,441 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Client CPU time of a TLS 1.2 handshake and of protecting an MQTT sized
+ * record per cipher suite and curve offered by default, against an
+ * in-memory server, and cost of verifying a CA chain compared to a public
+ * key pin. Uses the OpenSSL of the host, not mbedtls: the numbers don't
+ * carry over to a Cortex-M and don't decide the default order of the
+ * Marvell port. The host has AES instructions, so AES-GCM looks cheaper
+ * here than on a board without an AES engine. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#include <openssl/x509v3.h>
+
+#include <evrythng/sha256.h>
+
+#include "bench.h"
+
+#define HANDSHAKES 200
+#define RECORDS 20000
+#define RECORD_SIZE 256
+
+typedef struct suite_t
+{
+    const char* cipher;
+    const char* curves;     /* offered, the first one is used */
+    int rsa;                /* server certificate key */
+} suite_t;
+
+static const suite_t suites[] = {
+    /* the P-256 of the ECDSA certificate has to be offered too */
+    { "ECDHE-ECDSA-AES128-GCM-SHA256", "P-256", 0 },
+    { "ECDHE-ECDSA-AES128-GCM-SHA256", "X25519:P-256", 0 },
+    { "ECDHE-ECDSA-CHACHA20-POLY1305", "X25519:P-256", 0 },
+    { "ECDHE-RSA-AES128-GCM-SHA256", "P-256", 1 },
+    { "ECDHE-RSA-AES128-GCM-SHA256", "X25519", 1 },
+    { "ECDHE-RSA-CHACHA20-POLY1305", "X25519", 1 },
+};
+
+typedef struct server_t
+{
+    EVP_PKEY* key;
+    X509* cert;
+    SSL_CTX* ctx;
+} server_t;
+
+
+/* bytes allocated by the client while counting */
+static int counting;
+static uint64_t counted_bytes;
+
+
+static void* count_malloc(size_t size, const char* file, int line)
+{
+    (void)file; (void)line;
+
+    if (counting)
+        counted_bytes += size;
+    return malloc(size);
+}
+
+
+static void* count_realloc(void* p, size_t size, const char* file, int line)
+{
+    (void)file; (void)line;
+
+    if (counting)
+        counted_bytes += size;
+    return realloc(p, size);
+}
+
+
+static void count_free(void* p, const char* file, int line)
+{
+    (void)file; (void)line;
+    free(p);
+}
+
+
+static int make_server(server_t* s, int rsa)
+{
+    s->key = rsa ? EVP_RSA_gen(2048) : EVP_EC_gen("P-256");
+    s->cert = X509_new();
+    if (!s->key || !s->cert)
+        return -1;
+
+    X509_set_version(s->cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(s->cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(s->cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(s->cert), 3600);
+    X509_set_pubkey(s->cert, s->key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(s->cert), "CN", MBSTRING_ASC,
+            (const unsigned char*)"mqtt.evrythng.com", -1, -1, 0);
+    X509_set_issuer_name(s->cert, X509_get_subject_name(s->cert));
+    if (!X509_sign(s->cert, s->key, EVP_sha256()))
+        return -1;
+
+    s->ctx = SSL_CTX_new(TLS_server_method());
+    if (!s->ctx || !SSL_CTX_use_certificate(s->ctx, s->cert) || !SSL_CTX_use_PrivateKey(s->ctx, s->key))
+        return -1;
+
+    SSL_CTX_set_min_proto_version(s->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(s->ctx, TLS1_2_VERSION);
+    SSL_CTX_set_session_cache_mode(s->ctx, SSL_SESS_CACHE_OFF);
+
+    return 0;
+}
+
+
+static void free_server(server_t* s)
+{
+    SSL_CTX_free(s->ctx);
+    X509_free(s->cert);
+    EVP_PKEY_free(s->key);
+}
+
+
+/* SSL object connected to the peer through a pair of memory BIOs */
+static void connect_pair(SSL_CTX* client_ctx, SSL_CTX* server_ctx, SSL** client, SSL** server)
+{
+    BIO *c, *s;
+
+    BIO_new_bio_pair(&c, 0, &s, 0);
+    *client = SSL_new(client_ctx);
+    *server = SSL_new(server_ctx);
+    SSL_set_bio(*client, c, c);
+    SSL_set_bio(*server, s, s);
+    SSL_set_connect_state(*client);
+    SSL_set_accept_state(*server);
+}
+
+
+/* runs one handshake, returns the client CPU time or 0 on failure */
+static uint64_t handshake(SSL_CTX* client_ctx, SSL_CTX* server_ctx, SSL** client, SSL** server)
+{
+    uint64_t client_ns = 0;
+    int client_done = 0, server_done = 0, rounds = 0;
+
+    connect_pair(client_ctx, server_ctx, client, server);
+
+    while ((!client_done || !server_done) && rounds++ < 16)
+    {
+        if (!client_done)
+        {
+            uint64_t start = bench_cpu_ns();
+            int rc = SSL_do_handshake(*client);
+            client_ns += bench_cpu_ns() - start;
+
+            if (rc == 1)
+                client_done = 1;
+            else if (SSL_get_error(*client, rc) != SSL_ERROR_WANT_READ)
+                return 0;
+        }
+
+        if (!server_done)
+        {
+            int rc = SSL_do_handshake(*server);
+            if (rc == 1)
+                server_done = 1;
+            else if (SSL_get_error(*server, rc) != SSL_ERROR_WANT_READ)
+                return 0;
+        }
+    }
+
+    return client_done && server_done ? client_ns : 0;
+}
+
+
+/* client CPU time to protect a record and the server to take it */
+static double record_ns(SSL* client, SSL* server)
+{
+    unsigned char payload[RECORD_SIZE], buf[RECORD_SIZE];
+    uint64_t client_ns = 0;
+    int i;
+
+    memset(payload, 0x5a, sizeof payload);
+
+    for (i = 0; i < RECORDS; i++)
+    {
+        uint64_t start = bench_cpu_ns();
+        int rc = SSL_write(client, payload, sizeof payload);
+        client_ns += bench_cpu_ns() - start;
+
+        if (rc != (int)sizeof payload || SSL_read(server, buf, sizeof buf) != (int)sizeof buf)
+            return -1;
+    }
+
+    return (double)client_ns / RECORDS;
+}
+
+
+/* certificate of key signed by issuer, self-signed if issuer is NULL */
+static X509* make_cert(EVP_PKEY* key, const char* cn, X509* issuer, EVP_PKEY* issuer_key, int ca)
+{
+    X509* cert = X509_new();
+    X509V3_CTX v3;
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 3600);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const unsigned char*)cn, -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(issuer ? issuer : cert));
+
+    X509V3_set_ctx(&v3, issuer ? issuer : cert, cert, 0, 0, 0);
+    X509_EXTENSION* ext = X509V3_EXT_conf_nid(0, &v3, NID_basic_constraints, ca ? "critical,CA:TRUE" : "CA:FALSE");
+    X509_add_ext(cert, ext, -1);
+    X509_EXTENSION_free(ext);
+
+    X509_sign(cert, issuer_key ? issuer_key : key, EVP_sha256());
+
+    return cert;
+}
+
+
+/* SHA-256 of the DER SubjectPublicKeyInfo, as given to platform_tls_pin() */
+static void spki_sha256(X509* cert, unsigned char digest[EVRYTHNG_SHA256_SIZE])
+{
+    unsigned char* der = 0;
+    evrythng_sha256_t sha;
+
+    int len = i2d_X509_PUBKEY(X509_get_X509_PUBKEY(cert), &der);
+
+    EvrythngSha256Init(&sha);
+    EvrythngSha256Update(&sha, der, len > 0 ? len : 0);
+    EvrythngSha256Finish(&sha, digest);
+
+    OPENSSL_free(der);
+}
+
+
+/* handshakes against a server sending leaf and intermediate, either
+ * verifying the chain up to the root or checking the leaf key pin */
+static int run_verify(int pinned, SSL_CTX* server_ctx, const char* root_pem, const unsigned char* pin)
+{
+    uint64_t total = 0;
+    int i, ok = 1;
+
+    counted_bytes = 0;
+
+    for (i = 0; i < HANDSHAKES && ok; i++)
+    {
+        SSL *c = 0, *s = 0;
+
+        uint64_t start = bench_cpu_ns();
+        counting = 1;
+
+        /* the device builds its TLS configuration per connection too */
+        SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+        SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(client_ctx, "ECDHE-RSA-AES128-GCM-SHA256");
+        SSL_CTX_set1_groups_list(client_ctx, "X25519");
+        SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_OFF);
+
+        if (!pinned)
+        {
+            BIO* pem = BIO_new_mem_buf(root_pem, -1);
+            X509* root = PEM_read_bio_X509(pem, 0, 0, 0);
+            X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx), root);
+            X509_free(root);
+            BIO_free(pem);
+        }
+        SSL_CTX_set_verify(client_ctx, pinned ? SSL_VERIFY_NONE : SSL_VERIFY_PEER, 0);
+
+        counting = 0;
+        total += bench_cpu_ns() - start;
+
+        counting = 1;
+        uint64_t ns = handshake(client_ctx, server_ctx, &c, &s);
+        counting = 0;
+        if (!ns)
+            ok = 0;
+        total += ns;
+
+        if (ok && pinned)
+        {
+            unsigned char digest[EVRYTHNG_SHA256_SIZE];
+
+            start = bench_cpu_ns();
+            spki_sha256((X509*)SSL_get0_peer_certificate(c), digest);
+            if (memcmp(digest, pin, sizeof digest))
+                ok = 0;
+            total += bench_cpu_ns() - start;
+        }
+
+        SSL_free(c);
+        SSL_free(s);
+        SSL_CTX_free(client_ctx);
+    }
+
+    printf("%-32s %14.1f %12.1f %6s\n", pinned ? "public key pin" : "CA chain (root, intermediate)",
+            ok ? (double)total / HANDSHAKES / 1000 : 0, ok ? (double)counted_bytes / HANDSHAKES / 1024 : 0,
+            ok ? "ok" : "FAILED");
+
+    if (!ok)
+        ERR_print_errors_fp(stdout);
+
+    return ok ? 0 : -1;
+}
+
+
+static int verify_benchmark(void)
+{
+    unsigned char pin[EVRYTHNG_SHA256_SIZE];
+    int failed = 0;
+
+    EVP_PKEY* root_key = EVP_RSA_gen(2048);
+    EVP_PKEY* intermediate_key = EVP_RSA_gen(2048);
+    EVP_PKEY* leaf_key = EVP_RSA_gen(2048);
+
+    X509* root = make_cert(root_key, "Root CA", 0, 0, 1);
+    X509* intermediate = make_cert(intermediate_key, "Intermediate CA", root, root_key, 1);
+    X509* leaf = make_cert(leaf_key, "mqtt.evrythng.com", intermediate, intermediate_key, 0);
+
+    SSL_CTX* server_ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX_use_certificate(server_ctx, leaf);
+    SSL_CTX_use_PrivateKey(server_ctx, leaf_key);
+    SSL_CTX_add1_chain_cert(server_ctx, intermediate);
+    SSL_CTX_set_session_cache_mode(server_ctx, SSL_SESS_CACHE_OFF);
+
+    /* the CA is parsed from PEM on every connection, as on the device */
+    char root_pem[4096];
+    BIO* pem = BIO_new(BIO_s_mem());
+    PEM_write_bio_X509(pem, root);
+    int pem_len = BIO_read(pem, root_pem, sizeof root_pem - 1);
+    root_pem[pem_len > 0 ? pem_len : 0] = '\0';
+    BIO_free(pem);
+
+    spki_sha256(leaf, pin);
+
+    printf("\n%-32s %14s %12s\n", "server verification", "handshake us", "alloc KB");
+
+    if (run_verify(0, server_ctx, root_pem, pin) || run_verify(1, server_ctx, root_pem, pin))
+        failed = 1;
+
+    SSL_CTX_free(server_ctx);
+    X509_free(leaf);
+    X509_free(intermediate);
+    X509_free(root);
+    EVP_PKEY_free(leaf_key);
+    EVP_PKEY_free(intermediate_key);
+    EVP_PKEY_free(root_key);
+
+    return failed;
+}
+
+
+static int run(const suite_t* suite, server_t* server)
+{
+    SSL_CTX* client_ctx = SSL_CTX_new(TLS_client_method());
+    SSL *c = 0, *s = 0;
+    uint64_t total = 0;
+    int i, ok = 1;
+
+    /* the client verifies the server certificate as the device does */
+    SSL_CTX_set_min_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_max_proto_version(client_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_cipher_list(client_ctx, suite->cipher);
+    SSL_CTX_set1_groups_list(client_ctx, suite->curves);
+    SSL_CTX_set_session_cache_mode(client_ctx, SSL_SESS_CACHE_OFF);
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(client_ctx), server->cert);
+    SSL_CTX_set_verify(client_ctx, SSL_VERIFY_PEER, 0);
+
+    for (i = 0; i < HANDSHAKES && ok; i++)
+    {
+        uint64_t ns = handshake(client_ctx, server->ctx, &c, &s);
+        if (!ns || strcmp(SSL_get_cipher_name(c), suite->cipher))
+            ok = 0;
+        total += ns;
+
+        if (i + 1 < HANDSHAKES || !ok)
+        {
+            SSL_free(c);
+            SSL_free(s);
+            c = s = 0;
+        }
+    }
+
+    double record = ok ? record_ns(c, s) : -1;
+    if (record < 0)
+        ok = 0;
+
+    char kx[8] = "RSA";
+    if (!strncmp(suite->cipher, "ECDHE", 5))
+        sscanf(suite->curves, "%7[^:]", kx);
+
+    printf("%-32s %-7s %-5s %14.1f %12.1f %6s\n", suite->cipher, kx, suite->rsa ? "RSA" : "ECDSA",
+            ok ? (double)total / HANDSHAKES / 1000 : 0, ok ? record : 0, ok ? "ok" : "FAILED");
+
+    if (!ok)
+        ERR_print_errors_fp(stdout);
+
+    SSL_free(c);
+    SSL_free(s);
+    SSL_CTX_free(client_ctx);
+
+    return ok ? 0 : -1;
+}
+
+
+int main()
+{
+    server_t ecdsa, rsa;
+    unsigned i;
+    int failed = 0;
+
+    CRYPTO_set_mem_functions(count_malloc, count_realloc, count_free);
+
+    if (make_server(&ecdsa, 0) || make_server(&rsa, 1))
+    {
+        printf("failed to set up the servers\n");
+        ERR_print_errors_fp(stdout);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-32s %-7s %-5s %14s %12s\n", "suite", "kx", "cert", "handshake us", "record ns");
+
+    for (i = 0; i < sizeof suites / sizeof suites[0]; i++)
+        if (run(&suites[i], suites[i].rsa ? &rsa : &ecdsa))
+            failed = 1;
+
+    free_server(&ecdsa);
+    free_server(&rsa);
+
+    if (verify_benchmark())
+        failed = 1;
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
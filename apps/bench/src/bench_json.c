@@ -0,0 +1,118 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Cost of building property and action payloads with snprintf versus the
+ * JSON writer. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <evrythng/json_writer.h>
+
+#include "bench.h"
+
+#define ITERATIONS 1000000
+#define BUF_SIZE 128
+
+
+static int property_printf(char* buf, int i)
+{
+    return snprintf(buf, BUF_SIZE, "[{\"value\":%d}]", i);
+}
+
+
+static int property_writer(char* buf, int i)
+{
+    return EvrythngJsonPropertyInt(buf, BUF_SIZE, i);
+}
+
+
+static int float_printf(char* buf, int i)
+{
+    return snprintf(buf, BUF_SIZE, "[{\"value\":%.2f}]", i / 100.0 + 0.001);
+}
+
+
+static int float_writer(char* buf, int i)
+{
+    return EvrythngJsonPropertyFloat(buf, BUF_SIZE, i / 100.0 + 0.001, 2);
+}
+
+
+static int action_printf(char* buf, int i)
+{
+    return snprintf(buf, BUF_SIZE, "{\"type\":\"%s\",\"customFields\":{\"status\":\"%d\"}}", "_led1", i & 1);
+}
+
+
+static int action_writer(char* buf, int i)
+{
+    evrythng_json_t w;
+
+    EvrythngJsonInit(&w, buf, BUF_SIZE);
+    EvrythngJsonActionBegin(&w, "_led1");
+    EvrythngJsonKey(&w, "status");
+    EvrythngJsonString(&w, i & 1 ? "1" : "0");
+    EvrythngJsonActionEnd(&w);
+
+    return EvrythngJsonFinish(&w) ? (int)w.len : -1;
+}
+
+
+static double run(int (*build)(char*, int), char* out)
+{
+    char buf[BUF_SIZE];
+    int i;
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        build(buf, i);
+        bench_consume(buf);
+    }
+    uint64_t elapsed = bench_cpu_ns() - start;
+
+    /* the payload of the last iteration is compared between both */
+    strcpy(out, buf);
+
+    return (double)elapsed / ITERATIONS;
+}
+
+
+int main()
+{
+    static const struct {
+        const char* name;
+        int (*before)(char*, int);
+        int (*after)(char*, int);
+    } cases[] = {
+        { "int property", property_printf, property_writer },
+        { "float property", float_printf, float_writer },
+        { "action", action_printf, action_writer },
+    };
+    unsigned i;
+    int failed = 0;
+
+    printf("%-20s %12s %12s %8s\n", "payload", "snprintf ns", "writer ns", "speedup");
+
+    for (i = 0; i < sizeof cases / sizeof cases[0]; i++)
+    {
+        char before[BUF_SIZE], after[BUF_SIZE];
+
+        double before_ns = run(cases[i].before, before);
+        double after_ns = run(cases[i].after, after);
+
+        if (strcmp(before, after))
+        {
+            printf("%s: writer produced %s instead of %s\n", cases[i].name, after, before);
+            failed = 1;
+        }
+
+        printf("%-20s %12.1f %12.1f %7.2fx\n", cases[i].name, before_ns, after_ns, before_ns / after_ns);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,182 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* SDK overhead with networking removed: MQTT PUBLISH packets go through
+ * platform_network_write/read over the loopback transport to the broker
+ * stand-in (apps/broker). Round trips are broken down with the latency the
+ * broker measured between a packet arriving and being taken up by a worker
+ * (queueing) and until it was answered (handling). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <MQTTPacket.h>
+#include <evrythng/platform.h>
+#include <evrythng/transport.h>
+
+#include "bench.h"
+#include "broker.h"
+
+#define BROKER "broker.loopback"
+#define TOPIC "thngs/UEp4rDGsnpCAF6xABbys5Amc/properties/temperature"
+#define ROUND_TRIPS 100000
+#define STREAMED 1000000
+#define TIMEOUT_MS 1000
+
+
+/* reads one packet from n, returns its first byte or -1 */
+static int read_packet(Network* n, unsigned char* packet, int size)
+{
+    int rem = 0, mult = 1, i = 1;
+
+    if (platform_network_read(n, packet, 1, TIMEOUT_MS) != 1)
+        return -1;
+    do
+    {
+        if (i == 5 || platform_network_read(n, packet + i, 1, TIMEOUT_MS) != 1)
+            return -1;
+        rem += (packet[i] & 127) * mult;
+        mult *= 128;
+    }
+    while (packet[i++] & 128);
+
+    if (i + rem > size || (rem && platform_network_read(n, packet + i, rem, TIMEOUT_MS) != rem))
+        return -1;
+
+    return packet[0];
+}
+
+
+static int subscribe(Network* n, const char* filter)
+{
+    unsigned char buf[128];
+    int len = (int)strlen(filter);
+
+    if (len + 7 > (int)sizeof buf)
+        return -1;
+
+    /* fixed header, packet id, topic and requested QoS */
+    int i = 0;
+    buf[i++] = SUBSCRIBE << 4 | 2;
+    buf[i++] = (unsigned char)(len + 5);
+    buf[i++] = 0;
+    buf[i++] = 1;
+    buf[i++] = (unsigned char)(len >> 8);
+    buf[i++] = (unsigned char)len;
+    memcpy(buf + i, filter, len);
+    i += len;
+    buf[i++] = 0;
+
+    if (platform_network_write(n, buf, i, TIMEOUT_MS) != i)
+        return -1;
+
+    return read_packet(n, buf, sizeof buf) >> 4 == SUBACK && buf[4] == 0 ? 0 : -1;
+}
+
+
+static void print_breakdown(const char* name, double round_trip_ns)
+{
+    broker_stats_t s;
+    broker_stats(&s);
+
+    printf("%-28s %10.0f ns   broker queueing p50/p99 <= %u/%u us, handling <= %u/%u us\n", name,
+            round_trip_ns, broker_latency_percentile(s.queue_us, 50), broker_latency_percentile(s.queue_us, 99),
+            broker_latency_percentile(s.handle_us, 50), broker_latency_percentile(s.handle_us, 99));
+
+    broker_stats_reset();
+}
+
+
+static int publish(Network* n, int qos, unsigned short id, unsigned char* payload, int payload_len)
+{
+    unsigned char buf[512];
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = TOPIC;
+
+    int len = MQTTSerialize_publish(buf, sizeof buf, 0, qos, 0, id, topic, payload, payload_len);
+    if (platform_network_write(n, buf, len, TIMEOUT_MS) != len)
+        return -1;
+
+    return len;
+}
+
+
+int main()
+{
+    broker_stats_t stats;
+    Network n;
+    unsigned char payload[256];
+    unsigned char packet[512];
+    unsigned long streamed = 0;
+    int i, ok = 1;
+
+    memset(payload, 'x', sizeof payload);
+
+    if (broker_start(BROKER, 1) != 0)
+    {
+        printf("failed to start the broker\n");
+        return EXIT_FAILURE;
+    }
+
+    platform_network_init(&n);
+    if (platform_network_connect(&n, BROKER, 1883) != 0)
+    {
+        printf("failed to connect to the loopback broker\n");
+        return EXIT_FAILURE;
+    }
+
+    /* QoS 1: each publish waits for its PUBACK */
+    uint64_t start = bench_now_ns();
+    for (i = 0; i < ROUND_TRIPS && ok; i++)
+    {
+        unsigned short id = (unsigned short)(i % 65535 + 1);
+
+        ok = publish(&n, 1, id, payload, 64) > 0 && read_packet(&n, packet, sizeof packet) >> 4 == PUBACK &&
+            (packet[2] << 8 | packet[3]) == id;
+    }
+    print_breakdown("QoS 1 publish round trip", (double)(bench_now_ns() - start) / ROUND_TRIPS);
+
+    /* QoS 0: publishes streamed as fast as the broker drains them */
+    start = bench_now_ns();
+    for (i = 0; i < STREAMED && ok; i++)
+    {
+        int len = publish(&n, 0, 0, payload, sizeof payload);
+        ok = len > 0;
+        streamed += len;
+    }
+
+    /* the broker has read everything once a round trip after them answers */
+    ok = ok && publish(&n, 1, 1, payload, 0) > 0 && read_packet(&n, packet, sizeof packet) >> 4 == PUBACK;
+    uint64_t stream_ns = bench_now_ns() - start;
+
+    broker_stats(&stats);
+    broker_stats_reset();
+    ok = ok && stats.publishes == STREAMED + 1 && stats.delivered == 0;
+
+    printf("%-28s %10.0f msg/s %8.1f MB/s\n", "QoS 0 publish stream",
+            STREAMED * 1e9 / stream_ns, (double)streamed / stream_ns * 1e3);
+
+    /* QoS 0: each publish waits for the broker to echo it to the subscription */
+    ok = ok && subscribe(&n, "thngs/UEp4rDGsnpCAF6xABbys5Amc/properties") == 0;
+    start = bench_now_ns();
+    for (i = 0; i < ROUND_TRIPS && ok; i++)
+        ok = publish(&n, 0, 0, payload, 64) > 0 && read_packet(&n, packet, sizeof packet) >> 4 == PUBLISH;
+    double echo_ns = (double)(bench_now_ns() - start) / ROUND_TRIPS;
+
+    /* the statistics of a publish are complete once the next one is acknowledged */
+    ok = ok && publish(&n, 1, 1, payload, 0) > 0 && read_packet(&n, packet, sizeof packet) >> 4 == PUBACK &&
+        read_packet(&n, packet, sizeof packet) >> 4 == PUBLISH;
+    broker_stats(&stats);
+    ok = ok && stats.delivered >= ROUND_TRIPS;
+    print_breakdown("QoS 0 publish echo", echo_ns);
+
+    platform_network_disconnect(&n);
+    broker_stop();
+
+    printf("%-28s %10s\n", "publishes received", ok ? "ok" : "FAILED");
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
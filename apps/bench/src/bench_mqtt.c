@@ -0,0 +1,441 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Per-packet cost of the MQTT packet codec on corpora of EVRYTHNG traffic:
+ * property updates and actions published by a device, action and firmware
+ * pushes received from the cloud, and a mix of them. Each corpus is run
+ * through MQTTSerialize_publish() and MQTTDeserialize_publish(), QoS 1
+ * packets also through their PUBACK. A capture (see evrythng/capture.h)
+ * given as argument adds the PUBLISH packets found in it as a corpus.
+ * Reports ns/packet and MB/s of packet bytes. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <MQTTPacket.h>
+#include <evrythng/capture.h>
+
+#include "bench.h"
+
+#define CORPUS_SIZE 256
+#define PACKETS_PER_RUN 2000000
+#define BUF_SIZE 8192
+#define MAX_CONNECTIONS 256
+
+static const char* thng_ids[] = {
+    "UEp4rDGsnpCAF6xABbys5Amc",
+    "U3s8qRbEeDPwX6sWKhNtbyqd",
+    "UkPHWnqW8BSaRHrs4dEsKNfs",
+};
+
+static const char* properties[] = {
+    "temperature",
+    "button_1",
+    "battery_level",
+    "rssi",
+    "a_rather_long_property_name_for_a_sensor_reading",
+};
+
+static const char* actions[] = {
+    "_led1",
+    "_firmwareUpdated",
+    "scans",
+    "_customerDoorOpened",
+};
+
+typedef struct packet_t
+{
+    unsigned char* data;
+    int len;
+    /* fields as deserialized, point into data */
+    MQTTString topic;
+    unsigned char* payload;
+    int payload_len;
+    int qos;
+    unsigned short packetid;
+} packet_t;
+
+typedef struct corpus_t
+{
+    const char* name;
+    packet_t packets[CORPUS_SIZE];
+    int count;
+    unsigned long bytes;
+} corpus_t;
+
+static uint32_t seed = 1;
+
+
+/* deterministic, the corpora are the same on every run */
+static uint32_t next_random(uint32_t range)
+{
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % range;
+}
+
+
+/* adds fields to a JSON object being written at buf + len, up to size */
+static int custom_fields(char* buf, int len, int size, int fields)
+{
+    int i;
+
+    for (i = 0; i < fields && len < size; i++)
+        len += snprintf(buf + len, size - len, "%s\"field_%d\":\"%04x%04x-%04x\"", i ? "," : "", i,
+                next_random(0x10000), next_random(0x10000), next_random(0x10000));
+
+    return len < size ? len : size - 1;
+}
+
+
+static int property_payload(char* buf, int size)
+{
+    if (next_random(2))
+        return snprintf(buf, size, "[{\"value\":%u}]", next_random(1000));
+    return snprintf(buf, size, "[{\"value\":%u.%02u,\"timestamp\":14768%08u}]",
+            next_random(100), next_random(100), next_random(100000000));
+}
+
+
+static int action_payload(char* buf, int size, const char* type, int fields)
+{
+    int len = snprintf(buf, size, "{\"type\":\"%s\",\"customFields\":{", type);
+    len = custom_fields(buf, len, size - 2, fields);
+    return len + snprintf(buf + len, size - len, "}}");
+}
+
+
+/* an action as pushed by the cloud, with what it adds to the one created */
+static int pushed_payload(char* buf, int size, const char* type, const char* thng, int fields)
+{
+    int len = snprintf(buf, size, "{\"id\":\"U%023u\",\"createdAt\":14768%08u,\"timestamp\":14768%08u,"
+            "\"type\":\"%s\",\"thng\":\"%s\",\"location\":{\"latitude\":51.5%05u,\"longitude\":-0.1%05u,"
+            "\"position\":{\"type\":\"Point\",\"coordinates\":[-0.1%05u,51.5%05u]}},"
+            "\"context\":{\"ipAddress\":\"10.%u.%u.%u\",\"city\":\"London\",\"region\":\"England\","
+            "\"countryCode\":\"GB\",\"timeZone\":\"Europe/London\"},\"customFields\":{",
+            next_random(1000000), next_random(100000000), next_random(100000000), type, thng,
+            next_random(100000), next_random(100000), next_random(100000), next_random(100000),
+            next_random(256), next_random(256), next_random(256));
+    len = custom_fields(buf, len, size - 2, fields);
+    return len + snprintf(buf + len, size - len, "}}");
+}
+
+
+static int firmware_payload(char* buf, int size)
+{
+    return snprintf(buf, size, "[{\"value\":\"https://files.evrythng.com/firmware/%04x%04x/evrythng-%u.%u.%u.bin\","
+            "\"timestamp\":14768%08u}]", next_random(0x10000), next_random(0x10000), next_random(4), next_random(20),
+            next_random(100), next_random(100000000));
+}
+
+
+/* deserializes a packet into its fields */
+static int packet_parse(packet_t* p)
+{
+    unsigned char dup, retained;
+
+    return MQTTDeserialize_publish(&dup, &p->qos, &retained, &p->packetid, &p->topic,
+            &p->payload, &p->payload_len, p->data, p->len) == 1 ? 0 : -1;
+}
+
+
+static int corpus_add_packet(corpus_t* c, const unsigned char* data, int len)
+{
+    packet_t* p = &c->packets[c->count];
+
+    if (c->count == CORPUS_SIZE)
+        return -1;
+
+    p->data = (unsigned char*)malloc(len);
+    if (!p->data)
+        return -1;
+    memcpy(p->data, data, len);
+    p->len = len;
+
+    if (packet_parse(p) != 0)
+    {
+        free(p->data);
+        return -1;
+    }
+
+    c->count++;
+    c->bytes += len;
+
+    return 0;
+}
+
+
+/* serializes a publish into the corpus and checks it deserializes to the same */
+static int corpus_add(corpus_t* c, const char* topic, const char* payload, int payload_len, int qos)
+{
+    unsigned char buf[BUF_SIZE];
+    MQTTString topic_str = MQTTString_initializer;
+    unsigned short packetid = (unsigned short)(c->count + 1);
+
+    topic_str.cstring = (char*)topic;
+
+    int len = MQTTSerialize_publish(buf, sizeof buf, 0, qos, 0, packetid, topic_str,
+            (unsigned char*)payload, payload_len);
+    if (len <= 0 || corpus_add_packet(c, buf, len) != 0)
+        return -1;
+
+    packet_t* p = &c->packets[c->count - 1];
+    if (p->qos != qos || (qos && p->packetid != packetid) || p->payload_len != payload_len ||
+            memcmp(p->payload, payload, payload_len) || p->topic.lenstring.len != (int)strlen(topic) ||
+            memcmp(p->topic.lenstring.data, topic, strlen(topic)))
+    {
+        printf("%s: %s does not deserialize to what was serialized\n", c->name, topic);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static int corpus_add_property(corpus_t* c)
+{
+    char topic[128], payload[128];
+    const char* thng = thng_ids[next_random(3)];
+
+    snprintf(topic, sizeof topic, "thngs/%s/properties/%s", thng, properties[next_random(5)]);
+    return corpus_add(c, topic, payload, property_payload(payload, sizeof payload), 1);
+}
+
+
+static int corpus_add_action(corpus_t* c)
+{
+    char topic[128], payload[1024];
+    const char* type = actions[next_random(4)];
+
+    snprintf(topic, sizeof topic, "thngs/%s/actions/%s", thng_ids[next_random(3)], type);
+    return corpus_add(c, topic, payload, action_payload(payload, sizeof payload, type, next_random(12)), 1);
+}
+
+
+static int corpus_add_push(corpus_t* c)
+{
+    char topic[128], payload[BUF_SIZE / 2];
+    const char* thng = thng_ids[next_random(3)];
+
+    /* one in eight is a firmware update, the action ones vary from a few
+     * hundred bytes to a few KB */
+    if (!next_random(8))
+    {
+        snprintf(topic, sizeof topic, "thngs/%s/properties/_firmware", thng);
+        return corpus_add(c, topic, payload, firmware_payload(payload, sizeof payload), 1);
+    }
+
+    const char* type = actions[next_random(4)];
+    int fields = next_random(4) ? next_random(8) : 40 + next_random(60);
+
+    snprintf(topic, sizeof topic, "thngs/%s/actions/%s", thng, type);
+    return corpus_add(c, topic, payload, pushed_payload(payload, sizeof payload, type, thng, fields), 1);
+}
+
+
+static int corpus_build(corpus_t* c, const char* name, int (*add)(corpus_t*))
+{
+    c->name = name;
+    while (c->count < CORPUS_SIZE)
+        if (add(c) != 0)
+            return -1;
+    return 0;
+}
+
+
+/* mostly property updates and actions, some pushes; QoS 0 for a quarter */
+static int corpus_add_mixed(corpus_t* c)
+{
+    uint32_t r = next_random(8);
+
+    if (r < 4)
+    {
+        char topic[128], payload[128];
+        snprintf(topic, sizeof topic, "thngs/%s/properties/%s", thng_ids[next_random(3)], properties[next_random(5)]);
+        return corpus_add(c, topic, payload, property_payload(payload, sizeof payload), r == 0 ? 0 : 1);
+    }
+
+    return r < 6 ? corpus_add_action(c) : corpus_add_push(c);
+}
+
+
+/* the PUBLISH packets of a capture, as many as fit, both directions */
+static int corpus_from_capture(corpus_t* c, const char* path)
+{
+    static unsigned char stream[MAX_CONNECTIONS][2][BUF_SIZE];
+    static int stream_len[MAX_CONNECTIONS][2];
+    capture_record_t r;
+    size_t pos = 0;
+
+    c->name = "capture";
+
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* capture = (uint8_t*)malloc(len > 0 ? len : 1);
+    if (!capture || fread(capture, 1, len, f) != (size_t)len)
+    {
+        fclose(f);
+        free(capture);
+        printf("failed to read %s\n", path);
+        return -1;
+    }
+    fclose(f);
+
+    while (pos < (size_t)len && c->count < CORPUS_SIZE)
+    {
+        int size = capture_parse(capture + pos, len - pos, &r);
+        if (size < 0)
+            break;
+        pos += size;
+
+        if (r.type == CAPTURE_OPEN)
+            stream_len[r.connection][0] = stream_len[r.connection][1] = 0;
+        if (r.type != CAPTURE_READ && r.type != CAPTURE_WRITE)
+            continue;
+
+        /* appends the data to the stream of its direction, then takes the
+         * complete packets off its front */
+        unsigned char* s = stream[r.connection][r.type == CAPTURE_WRITE];
+        int* s_len = &stream_len[r.connection][r.type == CAPTURE_WRITE];
+        const uint8_t* data = capture + pos - r.len;
+        uint32_t left = r.len;
+
+        while (left)
+        {
+            uint32_t n = (uint32_t)(BUF_SIZE - *s_len) < left ? (uint32_t)(BUF_SIZE - *s_len) : left;
+            memcpy(s + *s_len, data, n);
+            *s_len += n;
+            data += n;
+            left -= n;
+
+            for (;;)
+            {
+                int rem = 0, mult = 1, i = 1;
+                while (i < *s_len && i < 5 && s[i] & 128)
+                    rem += (s[i++] & 127) * mult, mult *= 128;
+                if (i >= *s_len)
+                    break;
+                rem += (s[i++] & 127) * mult;
+
+                if (i + rem > BUF_SIZE)
+                {
+                    /* larger than we keep, skips the rest of the stream */
+                    *s_len = 0;
+                    break;
+                }
+                if (i + rem > *s_len)
+                    break;
+
+                if (s[0] >> 4 == PUBLISH)
+                    corpus_add_packet(c, s, i + rem);
+                memmove(s, s + i + rem, *s_len - (i + rem));
+                *s_len -= i + rem;
+            }
+        }
+    }
+    free(capture);
+
+    if (!c->count)
+    {
+        printf("no PUBLISH packets in %s\n", path);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+static void run(const corpus_t* c)
+{
+    static unsigned char buf[BUF_SIZE];
+    int rounds = PACKETS_PER_RUN / c->count, acks = 0, i, j;
+    unsigned long packets = (unsigned long)rounds * c->count;
+    unsigned long bytes = (unsigned long)rounds * c->bytes;
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < rounds; i++)
+    {
+        for (j = 0; j < c->count; j++)
+        {
+            const packet_t* p = &c->packets[j];
+            MQTTSerialize_publish(buf, sizeof buf, 0, p->qos, 0, p->packetid, p->topic, p->payload, p->payload_len);
+            bench_consume(buf);
+        }
+    }
+    uint64_t serialize_ns = bench_cpu_ns() - start;
+
+    start = bench_cpu_ns();
+    for (i = 0; i < rounds; i++)
+    {
+        for (j = 0; j < c->count; j++)
+        {
+            packet_t p = c->packets[j];
+            packet_parse(&p);
+            bench_consume(p.payload);
+        }
+    }
+    uint64_t deserialize_ns = bench_cpu_ns() - start;
+
+    /* the PUBACK sent or received for every QoS 1 publish */
+    start = bench_cpu_ns();
+    for (i = 0; i < rounds; i++)
+    {
+        for (j = 0; j < c->count; j++)
+        {
+            const packet_t* p = &c->packets[j];
+            unsigned char type, dup;
+            unsigned short packetid;
+
+            if (!p->qos)
+                continue;
+            int len = MQTTSerialize_puback(buf, sizeof buf, p->packetid);
+            MQTTDeserialize_ack(&type, &dup, &packetid, buf, len);
+            bench_consume(buf);
+            acks++;
+        }
+    }
+    uint64_t ack_ns = bench_cpu_ns() - start;
+
+    printf("%-12s %8d %8lu %14.1f %8.1f %14.1f %8.1f %10.1f\n", c->name, c->count, c->bytes / c->count,
+            (double)serialize_ns / packets, bytes * 1e3 / serialize_ns,
+            (double)deserialize_ns / packets, bytes * 1e3 / deserialize_ns,
+            acks ? (double)ack_ns / acks : 0.0);
+}
+
+
+int main(int argc, char** argv)
+{
+    static corpus_t corpora[5];
+    int count = 0, i;
+
+    if (argc > 2 || (argc == 2 && argv[1][0] == '-'))
+    {
+        fprintf(stderr, "usage: %s [capture]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    if (corpus_build(&corpora[count++], "properties", corpus_add_property) != 0 ||
+            corpus_build(&corpora[count++], "actions", corpus_add_action) != 0 ||
+            corpus_build(&corpora[count++], "pushes", corpus_add_push) != 0 ||
+            corpus_build(&corpora[count++], "mixed", corpus_add_mixed) != 0 ||
+            (argc == 2 && corpus_from_capture(&corpora[count++], argv[1]) != 0))
+        return EXIT_FAILURE;
+
+    printf("%-12s %8s %8s %14s %8s %14s %8s %10s\n", "corpus", "packets", "bytes",
+            "serialize ns", "MB/s", "deserialize ns", "MB/s", "puback ns");
+
+    for (i = 0; i < count; i++)
+        run(&corpora[i]);
+
+    return EXIT_SUCCESS;
+}
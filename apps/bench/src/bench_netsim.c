@@ -0,0 +1,311 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Connect time, publish round trips, throughput and reconnects under
+ * simulated link conditions, against a minimal broker on the loopback
+ * transport. Runs are repeatable from the seed. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <MQTTPacket.h>
+#include <netsim.h>
+#include <evrythng/platform.h>
+
+#include "bench.h"
+
+#define BROKER "broker.loopback"
+#define SEED 42
+#define ROUND_TRIPS 10
+#define STREAMED 10
+#define PAYLOAD_SIZE 256
+#define FLAKY_RUN_MS 10000
+#define MAX_CONNECTIONS 64
+#define TIMEOUT_MS 5000
+
+typedef struct profile_t
+{
+    const char* name;
+    NetsimConfig config;
+} profile_t;
+
+static const profile_t profiles[] = {
+    /*              latency jitter uplink   downlink loss reset  seed */
+    { "lan",      {   1,     0,        0,        0,   0,     0, SEED } },
+    { "dsl",      {  15,     5,  1000000,  8000000,   0,     0, SEED } },
+    { "cellular", { 100,    20,    20000,   100000,  50,     0, SEED } },
+    { "flaky",    { 100,    20,    20000,   100000,  50,  4000, SEED } },
+};
+
+typedef struct connection_t
+{
+    LoopbackEnd* end;
+    Thread thread;
+} connection_t;
+
+static connection_t connections[MAX_CONNECTIONS];
+static int connections_count;
+static volatile unsigned long received;
+
+
+/* reads one packet, returns its first byte or -1, body is the offset of
+ * what follows the remaining length */
+static int read_packet(LoopbackEnd* end, unsigned char* packet, int size, int* body)
+{
+    int rem = 0, mult = 1, i = 1, rc;
+
+    /* idle until the client sends or closes */
+    while ((rc = loopback_read(end, packet, 1, TIMEOUT_MS)) < 0);
+    if (rc != 1)
+        return -1;
+    do
+    {
+        if (i == 5 || loopback_read(end, packet + i, 1, TIMEOUT_MS) != 1)
+            return -1;
+        rem += (packet[i] & 127) * mult;
+        mult *= 128;
+    }
+    while (packet[i++] & 128);
+
+    if (i + rem > size || (rem && loopback_read(end, packet + i, rem, TIMEOUT_MS) != rem))
+        return -1;
+
+    *body = i;
+    return packet[0];
+}
+
+
+/* answers CONNECT and QoS 1 PUBLISH, counts publishes */
+static void connection_run(void* arg)
+{
+    connection_t* c = (connection_t*)arg;
+    unsigned char packet[1024];
+    int header, body;
+
+    while ((header = read_packet(c->end, packet, sizeof packet, &body)) >= 0)
+    {
+        unsigned char ack[4] = { 0, 2, 0, 0 };
+
+        if (header >> 4 == CONNECT)
+            ack[0] = CONNACK << 4;
+        else if (header >> 4 == PUBLISH)
+        {
+            received++;
+            if ((header >> 1 & 3) == 1)
+            {
+                /* packet id follows the topic */
+                int id = body + 2 + (packet[body] << 8 | packet[body + 1]);
+                ack[0] = PUBACK << 4;
+                ack[2] = packet[id];
+                ack[3] = packet[id + 1];
+            }
+        }
+
+        if (ack[0] && loopback_write(c->end, ack, sizeof ack, TIMEOUT_MS) != sizeof ack)
+            break;
+    }
+
+    loopback_close(c->end);
+}
+
+
+static void broker_accept(void* ctx, LoopbackEnd* peer)
+{
+    (void)ctx;
+
+    if (connections_count == MAX_CONNECTIONS)
+    {
+        loopback_close(peer);
+        return;
+    }
+
+    connection_t* c = &connections[connections_count++];
+    c->end = peer;
+    platform_thread_create(&c->thread, 0, "connection", connection_run, 0, c);
+}
+
+
+static void broker_join(void)
+{
+    int i;
+
+    for (i = 0; i < connections_count; i++)
+    {
+        platform_thread_join(&connections[i].thread, -1);
+        platform_thread_destroy(&connections[i].thread);
+    }
+    connections_count = 0;
+}
+
+
+/* TCP connect and MQTT CONNECT/CONNACK, returns the time taken or -1 */
+static double mqtt_connect(Network* n)
+{
+    /* CONNECT of MQTT 3.1.1, clean session, 60 s keepalive, client id "bench" */
+    static unsigned char connect[] = { CONNECT << 4, 17, 0, 4, 'M', 'Q', 'T', 'T', 4, 2, 0, 60, 0, 5, 'b', 'e', 'n', 'c', 'h' };
+    unsigned char connack[4];
+
+    uint64_t start = bench_now_ns();
+
+    platform_network_init(n);
+    if (platform_network_connect(n, BROKER, 1883) != 0)
+        return -1;
+
+    if (platform_network_write(n, connect, sizeof connect, TIMEOUT_MS) != sizeof connect ||
+            platform_network_read(n, connack, sizeof connack, TIMEOUT_MS) != sizeof connack ||
+            connack[0] >> 4 != CONNACK)
+    {
+        platform_network_disconnect(n);
+        return -1;
+    }
+
+    return (bench_now_ns() - start) / 1e6;
+}
+
+
+static int publish(Network* n, int qos, unsigned short id)
+{
+    unsigned char buf[512];
+    unsigned char payload[PAYLOAD_SIZE];
+    MQTTString topic = MQTTString_initializer;
+    topic.cstring = "thngs/UEp4rDGsnpCAF6xABbys5Amc/properties/temperature";
+
+    memset(payload, 'x', sizeof payload);
+
+    int len = MQTTSerialize_publish(buf, sizeof buf, 0, qos, 0, id, topic, payload, sizeof payload);
+    return platform_network_write(n, buf, len, TIMEOUT_MS) == len ? len : -1;
+}
+
+
+/* QoS 1 publish and its PUBACK, returns the time taken or -1 */
+static double round_trip(Network* n, unsigned short id)
+{
+    unsigned char puback[4];
+
+    uint64_t start = bench_now_ns();
+    if (publish(n, 1, id) < 0 ||
+            platform_network_read(n, puback, sizeof puback, TIMEOUT_MS) != sizeof puback ||
+            (puback[2] << 8 | puback[3]) != id)
+        return -1;
+
+    return (bench_now_ns() - start) / 1e6;
+}
+
+
+static int run(const profile_t* p)
+{
+    NetsimStats stats;
+    Network n;
+    double connect_ms, rtt_sum = 0, rtt_max = 0;
+    int i, len = 0;
+
+    netsim_configure(&p->config);
+    received = 0;
+
+    if ((connect_ms = mqtt_connect(&n)) < 0)
+    {
+        printf("%-10s failed to connect\n", p->name);
+        return -1;
+    }
+
+    for (i = 0; i < ROUND_TRIPS; i++)
+    {
+        double rtt = round_trip(&n, (unsigned short)(i + 1));
+        if (rtt < 0)
+        {
+            printf("%-10s publish failed\n", p->name);
+            platform_network_disconnect(&n);
+            return -1;
+        }
+        rtt_sum += rtt;
+        if (rtt > rtt_max) rtt_max = rtt;
+    }
+
+    /* QoS 0 publishes queue up in the uplink, throughput as seen by the broker */
+    unsigned long target = received + STREAMED;
+    uint64_t start = bench_now_ns();
+    for (i = 0; i < STREAMED; i++)
+        len = publish(&n, 0, 0);
+    while (received < target && bench_now_ns() - start < (uint64_t)TIMEOUT_MS * 10 * 1000000)
+        platform_sleep(1);
+    double stream_ms = (bench_now_ns() - start) / 1e6;
+
+    platform_network_disconnect(&n);
+    broker_join();
+    netsim_stats(&stats);
+
+    printf("%-10s %10.1f %10.1f %10.1f %12.0f %6u\n", p->name, connect_ms, rtt_sum / ROUND_TRIPS, rtt_max,
+            received == target ? STREAMED * len * 8 * 1000 / stream_ms : 0, stats.lost);
+
+    return received == target ? 0 : -1;
+}
+
+
+/* publishes for a while over a link with resets, reconnecting each time */
+static int run_flaky(const profile_t* p)
+{
+    NetsimStats stats;
+    Network n;
+    double reconnect_sum = 0, reconnect_max = 0;
+    int reconnects = 0, published = 0;
+
+    netsim_configure(&p->config);
+
+    if (mqtt_connect(&n) < 0)
+        return -1;
+
+    uint64_t end = bench_now_ns() + (uint64_t)FLAKY_RUN_MS * 1000000;
+    while (bench_now_ns() < end)
+    {
+        if (round_trip(&n, (unsigned short)(published % 65535 + 1)) >= 0)
+        {
+            published++;
+            continue;
+        }
+
+        /* reconnect time from noticing the reset to CONNACK */
+        platform_network_disconnect(&n);
+        double ms = mqtt_connect(&n);
+        if (ms < 0)
+            break;
+        reconnects++;
+        reconnect_sum += ms;
+        if (ms > reconnect_max) reconnect_max = ms;
+    }
+
+    platform_network_disconnect(&n);
+    broker_join();
+    netsim_stats(&stats);
+
+    printf("%-10s %u resets, %d reconnects %.1f ms mean %.1f ms max, %d publishes acknowledged, %u lost\n", p->name,
+            stats.resets, reconnects, reconnects ? reconnect_sum / reconnects : 0, reconnect_max, published, stats.lost);
+
+    return reconnects ? 0 : -1;
+}
+
+
+int main()
+{
+    unsigned i;
+    int failed = 0;
+
+    loopback_listen(BROKER, broker_accept, 0);
+
+    printf("seed %d, %d byte payloads\n", SEED, PAYLOAD_SIZE);
+    printf("%-10s %10s %10s %10s %12s %6s\n", "profile", "connect ms", "rtt ms", "rtt max", "goodput bps", "lost");
+
+    for (i = 0; i < sizeof profiles / sizeof profiles[0]; i++)
+    {
+        const profile_t* p = &profiles[i];
+        if (p->config.reset_mean_ms ? run_flaky(p) : run(p))
+            failed = 1;
+    }
+
+    netsim_configure(0);
+    loopback_unlisten(BROKER);
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Streams a firmware image through the OTA update the way the streaming
+ * receive delivers it, with a connection cut and a duplicate chunk on the
+ * way, and reports update time and the RAM used by the update. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <evrythng/ota.h>
+#include <evrythng/platform_ext.h>
+
+#include "bench.h"
+
+#define IMAGE_SIZE (512 * 1024)
+#define CHUNK_SIZE 2048
+#define TOPIC "thngs/UEp4rDGsnpCAF6xABbys5Amc/actions/_firmware"
+
+static unsigned char image[IMAGE_SIZE];
+static char message[CHUNK_SIZE * 2 + 512];
+
+
+static size_t base64(const unsigned char* in, size_t len, char* out)
+{
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    size_t i, o = 0;
+
+    for (i = 0; i + 2 < len; i += 3)
+    {
+        uint32_t v = in[i] << 16 | in[i + 1] << 8 | in[i + 2];
+        out[o++] = alphabet[v >> 18];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = alphabet[(v >> 6) & 63];
+        out[o++] = alphabet[v & 63];
+    }
+
+    if (i < len)
+    {
+        uint32_t v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0);
+        out[o++] = alphabet[v >> 18];
+        out[o++] = alphabet[(v >> 12) & 63];
+        out[o++] = i + 1 < len ? alphabet[(v >> 6) & 63] : '=';
+        out[o++] = '=';
+    }
+
+    return o;
+}
+
+
+static size_t build_message(const char* sha256_hex, uint32_t offset)
+{
+    uint32_t len = IMAGE_SIZE - offset < CHUNK_SIZE ? IMAGE_SIZE - offset : CHUNK_SIZE;
+
+    size_t n = sprintf(message, "{\"type\":\"_firmware\",\"customFields\":{\"size\":%d,\"sha256\":\"%s\","
+            "\"offset\":%u,\"data\":\"", IMAGE_SIZE, sha256_hex, offset);
+    n += base64(image + offset, len, message + n);
+    n += sprintf(message + n, "\"}}");
+
+    return n;
+}
+
+
+/* delivers the message like the streaming receive, cut after limit bytes */
+static void deliver(evrythng_ota_t* ota, size_t len, size_t limit)
+{
+    size_t offset;
+
+    for (offset = 0; offset < len && offset < limit; offset += STREAM_CHUNK_SIZE)
+    {
+        size_t n = len - offset < STREAM_CHUNK_SIZE ? len - offset : STREAM_CHUNK_SIZE;
+        if (n > limit - offset)
+            n = limit - offset;
+        EvrythngOtaStreamCallback(ota, TOPIC, (const unsigned char*)message + offset, n, offset, len);
+    }
+
+    if (limit < len)
+        EvrythngOtaStreamCallback(ota, TOPIC, NULL, 0, limit, len);
+}
+
+
+int main()
+{
+    unsigned char digest[EVRYTHNG_SHA256_SIZE];
+    char sha256_hex[2 * EVRYTHNG_SHA256_SIZE + 1];
+    evrythng_sha256_t sha;
+    evrythng_ota_t ota;
+    uint32_t i, messages = 0;
+
+    srand(1);
+    for (i = 0; i < IMAGE_SIZE; i++)
+        image[i] = (unsigned char)rand();
+
+    EvrythngSha256Init(&sha);
+    EvrythngSha256Update(&sha, image, IMAGE_SIZE);
+    EvrythngSha256Finish(&sha, digest);
+    for (i = 0; i < EVRYTHNG_SHA256_SIZE; i++)
+        sprintf(sha256_hex + 2 * i, "%02x", digest[i]);
+
+    /* wherever the bench is run from, the image goes to a temp file */
+    const char* tmpdir = getenv("TMPDIR");
+    char ota_path[256];
+    snprintf(ota_path, sizeof ota_path, "%s/bench_ota.XXXXXX", tmpdir && *tmpdir ? tmpdir : "/tmp");
+    int fd = mkstemp(ota_path);
+    if (fd < 0)
+    {
+        printf("failed to create %s\n", ota_path);
+        return EXIT_FAILURE;
+    }
+    close(fd);
+
+    setenv("EVRYTHNG_OTA_PATH", ota_path, 1);
+    EvrythngOtaInit(&ota, NULL, NULL);
+
+    uint64_t start = bench_now_ns();
+
+    while (ota.state != EVRYTHNG_OTA_DONE && ota.state != EVRYTHNG_OTA_FAILED && messages < 2 * IMAGE_SIZE / CHUNK_SIZE)
+    {
+        /* the sender continues where the device is */
+        uint32_t offset = EvrythngOtaOffset(&ota);
+        size_t len = build_message(sha256_hex, offset);
+
+        if (messages == 10)
+            deliver(&ota, len, len / 3);        /* connection cut */
+        else
+            deliver(&ota, len, len);
+
+        if (messages == 20)
+        {
+            /* sent again after a lost PUBACK */
+            deliver(&ota, len, len);
+        }
+
+        messages++;
+    }
+
+    double elapsed_ms = (bench_now_ns() - start) / 1e6;
+
+    FILE* f = fopen(ota_path, "rb");
+    static unsigned char written[IMAGE_SIZE + 1];
+    size_t written_len = f ? fread(written, 1, sizeof written, f) : 0;
+    if (f) fclose(f);
+
+    int ok = ota.state == EVRYTHNG_OTA_DONE && written_len == IMAGE_SIZE && !memcmp(written, image, IMAGE_SIZE);
+
+    printf("image %u bytes in %u messages of %u bytes: %s\n", IMAGE_SIZE, messages, CHUNK_SIZE, ok ? "ok" : "FAILED");
+    printf("update time %.1f ms (%.1f MB/s host CPU)\n", elapsed_ms, IMAGE_SIZE / elapsed_ms / 1000.0);
+    printf("accepted %u, duplicates %u, gaps %u, resumed %u, invalid %u\n", ota.stats.messages,
+            ota.stats.duplicates, ota.stats.gaps, ota.stats.resumes, ota.stats.invalid);
+    printf("RAM: ota state %u bytes + stream filter %u bytes per connection\n",
+            (unsigned)sizeof(evrythng_ota_t), (unsigned)sizeof(StreamFilter));
+
+    remove(ota_path);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
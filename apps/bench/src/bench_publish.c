@@ -0,0 +1,117 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Per-publish CPU cost of building the EVRYTHNG topic and serializing the
+ * MQTT PUBLISH packet on every call, as EvrythngPipelinePubThngProperty()
+ * does, versus the packet built from a prepared header by
+ * EvrythngPreparedPublish() and EvrythngPipelinePubPrepared(). */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <MQTTPacket.h>
+#include <evrythng/prepared.h>
+
+#include "bench.h"
+
+#define ITERATIONS 1000000
+#define BUF_SIZE 512
+
+static const char thng_id[] = "UEp4rDGsnpCAF6xABbys5Amc";
+
+static const char* properties[] = {
+    "button_1",
+    "temperature",
+    "a_rather_long_property_name_for_a_sensor_reading",
+};
+
+
+static uint64_t run_before(const char* property, const char* payload, int payload_len, unsigned char* out, int* out_len)
+{
+    unsigned char buf[BUF_SIZE];
+    char topic[256];
+    int i, len = 0;
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        snprintf(topic, sizeof topic, "thngs/%s/properties/%s", thng_id, property);
+
+        MQTTString topic_str = MQTTString_initializer;
+        topic_str.cstring = topic;
+
+        len = MQTTSerialize_publish(buf, sizeof buf, 0, 1, 0, (unsigned short)(i & 0xFFFF) | 1,
+                topic_str, (unsigned char*)payload, payload_len);
+        bench_consume(buf);
+    }
+    uint64_t elapsed = bench_cpu_ns() - start;
+
+    /* the packet of the last iteration is compared with the prepared one */
+    memcpy(out, buf, len);
+    *out_len = len;
+
+    return elapsed;
+}
+
+
+static uint64_t run_after(const evrythng_prepared_t* p, const char* payload, int payload_len, unsigned char* out, int* out_len)
+{
+    unsigned char buf[BUF_SIZE];
+    int i, len = 0;
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < ITERATIONS; i++)
+    {
+        len = EvrythngPreparedSerialize(p, buf, sizeof buf, (unsigned short)(i & 0xFFFF) | 1,
+                (const unsigned char*)payload, payload_len);
+        bench_consume(buf);
+    }
+    uint64_t elapsed = bench_cpu_ns() - start;
+
+    memcpy(out, buf, len);
+    *out_len = len;
+
+    return elapsed;
+}
+
+
+int main()
+{
+    static const char payload[] = "[{\"value\":42}]";
+    int payload_len = sizeof payload - 1;
+    unsigned i;
+    int failed = 0;
+
+    printf("%-50s %12s %12s %8s\n", "property", "before ns", "prepared ns", "speedup");
+
+    for (i = 0; i < sizeof properties / sizeof properties[0]; i++)
+    {
+        unsigned char before[BUF_SIZE], after[BUF_SIZE];
+        int before_len, after_len;
+        evrythng_prepared_t p;
+
+        if (EvrythngPrepare(&p, NULL, EVRYTHNG_PREPARED_THNG_PROPERTY, thng_id, properties[i], 1) != EVRYTHNG_SUCCESS)
+        {
+            printf("failed to prepare %s\n", properties[i]);
+            return EXIT_FAILURE;
+        }
+
+        double before_ns = (double)run_before(properties[i], payload, payload_len, before, &before_len) / ITERATIONS;
+        double after_ns = (double)run_after(&p, payload, payload_len, after, &after_len) / ITERATIONS;
+
+        if (before_len != after_len || memcmp(before, after, before_len))
+        {
+            printf("%s: prepared packet differs from MQTTSerialize_publish\n", properties[i]);
+            failed = 1;
+        }
+
+        printf("%-50s %12.1f %12.1f %7.2fx\n", properties[i], before_ns, after_ns, before_ns / after_ns);
+
+        EvrythngPreparedFree(&p);
+    }
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
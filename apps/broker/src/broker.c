@@ -0,0 +1,877 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include <MQTTPacket.h>
+#include <evrythng/platform.h>
+#include <evrythng/transport.h>
+
+#include "broker.h"
+
+#define WRITE_TIMEOUT_MS 1000
+#define MAX_TOPICS_PER_SUBSCRIBE 16
+#define MAX_TOPIC 256
+/* deliveries to more connections allocate their list */
+#define MAX_TARGETS 64
+#define WORKER_STACK_SIZE (64 * 1024)
+
+/* an EVRYTHNG subscription maps to up to two MQTT filters */
+typedef struct subscription_t
+{
+    struct subscription_t* next;
+    char* topic;                /* as subscribed, for UNSUBSCRIBE */
+    char* filters[2];
+    int qos;
+} subscription_t;
+
+typedef struct connection_t
+{
+    LoopbackEnd* end;
+    struct worker_t* worker;
+    struct connection_t* ready_next;    /* in the ready queue of the worker */
+    struct connection_t* prev;          /* all open connections */
+    struct connection_t* next;
+    int refs;                           /* the list and deliveries in progress */
+    int closed;                         /* off the list */
+    int queued;
+    int dead;                           /* freed by the worker once dequeued */
+    uint64_t ready_ns;                  /* when it was queued */
+    Mutex write_mutex;                  /* the worker and deliveries write */
+    unsigned short packet_id;
+    subscription_t* subscriptions;
+    int len;
+    unsigned char buf[BROKER_MAX_PACKET];
+} connection_t;
+
+typedef struct worker_t
+{
+    Thread thread;
+    Mutex mutex;
+    Semaphore ready;
+    connection_t* head;
+    connection_t* tail;
+    volatile int stop;
+} worker_t;
+
+static char broker_hostname[64];
+static worker_t workers[BROKER_MAX_WORKERS];
+static int workers_count;
+static int next_worker;
+
+/* connections list, references and subscriptions */
+static Mutex connections_mutex;
+static connection_t* connections;
+static int connections_count;
+
+static Mutex stats_mutex;
+static broker_stats_t stats;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static void histogram_add(uint32_t* histogram, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int i = 0;
+
+    while (us > 1 && i < BROKER_LATENCY_BUCKETS - 1)
+    {
+        us >>= 1;
+        i++;
+    }
+    histogram[i]++;
+}
+
+
+uint32_t broker_latency_percentile(const uint32_t* histogram, int percent)
+{
+    uint64_t total = 0, sum = 0;
+    int i;
+
+    for (i = 0; i < BROKER_LATENCY_BUCKETS; i++)
+        total += histogram[i];
+    if (!total)
+        return 0;
+
+    for (i = 0; i < BROKER_LATENCY_BUCKETS - 1; i++)
+    {
+        sum += histogram[i];
+        if (sum * 100 >= total * percent)
+            break;
+    }
+
+    return 2u << i;
+}
+
+
+/* called by the client side writing or closing, with its pipe locked */
+static void on_ready(void* ctx, LoopbackEnd* end)
+{
+    connection_t* c = (connection_t*)ctx;
+    worker_t* w = c->worker;
+    (void)end;
+
+    platform_mutex_lock(&w->mutex);
+    if (!c->queued)
+    {
+        c->queued = 1;
+        c->ready_ns = now_ns();
+        c->ready_next = 0;
+        if (w->tail)
+            w->tail->ready_next = c;
+        else
+            w->head = c;
+        w->tail = c;
+    }
+    platform_mutex_unlock(&w->mutex);
+
+    platform_semaphore_post(&w->ready);
+}
+
+
+static void on_accept(void* ctx, LoopbackEnd* peer)
+{
+    (void)ctx;
+
+    connection_t* c = (connection_t*)platform_malloc(sizeof(connection_t));
+    if (!c)
+    {
+        loopback_close(peer);
+        return;
+    }
+    memset(c, 0, sizeof(connection_t));
+    c->end = peer;
+    c->refs = 1;
+    platform_mutex_init(&c->write_mutex);
+
+    platform_mutex_lock(&connections_mutex);
+    c->worker = &workers[next_worker++ % workers_count];
+    c->next = connections;
+    if (connections)
+        connections->prev = c;
+    connections = c;
+    connections_count++;
+    platform_mutex_unlock(&connections_mutex);
+
+    platform_mutex_lock(&stats_mutex);
+    if (++stats.connections > stats.max_connections)
+        stats.max_connections = stats.connections;
+    platform_mutex_unlock(&stats_mutex);
+
+    loopback_set_notify(peer, on_ready, c);
+}
+
+
+static void subscription_free(subscription_t* s)
+{
+    platform_free(s->topic);
+    platform_free(s->filters[0]);
+    platform_free(s->filters[1]);
+    platform_free(s);
+}
+
+
+/* drops a reference, the last one closes the end and frees the connection */
+static void connection_unref(connection_t* c)
+{
+    platform_mutex_lock(&connections_mutex);
+    int refs = --c->refs;
+    platform_mutex_unlock(&connections_mutex);
+
+    if (refs)
+        return;
+
+    loopback_close(c->end);
+
+    while (c->subscriptions)
+    {
+        subscription_t* s = c->subscriptions;
+        c->subscriptions = s->next;
+        subscription_free(s);
+    }
+    platform_mutex_deinit(&c->write_mutex);
+
+    worker_t* w = c->worker;
+    platform_mutex_lock(&w->mutex);
+    int queued = c->queued;
+    c->dead = 1;
+    platform_mutex_unlock(&w->mutex);
+
+    if (!queued)
+        platform_free(c);
+}
+
+
+static void connection_close(connection_t* c)
+{
+    int subscriptions = 0;
+    subscription_t* s;
+
+    platform_mutex_lock(&connections_mutex);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        connections = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    connections_count--;
+    c->closed = 1;
+    for (s = c->subscriptions; s; s = s->next)
+        subscriptions++;
+    platform_mutex_unlock(&connections_mutex);
+
+    platform_mutex_lock(&stats_mutex);
+    stats.connections--;
+    stats.subscriptions -= subscriptions;
+    platform_mutex_unlock(&stats_mutex);
+
+    connection_unref(c);
+}
+
+
+static int send_packet(connection_t* c, const unsigned char* packet, int len)
+{
+    platform_mutex_lock(&c->write_mutex);
+    int rc = loopback_write(c->end, (unsigned char*)packet, len, WRITE_TIMEOUT_MS);
+    platform_mutex_unlock(&c->write_mutex);
+
+    if (rc != len)
+        return -1;
+
+    platform_mutex_lock(&stats_mutex);
+    stats.bytes_out += len;
+    platform_mutex_unlock(&stats_mutex);
+
+    return 0;
+}
+
+
+/* MQTT topic matching with + and # wildcards */
+static int topic_matches(const char* filter, const char* topic)
+{
+    for (;;)
+    {
+        if (!strcmp(filter, "#"))
+            return 1;
+
+        if (*filter == '+')
+        {
+            while (*topic && *topic != '/')
+                topic++;
+            filter++;
+        }
+        else
+        {
+            while (*filter && *filter != '/' && *filter == *topic)
+            {
+                filter++;
+                topic++;
+            }
+            if ((*filter && *filter != '/') || (*topic && *topic != '/'))
+                return 0;
+        }
+
+        if (!*filter)
+            return !*topic;
+        if (!*topic)
+            /* "a/#" matches "a" */
+            return !strcmp(filter, "/#");
+
+        filter++;
+        topic++;
+    }
+}
+
+
+static char* string_dup(const char* s, size_t len)
+{
+    char* d = (char*)platform_malloc(len + 1);
+    if (d)
+    {
+        memcpy(d, s, len);
+        d[len] = 0;
+    }
+    return d;
+}
+
+
+static int ends_with(const char* s, const char* suffix)
+{
+    size_t len = strlen(s), suffix_len = strlen(suffix);
+    return len >= suffix_len && !strcmp(s + len - suffix_len, suffix);
+}
+
+
+/* translates an EVRYTHNG subscription into MQTT filters */
+static subscription_t* subscription_new(const char* topic, int len, int qos)
+{
+    char filter[MAX_TOPIC + 16];
+    subscription_t* s;
+
+    if (len > MAX_TOPIC || !(s = (subscription_t*)platform_malloc(sizeof(subscription_t))))
+        return 0;
+
+    memset(s, 0, sizeof(subscription_t));
+    s->qos = qos > 1 ? 1 : qos;
+    s->topic = string_dup(topic, len);
+    if (!s->topic)
+        goto fail;
+
+    if (!strncmp(s->topic, "actions/", 8))
+    {
+        /* actions of all thngs, and the ones created without a thng */
+        const char* type = s->topic + 8;
+        if (!strcmp(type, "all"))
+            type = "+";
+        snprintf(filter, sizeof filter, "thngs/+/actions/%s", type);
+        s->filters[0] = string_dup(filter, strlen(filter));
+        snprintf(filter, sizeof filter, "actions/%s", type);
+        s->filters[1] = string_dup(filter, strlen(filter));
+        if (!s->filters[1])
+            goto fail;
+    }
+    else if (ends_with(s->topic, "/actions/all"))
+    {
+        snprintf(filter, sizeof filter, "%.*s+", len - 3, s->topic);
+        s->filters[0] = string_dup(filter, strlen(filter));
+    }
+    else if (ends_with(s->topic, "/properties"))
+    {
+        /* single properties, and bulk updates of several ones */
+        snprintf(filter, sizeof filter, "%s/+", s->topic);
+        s->filters[0] = string_dup(filter, strlen(filter));
+        s->filters[1] = string_dup(s->topic, len);
+        if (!s->filters[1])
+            goto fail;
+    }
+    else
+        s->filters[0] = string_dup(s->topic, len);
+
+    if (!s->filters[0])
+        goto fail;
+
+    return s;
+
+fail:
+    subscription_free(s);
+    return 0;
+}
+
+
+/* the highest QoS of the subscriptions of c matching topic, -1 if none */
+static int subscribed_qos(connection_t* c, const char* topic)
+{
+    subscription_t* s;
+    int qos = -1;
+
+    for (s = c->subscriptions; s; s = s->next)
+        if (s->qos > qos && (topic_matches(s->filters[0], topic) ||
+                    (s->filters[1] && topic_matches(s->filters[1], topic))))
+            qos = s->qos;
+
+    return qos;
+}
+
+
+/* thng id of an action topic "thngs/<id>/actions/<type>", NULL otherwise */
+static const char* action_thng(const char* topic, int* len)
+{
+    if (strncmp(topic, "thngs/", 6))
+        return 0;
+
+    const char* id = topic + 6;
+    const char* slash = strchr(id, '/');
+    if (!slash || strncmp(slash, "/actions/", 9))
+        return 0;
+
+    *len = (int)(slash - id);
+    return id;
+}
+
+
+/* adds "thng" and "timestamp" to an action object, as the cloud does */
+static int action_payload(const char* topic, const unsigned char* payload, int len, unsigned char* out, int size)
+{
+    int id_len;
+    const char* id = action_thng(topic, &id_len);
+
+    if (!id || len < 2 || payload[0] != '{' || size < len + id_len + 64)
+        return -1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    long long timestamp = (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    /* "{}" gets no separator */
+    int n = snprintf((char*)out, size, "{\"thng\":\"%.*s\",\"timestamp\":%lld%s", id_len, id, timestamp,
+            len > 2 ? "," : "");
+    memcpy(out + n, payload + 1, len - 1);
+
+    return n + len - 1;
+}
+
+
+/* delivers a publish to every connection subscribed to its topic */
+static void deliver(const char* topic, unsigned char* payload, int payload_len, int qos)
+{
+    typedef struct target_t { connection_t* c; int qos; } target_t;
+    target_t stack_targets[MAX_TARGETS];
+    target_t* targets = stack_targets;
+    unsigned char echo[BROKER_MAX_PACKET];
+    unsigned char packet[BROKER_MAX_PACKET + MAX_TOPIC + 8];
+    connection_t* c;
+    int n = 0, i, delivered = 0;
+
+    int echo_len = action_payload(topic, payload, payload_len, echo, sizeof echo);
+    if (echo_len > 0)
+    {
+        payload = echo;
+        payload_len = echo_len;
+    }
+
+    /* references keep the targets alive while writing outside the lock */
+    platform_mutex_lock(&connections_mutex);
+    if (connections_count > MAX_TARGETS)
+        targets = (target_t*)platform_malloc(connections_count * sizeof(target_t));
+    for (c = connections; c && targets; c = c->next)
+    {
+        int q = subscribed_qos(c, topic);
+        if (q < 0)
+            continue;
+
+        c->refs++;
+        targets[n].c = c;
+        targets[n++].qos = q < qos ? q : qos;
+    }
+    platform_mutex_unlock(&connections_mutex);
+
+    if (!targets)
+    {
+        platform_printf("%s: failed to allocate the targets\n", __func__);
+        return;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        c = targets[i].c;
+
+        MQTTString t = MQTTString_initializer;
+        t.cstring = (char*)topic;
+
+        platform_mutex_lock(&c->write_mutex);
+        if (!++c->packet_id)
+            c->packet_id = 1;
+        unsigned short id = c->packet_id;
+        platform_mutex_unlock(&c->write_mutex);
+
+        int len = MQTTSerialize_publish(packet, sizeof packet, 0, targets[i].qos, 0, id, t, payload, payload_len);
+        if (len > 0 && send_packet(c, packet, len) == 0)
+            delivered++;
+
+        connection_unref(c);
+    }
+
+    if (targets != stack_targets)
+        platform_free(targets);
+
+    platform_mutex_lock(&stats_mutex);
+    stats.delivered += delivered;
+    platform_mutex_unlock(&stats_mutex);
+}
+
+
+/* length of the packet at the start of buf, 0 if incomplete, -1 if invalid */
+static int packet_length(const unsigned char* buf, int len, int* body)
+{
+    int rem = 0, mult = 1, i = 1;
+
+    do
+    {
+        if (i >= len)
+            return 0;
+        if (i == 5)
+            return -1;
+        rem += (buf[i] & 127) * mult;
+        mult *= 128;
+    }
+    while (buf[i++] & 128);
+
+    *body = i;
+    return i + rem <= BROKER_MAX_PACKET ? i + rem : -1;
+}
+
+
+static int handle_publish(connection_t* c, unsigned char* p, int len, int body)
+{
+    unsigned char ack[4];
+    char topic[MAX_TOPIC + 1];
+    int qos = p[0] >> 1 & 3;
+
+    if (body + 2 > len)
+        return -1;
+
+    int topic_len = p[body] << 8 | p[body + 1];
+    int i = body + 2 + topic_len;
+
+    if (topic_len > MAX_TOPIC || i + (qos ? 2 : 0) > len)
+        return -1;
+
+    memcpy(topic, p + body + 2, topic_len);
+    topic[topic_len] = 0;
+
+    if (qos)
+    {
+        ack[0] = (qos == 1 ? PUBACK : PUBREC) << 4;
+        ack[1] = 2;
+        ack[2] = p[i];
+        ack[3] = p[i + 1];
+        if (send_packet(c, ack, sizeof ack) != 0)
+            return -1;
+        i += 2;
+    }
+
+    deliver(topic, p + i, len - i, qos > 1 ? 1 : qos);
+
+    return 0;
+}
+
+
+static int handle_subscribe(connection_t* c, unsigned char* p, int len, int body)
+{
+    unsigned char ack[4 + MAX_TOPICS_PER_SUBSCRIBE] = { SUBACK << 4, 2, p[body], p[body + 1] };
+    int ack_len = 4, added = 0;
+    int i = body + 2;
+
+    while (i + 2 < len && ack_len < (int)sizeof ack)
+    {
+        int topic_len = p[i] << 8 | p[i + 1];
+        if (i + 2 + topic_len >= len)
+            return -1;
+
+        subscription_t* s = subscription_new((char*)p + i + 2, topic_len, p[i + 2 + topic_len] & 3);
+        if (s)
+        {
+            platform_mutex_lock(&connections_mutex);
+            s->next = c->subscriptions;
+            c->subscriptions = s;
+            platform_mutex_unlock(&connections_mutex);
+            added++;
+        }
+
+        /* 0x80 refuses the subscription */
+        ack[ack_len++] = s ? (unsigned char)s->qos : 0x80;
+        i += 3 + topic_len;
+    }
+    ack[1] = (unsigned char)(ack_len - 2);
+
+    platform_mutex_lock(&stats_mutex);
+    stats.subscriptions += added;
+    platform_mutex_unlock(&stats_mutex);
+
+    return send_packet(c, ack, ack_len);
+}
+
+
+static int handle_unsubscribe(connection_t* c, unsigned char* p, int len, int body)
+{
+    unsigned char ack[4] = { UNSUBACK << 4, 2, p[body], p[body + 1] };
+    int i = body + 2, removed = 0;
+
+    while (i + 2 <= len)
+    {
+        int topic_len = p[i] << 8 | p[i + 1];
+        if (i + 2 + topic_len > len)
+            return -1;
+
+        platform_mutex_lock(&connections_mutex);
+        subscription_t** s = &c->subscriptions;
+        while (*s)
+        {
+            if ((int)strlen((*s)->topic) == topic_len && !memcmp((*s)->topic, p + i + 2, topic_len))
+            {
+                subscription_t* gone = *s;
+                *s = gone->next;
+                subscription_free(gone);
+                removed++;
+            }
+            else
+                s = &(*s)->next;
+        }
+        platform_mutex_unlock(&connections_mutex);
+
+        i += 2 + topic_len;
+    }
+
+    platform_mutex_lock(&stats_mutex);
+    stats.subscriptions -= removed;
+    platform_mutex_unlock(&stats_mutex);
+
+    return send_packet(c, ack, sizeof ack);
+}
+
+
+/* answers a packet, -1 closes the connection */
+static int handle_packet(connection_t* c, unsigned char* p, int len, int body, uint64_t ready_ns)
+{
+    unsigned char ack[4] = { 0, 2, 0, 0 };
+    int ack_len = 4;
+
+    /* everything but PINGREQ and DISCONNECT has a packet id or more */
+    int type = p[0] >> 4;
+    if (type != PINGREQ && type != DISCONNECT && body + 2 > len)
+        return -1;
+
+    switch (type)
+    {
+        case CONNECT:
+            platform_mutex_lock(&stats_mutex);
+            stats.connects++;
+            platform_mutex_unlock(&stats_mutex);
+
+            ack[0] = CONNACK << 4;
+            break;
+
+        case PUBLISH:
+        {
+            /* counted before the acknowledgement, clients can rely on it */
+            platform_mutex_lock(&stats_mutex);
+            stats.publishes++;
+            platform_mutex_unlock(&stats_mutex);
+
+            uint64_t start = now_ns();
+            int rc = handle_publish(c, p, len, body);
+            uint64_t end = now_ns();
+
+            platform_mutex_lock(&stats_mutex);
+            histogram_add(stats.queue_us, start - ready_ns);
+            histogram_add(stats.handle_us, end - start);
+            platform_mutex_unlock(&stats_mutex);
+
+            return rc;
+        }
+
+        case PUBREL:
+            ack[0] = PUBCOMP << 4;
+            ack[2] = p[body];
+            ack[3] = p[body + 1];
+            break;
+
+        case SUBSCRIBE:
+            return handle_subscribe(c, p, len, body);
+
+        case UNSUBSCRIBE:
+            return handle_unsubscribe(c, p, len, body);
+
+        case PINGREQ:
+            ack[0] = PINGRESP << 4;
+            ack[1] = 0;
+            ack_len = 2;
+            break;
+
+        case DISCONNECT:
+            return -1;
+
+        default:
+            /* PUBACK and PUBCOMP of deliveries */
+            return 0;
+    }
+
+    return send_packet(c, ack, ack_len);
+}
+
+
+/* handles everything the client has written, -1 closes the connection */
+static int serve(connection_t* c, uint64_t ready_ns)
+{
+    for (;;)
+    {
+        int n = loopback_read_some(c->end, c->buf + c->len, (int)sizeof c->buf - c->len);
+        if (n < 0)
+            return -1;
+        if (!n)
+            return 0;
+
+        platform_mutex_lock(&stats_mutex);
+        stats.bytes_in += n;
+        platform_mutex_unlock(&stats_mutex);
+
+        c->len += n;
+
+        int len, body;
+        while ((len = packet_length(c->buf, c->len, &body)) > 0 && len <= c->len)
+        {
+            if (handle_packet(c, c->buf, len, body, ready_ns) != 0)
+                return -1;
+
+            c->len -= len;
+            memmove(c->buf, c->buf + len, c->len);
+        }
+
+        if (len < 0)
+        {
+            platform_mutex_lock(&stats_mutex);
+            stats.errors++;
+            platform_mutex_unlock(&stats_mutex);
+            return -1;
+        }
+    }
+}
+
+
+static void worker_run(void* arg)
+{
+    worker_t* w = (worker_t*)arg;
+
+    while (!w->stop)
+    {
+        platform_semaphore_wait(&w->ready, 100);
+
+        for (;;)
+        {
+            platform_mutex_lock(&w->mutex);
+            connection_t* c = w->head;
+            if (c)
+            {
+                w->head = c->ready_next;
+                if (!w->head)
+                    w->tail = 0;
+                c->queued = 0;
+            }
+            int dead = c && c->dead;
+            uint64_t ready_ns = c ? c->ready_ns : 0;
+            platform_mutex_unlock(&w->mutex);
+
+            if (!c)
+                break;
+
+            /* closed connections are notified until the last reference */
+            if (dead)
+                platform_free(c);
+            else if (!c->closed && serve(c, ready_ns) != 0)
+                connection_close(c);
+        }
+    }
+}
+
+
+int broker_start(const char* hostname, int workers_n)
+{
+    int i;
+
+    if (!hostname || strlen(hostname) >= sizeof broker_hostname ||
+            workers_n < 1 || workers_n > BROKER_MAX_WORKERS)
+        return -1;
+
+    strcpy(broker_hostname, hostname);
+    memset(&stats, 0, sizeof stats);
+    connections = 0;
+    connections_count = 0;
+    next_worker = 0;
+    platform_mutex_init(&connections_mutex);
+    platform_mutex_init(&stats_mutex);
+
+    for (i = 0; i < workers_n; i++)
+    {
+        worker_t* w = &workers[i];
+
+        memset(w, 0, sizeof(worker_t));
+        platform_mutex_init(&w->mutex);
+        platform_semaphore_init(&w->ready);
+        if (platform_thread_create(&w->thread, 0, "broker", worker_run, WORKER_STACK_SIZE, w) != 0)
+        {
+            platform_semaphore_deinit(&w->ready);
+            platform_mutex_deinit(&w->mutex);
+            break;
+        }
+    }
+    workers_count = i;
+
+    if (workers_count < workers_n || loopback_listen(hostname, on_accept, 0) != 0)
+    {
+        broker_stop();
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void broker_stop(void)
+{
+    connection_t* c;
+    int i;
+
+    loopback_unlisten(broker_hostname);
+
+    for (i = 0; i < workers_count; i++)
+    {
+        workers[i].stop = 1;
+        platform_semaphore_post(&workers[i].ready);
+        platform_thread_join(&workers[i].thread, -1);
+        platform_thread_destroy(&workers[i].thread);
+    }
+
+    /* clients can't queue connections any more once they have no notify */
+    for (c = connections; c; c = c->next)
+        loopback_set_notify(c->end, 0, 0);
+
+    for (i = 0; i < workers_count; i++)
+    {
+        /* connections closed while still queued */
+        c = workers[i].head;
+        while (c)
+        {
+            connection_t* next = c->ready_next;
+            if (c->dead)
+                platform_free(c);
+            else
+                c->queued = 0;
+            c = next;
+        }
+        workers[i].head = workers[i].tail = 0;
+    }
+
+    while (connections)
+        connection_close(connections);
+
+    for (i = 0; i < workers_count; i++)
+    {
+        platform_semaphore_deinit(&workers[i].ready);
+        platform_mutex_deinit(&workers[i].mutex);
+    }
+    workers_count = 0;
+
+    platform_mutex_deinit(&connections_mutex);
+    platform_mutex_deinit(&stats_mutex);
+}
+
+
+void broker_stats(broker_stats_t* s)
+{
+    platform_mutex_lock(&stats_mutex);
+    *s = stats;
+    platform_mutex_unlock(&stats_mutex);
+}
+
+
+void broker_stats_reset(void)
+{
+    platform_mutex_lock(&stats_mutex);
+    memset(stats.queue_us, 0, sizeof stats.queue_us);
+    memset(stats.handle_us, 0, sizeof stats.handle_us);
+    stats.publishes = stats.delivered = stats.connects = stats.errors = 0;
+    stats.bytes_in = stats.bytes_out = 0;
+    stats.max_connections = stats.connections;
+    platform_mutex_unlock(&stats_mutex);
+}
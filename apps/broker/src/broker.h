@@ -0,0 +1,81 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#ifndef _EVRYTHNG_BROKER_H
+#define _EVRYTHNG_BROKER_H
+
+#include <stdint.h>
+
+/*
+ * MQTT broker stand-in for the host build, following the topic layout of
+ * the EVRYTHNG cloud. It accepts connections of the SDK over the loopback
+ * transport (see evrythng/transport.h), broker_listen_tcp() bridges TCP
+ * clients such as a board to it.
+ *
+ * Publishes are delivered to every matching subscription, the publisher's
+ * own included, as the cloud echoes property updates and actions. On top of
+ * MQTT wildcards the EVRYTHNG subscriptions are understood:
+ *
+ *   thngs/<id>/properties          all properties of a thng
+ *   thngs/<id>/actions/all         all actions of a thng
+ *   actions/<type>, actions/all    actions of any thng
+ *
+ * Actions published to a thng are delivered with "thng" and "timestamp"
+ * members added, as the cloud does. Nothing is retained or persisted.
+ *
+ * Connections are served by a few worker threads, not one thread each:
+ * a connection is queued to its worker whenever the client writes.
+ */
+
+/* largest packet accepted, larger ones close the connection */
+#define BROKER_MAX_PACKET 4096
+
+#define BROKER_MAX_WORKERS 16
+
+/* latency histograms, bucket i counts [2^i, 2^(i+1)) microseconds */
+#define BROKER_LATENCY_BUCKETS 24
+
+typedef struct broker_stats_t
+{
+    uint32_t connects;          /* CONNECTs answered */
+    uint32_t connections;       /* currently open */
+    uint32_t max_connections;
+    uint32_t subscriptions;     /* currently active */
+    uint32_t publishes;         /* PUBLISH received */
+    uint32_t delivered;         /* PUBLISH sent to subscribers */
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint32_t errors;            /* connections dropped for malformed packets */
+
+    /* per PUBLISH received: from its arrival until a worker took it up, and
+     * from then until it was acknowledged and delivered */
+    uint32_t queue_us[BROKER_LATENCY_BUCKETS];
+    uint32_t handle_us[BROKER_LATENCY_BUCKETS];
+} broker_stats_t;
+
+/** @brief Accepts loopback connections to hostname. Returns 0 on success. */
+int broker_start(const char* hostname, int workers);
+
+/** @brief Stops accepting connections and the workers, closing the open
+ *         connections.
+ */
+void broker_stop(void);
+
+/** @brief Accepts TCP clients on port and bridges each to a loopback
+ *         connection to hostname, one thread per client (POSIX only).
+ *         Returns 0 on success.
+ */
+int broker_listen_tcp(const char* hostname, int port);
+
+void broker_stats(broker_stats_t* stats);
+
+void broker_stats_reset(void);
+
+/** @brief Upper bound of the percentile of a latency histogram in
+ *         microseconds, 0 if it is empty.
+ */
+uint32_t broker_latency_percentile(const uint32_t* histogram, int percent);
+
+#endif
@@ -0,0 +1,74 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Standalone broker stand-in: serves MQTT clients on a TCP port, e.g. a
+ * board with its url set to tcp://<host>:1883, and prints the message
+ * counts and the server-side latency of every interval. */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <evrythng/platform.h>
+
+#include "broker.h"
+
+#define BROKER "broker.loopback"
+
+
+static int usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-p port] [-w workers] [-i report interval s]\n", name);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char** argv)
+{
+    broker_stats_t s;
+    int port = 1883, workers = 2, interval_s = 10;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc || argv[i][0] != '-')
+            return usage(argv[0]);
+
+        int v = atoi(argv[++i]);
+        switch (argv[i - 1][1])
+        {
+            case 'p': port = v; break;
+            case 'w': workers = v; break;
+            case 'i': interval_s = v; break;
+            default: return usage(argv[0]);
+        }
+    }
+
+    if (port < 1 || port > 65535 || interval_s < 1)
+        return usage(argv[0]);
+
+    if (broker_start(BROKER, workers) != 0 || broker_listen_tcp(BROKER, port) != 0)
+    {
+        fprintf(stderr, "failed to start the broker\n");
+        return EXIT_FAILURE;
+    }
+    printf("listening on port %d, %d workers\n", port, workers);
+
+    for (;;)
+    {
+        platform_sleep(interval_s * 1000);
+
+        broker_stats(&s);
+        broker_stats_reset();
+
+        printf("%u connections (max %u), %u subscriptions, %u connects, %u published, %u delivered, %u errors, "
+                "queue p50/p99 %u/%u us, handling p50/p99 %u/%u us\n",
+                s.connections, s.max_connections, s.subscriptions, s.connects, s.publishes, s.delivered, s.errors,
+                broker_latency_percentile(s.queue_us, 50), broker_latency_percentile(s.queue_us, 99),
+                broker_latency_percentile(s.handle_us, 50), broker_latency_percentile(s.handle_us, 99));
+        fflush(stdout);
+    }
+
+    return EXIT_SUCCESS;
+}
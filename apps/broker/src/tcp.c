@@ -0,0 +1,217 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* TCP front end of the broker: each client socket is copied to and from a
+ * loopback connection by its own thread. The thread sleeps in poll() on the
+ * socket and on a pipe written when the broker writes to the connection. */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#include <evrythng/platform.h>
+#include <evrythng/transport.h>
+
+#include "broker.h"
+
+#define BRIDGE_BUFFER 4096
+#define WRITE_TIMEOUT_MS 1000
+
+typedef struct bridge_t
+{
+    int socket;
+    int wakeup[2];          /* written by the notify of the loopback end */
+    LoopbackEnd* end;
+} bridge_t;
+
+static char bridge_hostname[64];
+static int listen_socket = -1;
+
+
+/* called with the pipe locked, must not block */
+static void on_broker_write(void* ctx, LoopbackEnd* end)
+{
+    bridge_t* b = (bridge_t*)ctx;
+    char c = 0;
+    (void)end;
+
+    if (write(b->wakeup[1], &c, 1) < 0 && errno != EAGAIN)
+        platform_printf("%s: wakeup failed: %s\n", __func__, strerror(errno));
+}
+
+
+static int send_all(int s, const unsigned char* buf, int len)
+{
+    while (len > 0)
+    {
+        ssize_t n = send(s, buf, (size_t)len, MSG_NOSIGNAL);
+        if (n <= 0)
+            return -1;
+        buf += n;
+        len -= (int)n;
+    }
+    return 0;
+}
+
+
+/* copies what the broker wrote to the socket, -1 once either side closed */
+static int to_client(bridge_t* b, unsigned char* buf)
+{
+    char drain[64];
+    int n;
+
+    while (read(b->wakeup[0], drain, sizeof drain) > 0)
+        ;
+
+    while ((n = loopback_read_some(b->end, buf, BRIDGE_BUFFER)) > 0)
+        if (send_all(b->socket, buf, n) != 0)
+            return -1;
+
+    return n;
+}
+
+
+static void* bridge_run(void* arg)
+{
+    bridge_t* b = (bridge_t*)arg;
+    unsigned char buf[BRIDGE_BUFFER];
+
+    loopback_set_notify(b->end, on_broker_write, b);
+
+    for (;;)
+    {
+        struct pollfd pfd[2] = { { b->socket, POLLIN, 0 }, { b->wakeup[0], POLLIN, 0 } };
+
+        if (poll(pfd, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (pfd[1].revents && to_client(b, buf) != 0)
+            break;
+
+        if (pfd[0].revents)
+        {
+            ssize_t n = recv(b->socket, buf, sizeof buf, 0);
+            if (n <= 0 || loopback_write(b->end, buf, (int)n, WRITE_TIMEOUT_MS) != n)
+                break;
+        }
+    }
+
+    loopback_set_notify(b->end, 0, 0);
+    loopback_close(b->end);
+    close(b->socket);
+    close(b->wakeup[0]);
+    close(b->wakeup[1]);
+    free(b);
+
+    return 0;
+}
+
+
+static void bridge_start(int s)
+{
+    int one = 1;
+    pthread_t thread;
+
+    bridge_t* b = (bridge_t*)calloc(1, sizeof(bridge_t));
+    if (!b)
+    {
+        close(s);
+        return;
+    }
+    b->socket = s;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    if (pipe(b->wakeup) != 0)
+    {
+        close(s);
+        free(b);
+        return;
+    }
+    fcntl(b->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(b->wakeup[1], F_SETFL, O_NONBLOCK);
+
+    b->end = loopback_connect(bridge_hostname);
+    if (!b->end || pthread_create(&thread, 0, bridge_run, b) != 0)
+    {
+        platform_printf("%s: failed to bridge a client\n", __func__);
+        if (b->end)
+            loopback_close(b->end);
+        close(s);
+        close(b->wakeup[0]);
+        close(b->wakeup[1]);
+        free(b);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+
+static void* accept_run(void* arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        int s = accept(listen_socket, 0, 0);
+        if (s >= 0)
+            bridge_start(s);
+        else if (errno != EINTR && errno != ECONNABORTED)
+            break;
+    }
+
+    return 0;
+}
+
+
+int broker_listen_tcp(const char* hostname, int port)
+{
+    struct sockaddr_in addr;
+    pthread_t thread;
+    int one = 1;
+
+    if (listen_socket >= 0 || !hostname || strlen(hostname) >= sizeof bridge_hostname)
+        return -1;
+    strcpy(bridge_hostname, hostname);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+        return -1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+
+    memset(&addr, 0, sizeof addr);
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)port);
+
+    if (bind(s, (struct sockaddr*)&addr, sizeof addr) != 0 || listen(s, 128) != 0)
+    {
+        platform_printf("%s: failed to listen on port %d: %s\n", __func__, port, strerror(errno));
+        close(s);
+        return -1;
+    }
+    listen_socket = s;
+
+    if (pthread_create(&thread, 0, accept_run, 0) != 0)
+    {
+        close(s);
+        listen_socket = -1;
+        return -1;
+    }
+    pthread_detach(thread);
+
+    return 0;
+}
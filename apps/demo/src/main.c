@@ -11,7 +11,6 @@
  */
 #include <wm_os.h>
 #include <app_framework.h>
-#include <httpc.h>
 #include <wmtime.h>
 #include <cli.h>
 #include <wmstdio.h>
@@ -20,6 +19,13 @@
 #include <psm.h>
 #include <psm-utils.h>
 #include <evrythng/evrythng.h>
+#include <evrythng/platform_ext.h>
+#include <evrythng/pipeline.h>
+#include <evrythng/prepared.h>
+#include <evrythng/json_writer.h>
+#include <evrythng/shadow.h>
+#include <evrythng/reconnect.h>
+#include <evrythng/timesync.h>
 #include <led_indicator.h>
 #include <push_button.h>
 
@@ -33,9 +39,9 @@ static os_thread_stack_define(app_stack, 4 * 1024);
 static os_thread_stack_define(button1_stack, 1 * 1024);
 static os_thread_stack_define(button2_stack, 1 * 1024);
 
-#define EVRYTHNG_GET_TIME_URL "http://time.evrythng.com/time"
-#define MAX_DOWNLOAD_DATA 150
-#define MAX_URL_LEN 128
+#define TIME_SYNC_INTERVAL_S (6 * 3600)
+#define TIME_SYNC_STACK_SIZE (4 * 1024)
+#define TIME_SYNC_TIMEOUT_MS 30000
 
 static output_gpio_cfg_t led_1;
 static output_gpio_cfg_t led_2;
@@ -46,6 +52,8 @@ os_semaphore_t button1_sem;
 os_semaphore_t button2_sem;
 
 evrythng_handle_t evt_handle;
+evrythng_reconnect_t evt_reconnect;
+evrythng_pipeline_t evt_pipeline;
 char *thng_id;
 
 
@@ -72,7 +80,18 @@ static void on_connection_lost()
 
 static void on_connection_restored()
 {
-    wmprintf("connection to cloud restored\n\r");
+    RttStats rtt;
+    platform_network_rtt_stats(NULL, &rtt);
+
+    evrythng_reconnect_stats_t stats;
+    EvrythngReconnectPaceStats(&stats);
+
+    EvrythngPipelineOnConnectionRestored(evt_pipeline);
+
+    wmprintf("connection to cloud restored in %u ms (%u attempts, %u deferred, %u reconnects)\n\r",
+            stats.last_ttr_ms, stats.attempts, stats.deferred, stats.reconnects);
+    wmprintf("ping rtt: last %u ms, smoothed %u ms, %u samples, recommended keepalive %d s\n\r",
+            rtt.last_ms, rtt.srtt_ms, rtt.samples, platform_keepalive_interval());
 }
 
 
@@ -165,6 +184,39 @@ callback_exit:
 }
 
 
+/* Called by the shadow only when the value of a property changed. */
+static void property_callback(void* ctx, const char* json_str, size_t size)
+{
+    const char* property = (const char*)ctx;
+    int slot = EvrythngShadowFind(thng_id, property);
+
+    /* long values are kept on the heap, size the copy from the stored one */
+    int len = EvrythngShadowGet(slot, NULL, 0, NULL);
+    if (len < 0)
+        return;
+
+    char* value = (char*)platform_malloc(len + 1);
+    if (!value)
+        return;
+
+    if (EvrythngShadowGet(slot, value, len + 1, NULL) >= 0)
+    {
+        wmprintf("Received property %s = %s\n\r", property, value);
+    }
+
+    platform_free(value);
+}
+
+
+static void publish_ack_callback(void* ctx, evrythng_return_t rc)
+{
+    if (rc != EVRYTHNG_SUCCESS)
+    {
+        wmprintf("publish of %s failed (%d)\n\r", (const char*)ctx, rc);
+    }
+}
+
+
 /* This task publishes messages to the Evrythng cloud when button is pressed. */
 static void button_task(os_thread_arg_t arg)
 {
@@ -172,25 +224,47 @@ static void button_task(os_thread_arg_t arg)
     int button = (int)arg;
     int presses = 0;
 
-    char json_str[256];
-    char led_action_json_fmt[] = "{\"type\":\"%s\",\"customFields\":{\"status\":\"%d\"}}";
-    char button_json_fmt[] = "[{\"value\": \"%d\"}]";
+    char json_str[128];
+    evrythng_json_t w;
 
     char* button_property = button == button_1 ? "button_1" : "button_2";
     char* led_action = button == button_1 ? "_led1" : "_led2";
     os_semaphore_t sem = button == button_1 ? button1_sem : button2_sem;
 
+    /* topics and headers are built once, every press only adds the payload */
+    evrythng_prepared_t property, action;
+    if (EvrythngPrepare(&property, evt_handle, EVRYTHNG_PREPARED_THNG_PROPERTY, thng_id, button_property, 1) != EVRYTHNG_SUCCESS)
+    {
+        wmprintf("failed to prepare publishing %s\n\r", button_property);
+        os_thread_self_complete(0);
+        return;
+    }
+    if (EvrythngPrepare(&action, evt_handle, EVRYTHNG_PREPARED_THNG_ACTION, thng_id, led_action, 1) != EVRYTHNG_SUCCESS)
+    {
+        wmprintf("failed to prepare publishing %s\n\r", led_action);
+        EvrythngPreparedFree(&property);
+        os_thread_self_complete(0);
+        return;
+    }
+
     while(1) 
     {
         if (os_semaphore_get(&sem, OS_WAIT_FOREVER) == WM_SUCCESS) 
         {
-            sprintf(json_str, button_json_fmt, ++presses);
-            EvrythngPubThngProperty(evt_handle, thng_id, button_property, json_str);
+            if (EvrythngJsonPropertyInt(json_str, sizeof json_str, ++presses) > 0)
+                EvrythngPipelinePubPrepared(evt_pipeline, &property, json_str,
+                        publish_ack_callback, button_property);
 
             led_state = !led_state;
-            sprintf(json_str, led_action_json_fmt, led_action, led_state);
-
-            EvrythngPubThngAction(evt_handle, thng_id, led_action, json_str);
+            EvrythngJsonInit(&w, json_str, sizeof json_str);
+            EvrythngJsonActionBegin(&w, led_action);
+            EvrythngJsonKey(&w, "status");
+            EvrythngJsonString(&w, led_state ? "1" : "0");
+            EvrythngJsonActionEnd(&w);
+
+            if (EvrythngJsonFinish(&w))
+                EvrythngPipelinePubPrepared(evt_pipeline, &action, json_str,
+                        publish_ack_callback, led_action);
         }
     }
 }
@@ -254,12 +328,32 @@ static void evrythng_task()
     EvrythngSetLogCallback(evt_handle, log_callback);
     EvrythngSetConnectionCallbacks(evt_handle, on_connection_lost, on_connection_restored);
 
-    while ((rc = EvrythngConnect(evt_handle)) != EVRYTHNG_SUCCESS) 
+    /* certificates can't be validated without the current time */
+    if (EvrythngTimeSyncWait(TIME_SYNC_TIMEOUT_MS) != EVRYTHNG_SUCCESS)
     {
-        wmprintf("connection failed (%d), retry\n\r", rc);
-        os_thread_sleep(os_msec_to_ticks(5000));
+        wmprintf("time is not synchronized yet\n\r");
+    }
+
+    /* the first connection and the ones of the core after a loss back off
+     * with jitter, so a fleet doesn't reconnect in lockstep after an outage */
+    EvrythngReconnectInit(&evt_reconnect, NULL);
+    EvrythngReconnect(evt_handle, &evt_reconnect, 0);
+    wmprintf("Connected in %u ms\n\r", evt_reconnect.stats.last_ttr_ms);
+    EvrythngReconnectPace(&evt_reconnect.policy);
+
+    evrythng_pipeline_config_t pipeline_config = {
+        .window = 2,
+        .queue_size = 16,
+        .max_attempts = 5,
+        .retry_ms = 5000,
+        .priority = OS_PRIO_3,
+        .stack_size = 2 * 1024,
+    };
+    if ((rc = EvrythngPipelineCreate(&evt_pipeline, evt_handle, &pipeline_config)) != EVRYTHNG_SUCCESS)
+    {
+        wmprintf("failed to create publish pipeline (%d)\n\r", rc);
+        goto exit;
     }
-    wmprintf("Connected\n\r");
 
     os_semaphore_create_counting(&button1_sem, "button1_sem", 1000, 0);
     os_semaphore_create_counting(&button2_sem, "button2_sem", 1000, 0);
@@ -267,8 +361,9 @@ static void evrythng_task()
     EvrythngSubThngAction(evt_handle, thng_id, "_led1", 0, action_led_callback);
     EvrythngSubThngAction(evt_handle, thng_id, "_led2", 0, action_led_callback);
 
-    EvrythngSubThngProperty(evt_handle, thng_id, "property_1", 0, action_led_callback);
-    EvrythngSubThngProperty(evt_handle, thng_id, "property_2", 0, action_led_callback);
+    EvrythngShadowInit();
+    EvrythngShadowSubThngProperty(evt_handle, thng_id, "property_1", property_callback, "property_1", NULL);
+    EvrythngShadowSubThngProperty(evt_handle, thng_id, "property_2", property_callback, "property_2", NULL);
 
 
     os_thread_create(&button1_thread, "button1_task", button_task, (void*)button_1, &button1_stack, OS_PRIO_3);
@@ -279,70 +374,6 @@ exit:
 }
 
 
-static void set_device_time()
-{
-	http_session_t handle;
-	http_resp_t *resp = NULL;
-	char buf[MAX_DOWNLOAD_DATA];
-	int64_t timestamp, offset;
-	int size = 0;
-	int status = 0;
-	char url_name[MAX_URL_LEN];
-
-	memset(url_name, 0, sizeof(url_name));
-	strncpy(url_name, EVRYTHNG_GET_TIME_URL, strlen(EVRYTHNG_GET_TIME_URL));
-
-	wmprintf("Get time from : %s\r\n", url_name);
-	status = httpc_get(url_name, &handle, &resp, NULL);
-	if (status != WM_SUCCESS) {
-		wmprintf("Getting URL failed");
-		return;
-	}
-	size = http_read_content(handle, buf, MAX_DOWNLOAD_DATA);
-	if (size <= 0) {
-		wmprintf("Reading time failed\r\n");
-		goto out_time;
-	}
-	/*
-	  If timezone is present in PSM
-	  Get on http://api.evrythng.com/time?tz=<timezone>
-	  The data will look like this
-	  {
-	  "timestamp":1429514751927,
-	  "offset":-18000000,
-	  "localTime":"2015-04-20T02:25:51.927-05:00",
-	  "nextChange":1446361200000
-	  }
-	  If timezone is not presentin PSM
-	  Get on http://api.evrythng.com/time
-	  The data will look like this
-	  {
-	  "timestamp":1429514751927
-	  }
-	*/
-	jobj_t json_obj;
-	if (json_parse_start(&json_obj, buf, size) != WM_SUCCESS) {
-		wmprintf("Wrong json string\r\n");
-		goto out_time;
-	}
-
-	if (json_get_val_int64(&json_obj, "timestamp", &timestamp) == WM_SUCCESS) {
-		if (json_get_val_int64(&json_obj, "offset", &offset)
-		    != WM_SUCCESS) {
-			offset = 0;
-		}
-		timestamp = timestamp + offset;
-	}
-	wmtime_time_set_posix(timestamp/1000);
-
-    json_parse_stop(&json_obj);
-
-out_time:
-	http_close_session(&handle);
-	return;
-}
-
-
 /* This function is defined for handling critical error.
  * For this application, we just stall and do nothing when
  * a critical error occurs.
@@ -403,7 +434,14 @@ int common_event_handler(int event, void *data)
 
 		break;
 	case AF_EVT_NORMAL_CONNECTED:
-		set_device_time();
+		/* the clock is synchronized in the background, only the first
+		 * connection to the cloud waits for it (see evrythng_task) */
+		if (!is_cloud_started)
+			EvrythngTimeSyncStart(TIME_SYNC_INTERVAL_S,
+					OS_PRIO_3, TIME_SYNC_STACK_SIZE);
+		else
+			EvrythngTimeSyncRequest();
+
 		if (!is_cloud_started) {
 			configure_gpios();
 			os_thread_sleep(2000);
@@ -430,6 +468,21 @@ int common_event_handler(int event, void *data)
 	return 0;
 }
 
+/* wake-ups of the SDK since the last call, for measuring tickless idle */
+static void cmd_wakeups(int argc, char **argv)
+{
+	WakeupStats stats;
+
+	platform_wakeup_stats(&stats);
+	wmprintf("wake-ups: %u per minute over %u ms (%u sleeps, %u read timeouts, %u reads)\r\n",
+			stats.per_minute, stats.period_ms, stats.sleeps, stats.read_timeouts, stats.reads);
+	platform_wakeup_stats_reset();
+}
+
+static struct cli_command wakeups_command = {
+	"wakeups", "print and reset the SDK wake-up counters", cmd_wakeups
+};
+
 static void modules_init()
 {
 	int ret;
@@ -456,6 +509,12 @@ static void modules_init()
 		wmprintf("Error: pm_cli_init failed\r\n");
 		appln_critical_error_handler((void *) -WM_FAIL);
 	}
+
+	ret = cli_register_command(&wakeups_command);
+	if (ret != WM_SUCCESS) {
+		wmprintf("Error: cli_register_command failed\r\n");
+		appln_critical_error_handler((void *) -WM_FAIL);
+	}
 	/* Initialize time subsystem.
 	 *
 	 * Initializes time to 1/1/1970 epoch 0.
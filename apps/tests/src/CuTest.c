@@ -1,6 +1,9 @@
 #include <setjmp.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+
+#include "evrythng/platform_ext.h"
 
 #include "CuTest.h"
 
@@ -112,6 +115,9 @@ void CuTestInit(CuTest* t, const char* name, TestFunction function)
 	t->failed = 0;
 	t->ran = 0;
 	t->function = function;
+	t->iterations = 0;
+	t->batch = 0;
+	t->mean_ns = t->min_ns = t->p99_ns = t->baseline_ns = 0;
     CuStringInit(&t->message);
 }
 
@@ -122,6 +128,13 @@ CuTest* CuTestNew(const char* name, TestFunction function)
 	return tc;
 }
 
+CuTest* CuBenchNew(const char* name, TestFunction function, int iterations)
+{
+	CuTest* tc = CuTestNew(name, function);
+	tc->iterations = iterations > 0 ? iterations : 1;
+	return tc;
+}
+
 void CuTestDelete(CuTest *t)
 {
     if (!t) return;
@@ -132,6 +145,12 @@ void CuTestDelete(CuTest *t)
 
 void CuTestRun(CuTest* tc)
 {
+    if (tc->iterations)
+    {
+        CuBenchRun(tc);
+        return;
+    }
+
     tc->ran = 1;
     (tc->function)(tc);
 }
@@ -190,10 +209,163 @@ void CuAssertPtrEquals_LineMsg(CuTest* tc, const char* file, int line, const cha
 }
 
 
+/*-------------------------------------------------------------------------*
+ * CuBench
+ *-------------------------------------------------------------------------*/
+
+static struct
+{
+	char* name;
+	uint32_t mean_ns;
+} baselines[CU_BENCH_MAX_BASELINES];
+
+static int baselinesCount;
+static int tolerance = CU_BENCH_TOLERANCE;
+
+void CuBenchSetBaseline(const char* name, uint32_t mean_ns)
+{
+	int i;
+	for (i = 0 ; i < baselinesCount ; ++i)
+	{
+		if (strcmp(baselines[i].name, name) == 0)
+		{
+			baselines[i].mean_ns = mean_ns;
+			return;
+		}
+	}
+
+	if (baselinesCount == CU_BENCH_MAX_BASELINES) return;
+	baselines[baselinesCount].name = CuStrCopy(name);
+	baselines[baselinesCount].mean_ns = mean_ns;
+	baselinesCount++;
+}
+
+void CuBenchSetTolerance(int percent)
+{
+	tolerance = percent;
+}
+
+uint32_t CuBenchGetBaseline(const char* name)
+{
+	int i;
+	for (i = 0 ; i < baselinesCount ; ++i)
+	{
+		if (strcmp(baselines[i].name, name) == 0) return baselines[i].mean_ns;
+	}
+	return 0;
+}
+
+static int CuCompareSamples(const void* a, const void* b)
+{
+	uint32_t x = *(const uint32_t*)a, y = *(const uint32_t*)b;
+	return x < y ? -1 : x > y;
+}
+
+/* runs batch iterations, returns the time taken in us */
+static uint32_t CuBenchBatch(CuTest* tc, int batch)
+{
+	uint32_t start = platform_uptime_us();
+	int i;
+	for (i = 0 ; i < batch && !tc->failed ; ++i)
+	{
+		(tc->function)(tc);
+	}
+	return platform_uptime_us() - start;
+}
+
+void CuBenchRun(CuTest* tc)
+{
+	uint32_t* samples;
+	uint32_t elapsed, sample;
+	uint64_t total_us = 0;
+	uint32_t random = 1;
+	int batch = 1, count = 0, taken = 0, done, n, i;
+
+	tc->ran = 1;
+	samples = (uint32_t*) platform_malloc(sizeof(uint32_t) * CU_BENCH_MAX_SAMPLES);
+	if (!samples)
+	{
+		CuFail(tc, "out of memory");
+		return;
+	}
+
+	/* warms up, then finds a batch long enough for the timer resolution
+	 * unless an iteration is long enough on its own */
+	CuBenchBatch(tc, 1);
+	if (!tc->failed && CuBenchBatch(tc, 1) < CU_BENCH_ITERATION_US)
+	{
+		while (batch < tc->iterations && !tc->failed && CuBenchBatch(tc, batch) < CU_BENCH_SAMPLE_US)
+		{
+			batch *= 2;
+		}
+	}
+	if (batch > 1 && batch < (tc->iterations + CU_BENCH_MAX_SAMPLES - 1) / CU_BENCH_MAX_SAMPLES)
+	{
+		batch = (tc->iterations + CU_BENCH_MAX_SAMPLES - 1) / CU_BENCH_MAX_SAMPLES;
+	}
+	if (batch > tc->iterations) batch = tc->iterations;
+	tc->batch = batch;
+
+	for (done = 0 ; done < tc->iterations && !tc->failed ; done += n)
+	{
+		n = tc->iterations - done < batch ? tc->iterations - done : batch;
+		elapsed = CuBenchBatch(tc, n);
+		sample = (uint32_t)((uint64_t)elapsed * 1000 / n);
+		total_us += elapsed;
+
+		/* reservoir sampling once the samples are full, with a fixed
+		 * generator so that runs select the same iterations */
+		if (count < CU_BENCH_MAX_SAMPLES)
+		{
+			samples[count++] = sample;
+		}
+		else
+		{
+			random = random * 1103515245 + 12345;
+			i = (int)((random >> 8) % (uint32_t)(taken + 1));
+			if (i < CU_BENCH_MAX_SAMPLES) samples[i] = sample;
+		}
+		taken++;
+	}
+
+	if (count)
+	{
+		qsort(samples, count, sizeof(uint32_t), CuCompareSamples);
+		tc->mean_ns = (uint32_t)(total_us * 1000 / done);
+		tc->min_ns = samples[0];
+		tc->p99_ns = samples[count * 99 / 100];
+	}
+	platform_free(samples);
+
+	tc->baseline_ns = CuBenchGetBaseline(tc->name);
+	if (!tc->failed && tc->baseline_ns &&
+	    (uint64_t)tc->mean_ns * 100 > (uint64_t)tc->baseline_ns * (100 + tolerance))
+	{
+		CuStringAppendFormat(&tc->message, "%s: mean %u ns, baseline %u ns", tc->name,
+			(unsigned)tc->mean_ns, (unsigned)tc->baseline_ns);
+		CuFail(tc, tc->message.buffer);
+	}
+}
+
 /*-------------------------------------------------------------------------*
  * CuSuite
  *-------------------------------------------------------------------------*/
 
+static int shardIndex = 0;
+static int shardCount = 1;
+static int failures = 0;
+
+void CuSuiteSetShard(int index, int count)
+{
+	shardIndex = index;
+	shardCount = count > 0 ? count : 1;
+}
+
+int CuFailures(void)
+{
+	return failures;
+}
+
 void CuSuiteInit(CuSuite* testSuite)
 {
 	testSuite->count = 0;
@@ -243,8 +415,9 @@ void CuSuiteRun(CuSuite* testSuite)
 	for (i = 0 ; i < testSuite->count ; ++i)
 	{
 		CuTest* testCase = testSuite->list[i];
+		if (i % shardCount != shardIndex) continue;
 		CuTestRun(testCase);
-		if (testCase->failed) { testSuite->failCount += 1; }
+		if (testCase->failed) { testSuite->failCount += 1; failures += 1; }
 	}
 }
 
@@ -254,6 +427,7 @@ void CuSuiteSummary(CuSuite* testSuite, CuString* summary)
 	for (i = 0 ; i < testSuite->count ; ++i)
 	{
 		CuTest* testCase = testSuite->list[i];
+		if (!testCase->ran) continue;
 		CuStringAppend(summary, testCase->failed ? "F" : ".");
 	}
 	CuStringAppend(summary, "\n\n\r");
@@ -261,9 +435,15 @@ void CuSuiteSummary(CuSuite* testSuite, CuString* summary)
 
 void CuSuiteDetails(CuSuite* testSuite, CuString* details)
 {
+	int i, runCount = 0;
+	for (i = 0 ; i < testSuite->count ; ++i)
+	{
+		if (testSuite->list[i]->ran) runCount++;
+	}
+
 	if (testSuite->failCount == 0)
 	{
-		int passCount = testSuite->count - testSuite->failCount;
+		int passCount = runCount - testSuite->failCount;
 		const char* testWord = passCount == 1 ? "test" : "tests";
 		CuStringAppendFormat(details, "OK (%d %s)\n\r", passCount, testWord);
 	}
@@ -271,8 +451,22 @@ void CuSuiteDetails(CuSuite* testSuite, CuString* details)
 	{
 		CuStringAppend(details, "\n\r!!!FAILURES!!!\n\r");
 
-		CuStringAppendFormat(details, "Runs: %d ",   testSuite->count);
-		CuStringAppendFormat(details, "Passes: %d ", testSuite->count - testSuite->failCount);
+		CuStringAppendFormat(details, "Runs: %d ",   runCount);
+		CuStringAppendFormat(details, "Passes: %d ", runCount - testSuite->failCount);
 		CuStringAppendFormat(details, "Fails: %d\n\r",  testSuite->failCount);
 	}
 }
+
+void CuSuiteBenchResults(CuSuite* testSuite, CuString* results)
+{
+	int i;
+	for (i = 0 ; i < testSuite->count ; ++i)
+	{
+		CuTest* testCase = testSuite->list[i];
+		if (!testCase->iterations || !testCase->ran) continue;
+
+		CuStringAppendFormat(results, "bench %s iterations=%d batch=%d mean_ns=%u min_ns=%u p99_ns=%u baseline_ns=%u %s\n\r",
+			testCase->name, testCase->iterations, testCase->batch, (unsigned)testCase->mean_ns, (unsigned)testCase->min_ns,
+			(unsigned)testCase->p99_ns, (unsigned)testCase->baseline_ns, testCase->failed ? "failed" : "ok");
+	}
+}
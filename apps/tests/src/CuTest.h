@@ -5,6 +5,7 @@
 
 #include <setjmp.h>
 #include <stdarg.h>
+#include <stdint.h>
 
 #define CUTEST_VERSION  "CuTest 1.5"
 
@@ -49,10 +50,19 @@ struct CuTest
 	int failed;
 	int ran;
 	CuString message;
+
+	/* benchmarks: function is one iteration, timed in ns per iteration */
+	int iterations;
+	int batch;		/* iterations per sample, 1 when timed one by one */
+	uint32_t mean_ns;
+	uint32_t min_ns;
+	uint32_t p99_ns;
+	uint32_t baseline_ns;
 };
 
 void CuTestInit(CuTest* t, const char* name, TestFunction function);
 CuTest* CuTestNew(const char* name, TestFunction function);
+CuTest* CuBenchNew(const char* name, TestFunction function, int iterations);
 void CuTestRun(CuTest* tc);
 void CuTestDelete(CuTest *t);
 
@@ -90,11 +100,33 @@ void CuAssertPtrEquals_LineMsg(CuTest* tc,
 #define CuAssertPtrNotNull(tc,p)        CuAssert_Line((tc),__FILE__,__LINE__,"null pointer unexpected",(p != NULL))
 #define CuAssertPtrNotNullMsg(tc,msg,p) CuAssert_Line((tc),__FILE__,__LINE__,(msg),(p != NULL))
 
+/* CuBench */
+
+/* an iteration taking at least CU_BENCH_ITERATION_US is timed on its own,
+ * min and p99 are then the ones of the individual iterations (of a uniform
+ * selection of CU_BENCH_MAX_SAMPLES of them if there are more). Shorter
+ * iterations are too close to the timer resolution and timed in batches
+ * of at least CU_BENCH_SAMPLE_US, min and p99 are then the ones of the
+ * batch means. The "batch" of the results tells which. */
+#define CU_BENCH_ITERATION_US	10
+#define CU_BENCH_SAMPLE_US	100
+#define CU_BENCH_MAX_SAMPLES	1024
+#define CU_BENCH_MAX_BASELINES	64
+#define CU_BENCH_TOLERANCE	25
+
+/* a benchmark fails when its mean exceeds the baseline by more than the
+ * tolerance in percent, benchmarks without baseline only report */
+void CuBenchSetBaseline(const char* name, uint32_t mean_ns);
+uint32_t CuBenchGetBaseline(const char* name);
+void CuBenchSetTolerance(int percent);
+void CuBenchRun(CuTest* tc);
+
 /* CuSuite */
 
 #define MAX_TEST_CASES	1024
 
 #define SUITE_ADD_TEST(SUITE,TEST)	CuSuiteAdd(SUITE, CuTestNew(#TEST, TEST))
+#define SUITE_ADD_BENCH(SUITE,TEST,ITERATIONS)	CuSuiteAdd(SUITE, CuBenchNew(#TEST, TEST, ITERATIONS))
 
 typedef struct
 {
@@ -111,7 +143,15 @@ void CuSuiteDelete(CuSuite *testSuite);
 void CuSuiteAdd(CuSuite* testSuite, CuTest *testCase);
 void CuSuiteAddSuite(CuSuite* testSuite, CuSuite* testSuite2);
 void CuSuiteRun(CuSuite* testSuite);
+/* runs only the cases i with i % count == index in CuSuiteRun(), for
+ * splitting a suite of independent cases over processes */
+void CuSuiteSetShard(int index, int count);
+/* cases failed in all CuSuiteRun() calls */
+int CuFailures(void);
 void CuSuiteSummary(CuSuite* testSuite, CuString* summary);
 void CuSuiteDetails(CuSuite* testSuite, CuString* details);
+/* one line per benchmark, "bench <name> iterations=... batch=... mean_ns=... min_ns=...
+ * p99_ns=... baseline_ns=... ok|failed" */
+void CuSuiteBenchResults(CuSuite* testSuite, CuString* results);
 
 #endif /* CU_TEST_H */
@@ -0,0 +1,126 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Benchmarks of the publish, payload and connect paths run after the unit tests.
+ * Baselines are mean ns per iteration, set by the runner before: read
+ * from the PSM on the board (apps/tests/src/main.c), from the file given
+ * with -b on the host. A run prints the current numbers to update them. */
+
+#include <string.h>
+
+#include <evrythng/cbor.h>
+#include <evrythng/json_writer.h>
+#include <evrythng/platform.h>
+#include <evrythng/prepared.h>
+
+#include "CuTest.h"
+#include "tests.h"
+
+#define ITERATIONS 100000
+
+/* every connect is timed on its own, see CU_BENCH_SAMPLE_US */
+#define CONNECT_ITERATIONS 50
+
+/* broker of the connect benchmark, the host runner's stand-in answers
+ * for it. Any broker will do: a refused CONNECT is answered too. */
+#if !defined(BENCH_MQTT_HOST)
+#define BENCH_MQTT_HOST "mqtt.evrythng.com"
+#endif
+#if !defined(BENCH_MQTT_PORT)
+#define BENCH_MQTT_PORT 1883
+#endif
+
+#define CONNECT_TIMEOUT_MS 5000
+
+static const char thng_id[] = "UEp4rDGsnpCAF6xABbys5Amc";
+
+static evrythng_prepared_t prepared;
+static uint8_t cbor[64];
+static int cbor_len;
+
+static const char* mqtt_host = BENCH_MQTT_HOST;
+
+
+void SetBenchHost(const char* hostname)
+{
+    mqtt_host = hostname;
+}
+
+
+static void BenchPreparedSerialize(CuTest* tc)
+{
+    static const unsigned char payload[] = "[{\"value\":42}]";
+    unsigned char buf[256];
+
+    int len = EvrythngPreparedSerialize(&prepared, buf, sizeof buf, 1, payload, sizeof payload - 1);
+    CuAssertTrue(tc, len > 0);
+}
+
+
+static void BenchJsonPropertyFloat(CuTest* tc)
+{
+    char buf[64];
+    CuAssertTrue(tc, EvrythngJsonPropertyFloat(buf, sizeof buf, 21.375, 2) > 0);
+}
+
+
+static void BenchCborMapFind(CuTest* tc)
+{
+    evrythng_cbor_reader_t r;
+    evrythng_cbor_item_t array, map, value;
+
+    EvrythngCborReaderInit(&r, cbor, cbor_len);
+    CuAssertTrue(tc, EvrythngCborNext(&r, &array) == 0 && EvrythngCborNext(&r, &map) == 0 &&
+            EvrythngCborMapFind(&r, &map, "value", &value) == 0);
+}
+
+
+static void BenchCborToJson(CuTest* tc)
+{
+    char json[64];
+    CuAssertTrue(tc, EvrythngCborToJson(cbor, cbor_len, json, sizeof json) > 0);
+}
+
+
+/* connection, MQTT CONNECT/CONNACK and disconnect through the platform */
+static void BenchConnect(CuTest* tc)
+{
+    /* CONNECT of MQTT 3.1.1, clean session, 60 s keepalive, client id "bench" */
+    unsigned char connect[] = { 0x10, 17, 0, 4, 'M', 'Q', 'T', 'T', 4, 2, 0, 60, 0, 5, 'b', 'e', 'n', 'c', 'h' };
+    unsigned char connack[4];
+    static Network n;
+
+    platform_network_init(&n);
+    CuAssertIntEquals(tc, 0, platform_network_connect(&n, (char*)mqtt_host, BENCH_MQTT_PORT));
+    CuAssertIntEquals(tc, sizeof connect, platform_network_write(&n, connect, sizeof connect, CONNECT_TIMEOUT_MS));
+    CuAssertIntEquals(tc, sizeof connack, platform_network_read(&n, connack, sizeof connack, CONNECT_TIMEOUT_MS));
+    CuAssertIntEquals(tc, 0x20, connack[0]);
+    platform_network_disconnect(&n);
+}
+
+
+void RunAllBenches()
+{
+    CuString *output = CuStringNew();
+    CuSuite* suite = CuSuiteNew();
+
+    EvrythngPrepare(&prepared, 0, EVRYTHNG_PREPARED_THNG_PROPERTY, thng_id, "temperature", 1);
+    cbor_len = EvrythngCborPropertyFloat(cbor, sizeof cbor, 21.375);
+
+    SUITE_ADD_BENCH(suite, BenchPreparedSerialize, ITERATIONS);
+    SUITE_ADD_BENCH(suite, BenchJsonPropertyFloat, ITERATIONS);
+    SUITE_ADD_BENCH(suite, BenchCborMapFind, ITERATIONS);
+    SUITE_ADD_BENCH(suite, BenchCborToJson, ITERATIONS);
+    SUITE_ADD_BENCH(suite, BenchConnect, CONNECT_ITERATIONS);
+
+    CuSuiteRun(suite);
+    CuSuiteBenchResults(suite, output);
+    CuSuiteDetails(suite, output);
+    platform_printf("%s", output->buffer);
+
+    EvrythngPreparedFree(&prepared);
+    CuSuiteDelete(suite);
+    CuStringDelete(output);
+}
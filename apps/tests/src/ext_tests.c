@@ -0,0 +1,1122 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Unit tests of the payload codecs and helpers under lib/ext, run after
+ * the tests of the core library. They don't need a connection. */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <evrythng/cbor.h>
+#include <evrythng/connect_backoff.h>
+#include <evrythng/deadband.h>
+#include <evrythng/gateway.h>
+#include <evrythng/json_writer.h>
+#include <evrythng/keepalive.h>
+#include <evrythng/ota.h>
+#include <evrythng/outbox.h>
+#include <evrythng/platform.h>
+#include <evrythng/platform_ext.h>
+#include <evrythng/prepared.h>
+#include <evrythng/reconnect.h>
+#include <evrythng/sha256.h>
+#include <evrythng/shadow.h>
+#include <evrythng/stream.h>
+#include <evrythng/timesync.h>
+
+#include "CuTest.h"
+#include "tests.h"
+
+
+static const char* json_number(char* buf, size_t size, double value)
+{
+    evrythng_json_t w;
+
+    EvrythngJsonInit(&w, buf, size);
+    EvrythngJsonNumber(&w, value);
+
+    return EvrythngJsonFinish(&w);
+}
+
+
+/* converts hex encoded CBOR to JSON, NULL if rejected */
+static const char* cbor_hex_to_json(const char* hex, char* json, size_t size)
+{
+    uint8_t cbor[64];
+    size_t i, len = strlen(hex) / 2;
+
+    for (i = 0; i < len && i < sizeof cbor; i++)
+    {
+        unsigned int b;
+        sscanf(hex + 2 * i, "%2x", &b);
+        cbor[i] = (uint8_t)b;
+    }
+
+    return EvrythngCborToJson(cbor, len, json, size) < 0 ? 0 : json;
+}
+
+
+static void TestJsonWriter(CuTest* tc)
+{
+    char buf[128];
+    evrythng_json_t w;
+
+    EvrythngJsonInit(&w, buf, sizeof buf);
+    EvrythngJsonObjectBegin(&w);
+    EvrythngJsonKey(&w, "s");
+    EvrythngJsonString(&w, "a\"b\\c\n\x01");
+    EvrythngJsonKey(&w, "i");
+    EvrythngJsonInt(&w, INT64_MIN);
+    EvrythngJsonKey(&w, "f");
+    EvrythngJsonFloat(&w, -0.125, 2);
+    EvrythngJsonKey(&w, "a");
+    EvrythngJsonArrayBegin(&w);
+    EvrythngJsonBool(&w, 1);
+    EvrythngJsonNull(&w);
+    EvrythngJsonArrayEnd(&w);
+    EvrythngJsonObjectEnd(&w);
+
+    CuAssertStrEquals(tc, "{\"s\":\"a\\\"b\\\\c\\n\\u0001\",\"i\":-9223372036854775808,"
+            "\"f\":-0.13,\"a\":[true,null]}", EvrythngJsonFinish(&w));
+}
+
+
+static void TestJsonWriterOverflow(CuTest* tc)
+{
+    char buf[8];
+    evrythng_json_t w;
+
+    EvrythngJsonInit(&w, buf, sizeof buf);
+    EvrythngJsonString(&w, "too long for it");
+    CuAssertPtrEquals(tc, NULL, (void*)EvrythngJsonFinish(&w));
+
+    /* left open */
+    EvrythngJsonInit(&w, buf, sizeof buf);
+    EvrythngJsonArrayBegin(&w);
+    CuAssertPtrEquals(tc, NULL, (void*)EvrythngJsonFinish(&w));
+}
+
+
+static void TestJsonNumberEdges(CuTest* tc)
+{
+    char buf[64];
+
+    CuAssertStrEquals(tc, "42", json_number(buf, sizeof buf, 42));
+    CuAssertStrEquals(tc, "-1.5", json_number(buf, sizeof buf, -1.5));
+    CuAssertStrEquals(tc, "0.000001", json_number(buf, sizeof buf, 1e-6));
+    CuAssertStrEquals(tc, "8999999999999999", json_number(buf, sizeof buf, 8999999999999999.0));
+    CuAssertStrEquals(tc, "1e+20", json_number(buf, sizeof buf, 1e20));
+    CuAssertStrEquals(tc, "-1.0000000000000001e+300", json_number(buf, sizeof buf, -1e300));
+    CuAssertStrEquals(tc, "1.7976931348623157e+308", json_number(buf, sizeof buf, 1.7976931348623157e308));
+    CuAssertStrEquals(tc, "null", json_number(buf, sizeof buf, NAN));
+    CuAssertStrEquals(tc, "null", json_number(buf, sizeof buf, INFINITY));
+    CuAssertStrEquals(tc, "null", json_number(buf, sizeof buf, -INFINITY));
+}
+
+
+static void TestJsonProperty(CuTest* tc)
+{
+    char buf[64];
+
+    CuAssertTrue(tc, EvrythngJsonPropertyInt(buf, sizeof buf, -7) > 0);
+    CuAssertStrEquals(tc, "[{\"value\":-7}]", buf);
+    CuAssertTrue(tc, EvrythngJsonPropertyFloat(buf, sizeof buf, 21.375, 2) > 0);
+    CuAssertStrEquals(tc, "[{\"value\":21.38}]", buf);
+}
+
+
+static void TestCborRoundTrip(CuTest* tc)
+{
+    uint8_t cbor[128];
+    char json[128];
+    evrythng_cbor_t w;
+
+    EvrythngCborInit(&w, cbor, sizeof cbor);
+    EvrythngCborArray(&w, 1);
+    EvrythngCborMap(&w, 5);
+    EvrythngCborString(&w, "value");
+    EvrythngCborFloat(&w, 21.375);
+    EvrythngCborString(&w, "n");
+    EvrythngCborInt(&w, -100000);
+    EvrythngCborString(&w, "big");
+    EvrythngCborInt(&w, INT64_MAX);
+    EvrythngCborString(&w, "on");
+    EvrythngCborBool(&w, 0);
+    EvrythngCborString(&w, "s");
+    EvrythngCborString(&w, "\"q\"");
+
+    int len = EvrythngCborFinish(&w);
+    CuAssertTrue(tc, len > 0);
+    CuAssertTrue(tc, EvrythngCborToJson(cbor, len, json, sizeof json) > 0);
+    CuAssertStrEquals(tc, "[{\"value\":21.375,\"n\":-100000,\"big\":9223372036854775807,"
+            "\"on\":false,\"s\":\"\\\"q\\\"\"}]", json);
+}
+
+
+static void TestCborPropertyMapFind(CuTest* tc)
+{
+    uint8_t cbor[32];
+    evrythng_cbor_reader_t r;
+    evrythng_cbor_item_t array, map, value;
+
+    int len = EvrythngCborPropertyFloat(cbor, sizeof cbor, 0.5);
+    CuAssertTrue(tc, len > 0);
+
+    EvrythngCborReaderInit(&r, cbor, len);
+    CuAssertIntEquals(tc, 0, EvrythngCborNext(&r, &array));
+    CuAssertIntEquals(tc, EVRYTHNG_CBOR_ARRAY, array.type);
+    CuAssertIntEquals(tc, 0, EvrythngCborNext(&r, &map));
+    CuAssertIntEquals(tc, 0, EvrythngCborMapFind(&r, &map, "value", &value));
+    CuAssertIntEquals(tc, EVRYTHNG_CBOR_FLOAT, value.type);
+    CuAssertDblEquals(tc, 0.5, value.v.f, 0);
+}
+
+
+static void TestCborFloatEdges(CuTest* tc)
+{
+    char json[64];
+
+    /* doubles beyond the fixed point range of the JSON writer */
+    CuAssertStrEquals(tc, "1e+20", cbor_hex_to_json("fb4415af1d78b58c40", json, sizeof json));
+    CuAssertStrEquals(tc, "1.0000000000000001e+300", cbor_hex_to_json("fb7e37e43c8800759c", json, sizeof json));
+
+    /* half and single precision */
+    CuAssertStrEquals(tc, "1.5", cbor_hex_to_json("f93e00", json, sizeof json));
+    CuAssertStrEquals(tc, "100000", cbor_hex_to_json("fa47c35000", json, sizeof json));
+    CuAssertStrEquals(tc, "0.000061", cbor_hex_to_json("f90400", json, sizeof json));
+
+    /* not representable in JSON */
+    CuAssertStrEquals(tc, "null", cbor_hex_to_json("f97c00", json, sizeof json));
+    CuAssertStrEquals(tc, "null", cbor_hex_to_json("f9fc00", json, sizeof json));
+    CuAssertStrEquals(tc, "null", cbor_hex_to_json("f97e00", json, sizeof json));
+    CuAssertStrEquals(tc, "[null]", cbor_hex_to_json("81fb7ff8000000000000", json, sizeof json));
+}
+
+
+static void TestCborMalformed(CuTest* tc)
+{
+    char json[64];
+
+    /* truncated double, array shorter than announced, trailing byte */
+    CuAssertPtrEquals(tc, NULL, (void*)cbor_hex_to_json("fb4415af", json, sizeof json));
+    CuAssertPtrEquals(tc, NULL, (void*)cbor_hex_to_json("8201", json, sizeof json));
+    CuAssertPtrEquals(tc, NULL, (void*)cbor_hex_to_json("0101", json, sizeof json));
+
+    /* byte strings have no JSON form, nesting beyond the limit */
+    CuAssertPtrEquals(tc, NULL, (void*)cbor_hex_to_json("4100", json, sizeof json));
+    CuAssertPtrEquals(tc, NULL, (void*)cbor_hex_to_json("818181818181818181818100", json, sizeof json));
+
+    /* output buffer too small */
+    CuAssertPtrEquals(tc, NULL, (void*)cbor_hex_to_json("fb4415af1d78b58c40", json, 4));
+}
+
+
+static void TestDeadband(CuTest* tc)
+{
+    evrythng_deadband_config_t config = { 2, 0.5, 0 };
+    evrythng_deadband_stats_t stats;
+    evrythng_deadband_t d;
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngDeadbandCreate(&d, &config));
+
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheck(d, "t1", "temp", 20.0));
+    CuAssertIntEquals(tc, 0, EvrythngDeadbandCheck(d, "t1", "temp", 20.4));
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheck(d, "t1", "temp", 20.6));
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheck(d, "t1", "hum", 20.6));
+
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheckJson(d, "t2", "mode", "\"eco\""));
+    CuAssertIntEquals(tc, 0, EvrythngDeadbandCheckJson(d, "t2", "mode", "\"eco\""));
+
+    /* a failed publish must not suppress the next one */
+    EvrythngDeadbandForget(d, "t2", "mode");
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheckJson(d, "t2", "mode", "\"eco\""));
+
+    /* same 32 bit FNV-1a hash, still a change */
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheckJson(d, "t2", "mode", "\"2112789\""));
+    CuAssertIntEquals(tc, 1, EvrythngDeadbandCheckJson(d, "t2", "mode", "\"2349192\""));
+    CuAssertIntEquals(tc, 0, EvrythngDeadbandCheckJson(d, "t2", "mode", "\"2349192\""));
+
+    EvrythngDeadbandStats(d, &stats);
+    CuAssertIntEquals(tc, 3, (int)stats.suppressed);
+    CuAssertTrue(tc, stats.evictions >= 1);
+
+    EvrythngDeadbandDestroy(d);
+}
+
+
+static void count_callback(void* ctx, const char* json, size_t len)
+{
+    (*(int*)ctx)++;
+}
+
+
+static void TestShadow(CuTest* tc)
+{
+    static const char long_a[] = "[{\"value\":\"0123456789012345678901234567890123456789012345678901234567-a\"}]";
+    static const char long_b[] = "[{\"value\":\"0123456789012345678901234567890123456789012345678901234567-b\"}]";
+    evrythng_shadow_stats_t stats;
+    char value[128];
+    int calls = 0, slot;
+
+    EvrythngShadowInit();
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngShadowSubThngProperty(NULL, "t1", "mode", count_callback, &calls, &slot));
+    CuAssertIntEquals(tc, slot, EvrythngShadowFind("t1", "mode"));
+
+    /* the same value in another layout is a duplicate */
+    EvrythngShadowDispatch(slot, "[{\"value\":\"eco\"}]", 17);
+    EvrythngShadowDispatch(slot, "[ { \"key\" : \"mode\", \"value\" : \"eco\" } ]", 39);
+    CuAssertIntEquals(tc, 1, calls);
+    CuAssertIntEquals(tc, 5, EvrythngShadowGet(slot, value, sizeof value, NULL));
+    CuAssertStrEquals(tc, "\"eco\"", value);
+
+    /* long values are kept whole, differing only in their last bytes */
+    EvrythngShadowDispatch(slot, long_a, sizeof long_a - 1);
+    EvrythngShadowDispatch(slot, long_b, sizeof long_b - 1);
+    EvrythngShadowDispatch(slot, long_b, sizeof long_b - 1);
+    CuAssertIntEquals(tc, 3, calls);
+    CuAssertIntEquals(tc, 62, EvrythngShadowGet(slot, NULL, 0, NULL));
+    CuAssertIntEquals(tc, -1, EvrythngShadowGet(slot, value, 62, NULL));
+    CuAssertIntEquals(tc, 62, EvrythngShadowGet(slot, value, sizeof value, NULL));
+    CuAssertTrue(tc, !memcmp(value + 59, "-b\"", 4));
+
+    EvrythngShadowDispatch(slot, "[{\"key\":\"mode\"}]", 16);
+
+    EvrythngShadowStats(&stats);
+    CuAssertIntEquals(tc, 6, (int)stats.updates);
+    CuAssertIntEquals(tc, 2, (int)stats.duplicates);
+    CuAssertIntEquals(tc, 1, (int)stats.parse_errors);
+
+    EvrythngShadowInit();
+}
+
+
+/* the packets the outbox writes, one at a time */
+typedef struct
+{
+    unsigned char packet[16];
+    int len;
+    int writes;
+} outbox_sink_t;
+
+
+static int sink_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    outbox_sink_t* sink = (outbox_sink_t*)io;
+
+    sink->len = len < (int)sizeof sink->packet ? len : (int)sizeof sink->packet;
+    memcpy(sink->packet, buffer, sink->len);
+    sink->writes++;
+
+    return len;
+}
+
+
+static int last_acked;
+
+static int ack_listener(void* ctx, unsigned short packet_id)
+{
+    if (packet_id != *(unsigned short*)ctx)
+        return 0;
+
+    last_acked = packet_id;
+    return 1;
+}
+
+
+static void TestOutboxPacketIds(CuTest* tc)
+{
+    static int conn;
+    static int handle, other;
+    unsigned char packet[] = { 0x32, 7, 0, 3, 't', '/', 'a', 0, 0, '1' };
+    unsigned char ack_id[2];
+    unsigned short client_id = 0;
+    outbox_sink_t sink;
+
+    memset(&sink, 0, sizeof sink);
+    CuAssertIntEquals(tc, 0, outbox_claim(&handle));
+    CuAssertIntEquals(tc, -1, outbox_claim(&other));
+
+    outbox_on_connected(&conn);
+    unsigned short id = outbox_packet_id();
+    CuAssertTrue(tc, id != 0);
+    CuAssertIntEquals(tc, 0, outbox_add_listener(ack_listener, &id));
+
+    packet[7] = id >> 8;
+    packet[8] = id & 0xFF;
+    CuAssertIntEquals(tc, 0, outbox_send(packet, sizeof packet));
+    outbox_flush(&conn, sink_write, &sink);
+    CuAssertIntEquals(tc, 1, sink.writes);
+    CuAssertTrue(tc, !memcmp(packet, sink.packet, sizeof packet));
+
+    /* a client packet with the reserved id goes out with another one */
+    CuAssertIntEquals(tc, 7, outbox_on_write(&conn, packet, sizeof packet, &client_id));
+    unsigned short wire_id = (unsigned short)(packet[7] << 8 | packet[8]);
+    CuAssertIntEquals(tc, id, client_id);
+    CuAssertTrue(tc, wire_id != id && wire_id != 0);
+
+    /* and its ack comes back with the client's id */
+    ack_id[0] = wire_id >> 8;
+    ack_id[1] = wire_id & 0xFF;
+    CuAssertIntEquals(tc, 0, outbox_on_ack(&conn, 0x40, ack_id));
+    CuAssertIntEquals(tc, id, ack_id[0] << 8 | ack_id[1]);
+
+    /* the SDK's PUBACK is taken out */
+    last_acked = 0;
+    CuAssertIntEquals(tc, 1, outbox_on_ack(&conn, 0x40, ack_id));
+    CuAssertIntEquals(tc, id, last_acked);
+
+    /* the id is free again, so is any other */
+    ack_id[0] = 0x12;
+    ack_id[1] = 0x34;
+    CuAssertIntEquals(tc, 0, outbox_on_ack(&conn, 0x40, ack_id));
+    CuAssertIntEquals(tc, 0x1234, ack_id[0] << 8 | ack_id[1]);
+
+    outbox_remove_listener(ack_listener, &id);
+    outbox_on_closed(&conn, 1);
+    outbox_release(&handle);
+    CuAssertIntEquals(tc, 0, outbox_claim(&other));
+    outbox_release(&other);
+}
+
+
+static void TestOutboxConnections(CuTest* tc)
+{
+    static int a, b, c;
+    unsigned char pingreq[2] = { 0xC0, 0 };
+    outbox_sink_t sink;
+
+    memset(&sink, 0, sizeof sink);
+    CuAssertIntEquals(tc, -1, outbox_send(pingreq, sizeof pingreq));
+
+    outbox_on_connected(&a);
+    CuAssertIntEquals(tc, 0, outbox_send(pingreq, sizeof pingreq));
+
+    /* nothing goes out on a connection that is not the outbox's */
+    outbox_flush(&b, sink_write, &sink);
+    CuAssertIntEquals(tc, 0, sink.writes);
+
+    /* a second connection may be another handle's: the queued packets
+     * are dropped and nothing is sent until only one is left */
+    outbox_on_connected(&b);
+    outbox_flush(&a, sink_write, &sink);
+    CuAssertIntEquals(tc, 0, sink.writes);
+    CuAssertIntEquals(tc, -1, outbox_send(pingreq, sizeof pingreq));
+
+    outbox_on_closed(&b, 1);
+    CuAssertIntEquals(tc, -1, outbox_send(pingreq, sizeof pingreq));
+    outbox_on_closed(&a, 1);
+
+    /* closed before the MQTT connect completed, doesn't count */
+    outbox_on_closed(&b, 0);
+
+    outbox_on_connected(&c);
+    CuAssertIntEquals(tc, 0, outbox_send(pingreq, sizeof pingreq));
+    outbox_flush(&c, sink_write, &sink);
+    CuAssertIntEquals(tc, 1, sink.writes);
+    outbox_on_closed(&c, 1);
+    CuAssertIntEquals(tc, -1, outbox_send(pingreq, sizeof pingreq));
+}
+
+
+static void TestKeepaliveProbe(CuTest* tc)
+{
+    KeepaliveProbe p;
+    int i;
+
+    keepalive_probe_init(&p, 30, 90, 30);
+    CuAssertIntEquals(tc, 30, p.interval_s);
+
+    /* pings after a shorter idle period don't confirm the interval */
+    for (i = 0; i < KEEPALIVE_CONFIRMATIONS; i++)
+        keepalive_probe_on_ping(&p, 10000);
+    CuAssertIntEquals(tc, 30, p.interval_s);
+
+    for (i = 0; i < KEEPALIVE_CONFIRMATIONS; i++)
+        keepalive_probe_on_ping(&p, 30000);
+    CuAssertIntEquals(tc, 60, p.interval_s);
+    CuAssertIntEquals(tc, 30, p.safe_s);
+
+    /* the path's timeout is between 30 and 60 s */
+    keepalive_probe_on_lost(&p);
+    CuAssertIntEquals(tc, 30, p.interval_s);
+    CuAssertIntEquals(tc, 1, p.settled);
+    CuAssertIntEquals(tc, 1, (int)p.losses);
+}
+
+
+static void TestPingMonitorOwnsPings(CuTest* tc)
+{
+    unsigned char connect[] = { 0x10, 17, 0, 4, 'M', 'Q', 'T', 'T', 4, 2, 0, 60, 0, 5, 'b', 'e', 'n', 'c', 'h' };
+    unsigned char pingreq[2] = { 0xC0, 0 };
+    unsigned char connack[4] = { 0x20, 2, 0, 0 };
+    unsigned char buffer[2];
+    unsigned short keepalive_s = 0;
+    PingMonitor m;
+
+    memset(&m, 0, sizeof m);
+    platform_keepalive_configure(30, 600, 30);
+
+    /* the broker has to tolerate the longest interval probed */
+    CuAssertIntEquals(tc, 10, ping_monitor_on_connect(&m, connect, sizeof connect, &keepalive_s));
+    CuAssertIntEquals(tc, 60, keepalive_s);
+    CuAssertIntEquals(tc, 600, connect[10] << 8 | connect[11]);
+
+    connect[10] = 0x0F;
+    connect[11] = 0xFF;
+    CuAssertIntEquals(tc, -1, ping_monitor_on_connect(&m, connect, sizeof connect, &keepalive_s));
+
+    /* before the CONNACK the client pings itself */
+    CuAssertIntEquals(tc, 0, ping_monitor_absorb(&m, pingreq, sizeof pingreq));
+    ping_monitor_on_read(&m, connack, sizeof connack);
+
+    /* the client's ping is answered locally, read byte by byte */
+    CuAssertIntEquals(tc, 1, ping_monitor_absorb(&m, pingreq, sizeof pingreq));
+    CuAssertIntEquals(tc, 0, m.ping_pending);
+    CuAssertIntEquals(tc, 1, ping_monitor_take_pingresp(&m, buffer, 1));
+    CuAssertIntEquals(tc, 0xD0, buffer[0]);
+    CuAssertIntEquals(tc, 1, ping_monitor_take_pingresp(&m, buffer, 2));
+    CuAssertIntEquals(tc, 0, buffer[0]);
+    CuAssertIntEquals(tc, 0, ping_monitor_take_pingresp(&m, buffer, 2));
+    CuAssertIntEquals(tc, 1, (int)m.client_pings);
+
+    /* the probe's own pings are timed */
+    ping_monitor_on_write(&m, pingreq, sizeof pingreq);
+    CuAssertIntEquals(tc, 1, m.ping_pending);
+
+    ping_monitor_on_closed(&m);
+    CuAssertIntEquals(tc, 0, ping_monitor_absorb(&m, pingreq, sizeof pingreq));
+
+    platform_keepalive_configure(KEEPALIVE_DEFAULT_MIN_S, KEEPALIVE_DEFAULT_MAX_S, KEEPALIVE_DEFAULT_STEP_S);
+}
+
+
+static void TestPreparedOwner(CuTest* tc)
+{
+    static int a, b;
+    evrythng_prepared_t pa, pb;
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPrepare(&pa, (evrythng_handle_t)&a,
+                EVRYTHNG_PREPARED_THNG_PROPERTY, "t1", "temp", 1));
+
+    /* the outbox would send b's publishes on a's connection */
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngPrepare(&pb, (evrythng_handle_t)&b,
+                EVRYTHNG_PREPARED_THNG_PROPERTY, "t1", "temp", 1));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPrepare(&pb, NULL,
+                EVRYTHNG_PREPARED_THNG_PROPERTY, "t1", "temp", 1));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngPreparedPublish(&pb, "1"));
+    EvrythngPreparedFree(&pb);
+
+    /* no connection */
+    CuAssertIntEquals(tc, EVRYTHNG_FAILURE, EvrythngPreparedPublish(&pa, "1"));
+    EvrythngPreparedFree(&pa);
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngPrepare(&pb, (evrythng_handle_t)&b,
+                EVRYTHNG_PREPARED_THNG_PROPERTY, "t1", "temp", 0));
+    EvrythngPreparedFree(&pb);
+}
+
+
+static void TestReconnectBackoff(CuTest* tc)
+{
+    evrythng_reconnect_policy_t policy = { 100, 1000, 30000, 1 };
+    evrythng_reconnect_t r;
+    int i, n;
+
+    EvrythngReconnectInit(&r, &policy);
+    CuAssertIntEquals(tc, 0, EvrythngReconnectDelay(&r));
+
+    /* full jitter below min(max_ms, initial_ms * 2^n) */
+    for (n = 0; n < 40; n++)
+    {
+        int ceiling = n < 4 ? 100 << n : 1000;
+        for (i = 0; i < 50; i++)
+        {
+            r.attempt = n + 1;
+            int delay = EvrythngReconnectDelay(&r);
+            CuAssertTrue(tc, delay >= 0 && delay <= ceiling);
+        }
+    }
+
+    /* a short connection keeps backing off, a stable one starts over */
+    r.attempt = 5;
+    EvrythngReconnectOnConnected(&r);
+    EvrythngReconnectOnLost(&r);
+    CuAssertIntEquals(tc, 5, r.attempt);
+    r.connected_at -= policy.stable_ms;
+    r.connected = 1;
+    EvrythngReconnectOnLost(&r);
+    CuAssertIntEquals(tc, 0, r.attempt);
+}
+
+
+static void TestConnectBackoff(CuTest* tc)
+{
+    evrythng_reconnect_policy_t policy = { 100, 1000, 30000, 1 };
+    evrythng_reconnect_stats_t stats;
+    ConnectBackoff a, b;
+
+    memset(&a, 0, sizeof a);
+    memset(&b, 0, sizeof b);
+
+    /* not paced */
+    a.attempt = 1;
+    a.not_before_ms = platform_uptime_ms() + 60000;
+    CuAssertIntEquals(tc, 0, connect_backoff_before(&a));
+
+    EvrythngReconnectPace(&policy);
+    EvrythngReconnectPaceStats(&stats);
+    uint32_t deferred = stats.deferred;
+
+    /* an attempt due later fails without waiting */
+    uint32_t start = platform_uptime_ms();
+    CuAssertIntEquals(tc, -1, connect_backoff_before(&a));
+    CuAssertTrue(tc, platform_uptime_ms() - start < CONNECT_BACKOFF_MAX_WAIT_MS);
+    EvrythngReconnectPaceStats(&stats);
+    CuAssertIntEquals(tc, (int)deferred + 1, (int)stats.deferred);
+
+    /* the connections back off on their own, the first attempt is immediate */
+    CuAssertIntEquals(tc, 0, connect_backoff_before(&b));
+    CuAssertIntEquals(tc, 1, b.attempt);
+    CuAssertTrue(tc, (int32_t)(b.not_before_ms - platform_uptime_ms()) <= 0);
+
+    /* a stable connection starts over */
+    connect_backoff_on_connected(&a);
+    a.connected_at -= policy.stable_ms;
+    connect_backoff_on_closed(&a, 1);
+    CuAssertIntEquals(tc, 0, a.attempt);
+    CuAssertIntEquals(tc, 0, connect_backoff_before(&a));
+
+    EvrythngReconnectPace(NULL);
+}
+
+
+static void TestTimeSync(CuTest* tc)
+{
+    evrythng_timesync_stats_t stats;
+    int64_t epoch_ms;
+
+    /* nothing before the thread is started */
+    CuAssertIntEquals(tc, 0, EvrythngTimeIsValid());
+    CuAssertTrue(tc, EvrythngTimeNowMs() == 0);
+    CuAssertIntEquals(tc, EVRYTHNG_FAILURE, EvrythngTimeSyncWait(0));
+    EvrythngTimeSyncStats(&stats);
+    CuAssertIntEquals(tc, 0, (int)stats.syncs);
+
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngTimeSyncStart(0, 0, 4096));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngTimeSyncStart(3600, 0, 16384));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngTimeSyncStart(3600, 0, 16384));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngTimeSyncWait(5000));
+    CuAssertIntEquals(tc, 1, EvrythngTimeIsValid());
+
+    /* the host clock is the reference of the posix port */
+    platform_time_fetch(&epoch_ms);
+    int64_t diff = EvrythngTimeNowMs() - epoch_ms;
+    CuAssertTrue(tc, diff > -1000 && diff < 1000);
+
+    /* a request right after a synchronization is ignored */
+    EvrythngTimeSyncRequest();
+    platform_sleep(50);
+    EvrythngTimeSyncStats(&stats);
+    CuAssertIntEquals(tc, 1, (int)stats.syncs);
+    CuAssertIntEquals(tc, 0, (int)stats.failures);
+    CuAssertIntEquals(tc, 0, stats.drift_ppm);
+}
+
+
+/* connection replaying scripted bytes, closed once they are used up */
+typedef struct
+{
+    const unsigned char* in;
+    int in_len;
+    int in_pos;
+    outbox_sink_t out;
+} stream_conn_t;
+
+
+static int conn_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    stream_conn_t* c = (stream_conn_t*)io;
+    int n = c->in_len - c->in_pos < len ? c->in_len - c->in_pos : len;
+
+    memcpy(buffer, c->in + c->in_pos, n);
+    c->in_pos += n;
+
+    return n;
+}
+
+
+static int conn_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    return sink_write(&((stream_conn_t*)io)->out, buffer, len, timeout_ms);
+}
+
+
+/* the payload as reassembled from the chunks */
+typedef struct
+{
+    unsigned char payload[512];
+    size_t len;
+    size_t total;
+    char topic[STREAM_TOPIC_SIZE];
+    int calls;
+    int aborts;
+} stream_sink_t;
+
+
+static void stream_sink(void* ctx, const char* topic,
+        const unsigned char* chunk, size_t len, size_t offset, size_t total)
+{
+    stream_sink_t* sink = (stream_sink_t*)ctx;
+
+    sink->calls++;
+    if (!len)
+    {
+        sink->aborts++;
+        return;
+    }
+
+    if (offset == sink->len && offset + len <= sizeof sink->payload)
+    {
+        memcpy(sink->payload + offset, chunk, len);
+        sink->len += len;
+    }
+    sink->total = total;
+    strncpy(sink->topic, topic, sizeof sink->topic - 1);
+}
+
+
+static void TestStreamFilter(CuTest* tc)
+{
+    /* a QoS 1 PUBLISH of 300 bytes to "t/ota" with id 0x1234, a short
+     * PUBLISH for the client and a PUBACK unknown to the outbox */
+    unsigned char in[309 + 3 + 8 + 4];
+    unsigned char buffer[16];
+    stream_sink_t sink;
+    stream_conn_t conn;
+    StreamFilter f;
+    StreamStats before, after;
+    int i, n = 0;
+
+    in[n++] = 0x32;
+    in[n++] = 0x80 | (309 & 127);
+    in[n++] = 309 >> 7;
+    in[n++] = 0;
+    in[n++] = 5;
+    memcpy(in + n, "t/ota", 5);
+    n += 5;
+    in[n++] = 0x12;
+    in[n++] = 0x34;
+    for (i = 0; i < 300; i++)
+        in[n++] = (unsigned char)i;
+
+    const unsigned char small[] = { 0x30, 6, 0, 3, 't', '/', 'a', '1', 0x40, 2, 0x56, 0x78 };
+    memcpy(in + n, small, sizeof small);
+    n += sizeof small;
+
+    memset(&sink, 0, sizeof sink);
+    memset(&conn, 0, sizeof conn);
+    memset(&f, 0, sizeof f);
+    conn.in = in;
+    conn.in_len = n;
+
+    platform_stream_configure(64, stream_sink, &sink);
+    platform_stream_stats(&before);
+
+    /* streamed in chunks, acknowledged by the filter, invisible to the client */
+    CuAssertIntEquals(tc, -1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, 300, (int)sink.len);
+    CuAssertIntEquals(tc, 300, (int)sink.total);
+    CuAssertIntEquals(tc, (300 + STREAM_CHUNK_SIZE - 1) / STREAM_CHUNK_SIZE, sink.calls);
+    CuAssertStrEquals(tc, "t/ota", sink.topic);
+    for (i = 0; i < 300; i++)
+        CuAssertIntEquals(tc, i & 0xFF, sink.payload[i]);
+
+    const unsigned char puback[] = { 0x40, 2, 0x12, 0x34 };
+    CuAssertIntEquals(tc, 1, conn.out.writes);
+    CuAssertIntEquals(tc, 4, conn.out.len);
+    CuAssertTrue(tc, !memcmp(puback, conn.out.packet, sizeof puback));
+    CuAssertIntEquals(tc, 1, stream_filter_idle(&f));
+
+    /* short packets pass through as the client reads them */
+    CuAssertIntEquals(tc, 1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, 0x30, buffer[0]);
+    CuAssertIntEquals(tc, 0, stream_filter_idle(&f));
+    CuAssertIntEquals(tc, 1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, 6, buffer[0]);
+    CuAssertIntEquals(tc, 6, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 6, 100));
+    CuAssertTrue(tc, !memcmp(small + 2, buffer, 6));
+    CuAssertIntEquals(tc, 1, stream_filter_idle(&f));
+
+    CuAssertIntEquals(tc, 1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, 1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer + 1, 1, 100));
+    CuAssertIntEquals(tc, 2, stream_filter_read(&f, conn_read, conn_write, &conn, buffer + 2, 2, 100));
+    CuAssertTrue(tc, !memcmp(small + 8, buffer, 4));
+    CuAssertIntEquals(tc, 1, conn.out.writes);
+
+    /* a connection broken while streaming aborts the message */
+    memset(&sink, 0, sizeof sink);
+    conn.in_len = 3 + 2 + 5 + 2 + 100;
+    conn.in_pos = 0;
+    CuAssertIntEquals(tc, 0, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, 1, sink.aborts);
+    CuAssertIntEquals(tc, 1, conn.out.writes);
+
+    platform_stream_stats(&after);
+    CuAssertIntEquals(tc, 1, (int)(after.messages - before.messages));
+    CuAssertIntEquals(tc, 300, (int)(after.bytes - before.bytes));
+    CuAssertIntEquals(tc, 1, (int)(after.aborted - before.aborted));
+
+    platform_stream_configure(0, NULL, NULL);
+}
+
+
+static void TestStreamPubackClaim(CuTest* tc)
+{
+    static int handle;
+    unsigned char in[] = { 0x40, 2, 0, 0, 0x40, 2, 0, 0 };
+    unsigned char buffer[4];
+    stream_conn_t conn;
+    StreamFilter f;
+
+    memset(&conn, 0, sizeof conn);
+    memset(&f, 0, sizeof f);
+    conn.in = in;
+    conn.in_len = sizeof in;
+
+    CuAssertIntEquals(tc, 0, outbox_claim(&handle));
+    outbox_on_connected(&conn);
+
+    unsigned short id = outbox_packet_id();
+    CuAssertTrue(tc, id != 0);
+    CuAssertIntEquals(tc, 0, outbox_add_listener(ack_listener, &id));
+    in[2] = id >> 8;
+    in[3] = id & 0xFF;
+    in[6] = (id + 1) >> 8;
+    in[7] = (id + 1) & 0xFF;
+
+    /* the SDK's PUBACK never reaches the client */
+    last_acked = 0;
+    CuAssertIntEquals(tc, -1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, id, last_acked);
+    CuAssertIntEquals(tc, 1, stream_filter_idle(&f));
+
+    /* any other does */
+    CuAssertIntEquals(tc, 1, stream_filter_read(&f, conn_read, conn_write, &conn, buffer, 1, 100));
+    CuAssertIntEquals(tc, 3, stream_filter_read(&f, conn_read, conn_write, &conn, buffer + 1, 3, 100));
+    CuAssertTrue(tc, !memcmp(in + 4, buffer, 4));
+
+    outbox_remove_listener(ack_listener, &id);
+    outbox_on_closed(&conn, 1);
+    outbox_release(&handle);
+}
+
+
+static void TestSha256(CuTest* tc)
+{
+    static const unsigned char abc[EVRYTHNG_SHA256_SIZE] = {
+        0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40, 0xde, 0x5d, 0xae, 0x22, 0x23,
+        0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17, 0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad,
+    };
+    static const unsigned char two_blocks[EVRYTHNG_SHA256_SIZE] = {
+        0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26, 0x93, 0x0c, 0x3e, 0x60, 0x39,
+        0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff, 0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1,
+    };
+    static const unsigned char empty[EVRYTHNG_SHA256_SIZE] = {
+        0xe3, 0xb0, 0xc4, 0x42, 0x98, 0xfc, 0x1c, 0x14, 0x9a, 0xfb, 0xf4, 0xc8, 0x99, 0x6f, 0xb9, 0x24,
+        0x27, 0xae, 0x41, 0xe4, 0x64, 0x9b, 0x93, 0x4c, 0xa4, 0x95, 0x99, 0x1b, 0x78, 0x52, 0xb8, 0x55,
+    };
+    const char* message = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+    unsigned char digest[EVRYTHNG_SHA256_SIZE];
+    evrythng_sha256_t sha;
+    size_t i;
+
+    EvrythngSha256Init(&sha);
+    EvrythngSha256Update(&sha, "abc", 3);
+    EvrythngSha256Finish(&sha, digest);
+    CuAssertTrue(tc, !memcmp(abc, digest, sizeof digest));
+
+    EvrythngSha256Init(&sha);
+    EvrythngSha256Finish(&sha, digest);
+    CuAssertTrue(tc, !memcmp(empty, digest, sizeof digest));
+
+    /* fed byte by byte over the block boundary */
+    EvrythngSha256Init(&sha);
+    for (i = 0; i < strlen(message); i++)
+        EvrythngSha256Update(&sha, message + i, 1);
+    EvrythngSha256Finish(&sha, digest);
+    CuAssertTrue(tc, !memcmp(two_blocks, digest, sizeof digest));
+}
+
+
+#define OTA_TEST_TOPIC "thngs/UEp4rDGsnpCAF6xABbys5Amc/actions/_firmware"
+
+/* 64 hex digits, not the digest of the test image */
+#define OTA_TEST_SHA256 "00000000000000000000000000000000000000000000000000000000000000ff"
+
+static int ota_states;
+static evrythng_ota_state_t ota_last_state;
+static uint32_t ota_last_offset;
+
+static void ota_callback(void* ctx, evrythng_ota_state_t state, uint32_t offset, uint32_t size)
+{
+    ota_states++;
+    ota_last_state = state;
+    ota_last_offset = offset;
+}
+
+
+static void ota_reset(evrythng_ota_t* ota)
+{
+    EvrythngOtaInit(ota, ota_callback, NULL);
+    ota_states = 0;
+    ota_last_state = EVRYTHNG_OTA_IDLE;
+    ota_last_offset = 0;
+}
+
+
+/* delivers the message as the streaming receive does, in short chunks */
+static void ota_stream(evrythng_ota_t* ota, const char* message)
+{
+    size_t offset, len = strlen(message);
+
+    for (offset = 0; offset < len; offset += 7)
+        EvrythngOtaStreamCallback(ota, OTA_TEST_TOPIC, (const unsigned char*)message + offset,
+                len - offset < 7 ? len - offset : 7, offset, len);
+}
+
+
+static void TestOtaMembers(CuTest* tc)
+{
+    /* the image "abc", "YWJj" in base64. Its hash doesn't match, so the
+     * update is received completely but never activated. */
+    static const char reordered[] = "{ \"customFields\" : {\n"
+        "  \"data\" : \"YWJj\",\n"
+        "  \"note\" : { \"size\" : 99, \"list\" : [ 1, \"x\", { \"offset\": 5 } ] },\n"
+        "  \"offset\" : 0 ,\n"
+        "  \"sha256\" : \"" OTA_TEST_SHA256 "\",\n"
+        "  \"size\":3\n"
+        "}, \"type\" : \"_firmware\" }";
+    static const char members_first[] = "{\"type\":\"_firmware\",\"customFields\":{ \"offset\": 0,"
+        " \"extra\": \"a \\\"quoted\\\" \\\\ value\", \"size\" :3, \"sha256\": \"" OTA_TEST_SHA256 "\","
+        " \"data\": \"YWJj\" }}";
+    static const char data_first[] = "{\"customFields\":{\"data\":\"YWJj\",\"size\":3,\"offset\":0,"
+        "\"sha256\":\"" OTA_TEST_SHA256 "\"}}";
+    static const char short_sha256[] = "{\"customFields\":{\"size\":3,\"offset\":0,\"sha256\":\"00ff\",\"data\":\"YWJj\"}}";
+    static const char no_fields[] = "{\"size\":3,\"offset\":0,\"sha256\":\"" OTA_TEST_SHA256 "\",\"data\":\"YWJj\"}";
+    unsigned char expected[EVRYTHNG_SHA256_SIZE];
+    evrythng_ota_t ota;
+
+    /* delivered in one piece: any order, members after "data" */
+    ota_reset(&ota);
+    EvrythngOtaFeed(&ota, (const unsigned char*)reordered, strlen(reordered), 0, strlen(reordered));
+    CuAssertIntEquals(tc, 2, ota_states);
+    CuAssertIntEquals(tc, EVRYTHNG_OTA_FAILED, ota_last_state);
+    CuAssertIntEquals(tc, 3, (int)ota_last_offset);
+    CuAssertIntEquals(tc, 3, (int)ota.size);
+    CuAssertIntEquals(tc, 0, (int)ota.stats.invalid);
+
+    /* streamed: members in any order before "data" */
+    ota_reset(&ota);
+    ota_stream(&ota, members_first);
+    CuAssertIntEquals(tc, 2, ota_states);
+    CuAssertIntEquals(tc, EVRYTHNG_OTA_FAILED, ota_last_state);
+    CuAssertIntEquals(tc, 3, (int)ota_last_offset);
+    CuAssertIntEquals(tc, 0xff, ota.sha256[EVRYTHNG_SHA256_SIZE - 1]);
+
+    /* streamed "data" can't be placed before its offset is known */
+    ota_reset(&ota);
+    ota_stream(&ota, data_first);
+    CuAssertIntEquals(tc, 0, ota_states);
+    CuAssertIntEquals(tc, 1, (int)ota.stats.invalid);
+
+    ota_reset(&ota);
+    ota_stream(&ota, short_sha256);
+    ota_stream(&ota, no_fields);
+    CuAssertIntEquals(tc, 0, ota_states);
+    CuAssertIntEquals(tc, 2, (int)ota.stats.invalid);
+
+    /* only the expected image is taken */
+    ota_reset(&ota);
+    memset(expected, 0, sizeof expected);
+    EvrythngOtaExpect(&ota, 3, expected);
+    ota_stream(&ota, members_first);
+    CuAssertIntEquals(tc, 0, ota_states);
+    CuAssertIntEquals(tc, 1, (int)ota.stats.rejected);
+
+    expected[EVRYTHNG_SHA256_SIZE - 1] = 0xff;
+    EvrythngOtaExpect(&ota, 3, expected);
+    ota_stream(&ota, members_first);
+    CuAssertIntEquals(tc, 2, ota_states);
+    CuAssertIntEquals(tc, 3, (int)ota_last_offset);
+
+    EvrythngOtaExpect(&ota, 0, NULL);
+}
+
+
+#define GW_THNG_A "UEp4rDGsnpCAF6xABbys5Amc"
+#define GW_THNG_B "UhXyqPDgMAbpNaaRw3Ns4Tdp"
+
+/* the messages the gateway sent, in order */
+typedef struct
+{
+    char log[256];
+    int sends;
+    int fail;
+} gw_sink_t;
+
+
+static evrythng_return_t gw_send(void* ctx, const char* thng_id,
+        evrythng_gateway_msg_t type, const char* name, const char* json)
+{
+    gw_sink_t* sink = (gw_sink_t*)ctx;
+    size_t n = strlen(sink->log);
+
+    if (sink->fail)
+        return EVRYTHNG_FAILURE;
+
+    snprintf(sink->log + n, sizeof sink->log - n, "%c%c:%s=%s;", thng_id[1],
+            type == EVRYTHNG_GATEWAY_PROPERTY ? 'p' : 'a', name, json);
+    sink->sends++;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static void gw_action(void* ctx, const char* thng_id, const char* json, size_t len)
+{
+    gw_sink_t* sink = (gw_sink_t*)ctx;
+    size_t n = strlen(sink->log);
+
+    snprintf(sink->log + n, sizeof sink->log - n, "%s;", thng_id);
+}
+
+
+static void TestGatewayRouting(CuTest* tc)
+{
+    evrythng_gateway_config_t config = EVRYTHNG_GATEWAY_CONFIG_DEFAULT;
+    evrythng_gateway_stats_t stats;
+    evrythng_gateway_t gw;
+    gw_sink_t sink;
+
+    memset(&sink, 0, sizeof sink);
+    config.send = gw_send;
+    config.send_ctx = &sink;
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayCreate(&gw, NULL, &config));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayAddThng(gw, GW_THNG_A, gw_action, &sink));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngGatewayAddThng(gw, GW_THNG_A, gw_action, &sink));
+
+    /* only the outermost "thng" member counts */
+    const char* action = "{\"type\":\"_on\",\"customFields\":{\"thng\":\"" GW_THNG_B "\"},"
+        " \"thng\" : \"" GW_THNG_A "\"}";
+    EvrythngGatewayDispatch(gw, action, strlen(action));
+    CuAssertStrEquals(tc, GW_THNG_A ";", sink.log);
+
+    const char* unknown = "{\"type\":\"_on\",\"thng\":\"" GW_THNG_B "\"}";
+    const char* no_thng = "{\"type\":\"_on\",\"customFields\":{\"thng\":\"" GW_THNG_A "\"}}";
+    const char* broken = "{\"thng\":\"" GW_THNG_A;
+    EvrythngGatewayDispatch(gw, unknown, strlen(unknown));
+    EvrythngGatewayDispatch(gw, no_thng, strlen(no_thng));
+    EvrythngGatewayDispatch(gw, broken, strlen(broken));
+    CuAssertStrEquals(tc, GW_THNG_A ";", sink.log);
+
+    EvrythngGatewayStats(gw, &stats);
+    CuAssertIntEquals(tc, 1, (int)stats.thngs);
+    CuAssertIntEquals(tc, 1, (int)stats.routed);
+    CuAssertIntEquals(tc, 3, (int)stats.unrouted);
+
+    /* removed thngs get nothing */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayRemoveThng(gw, GW_THNG_A));
+    EvrythngGatewayDispatch(gw, action, strlen(action));
+    CuAssertStrEquals(tc, GW_THNG_A ";", sink.log);
+
+    EvrythngGatewayDestroy(gw);
+}
+
+
+static void TestGatewayRoundRobin(CuTest* tc)
+{
+    evrythng_gateway_config_t config = { 4, 4, 2, 32, gw_send, 0 };
+    evrythng_gateway_stats_t stats;
+    evrythng_gateway_t gw;
+    gw_sink_t sink;
+
+    memset(&sink, 0, sizeof sink);
+    config.send_ctx = &sink;
+
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayCreate(&gw, NULL, &config));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayAddThng(gw, GW_THNG_A, 0, 0));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayAddThng(gw, GW_THNG_B, 0, 0));
+
+    /* a chatty thng can't take more than max_pending slots */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayPubThngProperty(gw, GW_THNG_A, "t", "1"));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayPubThngProperty(gw, GW_THNG_A, "t", "2"));
+    CuAssertIntEquals(tc, EVRYTHNG_MEMORY_ERROR, EvrythngGatewayPubThngProperty(gw, GW_THNG_A, "t", "3"));
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayPubThngAction(gw, GW_THNG_B, "_on", "{}"));
+    CuAssertIntEquals(tc, EVRYTHNG_BAD_ARGS, EvrythngGatewayPubThngProperty(gw, "unknown", "t", "1"));
+
+    /* one message per thng in turn */
+    CuAssertIntEquals(tc, 2, EvrythngGatewaySend(gw, 2));
+    CuAssertStrEquals(tc, "Ep:t=1;ha:_on={};", sink.log);
+
+    /* a failed send stays queued at the front of its thng's queue */
+    CuAssertIntEquals(tc, EVRYTHNG_SUCCESS, EvrythngGatewayPubThngAction(gw, GW_THNG_B, "_off", "{}"));
+    sink.fail = 1;
+    CuAssertIntEquals(tc, 0, EvrythngGatewaySend(gw, 4));
+    sink.fail = 0;
+
+    CuAssertIntEquals(tc, 2, EvrythngGatewaySend(gw, 4));
+    CuAssertStrEquals(tc, "Ep:t=1;ha:_on={};ha:_off={};Ep:t=2;", sink.log);
+    CuAssertIntEquals(tc, 0, EvrythngGatewaySend(gw, 4));
+
+    EvrythngGatewayStats(gw, &stats);
+    CuAssertIntEquals(tc, 4, (int)stats.sent);
+    CuAssertIntEquals(tc, 1, (int)stats.failed);
+    CuAssertIntEquals(tc, 1, (int)stats.rejected);
+    CuAssertIntEquals(tc, 3, (int)stats.max_queued);
+
+    EvrythngGatewayDestroy(gw);
+}
+
+
+void RunExtTests()
+{
+    CuString *output = CuStringNew();
+    CuSuite* suite = CuSuiteNew();
+
+    SUITE_ADD_TEST(suite, TestJsonWriter);
+    SUITE_ADD_TEST(suite, TestJsonWriterOverflow);
+    SUITE_ADD_TEST(suite, TestJsonNumberEdges);
+    SUITE_ADD_TEST(suite, TestJsonProperty);
+    SUITE_ADD_TEST(suite, TestCborRoundTrip);
+    SUITE_ADD_TEST(suite, TestCborPropertyMapFind);
+    SUITE_ADD_TEST(suite, TestCborFloatEdges);
+    SUITE_ADD_TEST(suite, TestCborMalformed);
+    SUITE_ADD_TEST(suite, TestDeadband);
+    SUITE_ADD_TEST(suite, TestShadow);
+    SUITE_ADD_TEST(suite, TestOutboxPacketIds);
+    SUITE_ADD_TEST(suite, TestOutboxConnections);
+    SUITE_ADD_TEST(suite, TestPreparedOwner);
+    SUITE_ADD_TEST(suite, TestKeepaliveProbe);
+    SUITE_ADD_TEST(suite, TestPingMonitorOwnsPings);
+    SUITE_ADD_TEST(suite, TestReconnectBackoff);
+    SUITE_ADD_TEST(suite, TestConnectBackoff);
+    SUITE_ADD_TEST(suite, TestTimeSync);
+    SUITE_ADD_TEST(suite, TestStreamFilter);
+    SUITE_ADD_TEST(suite, TestStreamPubackClaim);
+    SUITE_ADD_TEST(suite, TestSha256);
+    SUITE_ADD_TEST(suite, TestOtaMembers);
+    SUITE_ADD_TEST(suite, TestGatewayRouting);
+    SUITE_ADD_TEST(suite, TestGatewayRoundRobin);
+
+    CuSuiteRun(suite);
+    CuSuiteSummary(suite, output);
+    CuSuiteDetails(suite, output);
+    platform_printf("%s", output->buffer);
+
+    CuSuiteDelete(suite);
+    CuStringDelete(output);
+}
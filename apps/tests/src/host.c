@@ -0,0 +1,253 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Host runner of the tests application. The test suite is split into
+ * shards run by parallel processes, each with its own broker stand-in on
+ * the loopback transport in place of the EVRYTHNG cloud, so shards don't
+ * see each other's messages. The benchmark cases run afterwards on their
+ * own. A process prints its output once it is done, the exit status is 0
+ * if no case failed. */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <evrythng/platform.h>
+
+#include "CuTest.h"
+#include "broker.h"
+#include "tests.h"
+
+#define MAX_JOBS 64
+#define BROKER_WORKERS 2
+
+typedef struct job_t
+{
+    const char* name;
+    pid_t pid;
+    int fd;
+    char* output;
+    size_t len;
+    int failed;
+} job_t;
+
+static const char* hostname = "mqtt.evrythng.com";
+
+
+/* runs in the child, with its broker */
+static int run_child(int shard, int shards)
+{
+    if (broker_start(hostname, BROKER_WORKERS) != 0)
+    {
+        printf("failed to start the broker for %s\n", hostname);
+        return EXIT_FAILURE;
+    }
+
+    if (shard >= 0)
+    {
+        CuSuiteSetShard(shard, shards);
+        RunAllTests();
+        RunExtTests();
+    }
+    else
+    {
+        SetBenchHost(hostname);
+        RunAllBenches();
+    }
+
+    fflush(stdout);
+    broker_stop();
+
+    return CuFailures() ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+static int job_start(job_t* job, const char* name, int shard, int shards)
+{
+    int fds[2];
+
+    if (pipe(fds) != 0)
+        return -1;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (!pid)
+    {
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[1]);
+        _exit(run_child(shard, shards));
+    }
+
+    close(fds[1]);
+    memset(job, 0, sizeof(job_t));
+    job->name = name;
+    job->pid = pid;
+    job->fd = fds[0];
+
+    return 0;
+}
+
+
+/* collects the output of the jobs until all of them exited */
+static int jobs_wait(job_t* jobs, int count)
+{
+    struct pollfd pfd[MAX_JOBS];
+    char buf[4096];
+    int running = count, failed = 0, i;
+
+    if (count < 1 || count > MAX_JOBS)
+        return -1;
+
+    while (running)
+    {
+        for (i = 0; i < count; i++)
+        {
+            pfd[i].fd = jobs[i].fd;
+            pfd[i].events = POLLIN;
+        }
+
+        if (poll(pfd, count, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+
+        for (i = 0; i < count; i++)
+        {
+            job_t* job = &jobs[i];
+            if (!pfd[i].revents || job->fd < 0)
+                continue;
+
+            ssize_t n = read(job->fd, buf, sizeof buf);
+            if (n > 0)
+            {
+                char* output = (char*)realloc(job->output, job->len + n + 1);
+                if (!output)
+                    continue;
+                memcpy(output + job->len, buf, n);
+                job->output = output;
+                job->len += n;
+                job->output[job->len] = 0;
+                continue;
+            }
+
+            /* the child exited */
+            int status;
+            close(job->fd);
+            job->fd = -1;
+            waitpid(job->pid, &status, 0);
+            job->failed = !WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS;
+            failed += job->failed;
+            running--;
+
+            printf("==> %s: %s\n%s", job->name, job->failed ? "FAILED" : "ok", job->output ? job->output : "");
+            fflush(stdout);
+            free(job->output);
+            job->output = 0;
+        }
+    }
+
+    return failed;
+}
+
+
+/* reads the "bench" lines of a previous run */
+static int load_baselines(const char* path)
+{
+    char line[512], name[256];
+    unsigned mean_ns;
+
+    FILE* f = fopen(path, "r");
+    if (!f)
+        return -1;
+
+    while (fgets(line, sizeof line, f))
+    {
+        const char* mean = strstr(line, " mean_ns=");
+        if (sscanf(line, "bench %255s", name) == 1 && mean && sscanf(mean, " mean_ns=%u", &mean_ns) == 1)
+            CuBenchSetBaseline(name, mean_ns);
+    }
+    fclose(f);
+
+    return 0;
+}
+
+
+static int usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-j processes] [-b baselines] [-t tolerance %%] [-h broker hostname] [-n (no benchmarks)]\n", name);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char** argv)
+{
+    static char names[MAX_JOBS][32];
+    job_t jobs[MAX_JOBS];
+    struct timespec start, end;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int shards = cpus > 0 ? (cpus < MAX_JOBS ? (int)cpus : MAX_JOBS) : 1;
+    int benches = 1, opt, i, failed;
+
+    while ((opt = getopt(argc, argv, "j:b:t:h:n")) != -1)
+    {
+        switch (opt)
+        {
+            case 'j': shards = atoi(optarg); break;
+            case 'b':
+                if (load_baselines(optarg) != 0)
+                {
+                    fprintf(stderr, "failed to read %s\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 't': CuBenchSetTolerance(atoi(optarg)); break;
+            case 'h': hostname = optarg; break;
+            case 'n': benches = 0; break;
+            default: return usage(argv[0]);
+        }
+    }
+
+    if (shards < 1 || shards > MAX_JOBS)
+        return usage(argv[0]);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (i = 0; i < shards; i++)
+    {
+        snprintf(names[i], sizeof names[i], "tests %d/%d", i + 1, shards);
+        if (job_start(&jobs[i], names[i], i, shards) != 0)
+        {
+            fprintf(stderr, "failed to start %s\n", names[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    failed = jobs_wait(jobs, shards);
+
+    /* benchmarks alone, the tests would disturb the timing */
+    if (benches && failed >= 0)
+        failed = job_start(&jobs[0], "benchmarks", -1, 0) == 0 ? failed + jobs_wait(jobs, 1) : -1;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("%d processes, %.2f s, %s\n", shards,
+            (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9, failed ? "FAILED" : "ok");
+
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
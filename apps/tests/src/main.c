@@ -11,7 +11,6 @@
  */
 #include <wm_os.h>
 #include <app_framework.h>
-#include <httpc.h>
 #include <wmtime.h>
 #include <cli.h>
 #include <psm.h>
@@ -20,84 +19,67 @@
 #include <board.h>
 #include <wmtime.h>
 
+#include <evrythng/timesync.h>
+
+#include "CuTest.h"
 #include "tests.h"
 
 static os_thread_t app_thread;
 static os_thread_stack_define(app_stack, 6 * 1024);
 
-#define EVRYTHNG_GET_TIME_URL "http://time.evrythng.com/time"
-#define MAX_DOWNLOAD_DATA 150
-#define MAX_URL_LEN 128
+#define TIME_SYNC_INTERVAL_S (6 * 3600)
+#define TIME_SYNC_STACK_SIZE (4 * 1024)
+#define TIME_SYNC_TIMEOUT_MS 30000
 
 
-/* This task configures Evrythng client and connects to the Evrythng cloud  */
-static void evrythng_task()
+/* Baselines of the benchmark cases are measured on the board and kept in
+ * its PSM, as "<name>=<mean ns>" pairs taken from the bench lines of a
+ * previous run:
+ *   psm-set evrythng bench_baselines "BenchCborToJson=1500 BenchCborMapFind=700"
+ * A case fails when it regressed beyond its baseline, see RunAllBenches().
+ */
+static void load_baselines()
 {
-    RunAllTests();
-
-    os_thread_self_complete(0);
+    psm_handle_t handle;
+    char baselines[256], name[64];
+    const char* p = baselines;
+    unsigned mean_ns;
+    int n, loaded = 0;
+
+    if (psm_open(&handle, "evrythng") != 0)
+        return;
+
+    if (psm_get(&handle, "bench_baselines", baselines, sizeof baselines) == 0)
+    {
+        while (sscanf(p, " %63[^= ]=%u%n", name, &mean_ns, &n) == 2)
+        {
+            CuBenchSetBaseline(name, mean_ns);
+            loaded++;
+            p += n;
+        }
+    }
+    psm_close(&handle);
+
+    if (!loaded)
+        wmprintf("no benchmark baselines, set bench_baselines to fail on regressions\n\r");
 }
 
 
-static void set_device_time()
+/* This task configures Evrythng client and connects to the Evrythng cloud  */
+static void evrythng_task()
 {
-	http_session_t handle;
-	http_resp_t *resp = NULL;
-	char buf[MAX_DOWNLOAD_DATA];
-	int64_t timestamp, offset;
-	int size = 0;
-	int status = 0;
-	char url_name[MAX_URL_LEN];
-
-	memset(url_name, 0, sizeof(url_name));
-	strncpy(url_name, EVRYTHNG_GET_TIME_URL, strlen(EVRYTHNG_GET_TIME_URL));
-
-	wmprintf("Get time from : %s\r\n", url_name);
-	status = httpc_get(url_name, &handle, &resp, NULL);
-	if (status != WM_SUCCESS) {
-		wmprintf("Getting URL failed");
-		return;
-	}
-	size = http_read_content(handle, buf, MAX_DOWNLOAD_DATA);
-	if (size <= 0) {
-		wmprintf("Reading time failed\r\n");
-		goto out_time;
-	}
-	/*
-	  If timezone is present in PSM
-	  Get on http://api.evrythng.com/time?tz=<timezone>
-	  The data will look like this
-	  {
-	  "timestamp":1429514751927,
-	  "offset":-18000000,
-	  "localTime":"2015-04-20T02:25:51.927-05:00",
-	  "nextChange":1446361200000
-	  }
-	  If timezone is not presentin PSM
-	  Get on http://api.evrythng.com/time
-	  The data will look like this
-	  {
-	  "timestamp":1429514751927
-	  }
-	*/
-	jsontok_t json_tokens[9];
-	jobj_t json_obj;
-	if (json_init(&json_obj, json_tokens, 10, buf, size) != WM_SUCCESS) {
-		wmprintf("Wrong json string\r\n");
-		goto out_time;
-	}
+    if (EvrythngTimeSyncWait(TIME_SYNC_TIMEOUT_MS) != EVRYTHNG_SUCCESS)
+    {
+        wmprintf("time is not synchronized yet\n\r");
+    }
 
-	if (json_get_val_int64(&json_obj, "timestamp", &timestamp) == WM_SUCCESS) {
-		if (json_get_val_int64(&json_obj, "offset", &offset)
-		    != WM_SUCCESS) {
-			offset = 0;
-		}
-		timestamp = timestamp + offset;
-	}
-	wmtime_time_set_posix(timestamp/1000);
- out_time:
-	http_close_session(&handle);
-	return;
+    RunAllTests();
+    RunExtTests();
+
+    load_baselines();
+    RunAllBenches();
+
+    os_thread_self_complete(0);
 }
 
 
@@ -145,7 +127,14 @@ int common_event_handler(int event, void *data)
 
 		break;
 	case AF_EVT_NORMAL_CONNECTED:
-		set_device_time();
+		/* the clock is synchronized in the background, only the first
+		 * connection to the cloud waits for it (see evrythng_task) */
+		if (!is_cloud_started)
+			EvrythngTimeSyncStart(TIME_SYNC_INTERVAL_S,
+					OS_PRIO_3, TIME_SYNC_STACK_SIZE);
+		else
+			EvrythngTimeSyncRequest();
+
 		if (!is_cloud_started) {
 			ret = os_thread_create(
 					       /* thread handle */
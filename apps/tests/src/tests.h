@@ -8,4 +8,13 @@
 
 void RunAllTests();
 
+/* lib/ext payload helpers */
+void RunExtTests();
+
+/* benchmark cases, failing when one regressed beyond its baseline */
+void RunAllBenches();
+
+/* broker host of the connect benchmark, BENCH_MQTT_URL by default */
+void SetBenchHost(const char* hostname);
+
 #endif
@@ -0,0 +1,260 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Summarizes a traffic capture (see evrythng/capture.h), e.g. recorded
+ * with EVRYTHNG_CAPTURE_PATH or copied from a device ring: connections,
+ * bytes and the MQTT packet mix per direction. With -b the received
+ * traffic is replayed through platform_network_read() and split into MQTT
+ * packets as the client does, reporting the receive path cost per packet
+ * on the real traffic mix. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <MQTTPacket.h>
+#include <evrythng/capture.h>
+#include <evrythng/platform.h>
+
+#include "bench.h"
+
+#define MAX_PACKET (64 * 1024)
+#define MAX_CONNECTIONS 256
+
+static const char* packet_names[16] = {
+    "reserved", "CONNECT", "CONNACK", "PUBLISH", "PUBACK", "PUBREC", "PUBREL", "PUBCOMP",
+    "SUBSCRIBE", "SUBACK", "UNSUBSCRIBE", "UNSUBACK", "PINGREQ", "PINGRESP", "DISCONNECT", "reserved",
+};
+
+/* splits one direction of a connection into MQTT packets */
+typedef struct splitter_t
+{
+    unsigned char header[5];
+    int header_len;
+    uint32_t remaining;     /* body bytes still to come */
+} splitter_t;
+
+typedef struct direction_t
+{
+    uint64_t bytes;
+    uint32_t records;
+    uint32_t packets[16];
+    splitter_t split[MAX_CONNECTIONS];
+} direction_t;
+
+
+static void split(direction_t* d, splitter_t* s, const uint8_t* data, uint32_t len)
+{
+    while (len)
+    {
+        if (s->remaining)
+        {
+            uint32_t n = s->remaining < len ? s->remaining : len;
+            s->remaining -= n;
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        s->header[s->header_len++] = *data++;
+        len--;
+
+        /* type byte, then the remaining length until a byte without bit 7 */
+        if (s->header_len == 1 || (s->header[s->header_len - 1] & 128 && s->header_len < 5))
+            continue;
+
+        int i, mult = 1;
+        for (i = 1; i < s->header_len; i++, mult *= 128)
+            s->remaining += (s->header[i] & 127) * mult;
+        d->packets[s->header[0] >> 4]++;
+        s->header_len = 0;
+    }
+}
+
+
+/* returns the number of connections */
+static int summarize(const uint8_t* capture, size_t len)
+{
+    static direction_t in, out;
+    capture_record_t r;
+    uint32_t connections = 0, timeouts = 0, closed = 0, duration_us = 0;
+    size_t pos = 0;
+    int i;
+
+    while (pos < len)
+    {
+        pos += capture_parse(capture + pos, len - pos, &r);
+        const uint8_t* data = capture + pos - r.len;
+        duration_us = r.time_us;
+
+        switch (r.type)
+        {
+            case CAPTURE_OPEN:
+                connections++;
+                memset(&in.split[r.connection], 0, sizeof(splitter_t));
+                memset(&out.split[r.connection], 0, sizeof(splitter_t));
+                break;
+            case CAPTURE_READ:
+                in.bytes += r.len;
+                in.records++;
+                split(&in, &in.split[r.connection], data, r.len);
+                break;
+            case CAPTURE_WRITE:
+                out.bytes += r.len;
+                out.records++;
+                split(&out, &out.split[r.connection], data, r.len);
+                break;
+            case CAPTURE_TIMEOUT: timeouts++; break;
+            case CAPTURE_CLOSED: closed++; break;
+        }
+    }
+
+    printf("%u connections over %.1f s, %u read timeouts, %u closed by the peer\n",
+            connections, duration_us / 1e6, timeouts, closed);
+    printf("%-12s %10s %10s\n", "", "received", "sent");
+    printf("%-12s %10llu %10llu\n", "bytes", (unsigned long long)in.bytes, (unsigned long long)out.bytes);
+    printf("%-12s %10u %10u\n", "records", in.records, out.records);
+    for (i = 1; i < 15; i++)
+        if (in.packets[i] || out.packets[i])
+            printf("%-12s %10u %10u\n", packet_names[i], in.packets[i], out.packets[i]);
+
+    return (int)connections;
+}
+
+
+/* reads MQTT packets from the network until the connection ends */
+static int read_packets(Network* n, unsigned char* packet, unsigned long* bytes)
+{
+    int packets = 0;
+
+    for (;;)
+    {
+        int rc = platform_network_read(n, packet, 1, 0);
+        if (rc < 0)
+            continue;
+        if (rc == 0)
+            break;
+
+        int rem = 0, mult = 1, i = 1;
+        do
+        {
+            if (i == 5 || platform_network_read(n, packet + i, 1, 0) != 1)
+                return -1;
+            rem += (packet[i] & 127) * mult;
+            mult *= 128;
+        }
+        while (packet[i++] & 128);
+
+        if (i + rem > MAX_PACKET || (rem && platform_network_read(n, packet + i, rem, 0) != rem))
+            return -1;
+
+        *bytes += i + rem;
+        packets++;
+    }
+
+    return packets;
+}
+
+
+static int replay(const uint8_t* capture, size_t len, int connections, int rounds)
+{
+    static unsigned char packet[MAX_PACKET];
+    unsigned long bytes = 0, packets = 0;
+    replay_stats_t stats;
+    Network n;
+    int i, c;
+
+    uint64_t start = bench_cpu_ns();
+    for (i = 0; i < rounds; i++)
+    {
+        if (replay_start(capture, len) != 0)
+            return -1;
+
+        platform_network_init(&n);
+        for (c = 0; c < connections && platform_network_connect(&n, "replay", 0) == 0; c++)
+        {
+            int rc = read_packets(&n, packet, &bytes);
+            platform_network_disconnect(&n);
+            if (rc < 0)
+            {
+                printf("truncated packet in the capture\n");
+                return -1;
+            }
+            packets += rc;
+        }
+
+        replay_stats(&stats);
+        replay_stop();
+    }
+    uint64_t elapsed = bench_cpu_ns() - start;
+
+    printf("replayed %d times: %lu packets, %lu bytes, %u timeouts per round\n", rounds,
+            packets / rounds, bytes / rounds, stats.timeouts);
+    if (packets)
+        printf("%-12s %10.1f ns/packet %8.1f MB/s\n", "receive", (double)elapsed / packets, bytes * 1e3 / elapsed);
+
+    return 0;
+}
+
+
+static int usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-b] [-r rounds] capture\n", name);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char** argv)
+{
+    const char* path = 0;
+    int bench = 0, rounds = 100, i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-b"))
+            bench = 1;
+        else if (!strcmp(argv[i], "-r") && i + 1 < argc)
+            rounds = atoi(argv[++i]);
+        else if (argv[i][0] != '-' && !path)
+            path = argv[i];
+        else
+            return usage(argv[0]);
+    }
+    if (!path || rounds < 1)
+        return usage(argv[0]);
+
+    FILE* f = fopen(path, "rb");
+    if (!f)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    uint8_t* capture = (uint8_t*)malloc(len > 0 ? len : 1);
+    if (!capture || fread(capture, 1, len, f) != (size_t)len)
+    {
+        fprintf(stderr, "failed to read %s\n", path);
+        return EXIT_FAILURE;
+    }
+    fclose(f);
+
+    /* validates the records before summarize() walks them */
+    if (replay_start(capture, len) != 0)
+    {
+        fprintf(stderr, "%s is not a capture or truncated\n", path);
+        return EXIT_FAILURE;
+    }
+    replay_stop();
+
+    int connections = summarize(capture, len);
+
+    int rc = bench ? replay(capture, len, connections, rounds) : 0;
+    free(capture);
+
+    return rc == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
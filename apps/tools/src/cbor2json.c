@@ -0,0 +1,104 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Local stand-in for the CBOR to JSON converter in front of the cloud:
+ * reads a CBOR payload (raw, or hex with -x) from a file or stdin and
+ * prints the JSON the cloud would receive. */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <evrythng/cbor.h>
+
+#define MAX_PAYLOAD (64 * 1024)
+
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    c = tolower(c);
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+
+/* decodes hex digits in place, whitespace is ignored */
+static long unhex(unsigned char* buf, long len)
+{
+    long i, out = 0;
+    int high = -1;
+
+    for (i = 0; i < len; i++)
+    {
+        if (isspace(buf[i]))
+            continue;
+
+        int v = hex_value(buf[i]);
+        if (v < 0)
+            return -1;
+
+        if (high < 0)
+            high = v;
+        else
+        {
+            buf[out++] = (unsigned char)(high << 4 | v);
+            high = -1;
+        }
+    }
+
+    return high < 0 ? out : -1;
+}
+
+
+int main(int argc, char** argv)
+{
+    static unsigned char cbor[MAX_PAYLOAD];
+    static char json[MAX_PAYLOAD * 4];
+    const char* path = NULL;
+    int hex = 0;
+    int i;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (!strcmp(argv[i], "-x"))
+            hex = 1;
+        else if (argv[i][0] == '-' && argv[i][1])
+        {
+            fprintf(stderr, "usage: %s [-x] [file]\n", argv[0]);
+            return EXIT_FAILURE;
+        }
+        else
+            path = argv[i];
+    }
+
+    FILE* in = path && strcmp(path, "-") ? fopen(path, "rb") : stdin;
+    if (!in)
+    {
+        perror(path);
+        return EXIT_FAILURE;
+    }
+
+    long len = (long)fread(cbor, 1, sizeof cbor, in);
+    if (in != stdin)
+        fclose(in);
+
+    if (hex && (len = unhex(cbor, len)) < 0)
+    {
+        fprintf(stderr, "invalid hex input\n");
+        return EXIT_FAILURE;
+    }
+
+    if (EvrythngCborToJson(cbor, (size_t)len, json, sizeof json) < 0)
+    {
+        fprintf(stderr, "invalid or unsupported CBOR payload (%ld bytes)\n", len);
+        return EXIT_FAILURE;
+    }
+
+    printf("%s\n", json);
+
+    return EXIT_SUCCESS;
+}
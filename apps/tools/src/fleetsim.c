@@ -0,0 +1,328 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+/* Fleet simulator: runs many SDK handles in one process against the local
+ * broker stand-in, driven by a small pool of threads. All instances
+ * connect at once, as a fleet does after a backend outage, then publish
+ * a property periodically. Reports memory per instance, the connect
+ * latency distribution and the aggregate publish rate. */
+
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <evrythng/evrythng.h>
+#include <evrythng/platform.h>
+
+#include "broker.h"
+
+#define BROKER "broker.loopback"
+#define POOL_STACK_SIZE (64 * 1024)
+#define MAX_POOL 64
+
+typedef struct instance_t
+{
+    evrythng_handle_t handle;
+    char thng_id[25];
+    int connected;
+    double connect_ms;      /* from the start of the connect storm */
+    double call_ms;         /* EvrythngConnect alone */
+    uint64_t next_publish_ns;
+} instance_t;
+
+typedef struct pool_thread_t
+{
+    Thread thread;
+    int index;
+} pool_thread_t;
+
+static instance_t* instances;
+static int instances_count = 1000;
+static int pool_size = 8;
+static int duration_s = 10;
+static int interval_ms = 1000;
+static int broker_workers = 4;
+
+static pool_thread_t pool[MAX_POOL];
+static Mutex next_mutex;
+static int next_instance;
+static uint64_t storm_start_ns;
+static uint64_t publish_end_ns;
+static unsigned long published;
+static unsigned long publish_failures;
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static size_t heap_used(void)
+{
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+
+static size_t rss_bytes(void)
+{
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+
+    if (f)
+    {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+
+    return (size_t)resident * (size_t)sysconf(_SC_PAGESIZE);
+}
+
+
+static int take_instance(void)
+{
+    platform_mutex_lock(&next_mutex);
+    int i = next_instance < instances_count ? next_instance++ : -1;
+    platform_mutex_unlock(&next_mutex);
+
+    return i;
+}
+
+
+static void connect_run(void* arg)
+{
+    int i;
+    (void)arg;
+
+    while ((i = take_instance()) >= 0)
+    {
+        instance_t* in = &instances[i];
+
+        uint64_t start = now_ns();
+        in->connected = EvrythngConnect(in->handle) == EVRYTHNG_SUCCESS;
+        uint64_t end = now_ns();
+
+        in->call_ms = (end - start) / 1e6;
+        in->connect_ms = (end - storm_start_ns) / 1e6;
+    }
+}
+
+
+/* each pool thread publishes for the instances i % pool_size == index */
+static void publish_run(void* arg)
+{
+    pool_thread_t* t = (pool_thread_t*)arg;
+    unsigned long ok = 0, failed = 0;
+    char json[64];
+    int i;
+
+    while (now_ns() < publish_end_ns)
+    {
+        uint64_t now = now_ns();
+        uint64_t next = publish_end_ns;
+
+        for (i = t->index; i < instances_count; i += pool_size)
+        {
+            instance_t* in = &instances[i];
+            if (!in->connected)
+                continue;
+
+            if (in->next_publish_ns <= now)
+            {
+                snprintf(json, sizeof json, "[{\"value\":%d}]", rand() % 100);
+                if (EvrythngPubThngProperty(in->handle, in->thng_id, "temperature", json) == EVRYTHNG_SUCCESS)
+                    ok++;
+                else
+                    failed++;
+
+                in->next_publish_ns += (uint64_t)interval_ms * 1000000;
+                now = now_ns();
+            }
+            if (in->next_publish_ns < next)
+                next = in->next_publish_ns;
+        }
+
+        if (next > now)
+            platform_sleep((int)((next - now) / 1000000) + 1);
+    }
+
+    platform_mutex_lock(&next_mutex);
+    published += ok;
+    publish_failures += failed;
+    platform_mutex_unlock(&next_mutex);
+}
+
+
+static void run_pool(void (*func)(void*))
+{
+    int i;
+
+    for (i = 0; i < pool_size; i++)
+    {
+        pool[i].index = i;
+        platform_thread_create(&pool[i].thread, 0, "fleet", func, POOL_STACK_SIZE, &pool[i]);
+    }
+
+    for (i = 0; i < pool_size; i++)
+    {
+        platform_thread_join(&pool[i].thread, -1);
+        platform_thread_destroy(&pool[i].thread);
+    }
+}
+
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+
+static void print_distribution(const char* name, double* values, int n)
+{
+    double sum = 0;
+    int i;
+
+    if (!n)
+    {
+        printf("%-24s none\n", name);
+        return;
+    }
+
+    qsort(values, n, sizeof(double), compare_double);
+    for (i = 0; i < n; i++)
+        sum += values[i];
+
+    printf("%-24s mean %8.1f  p50 %8.1f  p90 %8.1f  p99 %8.1f  max %8.1f ms\n", name, sum / n,
+            values[n / 2], values[n * 90 / 100], values[n * 99 / 100], values[n - 1]);
+}
+
+
+static int usage(const char* name)
+{
+    fprintf(stderr, "usage: %s [-n instances] [-t pool threads] [-d seconds] [-i publish interval ms] [-w broker workers]\n", name);
+    return EXIT_FAILURE;
+}
+
+
+int main(int argc, char** argv)
+{
+    broker_stats_t bstats;
+    int i, connected = 0;
+
+    for (i = 1; i < argc; i++)
+    {
+        if (i + 1 == argc || argv[i][0] != '-')
+            return usage(argv[0]);
+
+        int v = atoi(argv[++i]);
+        switch (argv[i - 1][1])
+        {
+            case 'n': instances_count = v; break;
+            case 't': pool_size = v; break;
+            case 'd': duration_s = v; break;
+            case 'i': interval_ms = v; break;
+            case 'w': broker_workers = v; break;
+            default: return usage(argv[0]);
+        }
+    }
+
+    if (instances_count < 1 || pool_size < 1 || pool_size > MAX_POOL || duration_s < 0 || interval_ms < 1)
+        return usage(argv[0]);
+
+    if (broker_start(BROKER, broker_workers) != 0)
+    {
+        fprintf(stderr, "failed to start the broker\n");
+        return EXIT_FAILURE;
+    }
+    platform_mutex_init(&next_mutex);
+
+    instances = (instance_t*)calloc(instances_count, sizeof(instance_t));
+    double* latencies = (double*)calloc(instances_count, sizeof(double));
+    double* calls = (double*)calloc(instances_count, sizeof(double));
+    if (!instances || !latencies || !calls)
+        return EXIT_FAILURE;
+
+    /* handles, per instance state of the SDK before connecting */
+    size_t heap_start = heap_used();
+    size_t rss_start = rss_bytes();
+    for (i = 0; i < instances_count; i++)
+    {
+        instance_t* in = &instances[i];
+        char client_id[32];
+
+        snprintf(in->thng_id, sizeof in->thng_id, "UEp4rDGs%016d", i);
+        snprintf(client_id, sizeof client_id, "fleet-%d", i);
+
+        if (EvrythngInitHandle(&in->handle) != EVRYTHNG_SUCCESS)
+        {
+            fprintf(stderr, "failed to create handle %d\n", i);
+            return EXIT_FAILURE;
+        }
+        EvrythngSetUrl(in->handle, "tcp://" BROKER ":1883");
+        EvrythngSetKey(in->handle, "fleet-simulator-api-key");
+        EvrythngSetClientId(in->handle, client_id);
+    }
+    size_t heap_created = heap_used();
+
+    /* connect storm */
+    next_instance = 0;
+    storm_start_ns = now_ns();
+    run_pool(connect_run);
+    double storm_ms = (now_ns() - storm_start_ns) / 1e6;
+    size_t heap_connected = heap_used();
+    size_t rss_connected = rss_bytes();
+
+    for (i = 0; i < instances_count; i++)
+        if (instances[i].connected)
+        {
+            latencies[connected] = instances[i].connect_ms;
+            calls[connected] = instances[i].call_ms;
+            connected++;
+        }
+
+    /* steady state, instances publish with a random phase */
+    uint64_t publish_start = now_ns();
+    for (i = 0; i < instances_count; i++)
+        instances[i].next_publish_ns = publish_start + (uint64_t)(rand() % interval_ms) * 1000000;
+    publish_end_ns = publish_start + (uint64_t)duration_s * 1000000000ULL;
+    run_pool(publish_run);
+    double publish_s = (now_ns() - publish_start) / 1e9;
+
+    broker_stats(&bstats);
+
+    printf("%d instances, %d pool threads, %d broker workers\n", instances_count, pool_size, broker_workers);
+    printf("%-24s %10.0f B\n", "heap per handle", (double)(heap_created - heap_start) / instances_count);
+    printf("%-24s %10.0f B\n", "heap per connection", (double)(heap_connected - heap_created) / instances_count);
+    printf("%-24s %10.0f B\n", "RSS per instance", (double)(rss_connected - rss_start) / instances_count);
+    printf("%-24s %10d of %d in %.1f ms\n", "connected", connected, instances_count, storm_ms);
+    print_distribution("connect latency", latencies, connected);
+    print_distribution("EvrythngConnect call", calls, connected);
+    printf("%-24s %10.1f /s, %lu failed\n", "publish rate", published / (publish_s > 0 ? publish_s : 1), publish_failures);
+    printf("%-24s %10u connects, %u publishes, %u max connections, %u errors\n", "broker",
+            bstats.connects, bstats.publishes, bstats.max_connections, bstats.errors);
+
+    for (i = 0; i < instances_count; i++)
+    {
+        if (instances[i].connected)
+            EvrythngDisconnect(instances[i].handle);
+        EvrythngDestroyHandle(instances[i].handle);
+    }
+
+    broker_stop();
+    platform_mutex_deinit(&next_mutex);
+    free(instances);
+    free(latencies);
+    free(calls);
+
+    return connected == instances_count ? EXIT_SUCCESS : EXIT_FAILURE;
+}
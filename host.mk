@@ -0,0 +1,142 @@
+#
+# Host (Linux) build of the EVRYTHNG library with the POSIX platform port,
+# benchmarks and tools. Run from the project root:
+#   make -f host.mk bench
+#   make -f host.mk bench_run
+#   make -f host.mk tools
+#   make -f host.mk broker
+#   make -f host.mk tests_run
+#
+
+HOST_BUILD_DIR ?= build/host
+HOST_CC ?= gcc
+HOST_AR ?= ar
+HOST_CFLAGS ?= -O2 -g
+HOST_CFLAGS += -std=gnu99 -Wall -pthread
+HOST_LDLIBS += -pthread
+
+ifeq ($(NOISY),1)
+AT=
+else
+AT=@
+endif
+
+RMRF=rm -rf
+
+all: bench tools
+
+# reuse the library sources of the WMSDK build, swapping the platform port
+d := lib
+include lib/build.mk
+
+HOST_INCLUDES := \
+	-Ilib/core/evrythng/include \
+	-Ilib/ext/include \
+	-Ilib/core/embedded-mqtt/MQTTClient-C/src \
+	-Ilib/core/embedded-mqtt/MQTTPacket/src \
+	-Ilib/platform/posix
+
+HOST_LIB_SRCS := \
+	$(addprefix lib/,$(filter-out platform/marvell/%,$(libevrythng-objs-y))) \
+	lib/platform/posix/netsim.c \
+	lib/platform/posix/posix.c
+
+HOST_LIB := $(HOST_BUILD_DIR)/libevrythng.a
+HOST_LIB_OBJS := $(patsubst %.c,$(HOST_BUILD_DIR)/%.o,$(HOST_LIB_SRCS))
+
+HOST_BENCHES := \
+	bench_cbor \
+	bench_gateway \
+	bench_json \
+	bench_loopback \
+	bench_mqtt \
+	bench_netsim \
+	bench_ota \
+	bench_publish
+
+# benchmarks built only if the host has OpenSSL
+HOST_OPENSSL_LIBS := $(shell pkg-config --libs openssl 2>/dev/null)
+ifneq ($(HOST_OPENSSL_LIBS),)
+HOST_BENCHES += bench_handshake
+endif
+
+HOST_BENCH_BINS := $(addprefix $(HOST_BUILD_DIR)/,$(HOST_BENCHES))
+
+$(HOST_BUILD_DIR)/bench_handshake: HOST_LDLIBS += $(HOST_OPENSSL_LIBS)
+
+HOST_TOOLS := \
+	capreplay \
+	cbor2json \
+	fleetsim
+
+HOST_TOOL_BINS := $(addprefix $(HOST_BUILD_DIR)/,$(HOST_TOOLS))
+
+$(HOST_BUILD_DIR)/apps/tools/src/capreplay.o: HOST_INCLUDES += -Iapps/bench/src
+
+# MQTT broker stand-in on the loopback transport, linked into the programs using it
+HOST_BROKER_OBJS := $(HOST_BUILD_DIR)/apps/broker/src/broker.o
+HOST_BROKER_BIN := $(HOST_BUILD_DIR)/broker
+
+$(HOST_BUILD_DIR)/bench_loopback $(HOST_BUILD_DIR)/fleetsim: $(HOST_BROKER_OBJS)
+$(HOST_BUILD_DIR)/apps/bench/src/bench_loopback.o $(HOST_BUILD_DIR)/apps/tools/src/fleetsim.o: HOST_INCLUDES += -Iapps/broker/src
+
+# tests application, its test cases come with the core library and are
+# copied next to CuTest.h as by apps/tests/build.mk
+HOST_TESTS_SRC ?= $(wildcard lib/core/tests/tests.c)
+HOST_TESTS_BIN := $(HOST_BUILD_DIR)/evrythng_tests
+HOST_TESTS_OBJS := $(patsubst %.c,$(HOST_BUILD_DIR)/%.o,apps/tests/src/host.c apps/tests/src/CuTest.c apps/tests/src/ext_tests.c apps/tests/src/benches.c)
+HOST_TESTS_JOBS ?= $(shell nproc 2>/dev/null || echo 1)
+
+$(HOST_TESTS_OBJS) $(HOST_BUILD_DIR)/apps/tests/src/tests.o: HOST_INCLUDES += -Iapps/tests/src -Iapps/broker/src
+
+.PHONY: all lib bench bench_run tools broker tests tests_run clean
+.PRECIOUS: $(HOST_BUILD_DIR)/%.o
+
+lib: $(HOST_LIB)
+
+bench: $(HOST_BENCH_BINS)
+
+tools: $(HOST_TOOL_BINS) $(HOST_BROKER_BIN)
+
+broker: $(HOST_BROKER_BIN)
+
+tests: $(HOST_TESTS_BIN)
+
+tests_run: tests
+	$(AT)$(HOST_TESTS_BIN) -j $(HOST_TESTS_JOBS)
+
+bench_run: bench
+	$(AT)for b in $(HOST_BENCH_BINS); do $$b || exit 1; done
+
+$(HOST_BUILD_DIR)/%.o: %.c
+	@mkdir -p $(dir $@)
+	$(AT)$(HOST_CC) $(HOST_CFLAGS) $(HOST_INCLUDES) -c $< -o $@
+
+$(HOST_LIB): $(HOST_LIB_OBJS)
+	$(AT)$(HOST_AR) rcs $@ $^
+
+$(HOST_BUILD_DIR)/bench_%: $(HOST_BUILD_DIR)/apps/bench/src/bench_%.o $(HOST_LIB)
+	$(AT)$(HOST_CC) $(HOST_CFLAGS) $(filter %.o,$^) $(HOST_LIB) $(HOST_LDLIBS) -o $@
+
+$(HOST_TOOL_BINS): $(HOST_BUILD_DIR)/%: $(HOST_BUILD_DIR)/apps/tools/src/%.o $(HOST_LIB)
+	$(AT)$(HOST_CC) $(HOST_CFLAGS) $(filter %.o,$^) $(HOST_LIB) $(HOST_LDLIBS) -o $@
+
+$(HOST_BROKER_BIN): $(HOST_BUILD_DIR)/apps/broker/src/main.o $(HOST_BUILD_DIR)/apps/broker/src/tcp.o $(HOST_BROKER_OBJS) $(HOST_LIB)
+	$(AT)$(HOST_CC) $(HOST_CFLAGS) $(filter %.o,$^) $(HOST_LIB) $(HOST_LDLIBS) -o $@
+
+ifneq ($(HOST_TESTS_SRC),)
+$(HOST_BUILD_DIR)/apps/tests/src/tests.o: $(HOST_TESTS_SRC)
+	@mkdir -p $(dir $@)
+	$(AT)cp $< $(HOST_BUILD_DIR)/apps/tests/src/tests.c
+	$(AT)$(HOST_CC) $(HOST_CFLAGS) $(HOST_INCLUDES) -c $(HOST_BUILD_DIR)/apps/tests/src/tests.c -o $@
+
+$(HOST_TESTS_BIN): $(HOST_TESTS_OBJS) $(HOST_BUILD_DIR)/apps/tests/src/tests.o $(HOST_BROKER_OBJS) $(HOST_LIB)
+	$(AT)$(HOST_CC) $(HOST_CFLAGS) $(filter %.o,$^) $(HOST_LIB) $(HOST_LDLIBS) -o $@
+else
+$(HOST_TESTS_BIN):
+	@echo "lib/core/tests/tests.c not found, update the lib/core submodule"
+	@exit 1
+endif
+
+clean:
+	$(AT)$(RMRF) $(HOST_BUILD_DIR)
@@ -7,10 +7,15 @@
 
 libs-y += libevrythng
 
-global-cflags-y += -I$(d)/core/evrythng/include -I$(d)/platform/marvell
+global-cflags-y += -I$(d)/core/evrythng/include -I$(d)/ext/include -I$(d)/platform/marvell
+
+# hashing through the (hardware accelerated) mbedtls of the WMSDK, changes
+# the layout of evrythng_sha256_t so it has to be seen by the apps too
+global-cflags-y += -DEVRYTHNG_USE_MBEDTLS_SHA256
 
 libevrythng-cflags-y := \
 	-I $(d)/core/evrythng/include \
+	-I $(d)/ext/include \
 	-I $(d)/core/embedded-mqtt/MQTTClient-C/src \
 	-I $(d)/core/embedded-mqtt/MQTTPacket/src \
 	-I $(d)/platform/marvell
@@ -29,4 +34,20 @@ libevrythng-objs-y := \
 	core/embedded-mqtt/MQTTPacket/src/MQTTSubscribeServer.c \
 	core/embedded-mqtt/MQTTPacket/src/MQTTUnsubscribeClient.c \
 	core/embedded-mqtt/MQTTPacket/src/MQTTUnsubscribeServer.c \
+	ext/src/capture.c \
+	ext/src/cbor.c \
+	ext/src/deadband.c \
+	ext/src/gateway.c \
+	ext/src/json_writer.c \
+	ext/src/keepalive.c \
+	ext/src/loopback.c \
+	ext/src/ota.c \
+	ext/src/outbox.c \
+	ext/src/pipeline.c \
+	ext/src/prepared.c \
+	ext/src/reconnect.c \
+	ext/src/sha256.c \
+	ext/src/shadow.c \
+	ext/src/stream.c \
+	ext/src/timesync.c \
 	platform/marvell/marvell.c
@@ -0,0 +1,138 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_CAPTURE_H_)
+#define _EVRYTHNG_CAPTURE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evrythng/transport.h"
+
+/*
+ * Traffic capture: while capture_start() is active every connection made
+ * by platform_network_connect() records what the SDK reads and writes as
+ * it sees it (after TLS), with a timestamp, to a sink: a RAM ring on
+ * devices, a file on the host (EVRYTHNG_CAPTURE_PATH).
+ *
+ * A capture is a sequence of records, a 12 bytes little endian header
+ * followed by len bytes of data:
+ *
+ *   uint32_t time_us     since capture_start(), wraps after ~71 minutes
+ *   uint32_t len
+ *   uint8_t  type        capture_type_t
+ *   uint8_t  connection  numbered from 0 in the order of connecting
+ *   uint16_t reserved
+ *
+ * Replay: while replay_start() is active platform_network_connect() takes
+ * the connections of a capture in their order instead of connecting. Reads
+ * return the recorded bytes, timeouts and the end of the connection at the
+ * recorded points, without waiting; writes are counted. The SDK then runs
+ * through real traffic deterministically and as fast as it can process it.
+ */
+
+#define CAPTURE_HEADER_SIZE 12
+
+typedef enum
+{
+    CAPTURE_OPEN = 1,       /* connected */
+    CAPTURE_READ,           /* data read */
+    CAPTURE_WRITE,          /* data written */
+    CAPTURE_TIMEOUT,        /* read timed out */
+    CAPTURE_CLOSED,         /* read found the connection closed */
+    CAPTURE_CLOSE,          /* disconnected */
+} capture_type_t;
+
+typedef struct capture_record_t
+{
+    uint32_t time_us;
+    uint32_t len;
+    uint8_t type;
+    uint8_t connection;
+} capture_record_t;
+
+/* Gets every record, header and data, serialized by the capture lock. */
+typedef void capture_sink(void* ctx, const uint8_t* header, const uint8_t* data, size_t len);
+
+typedef struct capture_stats_t
+{
+    uint32_t connections;
+    uint32_t records;
+    uint32_t bytes;         /* data bytes of all records */
+} capture_stats_t;
+
+/** @brief Starts capturing connections made from now on. Returns 0 on
+ *         success, -1 if a capture is already active.
+ */
+int capture_start(capture_sink* sink, void* ctx);
+
+/** @brief Stops capturing, connections still open stop recording. */
+void capture_stop(void);
+
+void capture_stats(capture_stats_t* stats);
+
+/** @brief Puts the capture transport in front of a connection just made
+ *         if capturing, the inner one is closed if that fails. Called by
+ *         platform_network_connect(). Returns 0 on success.
+ */
+int capture_wrap(const Transport** transport, void** io);
+
+extern const Transport capture_transport;
+
+/* Parses the record at data, returns its total size or -1 if incomplete. */
+int capture_parse(const uint8_t* data, size_t len, capture_record_t* record);
+
+
+/*
+ * Ring sink for devices: keeps the latest records in a caller provided
+ * buffer, dropping the oldest ones whole to make room.
+ */
+typedef struct capture_ring_t
+{
+    uint8_t* buf;
+    size_t size;
+    size_t head;            /* oldest record */
+    size_t count;
+    uint32_t dropped;       /* records dropped, too old or too large */
+} capture_ring_t;
+
+void capture_ring_init(capture_ring_t* ring, uint8_t* buf, size_t size);
+
+/* pass with the ring as ctx */
+void capture_ring_sink(void* ctx, const uint8_t* header, const uint8_t* data, size_t len);
+
+/** @brief Copies the records, oldest first, e.g. to upload or dump them.
+ *         Stop capturing first. Returns the number of bytes copied, whole
+ *         records only.
+ */
+size_t capture_ring_copy(const capture_ring_t* ring, uint8_t* out, size_t size);
+
+
+typedef struct replay_stats_t
+{
+    uint32_t connections;
+    uint32_t bytes_read;
+    uint32_t bytes_written;
+    uint32_t timeouts;
+} replay_stats_t;
+
+/** @brief Replays capture to the connections made from now on. The
+ *         capture must stay valid until replay_stop(). Returns 0 on
+ *         success, -1 if it is malformed.
+ */
+int replay_start(const uint8_t* capture, size_t len);
+
+void replay_stop(void);
+
+/** @brief The next connection of the capture if replaying, NULL otherwise
+ *         or once all were taken. Called by platform_network_connect().
+ */
+void* replay_connect(void);
+
+extern const Transport replay_transport;
+
+void replay_stats(replay_stats_t* stats);
+
+#endif //_EVRYTHNG_CAPTURE_H_
@@ -0,0 +1,115 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_CBOR_H_)
+#define _EVRYTHNG_CBOR_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Compact binary encoding (CBOR, RFC 7049) of property and action
+ * payloads. Only definite length items are produced and accepted.
+ *
+ * The EVRYTHNG cloud speaks JSON: CBOR payloads are meant for links to a
+ * gateway or converter which translates them with EvrythngCborToJson().
+ */
+
+/* max nesting of arrays/maps accepted by the decoder */
+#define EVRYTHNG_CBOR_MAX_DEPTH 8
+
+typedef struct evrythng_cbor_t
+{
+    uint8_t* buf;
+    size_t size;
+    size_t len;
+    int error;
+} evrythng_cbor_t;
+
+void EvrythngCborInit(evrythng_cbor_t* w, uint8_t* buf, size_t size);
+
+/* a map is followed by pairs * 2 items, keys and values alternating */
+void EvrythngCborMap(evrythng_cbor_t* w, size_t pairs);
+void EvrythngCborArray(evrythng_cbor_t* w, size_t items);
+
+void EvrythngCborInt(evrythng_cbor_t* w, int64_t value);
+
+/* written as single precision if that is lossless */
+void EvrythngCborFloat(evrythng_cbor_t* w, double value);
+void EvrythngCborString(evrythng_cbor_t* w, const char* value);
+void EvrythngCborStringLen(evrythng_cbor_t* w, const char* value, size_t len);
+void EvrythngCborBool(evrythng_cbor_t* w, int value);
+void EvrythngCborNull(evrythng_cbor_t* w);
+
+/** @brief Returns the encoded length or -1 if the buffer overflowed. */
+int EvrythngCborFinish(evrythng_cbor_t* w);
+
+/* [{"value":<value>}] */
+int EvrythngCborPropertyInt(uint8_t* buf, size_t size, int64_t value);
+int EvrythngCborPropertyFloat(uint8_t* buf, size_t size, double value);
+
+
+typedef enum
+{
+    EVRYTHNG_CBOR_INT,
+    EVRYTHNG_CBOR_FLOAT,
+    EVRYTHNG_CBOR_STRING,
+    EVRYTHNG_CBOR_BYTES,
+    EVRYTHNG_CBOR_ARRAY,
+    EVRYTHNG_CBOR_MAP,
+    EVRYTHNG_CBOR_BOOL,
+    EVRYTHNG_CBOR_NULL,
+} evrythng_cbor_type_t;
+
+typedef struct evrythng_cbor_item_t
+{
+    evrythng_cbor_type_t type;
+    union
+    {
+        int64_t i;
+        double f;
+        int b;
+        struct
+        {
+            const char* ptr;    /* not NUL-terminated */
+            size_t len;
+        } s;
+        size_t count;           /* items of an array, pairs of a map */
+    } v;
+} evrythng_cbor_item_t;
+
+typedef struct evrythng_cbor_reader_t
+{
+    const uint8_t* ptr;
+    const uint8_t* end;
+} evrythng_cbor_reader_t;
+
+void EvrythngCborReaderInit(evrythng_cbor_reader_t* r, const uint8_t* data, size_t len);
+
+/** @brief Reads the next item header, tags are skipped. For arrays and
+ *         maps the contained items follow. Returns 0 on success, -1 at
+ *         the end of data or on malformed/unsupported input.
+ */
+int EvrythngCborNext(evrythng_cbor_reader_t* r, evrythng_cbor_item_t* item);
+
+/** @brief Skips the contents of an array or map item just read. */
+int EvrythngCborSkip(evrythng_cbor_reader_t* r, const evrythng_cbor_item_t* item);
+
+/** @brief Looks up a text key in the map item just read and reads its
+ *         value into item. Returns 0 if found, the reader is then
+ *         positioned after the value header.
+ */
+int EvrythngCborMapFind(evrythng_cbor_reader_t* r, const evrythng_cbor_item_t* map,
+        const char* key, evrythng_cbor_item_t* item);
+
+/** @brief Converts a CBOR payload into a NUL-terminated JSON string.
+ *         Floats are written by EvrythngJsonNumber(): NaN and infinities,
+ *         which JSON can't represent, become null. Returns the JSON
+ *         length or -1 on malformed input, byte strings or if json is too
+ *         small.
+ */
+int EvrythngCborToJson(const uint8_t* cbor, size_t len, char* json, size_t size);
+
+#endif //_EVRYTHNG_CBOR_H_
@@ -0,0 +1,42 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_CONNECT_BACKOFF_H_)
+#define _EVRYTHNG_CONNECT_BACKOFF_H_
+
+#include <stdint.h>
+
+/* platform_network_connect() waits at most that long for the backoff of
+ * its connection, attempts due later fail right away so the core's
+ * reconnect loop doesn't block in the connect */
+#define CONNECT_BACKOFF_MAX_WAIT_MS 1000
+
+/*
+ * Backoff of the connection attempts of one Network, so of one handle.
+ * Embedded into the Network structure of every platform and applied by
+ * platform_network_connect() with the policy set by
+ * EvrythngReconnectPace() (evrythng/reconnect.h).
+ */
+typedef struct ConnectBackoff
+{
+    int attempt;            /* attempts since the last stable connection */
+    int connected;          /* CONNACK received */
+    uint32_t connected_at;
+    uint32_t lost_at;
+    uint32_t not_before_ms; /* the next attempt is allowed from then on */
+} ConnectBackoff;
+
+/* Returns 0 if the connection may be attempted now, possibly after a
+ * short wait, or -1 if the attempt falls into the backoff. */
+int connect_backoff_before(ConnectBackoff* b);
+
+/* The connection completed the MQTT connect (CONNACK read). */
+void connect_backoff_on_connected(ConnectBackoff* b);
+
+/* The connection was closed, connected tells whether it had completed
+ * the MQTT connect. */
+void connect_backoff_on_closed(ConnectBackoff* b, int connected);
+
+#endif //_EVRYTHNG_CONNECT_BACKOFF_H_
@@ -0,0 +1,85 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_DEADBAND_H_)
+#define _EVRYTHNG_DEADBAND_H_
+
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Delta/deadband suppression of property publishes: the last published
+ * value of every (thng, property) is cached and a new value is only
+ * published if it differs by more than the deadband, or if the cached
+ * one is older than max_staleness_ms (heartbeat). When the cache is full
+ * the least recently published entry is evicted.
+ */
+
+typedef struct evrythng_deadband_ctx_t* evrythng_deadband_t;
+
+typedef struct evrythng_deadband_config_t
+{
+    int capacity;           /* number of (thng, property) entries cached */
+    double deadband;        /* numeric changes up to that are suppressed,
+                               0 suppresses identical values only */
+    int max_staleness_ms;   /* unchanged values are published again after
+                               that, 0 disables the heartbeat */
+} evrythng_deadband_config_t;
+
+#define EVRYTHNG_DEADBAND_CONFIG_DEFAULT { 16, 0.0, 15 * 60 * 1000 }
+
+typedef struct evrythng_deadband_stats_t
+{
+    uint32_t lookups;
+    uint32_t hits;          /* lookups finding a cached value */
+    uint32_t suppressed;    /* publishes avoided */
+    uint32_t published;     /* publishes passed, including heartbeats */
+    uint32_t heartbeats;    /* unchanged values published as stale */
+    uint32_t evictions;
+} evrythng_deadband_stats_t;
+
+evrythng_return_t EvrythngDeadbandCreate(evrythng_deadband_t* deadband,
+        const evrythng_deadband_config_t* config);
+
+void EvrythngDeadbandDestroy(evrythng_deadband_t deadband);
+
+/** @brief Returns 1 if value has to be published, the cache then already
+ *         holds it as the last published value. Returns 0 if the publish
+ *         can be suppressed.
+ */
+int EvrythngDeadbandCheck(evrythng_deadband_t deadband,
+        const char* thng_id,
+        const char* property_name,
+        double value);
+
+/** @brief Same for non numeric payloads: only byte for byte identical
+ *         JSON is suppressed, the cache keeps a heap copy of it.
+ */
+int EvrythngDeadbandCheckJson(evrythng_deadband_t deadband,
+        const char* thng_id,
+        const char* property_name,
+        const char* property_json);
+
+/** @brief Drops the cached value, call it when a publish allowed by the
+ *         cache failed so that the next value is not suppressed.
+ */
+void EvrythngDeadbandForget(evrythng_deadband_t deadband,
+        const char* thng_id,
+        const char* property_name);
+
+/** @brief Publishes [{"value":<value>}] unless suppressed. Suppressed
+ *         publishes return EVRYTHNG_SUCCESS.
+ */
+evrythng_return_t EvrythngDeadbandPubThngProperty(evrythng_deadband_t deadband,
+        evrythng_handle_t handle,
+        const char* thng_id,
+        const char* property_name,
+        double value,
+        int decimals);
+
+void EvrythngDeadbandStats(evrythng_deadband_t deadband, evrythng_deadband_stats_t* stats);
+
+#endif //_EVRYTHNG_DEADBAND_H_
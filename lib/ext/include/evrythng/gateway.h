@@ -0,0 +1,122 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_GATEWAY_H_)
+#define _EVRYTHNG_GATEWAY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Gateway mode: one connection carries the traffic of many thngs, for
+ * example sensors bridged over BLE. Thngs are kept in a registry of
+ * compact records with a hash index on the thng id.
+ *
+ * Incoming: a single subscription to all actions of the account replaces
+ * one subscription per thng, actions are routed to the callback of the
+ * thng named by their "thng" member.
+ *
+ * Outgoing: publishes are queued per thng into a shared pool of message
+ * slots and sent round-robin, one message per thng in turn, so a chatty
+ * thng can't delay the others. max_pending limits the slots a single
+ * thng may occupy.
+ */
+
+/* EVRYTHNG thng ids are 24 characters */
+#define EVRYTHNG_GATEWAY_ID_SIZE 24
+
+typedef struct evrythng_gateway_ctx_t* evrythng_gateway_t;
+
+typedef enum
+{
+    EVRYTHNG_GATEWAY_PROPERTY,
+    EVRYTHNG_GATEWAY_ACTION,
+} evrythng_gateway_msg_t;
+
+/* Called with the action JSON for the thng it was registered for. */
+typedef void evrythng_gateway_action_callback(void* ctx, const char* thng_id, const char* json, size_t len);
+
+/* Sends a queued message, EvrythngPubThngProperty/Action if not set. */
+typedef evrythng_return_t evrythng_gateway_send(void* ctx, const char* thng_id,
+        evrythng_gateway_msg_t type, const char* name, const char* json);
+
+typedef struct evrythng_gateway_config_t
+{
+    int max_thngs;          /* registry capacity, up to 65534 */
+    int queue_size;         /* message slots shared by all thngs */
+    int max_pending;        /* slots a single thng may occupy */
+    int payload_size;       /* max name + JSON length of a message */
+    evrythng_gateway_send* send;
+    void* send_ctx;
+} evrythng_gateway_config_t;
+
+#define EVRYTHNG_GATEWAY_CONFIG_DEFAULT { 64, 32, 4, 128, 0, 0 }
+
+typedef struct evrythng_gateway_stats_t
+{
+    uint32_t thngs;             /* thngs registered */
+    uint32_t registry_bytes;    /* records, hash index and context */
+    uint32_t queue_bytes;       /* message slots */
+    uint32_t queued;
+    uint32_t sent;
+    uint32_t failed;            /* sends failed, the message stays queued */
+    uint32_t rejected;          /* publishes refused, queue or thng limit full */
+    uint32_t max_queued;
+    uint32_t routed;            /* actions passed to a thng callback */
+    uint32_t unrouted;          /* actions for unknown thngs or without "thng" */
+} evrythng_gateway_stats_t;
+
+evrythng_return_t EvrythngGatewayCreate(evrythng_gateway_t* gateway,
+        evrythng_handle_t handle,
+        const evrythng_gateway_config_t* config);
+
+void EvrythngGatewayDestroy(evrythng_gateway_t gateway);
+
+/** @brief Registers a thng, callback gets its actions. Returns
+ *         EVRYTHNG_BAD_ARGS if it is registered already and
+ *         EVRYTHNG_MEMORY_ERROR if the registry is full.
+ */
+evrythng_return_t EvrythngGatewayAddThng(evrythng_gateway_t gateway,
+        const char* thng_id,
+        evrythng_gateway_action_callback* callback,
+        void* ctx);
+
+/** @brief Unregisters a thng, dropping its queued messages. */
+evrythng_return_t EvrythngGatewayRemoveThng(evrythng_gateway_t gateway, const char* thng_id);
+
+/** @brief Queues a property update of a registered thng, copying the
+ *         arguments. Returns EVRYTHNG_MEMORY_ERROR if no slot is left for
+ *         the thng.
+ */
+evrythng_return_t EvrythngGatewayPubThngProperty(evrythng_gateway_t gateway,
+        const char* thng_id,
+        const char* property_name,
+        const char* property_json);
+
+/** @brief Queues an action of a registered thng. */
+evrythng_return_t EvrythngGatewayPubThngAction(evrythng_gateway_t gateway,
+        const char* thng_id,
+        const char* action_name,
+        const char* action_json);
+
+/** @brief Sends up to max_messages queued messages round-robin over the
+ *         thngs. Stops at the first failed send. Returns the number of
+ *         messages sent.
+ */
+int EvrythngGatewaySend(evrythng_gateway_t gateway, int max_messages);
+
+/** @brief Subscribes to all actions of the account through the handle.
+ *         Only one gateway can be subscribed.
+ */
+evrythng_return_t EvrythngGatewaySubscribe(evrythng_gateway_t gateway, int qos);
+
+/** @brief Routes an action to its thng, as received by the subscription. */
+void EvrythngGatewayDispatch(evrythng_gateway_t gateway, const char* json, size_t len);
+
+void EvrythngGatewayStats(evrythng_gateway_t gateway, evrythng_gateway_stats_t* stats);
+
+#endif //_EVRYTHNG_GATEWAY_H_
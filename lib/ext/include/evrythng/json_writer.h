@@ -0,0 +1,81 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_JSON_WRITER_H_)
+#define _EVRYTHNG_JSON_WRITER_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * JSON writer appending into a caller provided buffer: no allocations,
+ * no printf, strings are escaped and every write is bounds checked.
+ * After an overflow all further writes are ignored and
+ * EvrythngJsonFinish() returns NULL.
+ */
+
+#define EVRYTHNG_JSON_MAX_DEPTH 8
+
+/* max number of decimals written by EvrythngJsonFloat */
+#define EVRYTHNG_JSON_MAX_DECIMALS 9
+
+typedef struct evrythng_json_t
+{
+    char* buf;
+    size_t size;
+    size_t len;
+
+    int error;
+    int depth;
+    int after_key;
+    unsigned char has_items[EVRYTHNG_JSON_MAX_DEPTH];
+} evrythng_json_t;
+
+void EvrythngJsonInit(evrythng_json_t* w, char* buf, size_t size);
+
+void EvrythngJsonObjectBegin(evrythng_json_t* w);
+void EvrythngJsonObjectEnd(evrythng_json_t* w);
+void EvrythngJsonArrayBegin(evrythng_json_t* w);
+void EvrythngJsonArrayEnd(evrythng_json_t* w);
+
+void EvrythngJsonKey(evrythng_json_t* w, const char* key);
+void EvrythngJsonString(evrythng_json_t* w, const char* value);
+
+/* for strings which are not NUL-terminated */
+void EvrythngJsonKeyLen(evrythng_json_t* w, const char* key, size_t len);
+void EvrythngJsonStringLen(evrythng_json_t* w, const char* value, size_t len);
+void EvrythngJsonInt(evrythng_json_t* w, int64_t value);
+
+/* non finite values are written as null, values beyond the fixed point
+ * range (about 9e18 / 10^decimals) as %.17g */
+void EvrythngJsonFloat(evrythng_json_t* w, double value, int decimals);
+/* integral values without fraction, others with up to 6 decimals, from
+ * 9e15 on as %.17g and non finite values as null */
+void EvrythngJsonNumber(evrythng_json_t* w, double value);
+void EvrythngJsonBool(evrythng_json_t* w, int value);
+void EvrythngJsonNull(evrythng_json_t* w);
+
+/** @brief Terminates the string. Returns the JSON string or NULL if the
+ *         buffer overflowed or objects/arrays were left open.
+ */
+const char* EvrythngJsonFinish(evrythng_json_t* w);
+
+/*
+ * Typed helpers for EVRYTHNG payloads, returning the length of the JSON
+ * written into buf or -1 if it doesn't fit.
+ */
+
+/* [{"value":<value>}] */
+int EvrythngJsonPropertyInt(char* buf, size_t size, int64_t value);
+int EvrythngJsonPropertyFloat(char* buf, size_t size, double value, int decimals);
+int EvrythngJsonPropertyString(char* buf, size_t size, const char* value);
+int EvrythngJsonPropertyBool(char* buf, size_t size, int value);
+
+/* {"type":<type>,"customFields":{ ... custom fields are written by the
+ * caller in between ... }} */
+void EvrythngJsonActionBegin(evrythng_json_t* w, const char* type);
+void EvrythngJsonActionEnd(evrythng_json_t* w);
+
+#endif //_EVRYTHNG_JSON_WRITER_H_
@@ -0,0 +1,139 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_KEEPALIVE_H_)
+#define _EVRYTHNG_KEEPALIVE_H_
+
+#include <stdint.h>
+
+/* Defaults of the keepalive search range, in seconds */
+#define KEEPALIVE_DEFAULT_MIN_S 30
+#define KEEPALIVE_DEFAULT_MAX_S 600
+#define KEEPALIVE_DEFAULT_STEP_S 30
+
+/* Number of answered pings required before a longer keepalive is tried. */
+#define KEEPALIVE_CONFIRMATIONS 3
+
+/* A ping confirms an interval if the connection was idle for at least the
+ * interval minus this slack before it was sent. */
+#define KEEPALIVE_SLACK_MS 1000
+
+/* A ping is lost once unanswered for longer than the read timeout of the
+ * measured round trip times, within these bounds. */
+#define KEEPALIVE_PING_TIMEOUT_MIN_MS 5000
+#define KEEPALIVE_PING_TIMEOUT_MAX_MS 30000
+
+/* Round trip time statistics of MQTT PINGREQ/PINGRESP exchanges. */
+typedef struct RttStats
+{
+    uint32_t samples;
+    uint32_t last_ms;
+    uint32_t min_ms;
+    uint32_t max_ms;
+    uint32_t srtt_ms;   /* smoothed round trip time */
+    uint32_t rttvar_ms; /* round trip time variation */
+} RttStats;
+
+/*
+ * Searches for the longest keepalive interval the network path (NATs,
+ * firewalls) tolerates. The interval grows by step_s after
+ * KEEPALIVE_CONFIRMATIONS answered pings sent after an idle period of the
+ * interval and falls back to the last confirmed interval as soon as a ping
+ * times out.
+ */
+typedef struct KeepaliveProbe
+{
+    int min_s;
+    int max_s;
+    int step_s;
+
+    int interval_s;     /* interval to be used for the next connection */
+    int safe_s;         /* longest interval confirmed to work */
+    int confirmations;
+    int settled;        /* the longest safe interval has been found */
+
+    uint32_t pings;
+    uint32_t losses;
+} KeepaliveProbe;
+
+/*
+ * Follows the MQTT framing of a connection to time PINGREQ/PINGRESP
+ * exchanges. Embedded into the Network structure of every platform and
+ * fed by its read/write functions.
+ */
+typedef struct PingMonitor
+{
+    int rx_state;
+    unsigned char rx_header;
+    uint32_t rx_remaining;
+    uint32_t rx_multiplier;
+
+    int connected;          /* CONNACK received */
+    uint32_t traffic_ms;    /* last packet sent or data received */
+
+    int ping_pending;
+    uint32_t ping_sent_ms;
+    uint32_t ping_idle_ms;  /* idle time of the connection before the ping */
+    RttStats rtt;
+
+    int pingresp_left;      /* bytes of a local PINGRESP still to be read */
+    uint32_t client_pings;  /* PINGREQs of the client answered locally */
+} PingMonitor;
+
+/* what the platform should do after a read timed out */
+typedef enum
+{
+    PING_MONITOR_IDLE,
+    PING_MONITOR_SEND_PING, /* idle for the probed interval, send a PINGREQ */
+    PING_MONITOR_LOST,      /* the ping timed out, the connection is dead */
+} ping_monitor_action_t;
+
+void rtt_stats_init(RttStats* s);
+void rtt_stats_update(RttStats* s, uint32_t rtt_ms);
+
+/* Read timeout covering the measured round trip time (srtt + 4 * rttvar),
+ * clamped to [min_ms, max_ms]. Returns max_ms if nothing was measured. */
+uint32_t rtt_stats_timeout(const RttStats* s, uint32_t min_ms, uint32_t max_ms);
+
+void keepalive_probe_init(KeepaliveProbe* p, int min_s, int max_s, int step_s);
+/* idle_ms: how long the connection was idle before the answered ping */
+void keepalive_probe_on_ping(KeepaliveProbe* p, uint32_t idle_ms);
+void keepalive_probe_on_lost(KeepaliveProbe* p);
+
+void ping_monitor_on_write(PingMonitor* m, const unsigned char* buffer, int len);
+void ping_monitor_on_read(PingMonitor* m, const unsigned char* buffer, int len);
+
+/*
+ * The probe owns pinging: the client's own PINGREQs would keep pinging at
+ * its keepalive, so the platform write function passes every packet of
+ * the client through these two before writing it.
+ */
+
+/* Raises the keepalive of a CONNECT packet to the max of the search
+ * range so the broker tolerates the probed interval. Returns the offset
+ * of the keepalive to restore to *keepalive once written, or -1 if packet
+ * was not changed. */
+int ping_monitor_on_connect(PingMonitor* m, unsigned char* packet, int len, unsigned short* keepalive);
+
+/* Returns 1 if packet is a PINGREQ of the client, which is not to be
+ * written: the next read of the client gets a PINGRESP from
+ * ping_monitor_take_pingresp() instead. Only called between incoming
+ * packets. */
+int ping_monitor_absorb(PingMonitor* m, const unsigned char* packet, int len);
+
+/* Copies the bytes of a pending local PINGRESP to buffer, returns their
+ * number or 0 if there is none. */
+int ping_monitor_take_pingresp(PingMonitor* m, unsigned char* buffer, int len);
+
+/* the connection was closed, a timed out ping counts as lost */
+void ping_monitor_on_closed(PingMonitor* m);
+
+/* Called by the read function when it timed out. Sends keepalive pings at
+ * the probed interval and gives up on a connection whose ping timed out.
+ * Writing from the read path is safe as the client reads and writes under
+ * its lock. */
+ping_monitor_action_t ping_monitor_on_idle(PingMonitor* m);
+
+#endif //_EVRYTHNG_KEEPALIVE_H_
@@ -0,0 +1,156 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_OTA_H_)
+#define _EVRYTHNG_OTA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+#include "evrythng/sha256.h"
+#include "evrythng/stream.h"
+
+/*
+ * Firmware update over the EVRYTHNG connection. The image is sent as a
+ * sequence of thng actions of type EVRYTHNG_OTA_ACTION:
+ *
+ *   {"type":"_firmware","customFields":{"size":<image size>,
+ *    "sha256":"<hex digest of the image>","offset":<offset of the chunk>,
+ *    "data":"<base64 chunk>"}}
+ *
+ * Members may come in any order, with any whitespace and next to other
+ * members. Messages are consumed as they arrive from the streaming
+ * receive (see evrythng/stream.h): the data is decoded and written to the
+ * firmware partition sequentially while the running hash is updated, so
+ * RAM use doesn't depend on the chunk size. A streamed message can only
+ * be written if "size", "offset" and "sha256" precede "data", messages
+ * delivered in one piece (below the streaming threshold) are scanned for
+ * them first.
+ *
+ * Chunks must arrive in order. Chunks already received are skipped and
+ * chunks beyond the received offset are dropped, so after a reconnect the
+ * sender resumes at EvrythngOtaOffset(). The update is committed once
+ * size bytes were written and the hash matches.
+ *
+ * The SHA-256 travels with the image, so it only protects against
+ * corruption: whoever can publish actions to the thng can install a
+ * firmware. Devices which must only accept known images get the digest
+ * over a trusted channel and set it with EvrythngOtaExpect().
+ */
+
+#define EVRYTHNG_OTA_ACTION "_firmware"
+
+/* JSON nesting levels a chunk message may have */
+#define EVRYTHNG_OTA_MAX_DEPTH 32
+
+/* member names longer than that are never one of ours */
+#define EVRYTHNG_OTA_KEY_SIZE 16
+
+/* decoded bytes buffered per flash write */
+#define EVRYTHNG_OTA_WRITE_SIZE 96
+
+typedef enum
+{
+    EVRYTHNG_OTA_IDLE,
+    EVRYTHNG_OTA_RECEIVING,
+    EVRYTHNG_OTA_DONE,
+    EVRYTHNG_OTA_FAILED,
+} evrythng_ota_state_t;
+
+/* Called when an update starts, completes or fails. */
+typedef void evrythng_ota_callback(void* ctx, evrythng_ota_state_t state, uint32_t offset, uint32_t size);
+
+typedef struct evrythng_ota_stats_t
+{
+    uint32_t messages;      /* chunk messages accepted */
+    uint32_t duplicates;    /* chunks skipped, already received */
+    uint32_t gaps;          /* chunks dropped, beyond the received offset */
+    uint32_t invalid;       /* messages which couldn't be parsed */
+    uint32_t rejected;      /* images not matching the expected digest */
+    uint32_t resumes;       /* chunks continuing after an interrupted one */
+    uint32_t started_ms;
+    uint32_t elapsed_ms;    /* from the first to the last byte written */
+} evrythng_ota_stats_t;
+
+typedef struct evrythng_ota_t
+{
+    evrythng_ota_state_t state;
+    uint32_t size;
+    uint32_t received;
+    unsigned char sha256[EVRYTHNG_SHA256_SIZE];
+    evrythng_sha256_t hash;
+
+    /* the only image accepted, see EvrythngOtaExpect() */
+    int expect;
+    uint32_t expect_size;
+    unsigned char expect_sha256[EVRYTHNG_SHA256_SIZE];
+
+    evrythng_ota_callback* callback;
+    void* ctx;
+
+    /* streamed messages on other topics are passed on to next */
+    stream_callback* next;
+    void* next_ctx;
+
+    /* parser state of the current message */
+    int msg_state;
+    int msg_writing;
+    int msg_resumed;
+    int interrupted;        /* the last chunk was cut by the connection */
+    int msg_prescan;        /* looking for the members only */
+    uint32_t msg_skip;
+    uint32_t msg_size;
+    uint32_t msg_offset;
+    unsigned char msg_sha256[EVRYTHNG_SHA256_SIZE];
+    int msg_found;          /* members seen so far */
+    int msg_hex;            /* digits of "sha256" read */
+
+    /* JSON scanner, kept over the chunks of a message */
+    int json_depth;
+    uint32_t json_arrays;   /* bit n set: level n + 1 is an array */
+    int json_fields_depth;  /* level of "customFields", 0 outside */
+    int json_in_string;
+    int json_escape;
+    int json_expect_key;
+    int json_member;        /* member whose value is being read */
+    char json_key[EVRYTHNG_OTA_KEY_SIZE];
+    int json_key_len;
+
+    uint32_t quad;
+    int quad_len;
+    unsigned char out[EVRYTHNG_OTA_WRITE_SIZE];
+    size_t out_len;
+
+    evrythng_ota_stats_t stats;
+} evrythng_ota_t;
+
+void EvrythngOtaInit(evrythng_ota_t* ota, evrythng_ota_callback* callback, void* ctx);
+
+/** @brief Accepts only the image of size bytes with that digest, NULL
+ *         accepts any image again. The digest must not come with the
+ *         image, e.g. provisioned or taken from a signed manifest.
+ */
+void EvrythngOtaExpect(evrythng_ota_t* ota, uint32_t size, const unsigned char sha256[EVRYTHNG_SHA256_SIZE]);
+
+/** @brief Streaming receive callback, pass it with the ota as ctx to
+ *         platform_stream_configure(). The threshold has to be below the
+ *         size of the chunk messages.
+ */
+void EvrythngOtaStreamCallback(void* ctx, const char* topic,
+        const unsigned char* chunk, size_t len, size_t offset, size_t total);
+
+/** @brief Subscribes to the firmware action, messages below the streaming
+ *         threshold are then handled too. Only one ota can be subscribed.
+ */
+evrythng_return_t EvrythngOtaSubscribe(evrythng_ota_t* ota, evrythng_handle_t handle, const char* thng_id);
+
+/** @brief Feeds part of a chunk message, as the stream callback. */
+void EvrythngOtaFeed(evrythng_ota_t* ota, const unsigned char* data, size_t len, size_t offset, size_t total);
+
+/* offset the sender has to continue at */
+uint32_t EvrythngOtaOffset(const evrythng_ota_t* ota);
+
+#endif //_EVRYTHNG_OTA_H_
@@ -0,0 +1,132 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_OUTBOX_H_)
+#define _EVRYTHNG_OUTBOX_H_
+
+#include "evrythng/stream.h"
+
+/*
+ * Outbox: MQTT packets built by the SDK itself (pipelined and prepared
+ * publishes) are queued here and written by the platform read function
+ * of the MQTT connection. The client only reads with its lock held, so
+ * they never interleave with the packets the client writes, without
+ * waiting for the client to finish a blocking publish.
+ *
+ * Packet ids are shared with the client: the SDK reserves its ids with
+ * outbox_packet_id(), which skips the ids of the client's packets still
+ * waiting for an ack. A packet the client writes with an id the SDK has
+ * reserved goes out with a free id instead and its ack is handed to the
+ * client with the client's id again. PUBACKs of reserved ids are taken
+ * out of the byte stream by the stream filter and never reach the client.
+ *
+ * One handle only: nothing tells which connection belongs to which
+ * handle. The outbox is owned by the handle of the pipelines and prepared
+ * publishes using it, outbox_claim() fails for another one. It sends only
+ * while a single MQTT connection is up, on that one: as soon as a second
+ * connection completes the MQTT connect the queued packets are dropped
+ * and sending fails until a connection completes it while no other one
+ * is up. Processes running several handles publish through the client.
+ */
+
+/* max packets queued for writing */
+#define OUTBOX_MAX_PACKETS 16
+
+#define OUTBOX_MAX_LISTENERS 4
+
+/* max packet ids reserved by the SDK at a time, as by the windows of the
+ * pipelines and the prepared publishes waiting for their PUBACK */
+#define OUTBOX_MAX_PACKET_IDS 32
+
+/* max packets of the client waiting for their ack, the client has one
+ * publish and a few subscriptions in flight at a time */
+#define OUTBOX_MAX_CLIENT_IDS 8
+
+/* max wait of the reading thread for a packet a listener announced, the
+ * packet then goes out before the read instead of after it */
+#define OUTBOX_FOLLOW_MS 50
+
+/* Called from the thread reading the connection for every PUBACK of a
+ * reserved packet id no outbox_send_wait() is waiting for. Returns 0 if
+ * the packet id is not the listener's, 1 if it is and 2 if it is and the
+ * listener is about to queue a packet. Must not block or use the outbox. */
+typedef int outbox_ack_listener(void* ctx, unsigned short packet_id);
+
+/** @brief Makes owner, the handle publishing through the outbox, its
+ *         owner or adds a reference to it. Returns -1 if another handle
+ *         owns it.
+ */
+int outbox_claim(const void* owner);
+
+void outbox_release(const void* owner);
+
+/** @brief Registers a listener for PUBACKs. Returns 0 on success. */
+int outbox_add_listener(outbox_ack_listener* listener, void* ctx);
+
+/** @brief Removes a listener, once it returns the listener is no longer
+ *         called.
+ */
+void outbox_remove_listener(outbox_ack_listener* listener, void* ctx);
+
+/** @brief Reserves a packet id neither the SDK nor the client uses.
+ *         Returns 0 if OUTBOX_MAX_PACKET_IDS are reserved already. The
+ *         id is released once its PUBACK was claimed or by
+ *         outbox_release_packet_id().
+ */
+unsigned short outbox_packet_id(void);
+
+/** @brief Releases an id whose packet was not acknowledged. A PUBACK
+ *         still on its way is dropped then.
+ */
+void outbox_release_packet_id(unsigned short packet_id);
+
+/** @brief Queues a copy of a complete MQTT packet. Returns 0 on success,
+ *         -1 if there is no MQTT connection or the outbox is full.
+ *         Packets queued when the connection breaks are dropped.
+ */
+int outbox_send(const unsigned char* packet, int len);
+
+/** @brief Queues a copy of a QoS 1 packet and waits up to timeout_ms for
+ *         its PUBACK. Returns 0 once it was acknowledged, -1 otherwise.
+ *         Releases the packet id in any case.
+ */
+int outbox_send_wait(const unsigned char* packet, int len, unsigned short packet_id, int timeout_ms);
+
+/*
+ * Platform side, called by the read, write and close functions of every
+ * port. conn is the platform's Network.
+ */
+
+/** @brief The connection completed the MQTT connect (CONNACK read). */
+void outbox_on_connected(const void* conn);
+
+/** @brief Writes the queued packets if conn is the outbox connection.
+ *         They don't go through outbox_on_write(). After a listener
+ *         announced a packet, waits up to OUTBOX_FOLLOW_MS for it. Packets
+ *         queued later go out on the next call, when the read the client
+ *         is in returns.
+ */
+void outbox_flush(const void* conn, stream_io* write, void* io);
+
+/** @brief Called for every packet the client writes, before it is written.
+ *         Records the packet id of QoS 1 PUBLISH, SUBSCRIBE and
+ *         UNSUBSCRIBE packets and replaces it in packet if the SDK has
+ *         reserved it. Returns the offset of the id to restore to
+ *         *client_id once written, or -1 if packet was not changed.
+ */
+int outbox_on_write(const void* conn, unsigned char* packet, int len, unsigned short* client_id);
+
+/** @brief Called by the stream filter for every incoming PUBACK, SUBACK
+ *         and UNSUBACK with the 2 bytes of its packet id. Returns 1 if it
+ *         was consumed, otherwise id holds the id to hand to the client.
+ */
+int outbox_on_ack(const void* conn, unsigned char header, unsigned char id[2]);
+
+/** @brief The connection was closed, connected tells whether it had
+ *         completed the MQTT connect.
+ */
+void outbox_on_closed(const void* conn, int connected);
+
+#endif //_EVRYTHNG_OUTBOX_H_
@@ -0,0 +1,104 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_PIPELINE_H_)
+#define _EVRYTHNG_PIPELINE_H_
+
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+#include "evrythng/prepared.h"
+
+/*
+ * Publish pipeline: publishes are queued and sent as QoS 1 PUBLISH
+ * packets through the outbox (evrythng/outbox.h) by one sender thread,
+ * which doesn't wait for the PUBACK of a message before sending the next
+ * one: up to "window" publishes wait for their PUBACK at the same time,
+ * matched by packet id, reserved from the outbox when a message enters the
+ * window. Messages are sent in the order they were queued,
+ * nothing is sent past one that could not be. Unacknowledged messages are
+ * sent again, with the DUP flag and in order, after retry_ms or once the
+ * connection is restored.
+ *
+ * The client's publish functions block until the PUBACK with the
+ * client's lock held, so they can't be used for that.
+ */
+
+typedef struct evrythng_pipeline_ctx_t* evrythng_pipeline_t;
+
+/* Called once per message with the final result of the publish, from the
+ * sender thread. */
+typedef void evrythng_pub_ack_callback(void* ctx, evrythng_return_t rc);
+
+typedef struct evrythng_pipeline_config_t
+{
+    int window;         /* max number of unacknowledged publishes */
+    int queue_size;     /* max number of queued messages */
+    int max_attempts;   /* a message is dropped after that many transmissions */
+    int retry_ms;       /* wait for the PUBACK before sending again */
+    int priority;       /* sender thread priority */
+    int stack_size;     /* sender thread stack size */
+} evrythng_pipeline_config_t;
+
+typedef struct evrythng_pipeline_stats_t
+{
+    uint32_t queued;
+    uint32_t acked;
+    uint32_t retransmits;
+    uint32_t dropped;
+    uint32_t in_flight;     /* publishes currently waiting for an ack */
+    uint32_t max_in_flight;
+} evrythng_pipeline_stats_t;
+
+/** @brief Creates a pipeline publishing on the connection of the given
+ *         handle, the connection the outbox sends on. Returns
+ *         EVRYTHNG_BAD_ARGS if the outbox belongs to another handle.
+ */
+evrythng_return_t EvrythngPipelineCreate(evrythng_pipeline_t* pipeline,
+        evrythng_handle_t handle,
+        const evrythng_pipeline_config_t* config);
+
+/** @brief Stops the sender thread and waits for it. Messages still
+ *         queued or unacknowledged are dropped, their callbacks get
+ *         EVRYTHNG_FAILURE.
+ */
+void EvrythngPipelineDestroy(evrythng_pipeline_t pipeline);
+
+/** @brief Queues a thng property update, copying the arguments.
+ *         Returns EVRYTHNG_MEMORY_ERROR if the queue is full.
+ */
+evrythng_return_t EvrythngPipelinePubThngProperty(evrythng_pipeline_t pipeline,
+        const char* thng_id,
+        const char* property_name,
+        const char* property_json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx);
+
+/** @brief Queues a thng action, copying the arguments. */
+evrythng_return_t EvrythngPipelinePubThngAction(evrythng_pipeline_t pipeline,
+        const char* thng_id,
+        const char* action_name,
+        const char* action_json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx);
+
+/** @brief Queues a publish of a prepared QoS 1 property or action, the
+ *         packet is built from its cached header right away. The prepared
+ *         publish must be for the pipeline's handle or NULL.
+ */
+evrythng_return_t EvrythngPipelinePubPrepared(evrythng_pipeline_t pipeline,
+        const evrythng_prepared_t* prepared,
+        const char* json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx);
+
+/** @brief Sends the unacknowledged messages again, call it from the
+ *         connection restored callback.
+ */
+void EvrythngPipelineOnConnectionRestored(evrythng_pipeline_t pipeline);
+
+void EvrythngPipelineStats(evrythng_pipeline_t pipeline, evrythng_pipeline_stats_t* stats);
+
+#endif //_EVRYTHNG_PIPELINE_H_
@@ -0,0 +1,155 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_PLATFORM_EXT_H_)
+#define _EVRYTHNG_PLATFORM_EXT_H_
+
+#include <stdint.h>
+
+#include "evrythng/platform.h"
+#include "evrythng/keepalive.h"
+#include "evrythng/stream.h"
+
+/*
+ * Extensions to the platform API declared in evrythng/platform.h.
+ * Every platform port under lib/platform implements these in addition to
+ * the core platform functions.
+ */
+
+/* Milliseconds since the platform was started, wraps around after ~49 days. */
+uint32_t platform_uptime_ms(void);
+
+/* Microseconds since the platform was started for timing short intervals,
+ * wraps around after ~71 minutes. */
+uint32_t platform_uptime_us(void);
+
+/*
+ * Returns the number of milliseconds until the earliest armed SDK timer
+ * (keepalive, command timeouts, retransmits, ...) expires, 0 if one has
+ * already expired or -1 if no timer is armed.
+ *
+ * A timer is tracked from platform_timer_countdown() until it is seen
+ * expired, deinitialized or reported here as due, so timers abandoned while
+ * armed cause at most one early wake-up.
+ */
+int platform_timer_next_deadline(void);
+
+/*
+ * Sleeps until the next SDK timer deadline but no longer than max_ms
+ * (max_ms < 0 means no limit). With tickless idle enabled the MCU stays
+ * in low power mode for the whole period. Returns the time slept in ms.
+ */
+int platform_sleep_until_deadline(int max_ms);
+
+typedef struct WakeupStats
+{
+    uint32_t sleeps;        /* returns from platform_sleep* */
+    uint32_t read_timeouts; /* platform_network_read returned without data */
+    uint32_t reads;         /* platform_network_read returned data */
+    uint32_t period_ms;     /* time elapsed since the last reset */
+    uint32_t per_minute;    /* all of the above per minute of period_ms */
+} WakeupStats;
+
+/* Returns the wake-up counters collected since the last reset. */
+void platform_wakeup_stats(WakeupStats* stats);
+
+/* Resets the wake-up counters and starts a new measurement period. */
+void platform_wakeup_stats_reset(void);
+
+/*
+ * Round trip times of MQTT PINGREQ/PINGRESP exchanges measured by the
+ * network layer. Pass NULL to get the statistics of all connections.
+ */
+void platform_network_rtt_stats(const Network* n, RttStats* stats);
+
+/* Sets the range in which the longest safe keepalive interval is searched. */
+void platform_keepalive_configure(int min_s, int max_s, int step_s);
+
+/* Keepalive interval (in seconds) recommended for the next connection. */
+int platform_keepalive_interval(void);
+
+/* Returns the keepalive probe state (answered/lost pings, safe interval). */
+void platform_keepalive_probe(KeepaliveProbe* probe);
+
+/* Read timeout (in ms) derived from the measured round trip times. */
+int platform_read_timeout(int min_ms, int max_ms);
+
+/*
+ * Streams the payload of incoming PUBLISH packets with a remaining length
+ * above threshold bytes to callback instead of passing them to the MQTT
+ * client, see evrythng/stream.h. A threshold of 0 disables streaming.
+ * Configure it before connecting.
+ */
+void platform_stream_configure(size_t threshold, stream_callback* callback, void* ctx);
+
+/* Returns the counters of streamed messages. */
+void platform_stream_stats(StreamStats* stats);
+
+typedef struct TlsStats
+{
+    uint32_t configs;       /* TLS configurations allocated */
+    uint32_t connections;   /* connections using one of them */
+    uint32_t created;       /* configurations built (CA chain parsed) */
+    uint32_t reused;        /* connections set up with an existing one */
+    uint32_t max_frag_len;  /* max fragment length requested on the last
+                               connection, 0 if none */
+    uint32_t mfl_fallbacks; /* handshakes repeated without it */
+    uint32_t pinned;        /* connections accepted by the key pin */
+    uint32_t pin_failures;  /* connections refused by the key pin */
+} TlsStats;
+
+/*
+ * TLS configurations (parsed CA chain, settings and RNG) are shared by all
+ * connections using the same CA buffer and kept over reconnects, only the
+ * per connection TLS context is allocated on connect. Frees the
+ * configurations no connection uses at the moment, returns their number.
+ */
+int platform_tls_release_unused(void);
+
+/*
+ * Cipher suites and elliptic curves offered in TLS handshakes, most
+ * preferred first, as zero terminated lists of mbedtls ids (MBEDTLS_TLS_*
+ * and MBEDTLS_ECP_DP_*). The lists are used in place and have to stay
+ * valid, NULL selects the defaults of the port. Applies to TLS
+ * configurations created afterwards, so call it before connecting or
+ * after platform_tls_release_unused(). Returns 0 on success.
+ */
+int platform_tls_configure(const int* ciphersuites, const int* curves);
+
+/*
+ * Pins the server public key: connections no longer parse and verify the
+ * CA chain but compare the SHA-256 of the DER SubjectPublicKeyInfo of the
+ * server certificate with spki_sha256 (32 bytes) once the handshake
+ * proved the server holds the key. Refused if it doesn't match. For
+ * devices talking to a single endpoint, the pin has to be updated before
+ * the server key changes. NULL turns pinning off again. Returns 0 on
+ * success.
+ */
+int platform_tls_pin(const unsigned char* spki_sha256);
+
+/* Returns the counters of shared TLS configurations. */
+void platform_tls_stats(TlsStats* stats);
+
+/*
+ * Firmware partition written by the OTA update (evrythng/ota.h):
+ * begin prepares (erases) the passive partition for an image of size
+ * bytes, write stores data sequentially at offset and finish either
+ * makes the image boot next (commit != 0) or discards it.
+ * All return 0 on success.
+ */
+int platform_ota_begin(uint32_t size);
+int platform_ota_write(uint32_t offset, const void* data, size_t len);
+int platform_ota_finish(int commit);
+
+/*
+ * Fetches the current UNIX time in ms from the network time source.
+ * Blocks for a network round trip, returns 0 on success.
+ */
+int platform_time_fetch(int64_t* epoch_ms);
+
+/* Sets the system clock to the given UNIX time in ms. */
+void platform_time_set(int64_t epoch_ms);
+
+#endif //_EVRYTHNG_PLATFORM_EXT_H_
@@ -0,0 +1,88 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_PREPARED_H_)
+#define _EVRYTHNG_PREPARED_H_
+
+#include <stddef.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Prepared publish: everything that does not depend on the payload
+ * (thng id, property/action name, EVRYTHNG topic string and the MQTT
+ * PUBLISH fixed header byte with the length prefixed topic) is validated
+ * and built once, publishing then only deals with the payload.
+ *
+ * EvrythngPreparedPublish() copies the cached header and the payload into
+ * a packet and sends it through the outbox (evrythng/outbox.h), not the
+ * client's publish functions which build the topic and header again.
+ */
+
+/* max wait for the PUBACK of a QoS 1 prepared publish */
+#define EVRYTHNG_PREPARED_TIMEOUT_MS 10000
+
+/* packets up to that size are built on the stack */
+#define EVRYTHNG_PREPARED_STACK_PACKET 256
+
+typedef enum
+{
+    EVRYTHNG_PREPARED_THNG_PROPERTY,
+    EVRYTHNG_PREPARED_THNG_ACTION,
+} evrythng_prepared_type_t;
+
+typedef struct evrythng_prepared_t
+{
+    evrythng_handle_t handle;
+    evrythng_prepared_type_t type;
+    int qos;
+
+    /* all strings point into data */
+    const char* thng_id;
+    const char* name;
+    const char* topic;      /* thngs/<thng_id>/properties|actions/<name> */
+    size_t topic_len;
+
+    /* PUBLISH fixed header byte followed by the 2 bytes topic length and
+     * the topic itself, ready to be copied into a packet */
+    unsigned char* header;
+    size_t header_len;
+
+    unsigned char* data;
+} evrythng_prepared_t;
+
+/** @brief Prepares publishing to a thng property or action with QoS 0
+ *         or 1, QoS 2 is not supported (EVRYTHNG_BAD_ARGS). handle may
+ *         be NULL if the prepared publish is only used for serializing.
+ *         Otherwise the outbox is claimed for the handle until
+ *         EvrythngPreparedFree(), EVRYTHNG_BAD_ARGS if another handle
+ *         owns it (see evrythng/outbox.h).
+ */
+evrythng_return_t EvrythngPrepare(evrythng_prepared_t* p,
+        evrythng_handle_t handle,
+        evrythng_prepared_type_t type,
+        const char* thng_id,
+        const char* name,
+        int qos);
+
+void EvrythngPreparedFree(evrythng_prepared_t* p);
+
+/** @brief Publishes the JSON payload on the connection of the handle.
+ *         QoS 1 blocks until the PUBACK arrives, as the client's publish
+ *         functions do. Fails while the handle's connection is down or
+ *         is not the only MQTT connection up.
+ */
+evrythng_return_t EvrythngPreparedPublish(const evrythng_prepared_t* p, const char* json);
+
+/** @brief Serializes a complete MQTT PUBLISH packet from the cached header
+ *         for transports sending packets themselves (benchmarks, gateways).
+ *         Returns the packet length or a negative value if buf is too small.
+ */
+int EvrythngPreparedSerialize(const evrythng_prepared_t* p,
+        unsigned char* buf, int buflen,
+        unsigned short packet_id,
+        const unsigned char* payload, int payload_len);
+
+#endif //_EVRYTHNG_PREPARED_H_
@@ -0,0 +1,81 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_RECONNECT_H_)
+#define _EVRYTHNG_RECONNECT_H_
+
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+
+typedef struct evrythng_reconnect_policy_t
+{
+    int initial_ms; /* base delay of the exponential backoff */
+    int max_ms;     /* upper limit of the backoff delay */
+    int stable_ms;  /* a connection lasting that long resets the backoff */
+    int fast_retry; /* retry immediately once before backing off */
+} evrythng_reconnect_policy_t;
+
+#define EVRYTHNG_RECONNECT_POLICY_DEFAULT { 1000, 60000, 30000, 1 }
+
+typedef struct evrythng_reconnect_stats_t
+{
+    uint32_t attempts;      /* connection attempts made */
+    uint32_t reconnects;    /* successful connections */
+    uint32_t last_ttr_ms;   /* time to reconnect of the last outage */
+    uint32_t max_ttr_ms;
+    uint32_t total_ttr_ms;
+    uint32_t deferred;      /* platform connects refused during the backoff */
+} evrythng_reconnect_stats_t;
+
+typedef struct evrythng_reconnect_t
+{
+    evrythng_reconnect_policy_t policy;
+
+    int attempt;            /* attempts since the last stable connection */
+    int connected;
+    uint32_t connected_at;
+    uint32_t lost_at;
+
+    evrythng_reconnect_stats_t stats;
+} evrythng_reconnect_t;
+
+/** @brief Initializes the reconnect state, pass NULL as policy
+ *         to use EVRYTHNG_RECONNECT_POLICY_DEFAULT.
+ */
+void EvrythngReconnectInit(evrythng_reconnect_t* r, const evrythng_reconnect_policy_t* policy);
+
+/** @brief Returns the delay in ms before the next connection attempt:
+ *         0 for the fast retry, afterwards a random value between 0 and
+ *         min(max_ms, initial_ms * 2^n) ("full jitter").
+ */
+int EvrythngReconnectDelay(evrythng_reconnect_t* r);
+
+/** @brief Records a successful connection. */
+void EvrythngReconnectOnConnected(evrythng_reconnect_t* r);
+
+/** @brief Records the loss of the connection. The backoff starts over
+ *         if the connection was stable for policy.stable_ms.
+ */
+void EvrythngReconnectOnLost(evrythng_reconnect_t* r);
+
+/** @brief Connects the handle, backing off between failed attempts
+ *         according to the policy. max_attempts <= 0 retries forever.
+ */
+evrythng_return_t EvrythngReconnect(evrythng_handle_t handle, evrythng_reconnect_t* r, int max_attempts);
+
+/** @brief Paces every connection attempt of the platform with policy,
+ *         including the ones of the core reconnecting after a lost
+ *         connection, NULL stops that. Each connection (so each handle)
+ *         backs off on its own, see evrythng/connect_backoff.h. Attempts
+ *         falling into the backoff fail without blocking the caller for
+ *         longer than CONNECT_BACKOFF_MAX_WAIT_MS.
+ */
+void EvrythngReconnectPace(const evrythng_reconnect_policy_t* policy);
+
+/** @brief Statistics of the paced platform connects of all connections. */
+void EvrythngReconnectPaceStats(evrythng_reconnect_stats_t* stats);
+
+#endif //_EVRYTHNG_RECONNECT_H_
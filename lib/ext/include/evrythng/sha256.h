@@ -0,0 +1,37 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_SHA256_H_)
+#define _EVRYTHNG_SHA256_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * SHA-256 for firmware and certificate checks. Built on mbedtls (hardware
+ * accelerated on the MW300) when EVRYTHNG_USE_MBEDTLS_SHA256 is defined,
+ * as in the WMSDK build, with a portable implementation for other ports.
+ */
+
+#define EVRYTHNG_SHA256_SIZE 32
+
+#if defined(EVRYTHNG_USE_MBEDTLS_SHA256)
+#include <mbedtls/sha256.h>
+typedef mbedtls_sha256_context evrythng_sha256_t;
+#else
+typedef struct evrythng_sha256_t
+{
+    uint32_t state[8];
+    uint64_t length;
+    unsigned char block[64];
+    size_t block_len;
+} evrythng_sha256_t;
+#endif
+
+void EvrythngSha256Init(evrythng_sha256_t* ctx);
+void EvrythngSha256Update(evrythng_sha256_t* ctx, const void* data, size_t len);
+void EvrythngSha256Finish(evrythng_sha256_t* ctx, unsigned char digest[EVRYTHNG_SHA256_SIZE]);
+
+#endif //_EVRYTHNG_SHA256_H_
@@ -0,0 +1,78 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_SHADOW_H_)
+#define _EVRYTHNG_SHADOW_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+
+/*
+ * Local shadow of subscribed thng properties: the last received value and
+ * when it was received are kept per property and can be read at any time
+ * without a round trip to the cloud. Updates carrying the same value as
+ * the shadow don't reach the application callback.
+ *
+ * Subscription callbacks of the core carry no context, so each shadowed
+ * property is bound to one of EVRYTHNG_SHADOW_MAX_PROPERTIES fixed slots.
+ * The slot index returned on subscription gives O(1) access to the value.
+ */
+
+#define EVRYTHNG_SHADOW_MAX_PROPERTIES 8
+
+/* values shorter than that are kept in the slot, longer ones on the heap */
+#define EVRYTHNG_SHADOW_VALUE_SIZE 48
+
+/* Called with the received JSON when the value of the property changed. */
+typedef void evrythng_shadow_callback(void* ctx, const char* json, size_t len);
+
+typedef struct evrythng_shadow_stats_t
+{
+    uint32_t updates;       /* messages received */
+    uint32_t duplicates;    /* updates not delivered, value unchanged */
+    uint32_t parse_errors;  /* updates without a readable "value" */
+} evrythng_shadow_stats_t;
+
+/** @brief Initializes the shadow, call once before subscribing. */
+void EvrythngShadowInit(void);
+
+/** @brief Subscribes to a thng property through the shadow.
+ *  @param handle may be NULL if the updates are received by other means
+ *         and handed over with EvrythngShadowDispatch()
+ *  @param callback may be NULL for properties which are only read
+ *  @param slot receives the slot index used by EvrythngShadowGet()
+ *  @return EVRYTHNG_MEMORY_ERROR if all slots are taken
+ */
+evrythng_return_t EvrythngShadowSubThngProperty(evrythng_handle_t handle,
+        const char* thng_id,
+        const char* property_name,
+        evrythng_shadow_callback* callback,
+        void* ctx,
+        int* slot);
+
+/** @brief Hands an update to the slot, as received by its subscription. */
+void EvrythngShadowDispatch(int slot, const char* json, size_t len);
+
+/** @brief Looks up the slot of a shadowed property, -1 if not shadowed. */
+int EvrythngShadowFind(const char* thng_id, const char* property_name);
+
+/** @brief Copies the last value of the property as JSON text (for
+ *         example 42 or "on") into value.
+ *  @param value may be NULL to only get the length, long values need a
+ *         buffer larger than EVRYTHNG_SHADOW_VALUE_SIZE
+ *  @param received_ms if not NULL receives platform_uptime_ms() of the
+ *         last update
+ *  @return length of the value, -1 if there is none yet or it doesn't fit
+ */
+int EvrythngShadowGet(int slot, char* value, size_t size, uint32_t* received_ms);
+
+/** @brief The last value as an integer. Returns 0 on success. */
+int EvrythngShadowGetInt(int slot, int64_t* value);
+
+void EvrythngShadowStats(evrythng_shadow_stats_t* stats);
+
+#endif //_EVRYTHNG_SHADOW_H_
@@ -0,0 +1,90 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_STREAM_H_)
+#define _EVRYTHNG_STREAM_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Streaming receive: incoming PUBLISH packets whose remaining length
+ * exceeds the configured threshold are taken out of the byte stream
+ * before the MQTT client sees them and their payload is passed to a
+ * callback in chunks as it arrives. The client read buffer then only has
+ * to fit messages up to the threshold.
+ *
+ * Streamed QoS 1 messages are acknowledged by the platform. QoS 2
+ * messages always go to the client.
+ */
+
+/* bytes passed to the callback at once */
+#define STREAM_CHUNK_SIZE 128
+
+/* topics are truncated to that, including the terminating zero */
+#define STREAM_TOPIC_SIZE 96
+
+/* max wait for the next bytes of a message being streamed */
+#define STREAM_READ_TIMEOUT_MS 5000
+
+/** @brief Called for every chunk of a streamed payload, in order. offset
+ *         is the position of the chunk in the payload of total bytes, the
+ *         last chunk has offset + len == total. Called from the thread
+ *         reading the connection, with len 0 and offset < total if the
+ *         connection broke before the message was complete.
+ */
+typedef void stream_callback(void* ctx, const char* topic,
+        const unsigned char* chunk, size_t len, size_t offset, size_t total);
+
+typedef struct StreamStats
+{
+    uint32_t messages;      /* messages streamed completely */
+    uint32_t bytes;         /* payload bytes streamed */
+    uint32_t aborted;       /* messages cut by a broken connection */
+    uint32_t max_message;   /* largest streamed payload */
+} StreamStats;
+
+/* reads or writes exactly len bytes, as platform_network_read/write */
+typedef int stream_io(void* io, unsigned char* buffer, int len, int timeout_ms);
+
+/*
+ * Per connection filter sitting between the platform read function and
+ * the MQTT client. Embedded into the Network structure of every platform.
+ */
+typedef struct StreamFilter
+{
+    /* fixed header read ahead, handed to the client if not streamed */
+    unsigned char header[5];
+    int header_len;
+    int header_pos;
+    int header_complete;
+
+    /* bytes of the current packet body the client still has to read */
+    uint32_t body_remaining;
+
+    /* start of the body read ahead (packet id of acks) */
+    unsigned char ahead[2];
+    int ahead_len;
+    int ahead_pos;
+
+    char topic[STREAM_TOPIC_SIZE];
+    unsigned char chunk[STREAM_CHUNK_SIZE];
+} StreamFilter;
+
+void stream_filter_reset(StreamFilter* f);
+
+/* Returns 1 if the client is not in the middle of a packet. */
+int stream_filter_idle(const StreamFilter* f);
+
+/** @brief Replaces the platform read: returns what the raw read would
+ *         for all packets the client has to process, consumes the
+ *         streamed ones. Returns -1, as a read timeout, after a message
+ *         was streamed and 0 if the connection broke while streaming.
+ *         io is the connection given to the outbox for acks.
+ */
+int stream_filter_read(StreamFilter* f, stream_io* read, stream_io* write, void* io,
+        unsigned char* buffer, int len, int timeout_ms);
+
+#endif //_EVRYTHNG_STREAM_H_
@@ -0,0 +1,54 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_TIMESYNC_H_)
+#define _EVRYTHNG_TIMESYNC_H_
+
+#include <stdint.h>
+
+#include "evrythng/evrythng.h"
+
+/* Time synchronizations closer together than that are skipped on request */
+#define EVRYTHNG_TIMESYNC_MIN_INTERVAL_S 600
+
+/* Drift estimates beyond that are treated as measurement errors */
+#define EVRYTHNG_TIMESYNC_MAX_DRIFT_PPM 500
+
+typedef struct evrythng_timesync_stats_t
+{
+    uint32_t syncs;         /* successful synchronizations */
+    uint32_t failures;
+    int32_t drift_ppm;      /* estimated drift of the local clock */
+    int32_t last_offset_ms; /* correction applied by the last synchronization */
+    uint32_t last_sync_ms;  /* platform uptime of the last synchronization */
+} evrythng_timesync_stats_t;
+
+/** @brief Starts the background time synchronization thread.
+ *         The clock is synchronized right away and then every interval_s.
+ */
+evrythng_return_t EvrythngTimeSyncStart(int interval_s, int priority, int stack_size);
+
+/** @brief Asks for a synchronization without blocking, e.g. after the
+ *         network has reconnected. Ignored if the last synchronization is
+ *         more recent than EVRYTHNG_TIMESYNC_MIN_INTERVAL_S.
+ */
+void EvrythngTimeSyncRequest(void);
+
+/** @brief Waits until the time has been synchronized at least once.
+ *         Returns immediately once a valid time has ever been obtained.
+ */
+evrythng_return_t EvrythngTimeSyncWait(int timeout_ms);
+
+/** @brief Returns non zero if a valid time has ever been obtained. */
+int EvrythngTimeIsValid(void);
+
+/** @brief Current UNIX time in ms, corrected for the estimated drift
+ *         of the local clock since the last synchronization.
+ */
+int64_t EvrythngTimeNowMs(void);
+
+void EvrythngTimeSyncStats(evrythng_timesync_stats_t* stats);
+
+#endif //_EVRYTHNG_TIMESYNC_H_
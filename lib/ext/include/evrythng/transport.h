@@ -0,0 +1,83 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_EVRYTHNG_TRANSPORT_H_)
+#define _EVRYTHNG_TRANSPORT_H_
+
+#include <stddef.h>
+
+#include "evrythng/stream.h"
+
+/*
+ * Byte transport under a Network: plain TCP, TLS or an in-memory loopback
+ * pipe. platform_network_connect() selects it once, reads and writes then
+ * go through the table without checking the connection type.
+ *
+ * read and write behave as platform_network_read/write: read returns len
+ * bytes, -1 on timeout or 0 if the connection was closed, write returns
+ * the number of bytes written or a negative value.
+ */
+typedef struct Transport
+{
+    const char* name;
+    stream_io* read;
+    stream_io* write;
+    void (*close)(void* io);
+} Transport;
+
+
+/*
+ * Loopback: platform_network_connect() to a hostname with a listener
+ * registered by loopback_listen() doesn't touch the network but creates a
+ * pipe and hands its other end to the listener, e.g. a test broker. Lets
+ * tests and benchmarks run the SDK at memory speed.
+ */
+
+/* bytes buffered per direction */
+#define LOOPBACK_BUFFER_SIZE 4096
+
+#define LOOPBACK_MAX_LISTENERS 4
+
+typedef struct LoopbackEnd LoopbackEnd;
+
+/* Called from platform_network_connect() with the peer end of a new pipe. */
+typedef void loopback_accept(void* ctx, LoopbackEnd* peer);
+
+/* Called when data was written to an end or its peer closed, from the
+ * writing thread with the pipe locked: it must not use the pipe. */
+typedef void loopback_notify(void* ctx, LoopbackEnd* end);
+
+extern const Transport loopback_transport;
+
+/** @brief Accepts connections to hostname, replacing a listener of the
+ *         same name. Returns 0 on success.
+ */
+int loopback_listen(const char* hostname, loopback_accept* accept, void* ctx);
+
+void loopback_unlisten(const char* hostname);
+
+/** @brief Creates a pipe if hostname has a listener and returns the
+ *         connecting end, NULL otherwise.
+ */
+LoopbackEnd* loopback_connect(const char* hostname);
+
+/* the peer side uses the same functions as the transport */
+int loopback_read(void* end, unsigned char* buffer, int len, int timeout_ms);
+int loopback_write(void* end, unsigned char* buffer, int len, int timeout_ms);
+
+/** @brief Reads what is buffered, up to len bytes, without waiting.
+ *         Returns -1 once the peer closed and everything was read. Lets
+ *         a server serve many ends from one thread with loopback_notify.
+ */
+int loopback_read_some(LoopbackEnd* end, unsigned char* buffer, int len);
+
+void loopback_set_notify(LoopbackEnd* end, loopback_notify* notify, void* ctx);
+
+/** @brief Closes an end, the other one then reads 0. The pipe is freed
+ *         once both ends are closed.
+ */
+void loopback_close(void* end);
+
+#endif //_EVRYTHNG_TRANSPORT_H_
@@ -0,0 +1,467 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/capture.h"
+#include "evrythng/platform_ext.h"
+
+typedef struct cap_io_t
+{
+    const Transport* inner;
+    void* inner_io;
+    uint32_t generation;    /* of the capture it records to */
+    uint8_t connection;
+} cap_io_t;
+
+typedef struct replay_io_t
+{
+    size_t pos;             /* next record to look at */
+    size_t offset;          /* read from the data of the record at pos */
+    uint8_t connection;
+} replay_io_t;
+
+/* serializes records and guards the capture and replay state */
+static Mutex mutex;
+static int mutex_ready;
+
+static capture_sink* sink;
+static void* sink_ctx;
+static uint32_t generation;
+static uint32_t start_us;
+static capture_stats_t cstats;
+
+static const uint8_t* replay_data;
+static size_t replay_len;
+static size_t replay_next;      /* search position of the next CAPTURE_OPEN */
+static replay_stats_t rstats;
+
+
+static void lock(void)
+{
+    /* capture_start() or replay_start() runs before any connection */
+    if (!mutex_ready)
+    {
+        platform_mutex_init(&mutex);
+        mutex_ready = 1;
+    }
+    platform_mutex_lock(&mutex);
+}
+
+
+static void put32(uint8_t* p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+
+static uint32_t get32(const uint8_t* p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+
+int capture_parse(const uint8_t* data, size_t len, capture_record_t* record)
+{
+    if (len < CAPTURE_HEADER_SIZE)
+        return -1;
+
+    record->time_us = get32(data);
+    record->len = get32(data + 4);
+    record->type = data[8];
+    record->connection = data[9];
+
+    if (record->len > len - CAPTURE_HEADER_SIZE)
+        return -1;
+
+    return (int)(CAPTURE_HEADER_SIZE + record->len);
+}
+
+
+/* called with the lock held */
+static void record(const cap_io_t* c, capture_type_t type, const uint8_t* data, size_t len)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+
+    if (!sink || c->generation != generation)
+        return;
+
+    put32(header, platform_uptime_us() - start_us);
+    put32(header + 4, (uint32_t)len);
+    header[8] = (uint8_t)type;
+    header[9] = c->connection;
+    header[10] = header[11] = 0;
+
+    sink(sink_ctx, header, data, len);
+
+    cstats.records++;
+    cstats.bytes += len;
+}
+
+
+int capture_start(capture_sink* s, void* ctx)
+{
+    int rc = -1;
+
+    if (!s)
+        return -1;
+
+    lock();
+    if (!sink)
+    {
+        sink = s;
+        sink_ctx = ctx;
+        generation++;
+        start_us = platform_uptime_us();
+        memset(&cstats, 0, sizeof cstats);
+        rc = 0;
+    }
+    platform_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+
+void capture_stop(void)
+{
+    lock();
+    sink = 0;
+    sink_ctx = 0;
+    generation++;
+    platform_mutex_unlock(&mutex);
+}
+
+
+void capture_stats(capture_stats_t* stats)
+{
+    lock();
+    *stats = cstats;
+    platform_mutex_unlock(&mutex);
+}
+
+
+int capture_wrap(const Transport** transport, void** io)
+{
+    if (!sink)
+        return 0;
+
+    cap_io_t* c = (cap_io_t*)platform_malloc(sizeof(cap_io_t));
+    if (!c)
+    {
+        platform_printf("%s: failed to allocate\n", __func__);
+        (*transport)->close(*io);
+        *transport = 0;
+        *io = 0;
+        return -1;
+    }
+
+    c->inner = *transport;
+    c->inner_io = *io;
+
+    lock();
+    c->generation = generation;
+    c->connection = (uint8_t)cstats.connections++;
+    record(c, CAPTURE_OPEN, 0, 0);
+    platform_mutex_unlock(&mutex);
+
+    *transport = &capture_transport;
+    *io = c;
+
+    return 0;
+}
+
+
+static int capture_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    cap_io_t* c = (cap_io_t*)io;
+    int rc = c->inner->read(c->inner_io, buffer, len, timeout_ms);
+
+    lock();
+    if (rc > 0)
+        record(c, CAPTURE_READ, buffer, rc);
+    else
+        record(c, rc == 0 ? CAPTURE_CLOSED : CAPTURE_TIMEOUT, 0, 0);
+    platform_mutex_unlock(&mutex);
+
+    return rc;
+}
+
+
+static int capture_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    cap_io_t* c = (cap_io_t*)io;
+    int rc = c->inner->write(c->inner_io, buffer, len, timeout_ms);
+
+    if (rc > 0)
+    {
+        lock();
+        record(c, CAPTURE_WRITE, buffer, rc);
+        platform_mutex_unlock(&mutex);
+    }
+
+    return rc;
+}
+
+
+static void capture_close(void* io)
+{
+    cap_io_t* c = (cap_io_t*)io;
+
+    lock();
+    record(c, CAPTURE_CLOSE, 0, 0);
+    platform_mutex_unlock(&mutex);
+
+    c->inner->close(c->inner_io);
+    platform_free(c);
+}
+
+
+const Transport capture_transport = { "capture", capture_read, capture_write, capture_close };
+
+
+void capture_ring_init(capture_ring_t* ring, uint8_t* buf, size_t size)
+{
+    memset(ring, 0, sizeof(capture_ring_t));
+    ring->buf = buf;
+    ring->size = size;
+}
+
+
+static void ring_copy_out(const capture_ring_t* ring, size_t pos, uint8_t* out, size_t len)
+{
+    size_t first = ring->size - pos < len ? ring->size - pos : len;
+
+    memcpy(out, ring->buf + pos, first);
+    memcpy(out + first, ring->buf, len - first);
+}
+
+
+static void ring_copy_in(capture_ring_t* ring, const uint8_t* in, size_t len)
+{
+    size_t tail = (ring->head + ring->count) % ring->size;
+    size_t first = ring->size - tail < len ? ring->size - tail : len;
+
+    memcpy(ring->buf + tail, in, first);
+    memcpy(ring->buf, in + first, len - first);
+    ring->count += len;
+}
+
+
+void capture_ring_sink(void* ctx, const uint8_t* header, const uint8_t* data, size_t len)
+{
+    capture_ring_t* ring = (capture_ring_t*)ctx;
+    uint8_t oldest[CAPTURE_HEADER_SIZE];
+
+    if (CAPTURE_HEADER_SIZE + len > ring->size)
+    {
+        ring->dropped++;
+        return;
+    }
+
+    /* oldest records out, whole */
+    while (ring->size - ring->count < CAPTURE_HEADER_SIZE + len)
+    {
+        ring_copy_out(ring, ring->head, oldest, CAPTURE_HEADER_SIZE);
+        size_t size = CAPTURE_HEADER_SIZE + get32(oldest + 4);
+
+        ring->head = (ring->head + size) % ring->size;
+        ring->count -= size;
+        ring->dropped++;
+    }
+
+    ring_copy_in(ring, header, CAPTURE_HEADER_SIZE);
+    if (len)
+        ring_copy_in(ring, data, len);
+}
+
+
+size_t capture_ring_copy(const capture_ring_t* ring, uint8_t* out, size_t size)
+{
+    uint8_t header[CAPTURE_HEADER_SIZE];
+    size_t done = 0;
+
+    while (done < ring->count)
+    {
+        size_t pos = (ring->head + done) % ring->size;
+        ring_copy_out(ring, pos, header, CAPTURE_HEADER_SIZE);
+
+        size_t len = CAPTURE_HEADER_SIZE + get32(header + 4);
+        if (done + len > size)
+            break;
+
+        ring_copy_out(ring, pos, out + done, len);
+        done += len;
+    }
+
+    return done;
+}
+
+
+int replay_start(const uint8_t* capture, size_t len)
+{
+    capture_record_t r;
+    size_t pos = 0;
+
+    /* whole records only */
+    while (pos < len)
+    {
+        int size = capture_parse(capture + pos, len - pos, &r);
+        if (size < 0)
+            return -1;
+        pos += size;
+    }
+
+    lock();
+    replay_data = capture;
+    replay_len = len;
+    replay_next = 0;
+    memset(&rstats, 0, sizeof rstats);
+    platform_mutex_unlock(&mutex);
+
+    return 0;
+}
+
+
+void replay_stop(void)
+{
+    lock();
+    replay_data = 0;
+    replay_len = 0;
+    platform_mutex_unlock(&mutex);
+}
+
+
+void replay_stats(replay_stats_t* stats)
+{
+    lock();
+    *stats = rstats;
+    platform_mutex_unlock(&mutex);
+}
+
+
+void* replay_connect(void)
+{
+    capture_record_t r = { 0, 0, 0, 0 };
+    replay_io_t* io = 0;
+
+    /* the common case, no replay */
+    if (!replay_data)
+        return 0;
+
+    lock();
+    while (replay_data && replay_next < replay_len)
+    {
+        size_t pos = replay_next;
+        replay_next += capture_parse(replay_data + pos, replay_len - pos, &r);
+
+        if (r.type != CAPTURE_OPEN)
+            continue;
+
+        io = (replay_io_t*)platform_malloc(sizeof(replay_io_t));
+        if (io)
+        {
+            io->pos = replay_next;
+            io->offset = 0;
+            io->connection = r.connection;
+            rstats.connections++;
+        }
+        break;
+    }
+    platform_mutex_unlock(&mutex);
+
+    return io;
+}
+
+
+/* the next read, timeout or closed record of the connection, -1 at its end */
+static int replay_seek(replay_io_t* io, capture_record_t* r)
+{
+    while (io->pos < replay_len)
+    {
+        int size = capture_parse(replay_data + io->pos, replay_len - io->pos, r);
+        if (size < 0)
+            break;
+        if (r->connection == io->connection)
+        {
+            /* connection numbers wrap, a new one with the number ends it */
+            if (r->type == CAPTURE_OPEN)
+                break;
+            if (r->type == CAPTURE_READ || r->type == CAPTURE_TIMEOUT || r->type == CAPTURE_CLOSED)
+                return 0;
+        }
+        io->pos += size;
+        io->offset = 0;
+    }
+
+    return -1;
+}
+
+
+static int replay_read(void* p, unsigned char* buffer, int len, int timeout_ms)
+{
+    replay_io_t* io = (replay_io_t*)p;
+    capture_record_t r;
+    int bytes = 0, rc;
+    (void)timeout_ms;
+
+    lock();
+    while (bytes < len && replay_data && replay_seek(io, &r) == 0 && r.type != CAPTURE_CLOSED)
+    {
+        if (r.type == CAPTURE_TIMEOUT)
+        {
+            if (!bytes)
+            {
+                io->pos += CAPTURE_HEADER_SIZE;
+                rstats.timeouts++;
+                bytes = -1;
+            }
+            break;
+        }
+
+        size_t n = r.len - io->offset < (size_t)(len - bytes) ? r.len - io->offset : (size_t)(len - bytes);
+        memcpy(buffer + bytes, replay_data + io->pos + CAPTURE_HEADER_SIZE + io->offset, n);
+        bytes += n;
+        io->offset += n;
+        if (io->offset == r.len)
+        {
+            io->pos += CAPTURE_HEADER_SIZE + r.len;
+            io->offset = 0;
+        }
+    }
+
+    if (bytes > 0)
+        rstats.bytes_read += bytes;
+    rc = bytes;
+    platform_mutex_unlock(&mutex);
+
+    /* 0: the connection ended there */
+    return rc;
+}
+
+
+static int replay_write(void* p, unsigned char* buffer, int len, int timeout_ms)
+{
+    (void)p;
+    (void)buffer;
+    (void)timeout_ms;
+
+    lock();
+    rstats.bytes_written += len;
+    platform_mutex_unlock(&mutex);
+
+    return len;
+}
+
+
+static void replay_close(void* p)
+{
+    platform_free(p);
+}
+
+
+const Transport replay_transport = { "replay", replay_read, replay_write, replay_close };
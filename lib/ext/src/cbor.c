@@ -0,0 +1,482 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <math.h>
+#include <string.h>
+
+#include "evrythng/cbor.h"
+#include "evrythng/json_writer.h"
+
+#define MAJOR_UINT   0
+#define MAJOR_NINT   1
+#define MAJOR_BYTES  2
+#define MAJOR_TEXT   3
+#define MAJOR_ARRAY  4
+#define MAJOR_MAP    5
+#define MAJOR_TAG    6
+#define MAJOR_SIMPLE 7
+
+#define SIMPLE_FALSE     20
+#define SIMPLE_TRUE      21
+#define SIMPLE_NULL      22
+#define SIMPLE_UNDEFINED 23
+#define SIMPLE_HALF      25
+#define SIMPLE_FLOAT     26
+#define SIMPLE_DOUBLE    27
+
+
+static void put(evrythng_cbor_t* w, const void* data, size_t len)
+{
+    if (w->error)
+        return;
+
+    if (w->len + len > w->size)
+    {
+        w->error = 1;
+        return;
+    }
+
+    memcpy(w->buf + w->len, data, len);
+    w->len += len;
+}
+
+
+/* writes the initial byte with the shortest encoding of the argument */
+static void put_head(evrythng_cbor_t* w, int major, uint64_t arg)
+{
+    uint8_t head[9];
+    int n, i;
+
+    if (arg < 24)
+    {
+        head[0] = (uint8_t)(major << 5 | arg);
+        put(w, head, 1);
+        return;
+    }
+
+    if (arg <= 0xFF) { head[0] = major << 5 | 24; n = 1; }
+    else if (arg <= 0xFFFF) { head[0] = major << 5 | 25; n = 2; }
+    else if (arg <= 0xFFFFFFFFULL) { head[0] = major << 5 | 26; n = 4; }
+    else { head[0] = major << 5 | 27; n = 8; }
+
+    for (i = n; i > 0; i--, arg >>= 8)
+        head[i] = (uint8_t)arg;
+
+    put(w, head, n + 1);
+}
+
+
+void EvrythngCborInit(evrythng_cbor_t* w, uint8_t* buf, size_t size)
+{
+    memset(w, 0, sizeof(evrythng_cbor_t));
+    w->buf = buf;
+    w->size = size;
+    w->error = !buf;
+}
+
+
+void EvrythngCborMap(evrythng_cbor_t* w, size_t pairs)
+{
+    put_head(w, MAJOR_MAP, pairs);
+}
+
+
+void EvrythngCborArray(evrythng_cbor_t* w, size_t items)
+{
+    put_head(w, MAJOR_ARRAY, items);
+}
+
+
+void EvrythngCborInt(evrythng_cbor_t* w, int64_t value)
+{
+    if (value < 0)
+        put_head(w, MAJOR_NINT, (uint64_t)(-(value + 1)));
+    else
+        put_head(w, MAJOR_UINT, (uint64_t)value);
+}
+
+
+void EvrythngCborFloat(evrythng_cbor_t* w, double value)
+{
+    uint8_t out[9];
+    float f = (float)value;
+    int i;
+
+    /* NaN never compares equal, it is written as single precision too */
+    if ((double)f == value || value != value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &f, sizeof bits);
+
+        out[0] = MAJOR_SIMPLE << 5 | SIMPLE_FLOAT;
+        for (i = 4; i > 0; i--, bits >>= 8)
+            out[i] = (uint8_t)bits;
+        put(w, out, 5);
+        return;
+    }
+
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof bits);
+
+    out[0] = MAJOR_SIMPLE << 5 | SIMPLE_DOUBLE;
+    for (i = 8; i > 0; i--, bits >>= 8)
+        out[i] = (uint8_t)bits;
+    put(w, out, 9);
+}
+
+
+void EvrythngCborStringLen(evrythng_cbor_t* w, const char* value, size_t len)
+{
+    put_head(w, MAJOR_TEXT, len);
+    put(w, value, len);
+}
+
+
+void EvrythngCborString(evrythng_cbor_t* w, const char* value)
+{
+    if (!value)
+    {
+        EvrythngCborNull(w);
+        return;
+    }
+
+    EvrythngCborStringLen(w, value, strlen(value));
+}
+
+
+void EvrythngCborBool(evrythng_cbor_t* w, int value)
+{
+    put_head(w, MAJOR_SIMPLE, value ? SIMPLE_TRUE : SIMPLE_FALSE);
+}
+
+
+void EvrythngCborNull(evrythng_cbor_t* w)
+{
+    put_head(w, MAJOR_SIMPLE, SIMPLE_NULL);
+}
+
+
+int EvrythngCborFinish(evrythng_cbor_t* w)
+{
+    return w->error ? -1 : (int)w->len;
+}
+
+
+static void property_begin(evrythng_cbor_t* w, uint8_t* buf, size_t size)
+{
+    EvrythngCborInit(w, buf, size);
+    EvrythngCborArray(w, 1);
+    EvrythngCborMap(w, 1);
+    EvrythngCborStringLen(w, "value", 5);
+}
+
+
+int EvrythngCborPropertyInt(uint8_t* buf, size_t size, int64_t value)
+{
+    evrythng_cbor_t w;
+    property_begin(&w, buf, size);
+    EvrythngCborInt(&w, value);
+    return EvrythngCborFinish(&w);
+}
+
+
+int EvrythngCborPropertyFloat(uint8_t* buf, size_t size, double value)
+{
+    evrythng_cbor_t w;
+    property_begin(&w, buf, size);
+    EvrythngCborFloat(&w, value);
+    return EvrythngCborFinish(&w);
+}
+
+
+static double half_to_double(uint16_t h)
+{
+    int exp = (h >> 10) & 0x1F;
+    double mant = h & 0x3FF;
+    double v;
+
+    if (exp == 0)
+        v = mant / (1 << 24);
+    else if (exp != 31)
+    {
+        v = mant + 1024;
+        if (exp >= 25)
+            v *= (double)(1 << (exp - 25));
+        else
+            v /= (double)(1 << (25 - exp));
+    }
+    else
+        v = mant == 0 ? INFINITY : NAN;
+
+    return h & 0x8000 ? -v : v;
+}
+
+
+void EvrythngCborReaderInit(evrythng_cbor_reader_t* r, const uint8_t* data, size_t len)
+{
+    r->ptr = data;
+    r->end = data + len;
+}
+
+
+static int read_arg(evrythng_cbor_reader_t* r, int info, uint64_t* arg)
+{
+    int n, i;
+
+    if (info < 24)
+    {
+        *arg = info;
+        return 0;
+    }
+
+    switch (info)
+    {
+        case 24: n = 1; break;
+        case 25: n = 2; break;
+        case 26: n = 4; break;
+        case 27: n = 8; break;
+        /* reserved and indefinite lengths */
+        default: return -1;
+    }
+
+    if (r->end - r->ptr < n)
+        return -1;
+
+    *arg = 0;
+    for (i = 0; i < n; i++)
+        *arg = *arg << 8 | *r->ptr++;
+
+    return 0;
+}
+
+
+int EvrythngCborNext(evrythng_cbor_reader_t* r, evrythng_cbor_item_t* item)
+{
+    uint64_t arg;
+    int major, info;
+
+    do {
+        if (r->ptr >= r->end)
+            return -1;
+
+        major = *r->ptr >> 5;
+        info = *r->ptr & 0x1F;
+        r->ptr++;
+
+        if (major == MAJOR_SIMPLE && info >= SIMPLE_HALF)
+            break;
+
+        if (read_arg(r, info, &arg))
+            return -1;
+    } while (major == MAJOR_TAG);
+
+    switch (major)
+    {
+        case MAJOR_UINT:
+            if (arg > INT64_MAX)
+                return -1;
+            item->type = EVRYTHNG_CBOR_INT;
+            item->v.i = (int64_t)arg;
+            return 0;
+
+        case MAJOR_NINT:
+            if (arg > INT64_MAX)
+                return -1;
+            item->type = EVRYTHNG_CBOR_INT;
+            item->v.i = -(int64_t)arg - 1;
+            return 0;
+
+        case MAJOR_BYTES:
+        case MAJOR_TEXT:
+            if (arg > (uint64_t)(r->end - r->ptr))
+                return -1;
+            item->type = major == MAJOR_TEXT ? EVRYTHNG_CBOR_STRING : EVRYTHNG_CBOR_BYTES;
+            item->v.s.ptr = (const char*)r->ptr;
+            item->v.s.len = (size_t)arg;
+            r->ptr += arg;
+            return 0;
+
+        case MAJOR_ARRAY:
+        case MAJOR_MAP:
+            /* every item takes at least one byte, which bounds bogus counts */
+            if (arg > (uint64_t)(r->end - r->ptr))
+                return -1;
+            item->type = major == MAJOR_MAP ? EVRYTHNG_CBOR_MAP : EVRYTHNG_CBOR_ARRAY;
+            item->v.count = (size_t)arg;
+            return 0;
+    }
+
+    /* MAJOR_SIMPLE */
+    if (info >= SIMPLE_HALF)
+    {
+        if (read_arg(r, info, &arg))
+            return -1;
+
+        item->type = EVRYTHNG_CBOR_FLOAT;
+
+        if (info == SIMPLE_HALF)
+            item->v.f = half_to_double((uint16_t)arg);
+        else if (info == SIMPLE_FLOAT)
+        {
+            uint32_t bits = (uint32_t)arg;
+            float f;
+            memcpy(&f, &bits, sizeof f);
+            item->v.f = f;
+        }
+        else
+            memcpy(&item->v.f, &arg, sizeof item->v.f);
+
+        return 0;
+    }
+
+    switch (arg)
+    {
+        case SIMPLE_FALSE:
+        case SIMPLE_TRUE:
+            item->type = EVRYTHNG_CBOR_BOOL;
+            item->v.b = arg == SIMPLE_TRUE;
+            return 0;
+        case SIMPLE_NULL:
+        case SIMPLE_UNDEFINED:
+            item->type = EVRYTHNG_CBOR_NULL;
+            return 0;
+    }
+
+    return -1;
+}
+
+
+static int skip(evrythng_cbor_reader_t* r, const evrythng_cbor_item_t* item, int depth)
+{
+    evrythng_cbor_item_t child;
+    size_t n;
+
+    if (item->type != EVRYTHNG_CBOR_ARRAY && item->type != EVRYTHNG_CBOR_MAP)
+        return 0;
+
+    if (depth >= EVRYTHNG_CBOR_MAX_DEPTH)
+        return -1;
+
+    n = item->type == EVRYTHNG_CBOR_MAP ? item->v.count * 2 : item->v.count;
+    while (n--)
+    {
+        if (EvrythngCborNext(r, &child) || skip(r, &child, depth + 1))
+            return -1;
+    }
+
+    return 0;
+}
+
+
+int EvrythngCborSkip(evrythng_cbor_reader_t* r, const evrythng_cbor_item_t* item)
+{
+    return skip(r, item, 0);
+}
+
+
+int EvrythngCborMapFind(evrythng_cbor_reader_t* r, const evrythng_cbor_item_t* map,
+        const char* key, evrythng_cbor_item_t* item)
+{
+    size_t key_len = strlen(key);
+    size_t n;
+
+    if (map->type != EVRYTHNG_CBOR_MAP)
+        return -1;
+
+    for (n = map->v.count; n; n--)
+    {
+        evrythng_cbor_item_t k;
+
+        if (EvrythngCborNext(r, &k))
+            return -1;
+
+        if (k.type == EVRYTHNG_CBOR_STRING && k.v.s.len == key_len && !memcmp(k.v.s.ptr, key, key_len))
+            return EvrythngCborNext(r, item);
+
+        if (EvrythngCborSkip(r, &k) || EvrythngCborNext(r, item) || EvrythngCborSkip(r, item))
+            return -1;
+    }
+
+    return -1;
+}
+
+
+static int to_json(evrythng_cbor_reader_t* r, evrythng_json_t* w, int depth)
+{
+    evrythng_cbor_item_t item;
+    size_t n;
+
+    if (depth >= EVRYTHNG_CBOR_MAX_DEPTH || EvrythngCborNext(r, &item))
+        return -1;
+
+    switch (item.type)
+    {
+        case EVRYTHNG_CBOR_INT:
+            EvrythngJsonInt(w, item.v.i);
+            break;
+
+        case EVRYTHNG_CBOR_FLOAT:
+            EvrythngJsonNumber(w, item.v.f);
+            break;
+
+        case EVRYTHNG_CBOR_STRING:
+            EvrythngJsonStringLen(w, item.v.s.ptr, item.v.s.len);
+            break;
+
+        case EVRYTHNG_CBOR_BYTES:
+            return -1;
+
+        case EVRYTHNG_CBOR_ARRAY:
+            EvrythngJsonArrayBegin(w);
+            for (n = item.v.count; n; n--)
+                if (to_json(r, w, depth + 1))
+                    return -1;
+            EvrythngJsonArrayEnd(w);
+            break;
+
+        case EVRYTHNG_CBOR_MAP:
+            EvrythngJsonObjectBegin(w);
+            for (n = item.v.count; n; n--)
+            {
+                evrythng_cbor_item_t k;
+
+                /* JSON only has text keys */
+                if (EvrythngCborNext(r, &k) || k.type != EVRYTHNG_CBOR_STRING)
+                    return -1;
+
+                EvrythngJsonKeyLen(w, k.v.s.ptr, k.v.s.len);
+
+                if (to_json(r, w, depth + 1))
+                    return -1;
+            }
+            EvrythngJsonObjectEnd(w);
+            break;
+
+        case EVRYTHNG_CBOR_BOOL:
+            EvrythngJsonBool(w, item.v.b);
+            break;
+
+        case EVRYTHNG_CBOR_NULL:
+            EvrythngJsonNull(w);
+            break;
+    }
+
+    return w->error ? -1 : 0;
+}
+
+
+int EvrythngCborToJson(const uint8_t* cbor, size_t len, char* json, size_t size)
+{
+    evrythng_cbor_reader_t r;
+    evrythng_json_t w;
+
+    EvrythngCborReaderInit(&r, cbor, len);
+    EvrythngJsonInit(&w, json, size);
+
+    if (to_json(&r, &w, 0) || r.ptr != r.end || !EvrythngJsonFinish(&w))
+        return -1;
+
+    return (int)w.len;
+}
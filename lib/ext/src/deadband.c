@@ -0,0 +1,340 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/deadband.h"
+#include "evrythng/json_writer.h"
+#include "evrythng/platform_ext.h"
+
+#define DEADBAND_JSON_SIZE 64
+
+typedef enum
+{
+    ENTRY_FREE,
+    ENTRY_NUMBER,
+    ENTRY_JSON,
+} entry_kind_t;
+
+typedef struct entry_t
+{
+    /* 64 bit hash of "<thng_id>/<property>", keeps entries small */
+    uint64_t key;
+    entry_kind_t kind;
+    uint32_t published_ms;
+    union
+    {
+        double number;
+        struct
+        {
+            uint32_t hash;  /* rejects most changes without a memcmp */
+            size_t len;
+            char* bytes;    /* heap copy, a hash match alone is no proof */
+        } json;
+    } v;
+} entry_t;
+
+struct evrythng_deadband_ctx_t
+{
+    evrythng_deadband_config_t config;
+    Mutex mutex;
+    entry_t* entries;
+    evrythng_deadband_stats_t stats;
+};
+
+
+#define FNV64_OFFSET 0xcbf29ce484222325ULL
+#define FNV64_PRIME 0x100000001b3ULL
+
+static uint64_t fnv64(uint64_t h, const char* s)
+{
+    for (; *s; s++)
+        h = (h ^ (unsigned char)*s) * FNV64_PRIME;
+    return h;
+}
+
+
+static uint64_t make_key(const char* thng_id, const char* property_name)
+{
+    uint64_t h = fnv64(FNV64_OFFSET, thng_id);
+    h = (h ^ '/') * FNV64_PRIME;
+    return fnv64(h, property_name);
+}
+
+
+static uint32_t json_hash(const char* json)
+{
+    uint32_t h = 2166136261U;
+    for (; *json; json++)
+        h = (h ^ (unsigned char)*json) * 16777619U;
+    return h;
+}
+
+
+static void free_entry(entry_t* e)
+{
+    if (e->kind == ENTRY_JSON)
+        platform_free(e->v.json.bytes);
+    e->kind = ENTRY_FREE;
+}
+
+
+/* returns the entry of key, or the slot to take for it */
+static entry_t* lookup(evrythng_deadband_t d, uint64_t key, int* found)
+{
+    entry_t* victim = 0;
+    int i;
+
+    d->stats.lookups++;
+
+    for (i = 0; i < d->config.capacity; i++)
+    {
+        entry_t* e = &d->entries[i];
+
+        if (e->kind == ENTRY_FREE)
+        {
+            if (!victim || victim->kind != ENTRY_FREE)
+                victim = e;
+            continue;
+        }
+
+        if (e->key == key)
+        {
+            d->stats.hits++;
+            *found = 1;
+            return e;
+        }
+
+        /* least recently published, free slots preferred */
+        if (!victim || (victim->kind != ENTRY_FREE &&
+                    (int32_t)(e->published_ms - victim->published_ms) < 0))
+            victim = e;
+    }
+
+    if (victim->kind != ENTRY_FREE)
+        d->stats.evictions++;
+
+    *found = 0;
+    return victim;
+}
+
+
+static int check(evrythng_deadband_t d, const char* thng_id, const char* property_name,
+        entry_kind_t kind, double number, const char* json)
+{
+    uint32_t hash = 0;
+    size_t len = 0;
+
+    uint32_t now = platform_uptime_ms();
+    int found, publish = 1;
+
+    if (!d || !thng_id || !property_name)
+        return 1;
+
+    uint64_t key = make_key(thng_id, property_name);
+
+    if (kind == ENTRY_JSON)
+    {
+        hash = json_hash(json);
+        len = strlen(json);
+    }
+
+    platform_mutex_lock(&d->mutex);
+
+    entry_t* e = lookup(d, key, &found);
+
+    if (found && e->kind == kind)
+    {
+        int unchanged = kind == ENTRY_NUMBER ?
+            number - e->v.number <= d->config.deadband && e->v.number - number <= d->config.deadband :
+            hash == e->v.json.hash && len == e->v.json.len && !memcmp(json, e->v.json.bytes, len);
+
+        if (unchanged)
+        {
+            if (d->config.max_staleness_ms > 0 && now - e->published_ms >= (uint32_t)d->config.max_staleness_ms)
+                d->stats.heartbeats++;
+            else
+                publish = 0;
+        }
+    }
+
+    if (publish)
+    {
+        char* bytes = 0;
+
+        /* the previous copy is reused if the length matches */
+        if (kind == ENTRY_JSON)
+        {
+            if (e->kind == ENTRY_JSON && e->v.json.len == len)
+            {
+                bytes = e->v.json.bytes;
+                e->kind = ENTRY_FREE;
+            }
+            else
+                bytes = (char*)platform_malloc(len ? len : 1);
+        }
+
+        free_entry(e);
+
+        /* without memory for the copy the value is not cached and the next
+         * one is published whatever it is */
+        if (kind == ENTRY_NUMBER || bytes)
+        {
+            e->key = key;
+            e->kind = kind;
+            e->published_ms = now;
+            if (kind == ENTRY_NUMBER)
+                e->v.number = number;
+            else
+            {
+                memcpy(bytes, json, len);
+                e->v.json.hash = hash;
+                e->v.json.len = len;
+                e->v.json.bytes = bytes;
+            }
+        }
+
+        d->stats.published++;
+    }
+    else
+        d->stats.suppressed++;
+
+    platform_mutex_unlock(&d->mutex);
+
+    return publish;
+}
+
+
+evrythng_return_t EvrythngDeadbandCreate(evrythng_deadband_t* deadband,
+        const evrythng_deadband_config_t* config)
+{
+    if (!deadband || !config || config->capacity <= 0 ||
+            config->deadband < 0 || config->max_staleness_ms < 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    evrythng_deadband_t d = (evrythng_deadband_t)platform_malloc(sizeof(struct evrythng_deadband_ctx_t));
+    if (!d)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    memset(d, 0, sizeof(struct evrythng_deadband_ctx_t));
+    d->config = *config;
+
+    d->entries = (entry_t*)platform_malloc(config->capacity * sizeof(entry_t));
+    if (!d->entries)
+    {
+        platform_free(d);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+    memset(d->entries, 0, config->capacity * sizeof(entry_t));
+
+    platform_mutex_init(&d->mutex);
+
+    *deadband = d;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngDeadbandDestroy(evrythng_deadband_t d)
+{
+    int i;
+
+    if (!d) return;
+
+    for (i = 0; i < d->config.capacity; i++)
+        free_entry(&d->entries[i]);
+
+    platform_mutex_deinit(&d->mutex);
+    platform_free(d->entries);
+    platform_free(d);
+}
+
+
+int EvrythngDeadbandCheck(evrythng_deadband_t d,
+        const char* thng_id,
+        const char* property_name,
+        double value)
+{
+    /* NaN compares unequal to everything, never suppress it */
+    if (value != value)
+    {
+        EvrythngDeadbandForget(d, thng_id, property_name);
+        return 1;
+    }
+
+    return check(d, thng_id, property_name, ENTRY_NUMBER, value, 0);
+}
+
+
+int EvrythngDeadbandCheckJson(evrythng_deadband_t d,
+        const char* thng_id,
+        const char* property_name,
+        const char* property_json)
+{
+    if (!property_json)
+        return 1;
+
+    return check(d, thng_id, property_name, ENTRY_JSON, 0, property_json);
+}
+
+
+void EvrythngDeadbandForget(evrythng_deadband_t d,
+        const char* thng_id,
+        const char* property_name)
+{
+    int i;
+
+    if (!d || !thng_id || !property_name)
+        return;
+
+    uint64_t key = make_key(thng_id, property_name);
+
+    platform_mutex_lock(&d->mutex);
+    for (i = 0; i < d->config.capacity; i++)
+    {
+        if (d->entries[i].kind != ENTRY_FREE && d->entries[i].key == key)
+        {
+            free_entry(&d->entries[i]);
+            break;
+        }
+    }
+    platform_mutex_unlock(&d->mutex);
+}
+
+
+evrythng_return_t EvrythngDeadbandPubThngProperty(evrythng_deadband_t d,
+        evrythng_handle_t handle,
+        const char* thng_id,
+        const char* property_name,
+        double value,
+        int decimals)
+{
+    char json[DEADBAND_JSON_SIZE];
+
+    if (!d || !handle || !thng_id || !property_name)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (EvrythngJsonPropertyFloat(json, sizeof json, value, decimals) < 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (!EvrythngDeadbandCheck(d, thng_id, property_name, value))
+        return EVRYTHNG_SUCCESS;
+
+    evrythng_return_t rc = EvrythngPubThngProperty(handle, thng_id, property_name, json);
+    if (rc != EVRYTHNG_SUCCESS)
+        EvrythngDeadbandForget(d, thng_id, property_name);
+
+    return rc;
+}
+
+
+void EvrythngDeadbandStats(evrythng_deadband_t d, evrythng_deadband_stats_t* stats)
+{
+    if (!d || !stats) return;
+
+    platform_mutex_lock(&d->mutex);
+    *stats = d->stats;
+    platform_mutex_unlock(&d->mutex);
+}
@@ -0,0 +1,640 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/gateway.h"
+#include "evrythng/platform_ext.h"
+
+/* end of lists, records and slots are referenced by 16 bit index */
+#define NIL 0xFFFF
+
+typedef struct gw_thng_t
+{
+    char id[EVRYTHNG_GATEWAY_ID_SIZE];  /* not terminated */
+    uint32_t hash;
+    uint16_t next;          /* hash chain, or free list if unused */
+    uint16_t rr_next;       /* round-robin list of thngs with queued messages */
+    uint16_t queue_head;
+    uint16_t queue_tail;
+    uint8_t id_len;         /* 0 if unused */
+    uint8_t pending;        /* messages queued */
+    evrythng_gateway_action_callback* callback;
+    void* ctx;
+} gw_thng_t;
+
+typedef struct gw_msg_t
+{
+    uint16_t next;          /* queue of the thng, or free list */
+    uint16_t thng;
+    uint8_t type;
+    uint8_t name_len;
+    char data[];            /* "<name>\0<json>\0" */
+} gw_msg_t;
+
+struct evrythng_gateway_ctx_t
+{
+    evrythng_gateway_config_t config;
+    evrythng_handle_t handle;
+    Mutex mutex;
+
+    gw_thng_t* thngs;
+    uint16_t* buckets;
+    uint32_t bucket_mask;
+    uint16_t free_thng;
+
+    unsigned char* msgs;
+    size_t msg_size;
+    uint16_t free_msg;
+    uint32_t queued;
+
+    uint16_t rr_head;
+    uint16_t rr_tail;
+
+    evrythng_gateway_stats_t stats;
+};
+
+static evrythng_gateway_t subscribed_gateway;
+
+
+static uint32_t id_hash(const char* id, size_t len)
+{
+    uint32_t h = 2166136261U;
+    while (len--)
+        h = (h ^ (unsigned char)*id++) * 16777619U;
+    return h;
+}
+
+
+static gw_msg_t* msg_at(evrythng_gateway_t gw, uint16_t i)
+{
+    return (gw_msg_t*)(gw->msgs + i * gw->msg_size);
+}
+
+
+/* returns the index of the thng or NIL, prev gets its predecessor in the chain */
+static uint16_t find(evrythng_gateway_t gw, const char* id, size_t len, uint32_t hash, uint16_t* prev)
+{
+    uint16_t i, p = NIL;
+
+    for (i = gw->buckets[hash & gw->bucket_mask]; i != NIL; p = i, i = gw->thngs[i].next)
+    {
+        const gw_thng_t* t = &gw->thngs[i];
+        if (t->hash == hash && t->id_len == len && !memcmp(t->id, id, len))
+            break;
+    }
+
+    if (prev)
+        *prev = p;
+
+    return i;
+}
+
+
+static void rr_append(evrythng_gateway_t gw, uint16_t i)
+{
+    gw->thngs[i].rr_next = NIL;
+    if (gw->rr_tail == NIL)
+        gw->rr_head = i;
+    else
+        gw->thngs[gw->rr_tail].rr_next = i;
+    gw->rr_tail = i;
+}
+
+
+static void rr_remove(evrythng_gateway_t gw, uint16_t i)
+{
+    uint16_t j, p = NIL;
+
+    for (j = gw->rr_head; j != NIL && j != i; p = j, j = gw->thngs[j].rr_next)
+        ;
+    if (j == NIL)
+        return;
+
+    if (p == NIL)
+        gw->rr_head = gw->thngs[i].rr_next;
+    else
+        gw->thngs[p].rr_next = gw->thngs[i].rr_next;
+    if (gw->rr_tail == i)
+        gw->rr_tail = p;
+}
+
+
+static void free_msg(evrythng_gateway_t gw, uint16_t m)
+{
+    msg_at(gw, m)->next = gw->free_msg;
+    gw->free_msg = m;
+    gw->queued--;
+}
+
+
+static evrythng_return_t default_send(void* ctx, const char* thng_id,
+        evrythng_gateway_msg_t type, const char* name, const char* json)
+{
+    evrythng_handle_t handle = (evrythng_handle_t)ctx;
+
+    if (type == EVRYTHNG_GATEWAY_PROPERTY)
+        return EvrythngPubThngProperty(handle, thng_id, name, json);
+
+    return EvrythngPubThngAction(handle, thng_id, name, json);
+}
+
+
+evrythng_return_t EvrythngGatewayCreate(evrythng_gateway_t* gateway,
+        evrythng_handle_t handle,
+        const evrythng_gateway_config_t* config)
+{
+    int i;
+
+    if (!gateway || !config ||
+            config->max_thngs < 1 || config->max_thngs >= NIL ||
+            config->queue_size < 1 || config->queue_size >= NIL ||
+            config->max_pending < 1 || config->max_pending > 255 ||
+            config->payload_size < 1 || (!handle && !config->send))
+        return EVRYTHNG_BAD_ARGS;
+
+    evrythng_gateway_t gw = (evrythng_gateway_t)platform_malloc(sizeof(struct evrythng_gateway_ctx_t));
+    if (!gw)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    memset(gw, 0, sizeof(struct evrythng_gateway_ctx_t));
+    gw->config = *config;
+    gw->handle = handle;
+    if (!gw->config.send)
+    {
+        gw->config.send = default_send;
+        gw->config.send_ctx = handle;
+    }
+
+    /* load factor up to 1 */
+    uint32_t buckets = 1;
+    while (buckets < (uint32_t)config->max_thngs)
+        buckets <<= 1;
+    gw->bucket_mask = buckets - 1;
+
+    /* both terminating zeros, slots aligned for the 16 bit members */
+    gw->msg_size = (sizeof(gw_msg_t) + config->payload_size + 2 + 3) & ~(size_t)3;
+
+    size_t thngs_size = config->max_thngs * sizeof(gw_thng_t);
+    size_t buckets_size = buckets * sizeof(uint16_t);
+    size_t msgs_size = config->queue_size * gw->msg_size;
+
+    gw->thngs = (gw_thng_t*)platform_malloc(thngs_size);
+    gw->buckets = (uint16_t*)platform_malloc(buckets_size);
+    gw->msgs = (unsigned char*)platform_malloc(msgs_size);
+    if (!gw->thngs || !gw->buckets || !gw->msgs)
+    {
+        platform_free(gw->thngs);
+        platform_free(gw->buckets);
+        platform_free(gw->msgs);
+        platform_free(gw);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    memset(gw->thngs, 0, thngs_size);
+    for (i = 0; i < config->max_thngs; i++)
+        gw->thngs[i].next = i + 1 < config->max_thngs ? i + 1 : NIL;
+    gw->free_thng = 0;
+
+    memset(gw->buckets, 0xFF, buckets_size);
+
+    for (i = 0; i < config->queue_size; i++)
+        msg_at(gw, i)->next = i + 1 < config->queue_size ? i + 1 : NIL;
+    gw->free_msg = 0;
+
+    gw->rr_head = gw->rr_tail = NIL;
+    gw->stats.registry_bytes = sizeof(struct evrythng_gateway_ctx_t) + thngs_size + buckets_size;
+    gw->stats.queue_bytes = msgs_size;
+
+    platform_mutex_init(&gw->mutex);
+
+    *gateway = gw;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngGatewayDestroy(evrythng_gateway_t gw)
+{
+    if (!gw) return;
+
+    if (subscribed_gateway == gw)
+        subscribed_gateway = 0;
+
+    platform_mutex_deinit(&gw->mutex);
+    platform_free(gw->thngs);
+    platform_free(gw->buckets);
+    platform_free(gw->msgs);
+    platform_free(gw);
+}
+
+
+evrythng_return_t EvrythngGatewayAddThng(evrythng_gateway_t gw,
+        const char* thng_id,
+        evrythng_gateway_action_callback* callback,
+        void* ctx)
+{
+    if (!gw || !thng_id)
+        return EVRYTHNG_BAD_ARGS;
+
+    size_t len = strlen(thng_id);
+    if (!len || len > EVRYTHNG_GATEWAY_ID_SIZE)
+        return EVRYTHNG_BAD_ARGS;
+
+    uint32_t hash = id_hash(thng_id, len);
+
+    platform_mutex_lock(&gw->mutex);
+
+    if (find(gw, thng_id, len, hash, 0) != NIL)
+    {
+        platform_mutex_unlock(&gw->mutex);
+        return EVRYTHNG_BAD_ARGS;
+    }
+
+    uint16_t i = gw->free_thng;
+    if (i == NIL)
+    {
+        platform_mutex_unlock(&gw->mutex);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    gw_thng_t* t = &gw->thngs[i];
+    gw->free_thng = t->next;
+
+    memcpy(t->id, thng_id, len);
+    t->id_len = (uint8_t)len;
+    t->hash = hash;
+    t->pending = 0;
+    t->queue_head = t->queue_tail = NIL;
+    t->rr_next = NIL;
+    t->callback = callback;
+    t->ctx = ctx;
+
+    t->next = gw->buckets[hash & gw->bucket_mask];
+    gw->buckets[hash & gw->bucket_mask] = i;
+
+    gw->stats.thngs++;
+
+    platform_mutex_unlock(&gw->mutex);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+evrythng_return_t EvrythngGatewayRemoveThng(evrythng_gateway_t gw, const char* thng_id)
+{
+    uint16_t prev;
+
+    if (!gw || !thng_id)
+        return EVRYTHNG_BAD_ARGS;
+
+    size_t len = strlen(thng_id);
+    uint32_t hash = id_hash(thng_id, len);
+
+    platform_mutex_lock(&gw->mutex);
+
+    uint16_t i = find(gw, thng_id, len, hash, &prev);
+    if (i == NIL)
+    {
+        platform_mutex_unlock(&gw->mutex);
+        return EVRYTHNG_BAD_ARGS;
+    }
+
+    gw_thng_t* t = &gw->thngs[i];
+
+    if (prev == NIL)
+        gw->buckets[hash & gw->bucket_mask] = t->next;
+    else
+        gw->thngs[prev].next = t->next;
+
+    if (t->pending)
+    {
+        rr_remove(gw, i);
+        while (t->queue_head != NIL)
+        {
+            uint16_t m = t->queue_head;
+            t->queue_head = msg_at(gw, m)->next;
+            free_msg(gw, m);
+        }
+    }
+
+    t->id_len = 0;
+    t->pending = 0;
+    t->next = gw->free_thng;
+    gw->free_thng = i;
+
+    gw->stats.thngs--;
+
+    platform_mutex_unlock(&gw->mutex);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static evrythng_return_t publish(evrythng_gateway_t gw, evrythng_gateway_msg_t type,
+        const char* thng_id, const char* name, const char* json)
+{
+    if (!gw || !thng_id || !name || !json)
+        return EVRYTHNG_BAD_ARGS;
+
+    size_t id_len = strlen(thng_id);
+    size_t name_len = strlen(name);
+    size_t json_len = strlen(json);
+
+    if (!name_len || name_len > 255 || name_len + json_len > (size_t)gw->config.payload_size)
+        return EVRYTHNG_BAD_ARGS;
+
+    uint32_t hash = id_hash(thng_id, id_len);
+
+    platform_mutex_lock(&gw->mutex);
+
+    uint16_t i = find(gw, thng_id, id_len, hash, 0);
+    if (i == NIL)
+    {
+        platform_mutex_unlock(&gw->mutex);
+        return EVRYTHNG_BAD_ARGS;
+    }
+
+    gw_thng_t* t = &gw->thngs[i];
+
+    if (t->pending >= gw->config.max_pending || gw->free_msg == NIL)
+    {
+        gw->stats.rejected++;
+        platform_mutex_unlock(&gw->mutex);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    uint16_t m = gw->free_msg;
+    gw_msg_t* msg = msg_at(gw, m);
+    gw->free_msg = msg->next;
+
+    msg->next = NIL;
+    msg->thng = i;
+    msg->type = (uint8_t)type;
+    msg->name_len = (uint8_t)name_len;
+    memcpy(msg->data, name, name_len + 1);
+    memcpy(msg->data + name_len + 1, json, json_len + 1);
+
+    if (t->queue_tail == NIL)
+        t->queue_head = m;
+    else
+        msg_at(gw, t->queue_tail)->next = m;
+    t->queue_tail = m;
+
+    if (!t->pending++)
+        rr_append(gw, i);
+
+    gw->stats.queued++;
+    if (++gw->queued > gw->stats.max_queued)
+        gw->stats.max_queued = gw->queued;
+
+    platform_mutex_unlock(&gw->mutex);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+evrythng_return_t EvrythngGatewayPubThngProperty(evrythng_gateway_t gw,
+        const char* thng_id,
+        const char* property_name,
+        const char* property_json)
+{
+    return publish(gw, EVRYTHNG_GATEWAY_PROPERTY, thng_id, property_name, property_json);
+}
+
+
+evrythng_return_t EvrythngGatewayPubThngAction(evrythng_gateway_t gw,
+        const char* thng_id,
+        const char* action_name,
+        const char* action_json)
+{
+    return publish(gw, EVRYTHNG_GATEWAY_ACTION, thng_id, action_name, action_json);
+}
+
+
+int EvrythngGatewaySend(evrythng_gateway_t gw, int max_messages)
+{
+    char id[EVRYTHNG_GATEWAY_ID_SIZE + 1];
+    int sent = 0;
+
+    if (!gw)
+        return 0;
+
+    while (sent < max_messages)
+    {
+        platform_mutex_lock(&gw->mutex);
+
+        uint16_t i = gw->rr_head;
+        if (i == NIL)
+        {
+            platform_mutex_unlock(&gw->mutex);
+            break;
+        }
+
+        /* the thng goes to the end of the round */
+        gw_thng_t* t = &gw->thngs[i];
+        gw->rr_head = t->rr_next;
+        if (gw->rr_head == NIL)
+            gw->rr_tail = NIL;
+
+        uint16_t m = t->queue_head;
+        gw_msg_t* msg = msg_at(gw, m);
+        t->queue_head = msg->next;
+        if (t->queue_head == NIL)
+            t->queue_tail = NIL;
+        if (--t->pending)
+            rr_append(gw, i);
+
+        size_t id_len = t->id_len;
+        memcpy(id, t->id, id_len);
+        id[id_len] = '\0';
+
+        platform_mutex_unlock(&gw->mutex);
+
+        /* the slot is owned by this call until the send returns */
+        evrythng_return_t rc = (*gw->config.send)(gw->config.send_ctx, id,
+                (evrythng_gateway_msg_t)msg->type, msg->data, msg->data + msg->name_len + 1);
+
+        platform_mutex_lock(&gw->mutex);
+
+        if (rc == EVRYTHNG_SUCCESS)
+        {
+            gw->stats.sent++;
+            free_msg(gw, m);
+            platform_mutex_unlock(&gw->mutex);
+            sent++;
+            continue;
+        }
+
+        gw->stats.failed++;
+
+        /* back to the front of its queue, unless the thng was removed meanwhile */
+        if (t->id_len == id_len && !memcmp(t->id, id, id_len))
+        {
+            msg->next = t->queue_head;
+            t->queue_head = m;
+            if (t->queue_tail == NIL)
+                t->queue_tail = m;
+            if (!t->pending++)
+                rr_append(gw, i);
+        }
+        else
+            free_msg(gw, m);
+
+        platform_mutex_unlock(&gw->mutex);
+        break;
+    }
+
+    return sent;
+}
+
+
+static const char* skip_ws(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+
+/* p points to the opening quote, returns the position after the closing one */
+static const char* skip_string(const char* p, const char* end)
+{
+    for (p++; p < end; p++)
+    {
+        if (*p == '\\')
+            p++;
+        else if (*p == '"')
+            return p + 1;
+    }
+    return 0;
+}
+
+
+/* finds the string value of the "thng" member of the outermost object */
+static int find_thng(const char* json, size_t len, const char** id, size_t* id_len)
+{
+    const char* p = json;
+    const char* end = json + len;
+    int depth = 0, object_depth = 0;
+
+    while (p < end)
+    {
+        if (*p == '{' || *p == '[')
+        {
+            depth++;
+            if (*p == '{' && !object_depth)
+                object_depth = depth;
+            p++;
+            continue;
+        }
+
+        if (*p == '}' || *p == ']')
+        {
+            depth--;
+            p++;
+            continue;
+        }
+
+        if (*p != '"')
+        {
+            p++;
+            continue;
+        }
+
+        const char* key = p + 1;
+        if (!(p = skip_string(p, end)))
+            return -1;
+        if (depth != object_depth || p - 1 - key != 4 || memcmp(key, "thng", 4))
+            continue;
+
+        p = skip_ws(p, end);
+        if (p >= end || *p != ':')
+            continue;
+        p = skip_ws(p + 1, end);
+        if (p >= end || *p != '"')
+            return -1;
+
+        const char* v = p + 1;
+        if (!(p = skip_string(p, end)))
+            return -1;
+
+        *id = v;
+        *id_len = p - 1 - v;
+        return 0;
+    }
+
+    return -1;
+}
+
+
+void EvrythngGatewayDispatch(evrythng_gateway_t gw, const char* json, size_t len)
+{
+    char id[EVRYTHNG_GATEWAY_ID_SIZE + 1];
+    const char* thng_id;
+    size_t id_len;
+
+    if (!gw || !json)
+        return;
+
+    if (find_thng(json, len, &thng_id, &id_len) || !id_len || id_len > EVRYTHNG_GATEWAY_ID_SIZE)
+    {
+        platform_mutex_lock(&gw->mutex);
+        gw->stats.unrouted++;
+        platform_mutex_unlock(&gw->mutex);
+        return;
+    }
+
+    uint32_t hash = id_hash(thng_id, id_len);
+
+    platform_mutex_lock(&gw->mutex);
+
+    uint16_t i = find(gw, thng_id, id_len, hash, 0);
+    if (i == NIL || !gw->thngs[i].callback)
+    {
+        gw->stats.unrouted++;
+        platform_mutex_unlock(&gw->mutex);
+        return;
+    }
+
+    evrythng_gateway_action_callback* callback = gw->thngs[i].callback;
+    void* ctx = gw->thngs[i].ctx;
+    gw->stats.routed++;
+
+    platform_mutex_unlock(&gw->mutex);
+
+    memcpy(id, thng_id, id_len);
+    id[id_len] = '\0';
+
+    (*callback)(ctx, id, json, len);
+}
+
+
+static void gateway_sub_callback(const char* json, size_t len)
+{
+    if (subscribed_gateway)
+        EvrythngGatewayDispatch(subscribed_gateway, json, len);
+}
+
+
+evrythng_return_t EvrythngGatewaySubscribe(evrythng_gateway_t gw, int qos)
+{
+    if (!gw || !gw->handle)
+        return EVRYTHNG_BAD_ARGS;
+
+    subscribed_gateway = gw;
+
+    return EvrythngSubActions(gw->handle, qos, gateway_sub_callback);
+}
+
+
+void EvrythngGatewayStats(evrythng_gateway_t gw, evrythng_gateway_stats_t* s)
+{
+    if (!gw || !s) return;
+
+    platform_mutex_lock(&gw->mutex);
+    *s = gw->stats;
+    platform_mutex_unlock(&gw->mutex);
+}
@@ -0,0 +1,438 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "evrythng/json_writer.h"
+
+static const uint64_t pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL,
+    1000000ULL, 10000000ULL, 100000000ULL, 1000000000ULL,
+};
+
+
+static void put(evrythng_json_t* w, const char* s, size_t len)
+{
+    if (w->error)
+        return;
+
+    /* one byte is always kept for the terminating zero */
+    if (w->len + len >= w->size)
+    {
+        w->error = 1;
+        return;
+    }
+
+    memcpy(w->buf + w->len, s, len);
+    w->len += len;
+}
+
+
+static void putc_(evrythng_json_t* w, char c)
+{
+    if (w->error)
+        return;
+
+    if (w->len + 1 >= w->size)
+    {
+        w->error = 1;
+        return;
+    }
+
+    w->buf[w->len++] = c;
+}
+
+
+/* writes the separator in front of a new value */
+static void value_begin(evrythng_json_t* w)
+{
+    if (w->after_key)
+    {
+        w->after_key = 0;
+        return;
+    }
+
+    if (w->depth > 0 && w->depth <= EVRYTHNG_JSON_MAX_DEPTH)
+    {
+        if (w->has_items[w->depth - 1])
+            putc_(w, ',');
+        w->has_items[w->depth - 1] = 1;
+    }
+}
+
+
+static void container_begin(evrythng_json_t* w, char c)
+{
+    value_begin(w);
+
+    if (w->depth >= EVRYTHNG_JSON_MAX_DEPTH)
+    {
+        w->error = 1;
+        return;
+    }
+
+    putc_(w, c);
+    w->has_items[w->depth++] = 0;
+}
+
+
+static void container_end(evrythng_json_t* w, char c)
+{
+    if (w->depth <= 0 || w->after_key)
+    {
+        w->error = 1;
+        return;
+    }
+
+    w->depth--;
+    putc_(w, c);
+}
+
+
+/* writes the escape sequence of c into out, returns its length */
+static size_t escape(unsigned char c, char* out)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    out[0] = '\\';
+    switch (c)
+    {
+        case '"': out[1] = '"'; return 2;
+        case '\\': out[1] = '\\'; return 2;
+        case '\n': out[1] = 'n'; return 2;
+        case '\r': out[1] = 'r'; return 2;
+        case '\t': out[1] = 't'; return 2;
+        case '\b': out[1] = 'b'; return 2;
+        case '\f': out[1] = 'f'; return 2;
+    }
+
+    out[1] = 'u'; out[2] = '0'; out[3] = '0';
+    out[4] = hex[c >> 4]; out[5] = hex[c & 15];
+    return 6;
+}
+
+
+#define NEEDS_ESCAPE(c) ((c) < 0x20 || (c) == '"' || (c) == '\\')
+
+static void put_escaped(evrythng_json_t* w, const char* s, size_t len)
+{
+    const char* end = s + len;
+
+    if (w->error)
+        return;
+
+    /* room even if every character expands to \u00XX: copy directly */
+    if (len <= (w->size - w->len) / 6 && w->len + len * 6 + 2 < w->size)
+    {
+        char* d = w->buf + w->len;
+
+        *d++ = '"';
+        for (; s < end; s++)
+        {
+            unsigned char c = (unsigned char)*s;
+            if (NEEDS_ESCAPE(c))
+                d += escape(c, d);
+            else
+                *d++ = (char)c;
+        }
+        *d++ = '"';
+
+        w->len = d - w->buf;
+        return;
+    }
+
+    const char* run = s;
+
+    putc_(w, '"');
+
+    for (; s < end; s++)
+    {
+        unsigned char c = (unsigned char)*s;
+        char esc[6];
+
+        if (!NEEDS_ESCAPE(c))
+            continue;
+
+        /* flush the run of characters which don't need escaping */
+        put(w, run, s - run);
+        run = s + 1;
+
+        put(w, esc, escape(c, esc));
+    }
+
+    put(w, run, s - run);
+    putc_(w, '"');
+}
+
+
+static void put_uint(evrythng_json_t* w, uint64_t v, int min_digits)
+{
+    char tmp[20];
+    int i = sizeof tmp;
+
+    do {
+        tmp[--i] = '0' + (char)(v % 10);
+        v /= 10;
+    } while (v || (int)sizeof tmp - i < min_digits);
+
+    put(w, tmp + i, sizeof tmp - i);
+}
+
+
+void EvrythngJsonInit(evrythng_json_t* w, char* buf, size_t size)
+{
+    memset(w, 0, sizeof(evrythng_json_t));
+    w->buf = buf;
+    w->size = size;
+    w->error = !buf || !size;
+}
+
+
+void EvrythngJsonObjectBegin(evrythng_json_t* w) { container_begin(w, '{'); }
+void EvrythngJsonObjectEnd(evrythng_json_t* w) { container_end(w, '}'); }
+void EvrythngJsonArrayBegin(evrythng_json_t* w) { container_begin(w, '['); }
+void EvrythngJsonArrayEnd(evrythng_json_t* w) { container_end(w, ']'); }
+
+
+void EvrythngJsonKeyLen(evrythng_json_t* w, const char* key, size_t len)
+{
+    if (!key || w->after_key)
+    {
+        w->error = 1;
+        return;
+    }
+
+    value_begin(w);
+    put_escaped(w, key, len);
+    putc_(w, ':');
+    w->after_key = 1;
+}
+
+
+void EvrythngJsonKey(evrythng_json_t* w, const char* key)
+{
+    EvrythngJsonKeyLen(w, key, key ? strlen(key) : 0);
+}
+
+
+void EvrythngJsonStringLen(evrythng_json_t* w, const char* value, size_t len)
+{
+    if (!value)
+    {
+        EvrythngJsonNull(w);
+        return;
+    }
+
+    value_begin(w);
+    put_escaped(w, value, len);
+}
+
+
+void EvrythngJsonString(evrythng_json_t* w, const char* value)
+{
+    EvrythngJsonStringLen(w, value, value ? strlen(value) : 0);
+}
+
+
+void EvrythngJsonInt(evrythng_json_t* w, int64_t value)
+{
+    value_begin(w);
+
+    if (value < 0)
+    {
+        putc_(w, '-');
+        put_uint(w, (uint64_t)(-(value + 1)) + 1, 1);
+    }
+    else
+        put_uint(w, (uint64_t)value, 1);
+}
+
+
+/* finite values beyond the fixed point range, with all 17 significant
+ * digits of a double and an exponent */
+static void put_exponent(evrythng_json_t* w, double value)
+{
+    char tmp[32];
+    int n = snprintf(tmp, sizeof tmp, "%.17g", value);
+
+    value_begin(w);
+    put(w, tmp, n);
+}
+
+
+void EvrythngJsonFloat(evrythng_json_t* w, double value, int decimals)
+{
+    /* NaN and infinities have no JSON representation */
+    if (!isfinite(value))
+    {
+        EvrythngJsonNull(w);
+        return;
+    }
+
+    if (decimals < 0) decimals = 0;
+    if (decimals > EVRYTHNG_JSON_MAX_DECIMALS) decimals = EVRYTHNG_JSON_MAX_DECIMALS;
+
+    int negative = value < 0;
+    if (negative) value = -value;
+
+    double scaled = value * (double)pow10[decimals] + 0.5;
+
+    /* beyond 2^63 fixed point doesn't fit, fall back to whole numbers */
+    while (scaled >= 9.2e18 && decimals > 0)
+    {
+        decimals--;
+        scaled = value * (double)pow10[decimals] + 0.5;
+    }
+    if (scaled >= 9.2e18)
+    {
+        put_exponent(w, negative ? -value : value);
+        return;
+    }
+
+    uint64_t fixed = (uint64_t)scaled;
+
+    value_begin(w);
+
+    if (negative && fixed)
+        putc_(w, '-');
+
+    put_uint(w, fixed / pow10[decimals], 1);
+    if (decimals)
+    {
+        putc_(w, '.');
+        put_uint(w, fixed % pow10[decimals], decimals);
+    }
+}
+
+
+void EvrythngJsonNumber(evrythng_json_t* w, double value)
+{
+    if (isfinite(value) && (value >= 9e15 || value <= -9e15))
+    {
+        put_exponent(w, value);
+        return;
+    }
+
+    /* range checked first, converting NaN, infinities or values beyond
+     * int64_t is undefined */
+    if (isfinite(value) && value > -9e15 && value < 9e15 && value == (double)(int64_t)value)
+    {
+        EvrythngJsonInt(w, (int64_t)value);
+        return;
+    }
+
+    size_t start = w->len;
+
+    EvrythngJsonFloat(w, value, 6);
+    if (w->error || !memchr(w->buf + start, '.', w->len - start))
+        return;
+
+    /* drop the trailing zeros of the fraction */
+    while (w->buf[w->len - 1] == '0')
+        w->len--;
+    if (w->buf[w->len - 1] == '.')
+        w->len--;
+}
+
+
+void EvrythngJsonBool(evrythng_json_t* w, int value)
+{
+    value_begin(w);
+    if (value)
+        put(w, "true", 4);
+    else
+        put(w, "false", 5);
+}
+
+
+void EvrythngJsonNull(evrythng_json_t* w)
+{
+    value_begin(w);
+    put(w, "null", 4);
+}
+
+
+const char* EvrythngJsonFinish(evrythng_json_t* w)
+{
+    if (w->error || w->depth || w->after_key)
+        return 0;
+
+    w->buf[w->len] = '\0';
+
+    return w->buf;
+}
+
+
+static void property_begin(evrythng_json_t* w, char* buf, size_t size)
+{
+    EvrythngJsonInit(w, buf, size);
+    EvrythngJsonArrayBegin(w);
+    EvrythngJsonObjectBegin(w);
+    EvrythngJsonKey(w, "value");
+}
+
+
+static int property_end(evrythng_json_t* w)
+{
+    EvrythngJsonObjectEnd(w);
+    EvrythngJsonArrayEnd(w);
+
+    return EvrythngJsonFinish(w) ? (int)w->len : -1;
+}
+
+
+int EvrythngJsonPropertyInt(char* buf, size_t size, int64_t value)
+{
+    evrythng_json_t w;
+    property_begin(&w, buf, size);
+    EvrythngJsonInt(&w, value);
+    return property_end(&w);
+}
+
+
+int EvrythngJsonPropertyFloat(char* buf, size_t size, double value, int decimals)
+{
+    evrythng_json_t w;
+    property_begin(&w, buf, size);
+    EvrythngJsonFloat(&w, value, decimals);
+    return property_end(&w);
+}
+
+
+int EvrythngJsonPropertyString(char* buf, size_t size, const char* value)
+{
+    evrythng_json_t w;
+    property_begin(&w, buf, size);
+    EvrythngJsonString(&w, value);
+    return property_end(&w);
+}
+
+
+int EvrythngJsonPropertyBool(char* buf, size_t size, int value)
+{
+    evrythng_json_t w;
+    property_begin(&w, buf, size);
+    EvrythngJsonBool(&w, value);
+    return property_end(&w);
+}
+
+
+void EvrythngJsonActionBegin(evrythng_json_t* w, const char* type)
+{
+    EvrythngJsonObjectBegin(w);
+    EvrythngJsonKey(w, "type");
+    EvrythngJsonString(w, type);
+    EvrythngJsonKey(w, "customFields");
+    EvrythngJsonObjectBegin(w);
+}
+
+
+void EvrythngJsonActionEnd(evrythng_json_t* w)
+{
+    EvrythngJsonObjectEnd(w);
+    EvrythngJsonObjectEnd(w);
+}
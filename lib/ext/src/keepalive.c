@@ -0,0 +1,438 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/keepalive.h"
+#include "evrythng/platform_ext.h"
+
+
+void rtt_stats_init(RttStats* s)
+{
+    memset(s, 0, sizeof(RttStats));
+}
+
+
+void rtt_stats_update(RttStats* s, uint32_t rtt_ms)
+{
+    s->last_ms = rtt_ms;
+
+    if (!s->samples++)
+    {
+        s->min_ms = s->max_ms = rtt_ms;
+        s->srtt_ms = rtt_ms;
+        s->rttvar_ms = rtt_ms / 2;
+        return;
+    }
+
+    if (rtt_ms < s->min_ms) s->min_ms = rtt_ms;
+    if (rtt_ms > s->max_ms) s->max_ms = rtt_ms;
+
+    /* RFC 6298 estimator: rttvar = 3/4 rttvar + 1/4 |srtt - rtt|,
+     * srtt = 7/8 srtt + 1/8 rtt */
+    uint32_t delta = s->srtt_ms > rtt_ms ? s->srtt_ms - rtt_ms : rtt_ms - s->srtt_ms;
+    s->rttvar_ms = (3 * s->rttvar_ms + delta) / 4;
+    s->srtt_ms = (7 * s->srtt_ms + rtt_ms) / 8;
+}
+
+
+uint32_t rtt_stats_timeout(const RttStats* s, uint32_t min_ms, uint32_t max_ms)
+{
+    if (!s->samples)
+        return max_ms;
+
+    uint32_t timeout = s->srtt_ms + 4 * s->rttvar_ms;
+
+    if (timeout < min_ms) return min_ms;
+    if (timeout > max_ms) return max_ms;
+
+    return timeout;
+}
+
+
+void keepalive_probe_init(KeepaliveProbe* p, int min_s, int max_s, int step_s)
+{
+    memset(p, 0, sizeof(KeepaliveProbe));
+
+    p->min_s = min_s;
+    p->max_s = max_s < min_s ? min_s : max_s;
+    p->step_s = step_s > 0 ? step_s : 1;
+
+    p->interval_s = p->safe_s = min_s;
+    p->settled = p->min_s == p->max_s;
+}
+
+
+void keepalive_probe_on_ping(KeepaliveProbe* p, uint32_t idle_ms)
+{
+    p->pings++;
+
+    /* a ping after a shorter idle period says nothing about the interval */
+    if (idle_ms + KEEPALIVE_SLACK_MS < (uint32_t)p->interval_s * 1000)
+        return;
+
+    if (p->settled || ++p->confirmations < KEEPALIVE_CONFIRMATIONS)
+        return;
+
+    p->confirmations = 0;
+    p->safe_s = p->interval_s;
+
+    if (p->interval_s >= p->max_s)
+    {
+        p->settled = 1;
+        return;
+    }
+
+    p->interval_s += p->step_s;
+    if (p->interval_s > p->max_s)
+        p->interval_s = p->max_s;
+}
+
+
+void keepalive_probe_on_lost(KeepaliveProbe* p)
+{
+    p->losses++;
+    p->confirmations = 0;
+
+    if (p->interval_s > p->safe_s)
+    {
+        /* the idle timeout of the path lies between safe_s and interval_s */
+        p->interval_s = p->safe_s;
+        p->settled = 1;
+        return;
+    }
+
+    /* a confirmed interval stopped working, the path has changed:
+     * halve it and start probing again */
+    p->safe_s /= 2;
+    if (p->safe_s < p->min_s)
+        p->safe_s = p->min_s;
+
+    p->interval_s = p->safe_s;
+    p->settled = p->min_s == p->max_s;
+}
+
+
+/* keepalive search shared by all connections, NAT timeouts are a property
+ * of the network path rather than of a single connection. Updated from
+ * the read functions of all connections, guarded by mutex. */
+static Mutex mutex;
+static int mutex_state;         /* 0: none, 1: being created, 2: ready */
+
+static KeepaliveProbe keepalive;
+static int keepalive_configured;
+static RttStats rtt_all;
+
+enum { RX_HEADER, RX_LENGTH, RX_BODY };
+
+#define MQTT_CONNECT 0x10
+#define MQTT_CONNACK 0x20
+#define MQTT_PINGREQ 0xC0
+#define MQTT_PINGRESP 0xD0
+
+
+/* created on first use by whichever thread gets there first */
+static void lock(void)
+{
+    int none = 0;
+
+    if (__atomic_load_n(&mutex_state, __ATOMIC_ACQUIRE) != 2)
+    {
+        if (__atomic_compare_exchange_n(&mutex_state, &none, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            platform_mutex_init(&mutex);
+            __atomic_store_n(&mutex_state, 2, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            while (__atomic_load_n(&mutex_state, __ATOMIC_ACQUIRE) != 2)
+                platform_sleep(1);
+        }
+    }
+    platform_mutex_lock(&mutex);
+}
+
+
+static void unlock(void)
+{
+    platform_mutex_unlock(&mutex);
+}
+
+
+/* called with the lock held */
+static KeepaliveProbe* keepalive_get()
+{
+    if (!keepalive_configured)
+    {
+        keepalive_probe_init(&keepalive, 
+                KEEPALIVE_DEFAULT_MIN_S, 
+                KEEPALIVE_DEFAULT_MAX_S, 
+                KEEPALIVE_DEFAULT_STEP_S);
+        keepalive_configured = 1;
+    }
+
+    return &keepalive;
+}
+
+
+static void rx_packet_received(PingMonitor* m, unsigned char header)
+{
+    if (header == MQTT_CONNACK)
+        m->connected = 1;
+
+    if (header != MQTT_PINGRESP || !m->ping_pending)
+        return;
+
+    uint32_t rtt = platform_uptime_ms() - m->ping_sent_ms;
+    m->ping_pending = 0;
+
+    rtt_stats_update(&m->rtt, rtt);
+
+    lock();
+    rtt_stats_update(&rtt_all, rtt);
+    keepalive_probe_on_ping(keepalive_get(), m->ping_idle_ms);
+    unlock();
+}
+
+
+static void probe_lost(void)
+{
+    lock();
+    keepalive_probe_on_lost(keepalive_get());
+    unlock();
+}
+
+
+static int ping_timed_out(const PingMonitor* m)
+{
+    uint32_t timeout = platform_read_timeout(KEEPALIVE_PING_TIMEOUT_MIN_MS, KEEPALIVE_PING_TIMEOUT_MAX_MS);
+
+    return m->ping_pending && platform_uptime_ms() - m->ping_sent_ms > timeout;
+}
+
+
+void ping_monitor_on_read(PingMonitor* m, const unsigned char* buffer, int len)
+{
+    int i = 0;
+
+    m->traffic_ms = platform_uptime_ms();
+
+    while (i < len)
+    {
+        switch (m->rx_state)
+        {
+            case RX_HEADER:
+                m->rx_header = buffer[i++];
+                m->rx_remaining = 0;
+                m->rx_multiplier = 1;
+                m->rx_state = RX_LENGTH;
+                break;
+
+            case RX_LENGTH:
+                m->rx_remaining += (buffer[i] & 127) * m->rx_multiplier;
+                m->rx_multiplier *= 128;
+                if (!(buffer[i++] & 128))
+                {
+                    if (m->rx_remaining)
+                        m->rx_state = RX_BODY;
+                    else
+                    {
+                        m->rx_state = RX_HEADER;
+                        rx_packet_received(m, m->rx_header);
+                    }
+                }
+                break;
+
+            case RX_BODY:
+            {
+                uint32_t chunk = (uint32_t)(len - i) < m->rx_remaining ? (uint32_t)(len - i) : m->rx_remaining;
+                i += chunk;
+                m->rx_remaining -= chunk;
+                if (!m->rx_remaining)
+                {
+                    m->rx_state = RX_HEADER;
+                    rx_packet_received(m, m->rx_header);
+                }
+                break;
+            }
+        }
+    }
+}
+
+
+void ping_monitor_on_write(PingMonitor* m, const unsigned char* buffer, int len)
+{
+    uint32_t now = platform_uptime_ms();
+
+    if (len == 2 && buffer[0] == MQTT_PINGREQ && buffer[1] == 0)
+    {
+        m->ping_pending = 1;
+        m->ping_sent_ms = now;
+        m->ping_idle_ms = now - m->traffic_ms;
+    }
+
+    m->traffic_ms = now;
+}
+
+
+int ping_monitor_on_connect(PingMonitor* m, unsigned char* packet, int len, unsigned short* keepalive_s)
+{
+    int i = 1;
+
+    if (len < 2 || packet[0] != MQTT_CONNECT)
+        return -1;
+
+    /* remaining length, protocol name, level and flags */
+    while (i < len && i < 5 && (packet[i] & 128))
+        i++;
+    i++;
+    if (i + 2 > len)
+        return -1;
+    i += 2 + (packet[i] << 8 | packet[i + 1]) + 2;
+    if (i + 2 > len)
+        return -1;
+
+    unsigned short client_s = (unsigned short)(packet[i] << 8 | packet[i + 1]);
+
+    lock();
+    unsigned short max_s = (unsigned short)keepalive_get()->max_s;
+    unlock();
+
+    /* 0 turns the broker's timeout off, nothing to cover */
+    if (!client_s || client_s >= max_s)
+        return -1;
+
+    *keepalive_s = client_s;
+    packet[i] = (unsigned char)(max_s >> 8);
+    packet[i + 1] = (unsigned char)max_s;
+
+    return i;
+}
+
+
+int ping_monitor_absorb(PingMonitor* m, const unsigned char* packet, int len)
+{
+    if (!m->connected || len != 2 || packet[0] != MQTT_PINGREQ || packet[1] != 0 || m->pingresp_left)
+        return 0;
+
+    m->client_pings++;
+    m->pingresp_left = 2;
+
+    return 1;
+}
+
+
+int ping_monitor_take_pingresp(PingMonitor* m, unsigned char* buffer, int len)
+{
+    static const unsigned char pingresp[2] = { MQTT_PINGRESP, 0 };
+    int bytes = 0;
+
+    while (bytes < len && m->pingresp_left)
+        buffer[bytes++] = pingresp[2 - m->pingresp_left--];
+
+    return bytes;
+}
+
+
+void ping_monitor_on_closed(PingMonitor* m)
+{
+    m->rx_state = RX_HEADER;
+    m->connected = 0;
+    m->pingresp_left = 0;
+
+    /* closed for another reason while the ping was still in time */
+    if (ping_timed_out(m))
+        probe_lost();
+
+    m->ping_pending = 0;
+}
+
+
+ping_monitor_action_t ping_monitor_on_idle(PingMonitor* m)
+{
+    if (!m->connected)
+        return PING_MONITOR_IDLE;
+
+    if (ping_timed_out(m))
+    {
+        m->ping_pending = 0;
+        probe_lost();
+        return PING_MONITOR_LOST;
+    }
+
+    if (!m->ping_pending && platform_uptime_ms() - m->traffic_ms >= (uint32_t)platform_keepalive_interval() * 1000)
+        return PING_MONITOR_SEND_PING;
+
+    return PING_MONITOR_IDLE;
+}
+
+
+void platform_network_rtt_stats(const Network* n, RttStats* stats)
+{
+    if (!stats)
+    {
+        platform_printf("%s: invalid stats\n", __func__);
+        return;
+    }
+
+    if (n)
+    {
+        *stats = n->monitor.rtt;
+        return;
+    }
+
+    lock();
+    *stats = rtt_all;
+    unlock();
+}
+
+
+void platform_keepalive_configure(int min_s, int max_s, int step_s)
+{
+    if (min_s <= 0 || max_s < min_s)
+    {
+        platform_printf("%s: bad args\n", __func__);
+        return;
+    }
+
+    lock();
+    keepalive_probe_init(&keepalive, min_s, max_s, step_s);
+    keepalive_configured = 1;
+    unlock();
+}
+
+
+int platform_keepalive_interval(void)
+{
+    lock();
+    int interval_s = keepalive_get()->interval_s;
+    unlock();
+
+    return interval_s;
+}
+
+
+void platform_keepalive_probe(KeepaliveProbe* probe)
+{
+    if (!probe)
+    {
+        platform_printf("%s: invalid probe\n", __func__);
+        return;
+    }
+
+    lock();
+    *probe = *keepalive_get();
+    unlock();
+}
+
+
+int platform_read_timeout(int min_ms, int max_ms)
+{
+    lock();
+    int timeout = (int)rtt_stats_timeout(&rtt_all, (uint32_t)min_ms, (uint32_t)max_ms);
+    unlock();
+
+    return timeout;
+}
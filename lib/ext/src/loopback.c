@@ -0,0 +1,311 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/transport.h"
+#include "evrythng/platform_ext.h"
+
+/* one direction of a pipe, single reader and single writer */
+typedef struct lb_ring_t
+{
+    unsigned char data[LOOPBACK_BUFFER_SIZE];
+    size_t head;            /* next byte to read */
+    size_t count;
+    Semaphore readable;     /* posted after a write */
+    Semaphore writable;     /* posted after a read */
+} lb_ring_t;
+
+typedef struct lb_pipe_t
+{
+    Mutex mutex;
+    lb_ring_t ring[2];      /* ring[i] is read by end i */
+    int closed;
+    int refs;
+} lb_pipe_t;
+
+struct LoopbackEnd
+{
+    lb_pipe_t* pipe;
+    int side;
+    loopback_notify* notify;
+    void* notify_ctx;
+};
+
+typedef struct lb_listener_t
+{
+    char hostname[64];
+    loopback_accept* accept;
+    void* ctx;
+} lb_listener_t;
+
+/* changed only by loopback_listen/unlisten, before connections are made */
+static lb_listener_t listeners[LOOPBACK_MAX_LISTENERS];
+static int listeners_count;
+
+
+int loopback_listen(const char* hostname, loopback_accept* accept, void* ctx)
+{
+    int i;
+
+    if (!hostname || !accept || strlen(hostname) >= sizeof listeners[0].hostname)
+        return -1;
+
+    for (i = 0; i < LOOPBACK_MAX_LISTENERS; i++)
+        if (listeners[i].accept && !strcmp(listeners[i].hostname, hostname))
+            break;
+
+    if (i == LOOPBACK_MAX_LISTENERS)
+        for (i = 0; i < LOOPBACK_MAX_LISTENERS; i++)
+            if (!listeners[i].accept)
+            {
+                listeners_count++;
+                break;
+            }
+
+    if (i == LOOPBACK_MAX_LISTENERS)
+        return -1;
+
+    strcpy(listeners[i].hostname, hostname);
+    listeners[i].ctx = ctx;
+    listeners[i].accept = accept;
+
+    return 0;
+}
+
+
+void loopback_unlisten(const char* hostname)
+{
+    int i;
+
+    for (i = 0; i < LOOPBACK_MAX_LISTENERS; i++)
+        if (listeners[i].accept && !strcmp(listeners[i].hostname, hostname))
+        {
+            memset(&listeners[i], 0, sizeof listeners[i]);
+            listeners_count--;
+        }
+}
+
+
+LoopbackEnd* loopback_connect(const char* hostname)
+{
+    lb_listener_t* l = 0;
+    int i;
+
+    /* the common case, networking as usual */
+    if (!listeners_count || !hostname)
+        return 0;
+
+    for (i = 0; i < LOOPBACK_MAX_LISTENERS && !l; i++)
+        if (listeners[i].accept && !strcmp(listeners[i].hostname, hostname))
+            l = &listeners[i];
+    if (!l)
+        return 0;
+
+    /* pipe and both ends in one allocation */
+    lb_pipe_t* p = (lb_pipe_t*)platform_malloc(sizeof(lb_pipe_t) + 2 * sizeof(LoopbackEnd));
+    if (!p)
+    {
+        platform_printf("%s: failed to allocate a pipe\n", __func__);
+        return 0;
+    }
+    memset(p, 0, sizeof(lb_pipe_t) + 2 * sizeof(LoopbackEnd));
+
+    platform_mutex_init(&p->mutex);
+    for (i = 0; i < 2; i++)
+    {
+        platform_semaphore_init(&p->ring[i].readable);
+        platform_semaphore_init(&p->ring[i].writable);
+    }
+    p->refs = 2;
+
+    LoopbackEnd* ends = (LoopbackEnd*)(p + 1);
+    ends[0].pipe = ends[1].pipe = p;
+    ends[0].side = 0;
+    ends[1].side = 1;
+
+    l->accept(l->ctx, &ends[1]);
+
+    return &ends[0];
+}
+
+
+static LoopbackEnd* peer_of(LoopbackEnd* end)
+{
+    return (LoopbackEnd*)(end->pipe + 1) + !end->side;
+}
+
+
+/* ms left until deadline, 0 once it passed */
+static int time_left(uint32_t deadline)
+{
+    int32_t left = (int32_t)(deadline - platform_uptime_ms());
+    return left > 0 ? left : 0;
+}
+
+
+/* moves up to len buffered bytes out of r, called with the pipe locked */
+static size_t ring_take(lb_ring_t* r, unsigned char* buffer, size_t len)
+{
+    size_t n = r->count < len ? r->count : len;
+    size_t first = LOOPBACK_BUFFER_SIZE - r->head < n ? LOOPBACK_BUFFER_SIZE - r->head : n;
+
+    memcpy(buffer, r->data + r->head, first);
+    memcpy(buffer + first, r->data, n - first);
+    r->head = (r->head + n) % LOOPBACK_BUFFER_SIZE;
+    r->count -= n;
+
+    return n;
+}
+
+
+int loopback_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    LoopbackEnd* end = (LoopbackEnd*)io;
+    lb_pipe_t* p = end->pipe;
+    lb_ring_t* r = &p->ring[end->side];
+    uint32_t deadline = platform_uptime_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    int bytes = 0;
+
+    while (bytes < len)
+    {
+        platform_mutex_lock(&p->mutex);
+
+        size_t n = ring_take(r, buffer + bytes, (size_t)(len - bytes));
+        bytes += n;
+
+        /* buffered data is still delivered after the peer closed */
+        int closed = p->closed && !r->count;
+
+        platform_mutex_unlock(&p->mutex);
+
+        if (n)
+            platform_semaphore_post(&r->writable);
+
+        if (bytes == len)
+            break;
+        if (closed)
+            return 0;
+
+        /* the semaphore counts writes, a wake-up may find nothing new */
+        if (platform_semaphore_wait(&r->readable, time_left(deadline)) != 0)
+            return -1;
+    }
+
+    return bytes;
+}
+
+
+int loopback_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    LoopbackEnd* end = (LoopbackEnd*)io;
+    lb_pipe_t* p = end->pipe;
+    lb_ring_t* r = &p->ring[!end->side];
+    uint32_t deadline = platform_uptime_ms() + (timeout_ms > 0 ? timeout_ms : 0);
+    int bytes = 0;
+
+    while (bytes < len)
+    {
+        platform_mutex_lock(&p->mutex);
+
+        if (p->closed)
+        {
+            platform_mutex_unlock(&p->mutex);
+            return -1;
+        }
+
+        size_t space = LOOPBACK_BUFFER_SIZE - r->count;
+        size_t n = space < (size_t)(len - bytes) ? space : (size_t)(len - bytes);
+        size_t tail = (r->head + r->count) % LOOPBACK_BUFFER_SIZE;
+        size_t first = LOOPBACK_BUFFER_SIZE - tail < n ? LOOPBACK_BUFFER_SIZE - tail : n;
+        memcpy(r->data + tail, buffer + bytes, first);
+        memcpy(r->data, buffer + bytes + first, n - first);
+        r->count += n;
+        bytes += n;
+
+        LoopbackEnd* peer = peer_of(end);
+        if (n && peer->notify)
+            peer->notify(peer->notify_ctx, peer);
+
+        platform_mutex_unlock(&p->mutex);
+
+        if (n)
+            platform_semaphore_post(&r->readable);
+
+        if (bytes == len)
+            break;
+
+        if (platform_semaphore_wait(&r->writable, time_left(deadline)) != 0)
+            break;
+    }
+
+    return bytes ? bytes : -1;
+}
+
+
+int loopback_read_some(LoopbackEnd* end, unsigned char* buffer, int len)
+{
+    lb_pipe_t* p = end->pipe;
+    lb_ring_t* r = &p->ring[end->side];
+
+    platform_mutex_lock(&p->mutex);
+    int closed = p->closed && !r->count;
+    size_t n = ring_take(r, buffer, (size_t)len);
+    platform_mutex_unlock(&p->mutex);
+
+    if (n)
+        platform_semaphore_post(&r->writable);
+
+    return closed ? -1 : (int)n;
+}
+
+
+void loopback_set_notify(LoopbackEnd* end, loopback_notify* notify, void* ctx)
+{
+    platform_mutex_lock(&end->pipe->mutex);
+    end->notify = notify;
+    end->notify_ctx = ctx;
+    platform_mutex_unlock(&end->pipe->mutex);
+}
+
+
+void loopback_close(void* io)
+{
+    LoopbackEnd* end = (LoopbackEnd*)io;
+    lb_pipe_t* p = end->pipe;
+    int i;
+
+    platform_mutex_lock(&p->mutex);
+    p->closed = 1;
+    int refs = --p->refs;
+
+    LoopbackEnd* peer = peer_of(end);
+    if (refs && peer->notify)
+        peer->notify(peer->notify_ctx, peer);
+
+    /* wake up the peer blocked on either direction, before the unlock:
+     * once it is released the peer may close and free the pipe */
+    for (i = 0; refs && i < 2; i++)
+    {
+        platform_semaphore_post(&p->ring[i].readable);
+        platform_semaphore_post(&p->ring[i].writable);
+    }
+
+    platform_mutex_unlock(&p->mutex);
+
+    if (refs)
+        return;
+
+    for (i = 0; i < 2; i++)
+    {
+        platform_semaphore_deinit(&p->ring[i].readable);
+        platform_semaphore_deinit(&p->ring[i].writable);
+    }
+    platform_mutex_deinit(&p->mutex);
+    platform_free(p);
+}
+
+
+const Transport loopback_transport = { "loopback", loopback_read, loopback_write, loopback_close };
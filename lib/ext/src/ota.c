@@ -0,0 +1,587 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/ota.h"
+#include "evrythng/platform_ext.h"
+
+#define OTA_TOPIC_SUFFIX "/actions/" EVRYTHNG_OTA_ACTION
+
+typedef enum
+{
+    MSG_MEMBERS,    /* scanning the members up to "data" */
+    MSG_DATA,       /* decoding base64 */
+    MSG_SKIP,       /* rest of the message is ignored */
+} msg_state_t;
+
+/* members of "customFields", found ones are flagged in msg_found */
+typedef enum
+{
+    MEMBER_OTHER,
+    MEMBER_SIZE = 1,
+    MEMBER_OFFSET = 2,
+    MEMBER_SHA256 = 4,
+    MEMBER_DATA,
+    MEMBER_FIELDS,  /* "customFields" itself */
+} member_t;
+
+#define MEMBERS_ALL (MEMBER_SIZE | MEMBER_OFFSET | MEMBER_SHA256)
+
+static evrythng_ota_t* subscribed_ota;
+
+
+void EvrythngOtaInit(evrythng_ota_t* ota, evrythng_ota_callback* callback, void* ctx)
+{
+    memset(ota, 0, sizeof(evrythng_ota_t));
+    ota->state = EVRYTHNG_OTA_IDLE;
+    ota->callback = callback;
+    ota->ctx = ctx;
+    ota->msg_state = MSG_SKIP;
+}
+
+
+void EvrythngOtaExpect(evrythng_ota_t* ota, uint32_t size, const unsigned char sha256[EVRYTHNG_SHA256_SIZE])
+{
+    ota->expect = sha256 != 0;
+    ota->expect_size = size;
+    if (sha256)
+        memcpy(ota->expect_sha256, sha256, sizeof ota->expect_sha256);
+}
+
+
+uint32_t EvrythngOtaOffset(const evrythng_ota_t* ota)
+{
+    return ota->state == EVRYTHNG_OTA_RECEIVING ? ota->received : 0;
+}
+
+
+static void set_state(evrythng_ota_t* ota, evrythng_ota_state_t state)
+{
+    ota->state = state;
+    if (ota->callback)
+        (*ota->callback)(ota->ctx, state, ota->received, ota->size);
+}
+
+
+static void fail(evrythng_ota_t* ota)
+{
+    platform_ota_finish(0);
+    ota->msg_state = MSG_SKIP;
+    ota->msg_writing = 0;
+    set_state(ota, EVRYTHNG_OTA_FAILED);
+}
+
+
+static void complete(evrythng_ota_t* ota)
+{
+    unsigned char digest[EVRYTHNG_SHA256_SIZE];
+
+    EvrythngSha256Finish(&ota->hash, digest);
+    ota->stats.elapsed_ms = platform_uptime_ms() - ota->stats.started_ms;
+    ota->msg_state = MSG_SKIP;
+
+    if (memcmp(digest, ota->sha256, sizeof digest))
+    {
+        platform_printf("%s: firmware hash mismatch\n", __func__);
+        fail(ota);
+        return;
+    }
+
+    if (platform_ota_finish(1) != 0)
+    {
+        set_state(ota, EVRYTHNG_OTA_FAILED);
+        return;
+    }
+
+    set_state(ota, EVRYTHNG_OTA_DONE);
+}
+
+
+static void flush(evrythng_ota_t* ota)
+{
+    if (!ota->out_len)
+        return;
+
+    if (ota->out_len > ota->size - ota->received ||
+            platform_ota_write(ota->received, ota->out, ota->out_len) != 0)
+    {
+        platform_printf("%s: failed to write %u bytes at %u\n", __func__,
+                (unsigned)ota->out_len, (unsigned)ota->received);
+        ota->out_len = 0;
+        fail(ota);
+        return;
+    }
+
+    EvrythngSha256Update(&ota->hash, ota->out, ota->out_len);
+    ota->received += ota->out_len;
+    ota->out_len = 0;
+    ota->msg_writing = 2;
+
+    if (ota->received == ota->size)
+        complete(ota);
+}
+
+
+static void emit(evrythng_ota_t* ota, unsigned char byte)
+{
+    /* decoded bytes of a chunk overlapping what was received are skipped */
+    if (ota->msg_skip)
+    {
+        ota->msg_skip--;
+        return;
+    }
+
+    ota->out[ota->out_len++] = byte;
+    if (ota->out_len == sizeof ota->out)
+        flush(ota);
+}
+
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+
+static void invalid(evrythng_ota_t* ota)
+{
+    ota->stats.invalid++;
+    ota->msg_state = MSG_SKIP;
+}
+
+
+/* "data" starts, decides what to do with the chunk */
+static void start_chunk(evrythng_ota_t* ota)
+{
+    const unsigned char* sha256 = ota->msg_sha256;
+    uint32_t size = ota->msg_size, offset = ota->msg_offset;
+
+    if (ota->msg_found != MEMBERS_ALL || !size || offset >= size)
+    {
+        invalid(ota);
+        return;
+    }
+
+    if (ota->expect && (size != ota->expect_size || memcmp(sha256, ota->expect_sha256, EVRYTHNG_SHA256_SIZE)))
+    {
+        ota->stats.rejected++;
+        ota->msg_state = MSG_SKIP;
+        return;
+    }
+
+    int same = size == ota->size && !memcmp(sha256, ota->sha256, EVRYTHNG_SHA256_SIZE);
+
+    if (same && ota->state == EVRYTHNG_OTA_DONE)
+    {
+        ota->stats.duplicates++;
+        ota->msg_state = MSG_SKIP;
+        return;
+    }
+
+    if (!same || ota->state != EVRYTHNG_OTA_RECEIVING)
+    {
+        /* a new image starts with its first chunk */
+        if (offset != 0)
+        {
+            ota->stats.gaps++;
+            ota->msg_state = MSG_SKIP;
+            return;
+        }
+
+        if (ota->state == EVRYTHNG_OTA_RECEIVING)
+            platform_ota_finish(0);
+
+        memset(&ota->stats, 0, sizeof ota->stats);
+        ota->size = size;
+        ota->received = 0;
+        memcpy(ota->sha256, sha256, EVRYTHNG_SHA256_SIZE);
+        EvrythngSha256Init(&ota->hash);
+        ota->stats.started_ms = platform_uptime_ms();
+
+        if (platform_ota_begin(size) != 0)
+        {
+            ota->msg_state = MSG_SKIP;
+            set_state(ota, EVRYTHNG_OTA_FAILED);
+            return;
+        }
+
+        set_state(ota, EVRYTHNG_OTA_RECEIVING);
+    }
+
+    if (offset > ota->received)
+    {
+        ota->stats.gaps++;
+        ota->msg_state = MSG_SKIP;
+        return;
+    }
+
+    ota->msg_skip = ota->received - offset;
+    ota->msg_resumed = ota->interrupted;
+    ota->interrupted = 0;
+    ota->msg_state = MSG_DATA;
+    ota->msg_writing = 1;
+    ota->quad = 0;
+    ota->quad_len = 0;
+    ota->out_len = 0;
+}
+
+
+/* the chunk ended, completely or cut by the connection */
+static void end_chunk(evrythng_ota_t* ota)
+{
+    if (ota->msg_state != MSG_DATA && !ota->msg_writing)
+        return;
+
+    if (ota->msg_state == MSG_DATA)
+    {
+        /* trailing bytes of the base64 group */
+        if (ota->quad_len == 2)
+            emit(ota, (unsigned char)(ota->quad >> 4));
+        else if (ota->quad_len == 3)
+        {
+            emit(ota, (unsigned char)(ota->quad >> 10));
+            emit(ota, (unsigned char)(ota->quad >> 2));
+        }
+        ota->quad_len = 0;
+    }
+
+    if (ota->state == EVRYTHNG_OTA_RECEIVING)
+        flush(ota);
+
+    if (ota->msg_writing == 2)
+    {
+        ota->stats.messages++;
+        if (ota->msg_resumed)
+            ota->stats.resumes++;
+    }
+    else if (ota->msg_writing == 1)
+        ota->stats.duplicates++;
+
+    ota->msg_writing = 0;
+    ota->msg_state = MSG_SKIP;
+}
+
+
+static int base64_value(unsigned char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '+') return 62;
+    if (c == '/') return 63;
+    return -1;
+}
+
+
+static member_t member_of_key(const evrythng_ota_t* ota)
+{
+    static const struct { const char* key; member_t member; } members[] = {
+        { "size", MEMBER_SIZE },
+        { "offset", MEMBER_OFFSET },
+        { "sha256", MEMBER_SHA256 },
+        { "data", MEMBER_DATA },
+    };
+    size_t i;
+
+    if (ota->json_key_len >= EVRYTHNG_OTA_KEY_SIZE)
+        return MEMBER_OTHER;
+
+    if (ota->json_depth == 1 && !strcmp(ota->json_key, "customFields"))
+        return MEMBER_FIELDS;
+
+    if (ota->json_depth != ota->json_fields_depth)
+        return MEMBER_OTHER;
+
+    for (i = 0; i < sizeof members / sizeof members[0]; i++)
+        if (!strcmp(ota->json_key, members[i].key))
+            return members[i].member;
+
+    return MEMBER_OTHER;
+}
+
+
+/* a character of a string, of a key or a value */
+static void scan_string(evrythng_ota_t* ota, unsigned char c)
+{
+    if (!ota->json_escape && c == '\\')
+    {
+        ota->json_escape = 1;
+        return;
+    }
+
+    if (!ota->json_escape && c == '"')
+    {
+        ota->json_in_string = 0;
+
+        if (ota->json_expect_key)
+        {
+            ota->json_expect_key = 0;
+            ota->json_member = member_of_key(ota);
+
+            /* a repeated member counts with its last value */
+            if (ota->json_member <= MEMBER_SHA256)
+                ota->msg_found &= ~ota->json_member;
+            if (ota->json_member == MEMBER_SIZE)
+                ota->msg_size = 0;
+            if (ota->json_member == MEMBER_OFFSET)
+                ota->msg_offset = 0;
+        }
+        else if (ota->json_member == MEMBER_SHA256)
+        {
+            if (ota->msg_hex != 2 * EVRYTHNG_SHA256_SIZE)
+                invalid(ota);
+            else
+                ota->msg_found |= MEMBER_SHA256;
+        }
+        return;
+    }
+
+    ota->json_escape = 0;
+
+    if (ota->json_expect_key)
+    {
+        if (ota->json_key_len < EVRYTHNG_OTA_KEY_SIZE - 1)
+            ota->json_key[ota->json_key_len] = (char)c;
+        ota->json_key_len++;
+        if (ota->json_key_len < EVRYTHNG_OTA_KEY_SIZE)
+            ota->json_key[ota->json_key_len] = '\0';
+    }
+    else if (ota->json_member == MEMBER_SHA256)
+    {
+        int v = hex_value((char)c);
+        if (v < 0 || ota->msg_hex == 2 * EVRYTHNG_SHA256_SIZE)
+        {
+            invalid(ota);
+            return;
+        }
+
+        if (ota->msg_hex & 1)
+            ota->msg_sha256[ota->msg_hex / 2] |= (unsigned char)v;
+        else
+            ota->msg_sha256[ota->msg_hex / 2] = (unsigned char)(v << 4);
+        ota->msg_hex++;
+    }
+}
+
+
+/* a character of the message outside "data", picks up the members */
+static void scan(evrythng_ota_t* ota, unsigned char c)
+{
+    if (ota->json_in_string)
+    {
+        scan_string(ota, c);
+        return;
+    }
+
+    switch (c)
+    {
+        case '"':
+            if (ota->json_expect_key)
+            {
+                ota->json_key_len = 0;
+                ota->json_key[0] = '\0';
+            }
+            else if (ota->json_member == MEMBER_DATA && !ota->msg_prescan)
+            {
+                start_chunk(ota);
+                return;
+            }
+            else if (ota->json_member == MEMBER_SHA256)
+                ota->msg_hex = 0;
+            ota->json_in_string = 1;
+            ota->json_escape = 0;
+            break;
+
+        case '{':
+        case '[':
+            if (ota->json_depth == EVRYTHNG_OTA_MAX_DEPTH)
+            {
+                invalid(ota);
+                return;
+            }
+            ota->json_depth++;
+            if (c == '[')
+                ota->json_arrays |= 1U << (ota->json_depth - 1);
+            else
+                ota->json_arrays &= ~(1U << (ota->json_depth - 1));
+            if (c == '{' && ota->json_member == MEMBER_FIELDS)
+                ota->json_fields_depth = ota->json_depth;
+            ota->json_expect_key = c == '{';
+            ota->json_member = MEMBER_OTHER;
+            break;
+
+        case '}':
+        case ']':
+            if (!ota->json_depth)
+            {
+                invalid(ota);
+                return;
+            }
+            if (ota->json_depth == ota->json_fields_depth)
+                ota->json_fields_depth = 0;
+            ota->json_depth--;
+            ota->json_expect_key = 0;
+            ota->json_member = MEMBER_OTHER;
+            break;
+
+        case ',':
+            ota->json_expect_key = ota->json_depth && !(ota->json_arrays & 1U << (ota->json_depth - 1));
+            ota->json_member = MEMBER_OTHER;
+            break;
+
+        case ':':
+        case ' ':
+        case '\t':
+        case '\r':
+        case '\n':
+            break;
+
+        default:
+            if (ota->json_member == MEMBER_SIZE || ota->json_member == MEMBER_OFFSET)
+            {
+                uint32_t* value = ota->json_member == MEMBER_SIZE ? &ota->msg_size : &ota->msg_offset;
+
+                if (c < '0' || c > '9' || *value > (UINT32_MAX - 9) / 10)
+                {
+                    invalid(ota);
+                    return;
+                }
+                *value = *value * 10 + (c - '0');
+                ota->msg_found |= ota->json_member;
+            }
+            break;
+    }
+}
+
+
+/* a new message starts, the members found by a prescan are kept */
+static void begin_message(evrythng_ota_t* ota, int keep_members)
+{
+    ota->msg_state = MSG_MEMBERS;
+    ota->msg_writing = 0;
+    if (!keep_members)
+    {
+        ota->msg_found = 0;
+        ota->msg_size = 0;
+        ota->msg_offset = 0;
+    }
+
+    ota->json_depth = 0;
+    ota->json_arrays = 0;
+    ota->json_fields_depth = 0;
+    ota->json_in_string = 0;
+    ota->json_escape = 0;
+    ota->json_expect_key = 0;
+    ota->json_member = MEMBER_OTHER;
+    ota->json_key_len = 0;
+}
+
+
+void EvrythngOtaFeed(evrythng_ota_t* ota, const unsigned char* data, size_t len, size_t offset, size_t total)
+{
+    size_t i;
+
+    if (offset == 0)
+    {
+        begin_message(ota, 0);
+
+        /* the whole message is here, the members may follow "data" */
+        if (len && len == total)
+        {
+            ota->msg_prescan = 1;
+            for (i = 0; i < len && ota->msg_state != MSG_SKIP; i++)
+                scan(ota, data[i]);
+            ota->msg_prescan = 0;
+
+            if (ota->msg_state == MSG_SKIP)
+                return;
+            begin_message(ota, 1);
+        }
+    }
+
+    /* the connection broke: keep what was written, the sender resumes */
+    if (!len && offset < total)
+    {
+        if (ota->msg_state == MSG_DATA)
+            ota->interrupted = 1;
+        end_chunk(ota);
+        return;
+    }
+
+    for (i = 0; i < len && ota->msg_state != MSG_SKIP; i++)
+    {
+        unsigned char c = data[i];
+
+        if (ota->msg_state == MSG_MEMBERS)
+        {
+            scan(ota, c);
+            continue;
+        }
+
+        /* MSG_DATA */
+        int v = base64_value(c);
+        if (v >= 0)
+        {
+            ota->quad = ota->quad << 6 | v;
+            if (++ota->quad_len == 4)
+            {
+                emit(ota, (unsigned char)(ota->quad >> 16));
+                emit(ota, (unsigned char)(ota->quad >> 8));
+                emit(ota, (unsigned char)ota->quad);
+                ota->quad_len = 0;
+            }
+        }
+        else if (c == '"')
+            end_chunk(ota);
+        /* padding, JSON escaped '/' and whitespace are skipped */
+    }
+
+    if (offset + len >= total)
+    {
+        /* no "data" member */
+        if (ota->msg_state == MSG_MEMBERS)
+            invalid(ota);
+        end_chunk(ota);
+    }
+}
+
+
+void EvrythngOtaStreamCallback(void* ctx, const char* topic,
+        const unsigned char* chunk, size_t len, size_t offset, size_t total)
+{
+    evrythng_ota_t* ota = (evrythng_ota_t*)ctx;
+    size_t topic_len = strlen(topic), suffix_len = strlen(OTA_TOPIC_SUFFIX);
+
+    if (topic_len < suffix_len || strcmp(topic + topic_len - suffix_len, OTA_TOPIC_SUFFIX))
+    {
+        if (ota->next)
+            (*ota->next)(ota->next_ctx, topic, chunk, len, offset, total);
+        return;
+    }
+
+    EvrythngOtaFeed(ota, chunk, len, offset, total);
+}
+
+
+static void ota_sub_callback(const char* json, size_t len)
+{
+    if (subscribed_ota)
+        EvrythngOtaFeed(subscribed_ota, (const unsigned char*)json, len, 0, len);
+}
+
+
+evrythng_return_t EvrythngOtaSubscribe(evrythng_ota_t* ota, evrythng_handle_t handle, const char* thng_id)
+{
+    if (!ota || !handle || !thng_id)
+        return EVRYTHNG_BAD_ARGS;
+
+    subscribed_ota = ota;
+
+    return EvrythngSubThngAction(handle, thng_id, EVRYTHNG_OTA_ACTION, 0, ota_sub_callback);
+}
@@ -0,0 +1,613 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/outbox.h"
+#include "evrythng/platform_ext.h"
+
+#define MQTT_PUBLISH 3
+#define MQTT_SUBSCRIBE 8
+#define MQTT_UNSUBSCRIBE 10
+#define MQTT_PUBACK 0x40
+
+typedef struct outbox_packet_t
+{
+    struct outbox_packet_t* next;
+    int len;
+    unsigned char data[];
+} outbox_packet_t;
+
+/* a thread waiting in outbox_send_wait(), on its stack */
+typedef struct outbox_waiter_t
+{
+    struct outbox_waiter_t* next;
+    unsigned short packet_id;
+    int acked;
+    Semaphore done;
+} outbox_waiter_t;
+
+typedef struct outbox_listener_t
+{
+    outbox_ack_listener* listener;
+    void* ctx;
+} outbox_listener_t;
+
+typedef enum
+{
+    ID_FREE,
+    ID_RESERVED,    /* used by a packet of the SDK */
+    ID_ORPHAN,      /* released unacknowledged, its PUBACK is dropped */
+} id_state_t;
+
+typedef struct outbox_id_t
+{
+    unsigned short id;
+    id_state_t state;
+} outbox_id_t;
+
+/* a packet of the client waiting for its ack, sent with wire_id */
+typedef struct client_id_t
+{
+    unsigned short wire_id;
+    unsigned short client_id;
+} client_id_t;
+
+/* guards everything below, listeners are called with it held */
+static Mutex mutex;
+static int mutex_state;         /* 0: none, 1: being created, 2: ready */
+static Semaphore queued;        /* posted by outbox_send() while following */
+
+static const void* owner;       /* handle of the users, see outbox_claim() */
+static int owner_refs;
+
+static int connections;         /* MQTT connections up */
+static const void* connection;  /* the connection packets are written to */
+static outbox_packet_t* head;
+static outbox_packet_t* tail;
+static int count;
+static int follow;              /* a listener announced a packet */
+static int following;           /* outbox_flush() waits for it */
+
+static unsigned short next_id = 1;
+static outbox_id_t ids[OUTBOX_MAX_PACKET_IDS];
+static client_id_t client_ids[OUTBOX_MAX_CLIENT_IDS];
+static int client_count;
+
+static outbox_listener_t listeners[OUTBOX_MAX_LISTENERS];
+static outbox_waiter_t* waiters;
+
+
+/* created on first use by whichever thread gets there first, the read
+ * functions of all connections look at it */
+static int ready(void)
+{
+    return __atomic_load_n(&mutex_state, __ATOMIC_ACQUIRE) == 2;
+}
+
+
+static void lock(void)
+{
+    int none = 0;
+
+    if (!ready())
+    {
+        if (__atomic_compare_exchange_n(&mutex_state, &none, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            platform_mutex_init(&mutex);
+            platform_semaphore_init(&queued);
+            __atomic_store_n(&mutex_state, 2, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            while (!ready())
+                platform_sleep(1);
+        }
+    }
+    platform_mutex_lock(&mutex);
+}
+
+
+static void unlock(void)
+{
+    platform_mutex_unlock(&mutex);
+}
+
+
+static void drop_all(void)
+{
+    while (head)
+    {
+        outbox_packet_t* pkt = head;
+        head = pkt->next;
+        platform_free(pkt);
+    }
+    tail = 0;
+    count = 0;
+}
+
+
+/* forgets the state of the outbox connection, which is gone */
+static void unbind(void)
+{
+    int i;
+
+    connection = 0;
+    follow = 0;
+    drop_all();
+
+    /* their PUBACKs can't come anymore */
+    for (i = 0; i < OUTBOX_MAX_PACKET_IDS; i++)
+        if (ids[i].state == ID_ORPHAN)
+            ids[i].state = ID_FREE;
+
+    client_count = 0;
+}
+
+
+static outbox_id_t* find_id(unsigned short id)
+{
+    int i;
+
+    for (i = 0; i < OUTBOX_MAX_PACKET_IDS; i++)
+        if (ids[i].state != ID_FREE && ids[i].id == id)
+            return &ids[i];
+
+    return 0;
+}
+
+
+static client_id_t* find_wire_id(unsigned short wire_id)
+{
+    int i;
+
+    for (i = 0; i < client_count; i++)
+        if (client_ids[i].wire_id == wire_id)
+            return &client_ids[i];
+
+    return 0;
+}
+
+
+/* the next id in the client's range 1..65535 nobody uses */
+static unsigned short free_id(void)
+{
+    int i;
+
+    for (i = 0; i < 0xFFFF; i++)
+    {
+        unsigned short id = next_id;
+        next_id = next_id == 0xFFFF ? 1 : next_id + 1;
+
+        if (!find_id(id) && !find_wire_id(id))
+            return id;
+    }
+
+    return 0;
+}
+
+
+int outbox_claim(const void* o)
+{
+    int rc = -1;
+
+    if (!o) return -1;
+
+    lock();
+    if (!owner_refs || owner == o)
+    {
+        owner = o;
+        owner_refs++;
+        rc = 0;
+    }
+    unlock();
+
+    return rc;
+}
+
+
+void outbox_release(const void* o)
+{
+    if (!o || !ready()) return;
+
+    lock();
+    if (owner == o && owner_refs && !--owner_refs)
+        owner = 0;
+    unlock();
+}
+
+
+int outbox_add_listener(outbox_ack_listener* listener, void* ctx)
+{
+    int i, rc = -1;
+
+    if (!listener) return -1;
+
+    lock();
+    for (i = 0; i < OUTBOX_MAX_LISTENERS; i++)
+    {
+        if (!listeners[i].listener)
+        {
+            listeners[i].listener = listener;
+            listeners[i].ctx = ctx;
+            rc = 0;
+            break;
+        }
+    }
+    unlock();
+
+    return rc;
+}
+
+
+void outbox_remove_listener(outbox_ack_listener* listener, void* ctx)
+{
+    int i;
+
+    if (!ready()) return;
+
+    lock();
+    for (i = 0; i < OUTBOX_MAX_LISTENERS; i++)
+    {
+        if (listeners[i].listener == listener && listeners[i].ctx == ctx)
+            memset(&listeners[i], 0, sizeof listeners[i]);
+    }
+    unlock();
+}
+
+
+unsigned short outbox_packet_id(void)
+{
+    unsigned short id = 0;
+    int i;
+
+    lock();
+    for (i = 0; i < OUTBOX_MAX_PACKET_IDS; i++)
+    {
+        if (ids[i].state == ID_FREE)
+        {
+            if ((id = free_id()) != 0)
+            {
+                ids[i].id = id;
+                ids[i].state = ID_RESERVED;
+            }
+            break;
+        }
+    }
+    unlock();
+
+    return id;
+}
+
+
+static void release_id(unsigned short packet_id, int sent)
+{
+    lock();
+    outbox_id_t* e = find_id(packet_id);
+    if (e && e->state == ID_RESERVED)
+        e->state = sent && connection ? ID_ORPHAN : ID_FREE;
+    unlock();
+}
+
+
+void outbox_release_packet_id(unsigned short packet_id)
+{
+    release_id(packet_id, 1);
+}
+
+
+int outbox_send(const unsigned char* packet, int len)
+{
+    if (!packet || len <= 0)
+        return -1;
+
+    outbox_packet_t* pkt = (outbox_packet_t*)platform_malloc(sizeof(outbox_packet_t) + len);
+    if (!pkt)
+        return -1;
+
+    pkt->next = 0;
+    pkt->len = len;
+    memcpy(pkt->data, packet, len);
+
+    lock();
+    if (!connection || count == OUTBOX_MAX_PACKETS)
+    {
+        unlock();
+        platform_free(pkt);
+        return -1;
+    }
+
+    if (tail)
+        tail->next = pkt;
+    else
+        head = pkt;
+    tail = pkt;
+    count++;
+    if (following)
+    {
+        following = 0;
+        platform_semaphore_post(&queued);
+    }
+    unlock();
+
+    return 0;
+}
+
+
+int outbox_send_wait(const unsigned char* packet, int len, unsigned short packet_id, int timeout_ms)
+{
+    outbox_waiter_t w, **pw;
+    int acked, sent;
+
+    memset(&w, 0, sizeof w);
+    w.packet_id = packet_id;
+    platform_semaphore_init(&w.done);
+
+    lock();
+    w.next = waiters;
+    waiters = &w;
+    unlock();
+
+    if ((sent = outbox_send(packet, len) == 0))
+        platform_semaphore_wait(&w.done, timeout_ms);
+
+    lock();
+    for (pw = &waiters; *pw; pw = &(*pw)->next)
+    {
+        if (*pw == &w)
+        {
+            *pw = w.next;
+            break;
+        }
+    }
+    acked = w.acked;
+    unlock();
+
+    platform_semaphore_deinit(&w.done);
+
+    if (!acked)
+        release_id(packet_id, sent);
+
+    return acked ? 0 : -1;
+}
+
+
+void outbox_on_connected(const void* conn)
+{
+    lock();
+
+    /* a second connection may be another handle's, send on neither */
+    if (++connections == 1)
+        connection = conn;
+    else if (connection)
+    {
+        platform_printf("%s: more than one MQTT connection, the outbox stops sending\n", __func__);
+        unbind();
+    }
+
+    unlock();
+}
+
+
+/* writes the queued packets, called and returns with the lock held */
+static void write_queued(const void* conn, stream_io* write, void* io)
+{
+    while (connection == conn && head)
+    {
+        outbox_packet_t* pkt = head;
+        head = pkt->next;
+        if (!head)
+            tail = 0;
+        count--;
+
+        /* only this thread writes, the next ones can be queued meanwhile */
+        unlock();
+        int len = pkt->len;
+        int rc = (*write)(io, pkt->data, len, STREAM_READ_TIMEOUT_MS);
+        platform_free(pkt);
+        lock();
+
+        /* broken, the owners send them again on the next connection */
+        if (rc != len)
+        {
+            drop_all();
+            break;
+        }
+    }
+}
+
+
+void outbox_flush(const void* conn, stream_io* write, void* io)
+{
+    /* nothing to do before the outbox was used */
+    if (!ready())
+        return;
+
+    lock();
+    write_queued(conn, write, io);
+
+    /* the next packet of a burst follows an ack, it would otherwise wait
+     * for the read the client is about to start */
+    if (connection == conn && follow && !head)
+    {
+        follow = 0;
+        following = 1;
+        unlock();
+        platform_semaphore_wait(&queued, OUTBOX_FOLLOW_MS);
+        lock();
+        following = 0;
+
+        /* posted after the wait timed out */
+        while (platform_semaphore_wait(&queued, 0) == 0);
+
+        write_queued(conn, write, io);
+    }
+    follow = 0;
+    unlock();
+}
+
+
+/* offset of the packet id in a packet of the client, -1 if it has none
+ * or isn't waiting for an ack with it */
+static int client_id_offset(const unsigned char* packet, int len)
+{
+    int type = packet[0] >> 4;
+    int i = 1;
+
+    if (len < 2 || !((type == MQTT_PUBLISH && ((packet[0] >> 1) & 3) == 1) ||
+                packet[0] == (MQTT_SUBSCRIBE << 4 | 2) || packet[0] == (MQTT_UNSUBSCRIBE << 4 | 2)))
+        return -1;
+
+    /* remaining length */
+    while (i < len && i < 5 && (packet[i] & 128))
+        i++;
+    i++;
+
+    if (type == MQTT_PUBLISH)
+    {
+        if (i + 2 > len)
+            return -1;
+        i += 2 + (packet[i] << 8 | packet[i + 1]);
+    }
+
+    return i + 2 <= len ? i : -1;
+}
+
+
+int outbox_on_write(const void* conn, unsigned char* packet, int len, unsigned short* client_id)
+{
+    int pos;
+
+    if (!packet || !ready() || (pos = client_id_offset(packet, len)) < 0)
+        return -1;
+
+    unsigned short id = (unsigned short)(packet[pos] << 8 | packet[pos + 1]);
+    unsigned short wire_id = id;
+    int i;
+
+    lock();
+    if (connection != conn)
+    {
+        unlock();
+        return -1;
+    }
+
+    /* sent again, keeps the id it went out with */
+    for (i = 0; i < client_count; i++)
+    {
+        if (client_ids[i].client_id == id)
+        {
+            wire_id = client_ids[i].wire_id;
+            break;
+        }
+    }
+
+    if (i == client_count)
+    {
+        if (find_id(id) || find_wire_id(id))
+            wire_id = free_id();
+
+        if (client_count < OUTBOX_MAX_CLIENT_IDS && wire_id)
+        {
+            client_ids[client_count].wire_id = wire_id;
+            client_ids[client_count].client_id = id;
+            client_count++;
+        }
+        else
+        {
+            platform_printf("%s: too many client packets in flight\n", __func__);
+            wire_id = id;
+        }
+    }
+    unlock();
+
+    if (wire_id == id)
+        return -1;
+
+    *client_id = id;
+    packet[pos] = (unsigned char)(wire_id >> 8);
+    packet[pos + 1] = (unsigned char)wire_id;
+
+    return pos;
+}
+
+
+/* PUBACK of a reserved id, returns 1 if an owner took it, 2 if a packet
+ * of the owner follows */
+static int claim(unsigned short packet_id)
+{
+    outbox_waiter_t* w;
+    int i, claimed = 0;
+
+    for (w = waiters; w && !claimed; w = w->next)
+    {
+        if (w->packet_id == packet_id && !w->acked)
+        {
+            w->acked = claimed = 1;
+            platform_semaphore_post(&w->done);
+        }
+    }
+    for (i = 0; i < OUTBOX_MAX_LISTENERS && !claimed; i++)
+    {
+        if (listeners[i].listener)
+            claimed = (*listeners[i].listener)(listeners[i].ctx, packet_id);
+    }
+
+    return claimed;
+}
+
+
+int outbox_on_ack(const void* conn, unsigned char header, unsigned char id[2])
+{
+    unsigned short packet_id = (unsigned short)(id[0] << 8 | id[1]);
+    int consumed = 0;
+
+    if (!ready())
+        return 0;
+
+    lock();
+    if (connection != conn)
+    {
+        unlock();
+        return 0;
+    }
+
+    outbox_id_t* e = header == MQTT_PUBACK ? find_id(packet_id) : 0;
+    client_id_t* c = find_wire_id(packet_id);
+
+    if (e)
+    {
+        /* never the client's: its packets don't go out with reserved ids */
+        consumed = 1;
+        int claimed = e->state == ID_ORPHAN ? 1 : claim(packet_id);
+        if (claimed)
+            e->state = ID_FREE;
+        if (claimed == 2)
+            follow = 1;
+    }
+    else if (c)
+    {
+        id[0] = (unsigned char)(c->client_id >> 8);
+        id[1] = (unsigned char)c->client_id;
+        *c = client_ids[--client_count];
+    }
+    unlock();
+
+    return consumed;
+}
+
+
+void outbox_on_closed(const void* conn, int connected)
+{
+    if (!ready())
+        return;
+
+    lock();
+    if (connected && connections > 0)
+        connections--;
+    if (connection == conn)
+        unbind();
+    unlock();
+}
@@ -0,0 +1,548 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "evrythng/pipeline.h"
+#include "evrythng/outbox.h"
+#include "evrythng/platform_ext.h"
+
+#include "MQTTPacket.h"
+
+#define MQTT_DUP 0x08
+
+typedef enum
+{
+    PUB_THNG_PROPERTY,
+    PUB_THNG_ACTION,
+} pub_type_t;
+
+typedef struct pub_msg_t
+{
+    struct pub_msg_t* next;
+    unsigned short packet_id;   /* reserved once admitted to the window */
+    int id_pos;                 /* offset of the packet id in packet */
+    int attempts;           /* transmissions so far */
+    int sent;               /* waiting for its PUBACK */
+    int acked;
+    uint32_t sent_ms;
+    evrythng_pub_ack_callback* callback;
+    void* ctx;
+
+    /* QoS 1 PUBLISH packet, right after the structure */
+    int len;
+    unsigned char* packet;
+} pub_msg_t;
+
+struct evrythng_pipeline_ctx_t
+{
+    evrythng_handle_t handle;
+    evrythng_pipeline_config_t config;
+
+    Mutex mutex;
+    Semaphore wake;     /* queued, acknowledged, restored or stopping */
+    Thread sender;
+    int sender_started;
+    int claimed;
+    int listening;
+    int stopping;
+    int restored;
+
+    /* queued messages */
+    pub_msg_t** queue;
+    int head;
+    int count;
+
+    /* sent messages in the order they were queued */
+    pub_msg_t** window;
+    int in_flight;
+
+    evrythng_pipeline_stats_t stats;
+};
+
+
+static void ack(pub_msg_t* msg, evrythng_return_t rc)
+{
+    if (msg->callback)
+        (*msg->callback)(msg->ctx, rc);
+    platform_free(msg);
+}
+
+
+/* called by the thread reading the connection */
+static int on_puback(void* ctx, unsigned short packet_id)
+{
+    evrythng_pipeline_t p = (evrythng_pipeline_t)ctx;
+    int i, found = 0;
+
+    platform_mutex_lock(&p->mutex);
+    for (i = 0; i < p->in_flight && !found; i++)
+    {
+        pub_msg_t* msg = p->window[i];
+        if (msg->sent && !msg->acked && msg->packet_id == packet_id)
+            msg->acked = found = 1;
+    }
+
+    /* the sender fills the room made in the window right away */
+    if (found && p->count && !p->stopping)
+        found = 2;
+    platform_mutex_unlock(&p->mutex);
+
+    if (found)
+        platform_semaphore_post(&p->wake);
+
+    return found;
+}
+
+
+/* removes acknowledged and given up messages from the window and calls
+ * their callbacks, without the lock held */
+static void complete(evrythng_pipeline_t p)
+{
+    pub_msg_t* done = 0;
+    pub_msg_t** last = &done;
+    int i, kept = 0;
+
+    for (i = 0; i < p->in_flight; i++)
+    {
+        pub_msg_t* msg = p->window[i];
+
+        if (!msg->acked && (msg->sent || msg->attempts < p->config.max_attempts))
+        {
+            p->window[kept++] = msg;
+            continue;
+        }
+
+        if (msg->acked)
+            p->stats.acked++;
+        else
+            p->stats.dropped++;
+
+        msg->next = 0;
+        *last = msg;
+        last = &msg->next;
+    }
+    p->in_flight = kept;
+    p->stats.in_flight = kept;
+
+    if (!done)
+        return;
+
+    platform_mutex_unlock(&p->mutex);
+    while (done)
+    {
+        pub_msg_t* msg = done;
+        done = msg->next;
+
+        /* the outbox frees the ids it handed a PUBACK for */
+        if (!msg->acked)
+            outbox_release_packet_id(msg->packet_id);
+        ack(msg, msg->acked ? EVRYTHNG_SUCCESS : EVRYTHNG_FAILURE);
+    }
+    platform_mutex_lock(&p->mutex);
+}
+
+
+/* (re)sends msg, called and returns with the lock held. Returns 0 if the
+ * packet was queued for writing. */
+static int transmit(evrythng_pipeline_t p, pub_msg_t* msg)
+{
+    if (msg->attempts)
+    {
+        msg->packet[0] |= MQTT_DUP;
+        p->stats.retransmits++;
+    }
+    msg->attempts++;
+    msg->sent = 1;
+    msg->sent_ms = platform_uptime_ms();
+
+    /* the PUBACK can't be there before the packet is written */
+    platform_mutex_unlock(&p->mutex);
+    int rc = outbox_send(msg->packet, msg->len);
+    platform_mutex_lock(&p->mutex);
+
+    /* most likely the connection is down, sent again once it is restored
+     * or the retry interval has passed */
+    if (rc != 0)
+        msg->sent = 0;
+
+    return rc;
+}
+
+
+static void sender_thread(void* arg)
+{
+    evrythng_pipeline_t p = (evrythng_pipeline_t)arg;
+
+    platform_mutex_lock(&p->mutex);
+    while (!p->stopping)
+    {
+        int i, wait_ms = -1, blocked = 0;
+
+        /* a new connection gets all unacknowledged messages again, in order */
+        if (p->restored)
+        {
+            p->restored = 0;
+            for (i = 0; i < p->in_flight; i++)
+                p->window[i]->sent_ms = platform_uptime_ms() - p->config.retry_ms;
+        }
+
+        complete(p);
+
+        /* nothing is sent past a message that could not be, to keep the order */
+        for (i = 0; i < p->in_flight && !p->stopping && !blocked; i++)
+        {
+            pub_msg_t* msg = p->window[i];
+            if (msg->acked)
+                continue;
+
+            int32_t left = (int32_t)(msg->sent_ms + p->config.retry_ms - platform_uptime_ms());
+            if (left <= 0 && msg->attempts >= p->config.max_attempts)
+            {
+                /* given up, completed on the next round */
+                msg->sent = 0;
+                wait_ms = 0;
+                continue;
+            }
+
+            if (left <= 0)
+            {
+                blocked = transmit(p, msg) != 0;
+                left = p->config.retry_ms;
+            }
+
+            if (wait_ms < 0 || left < wait_ms)
+                wait_ms = left;
+        }
+
+        /* new messages as long as the window has room */
+        while (p->count && p->in_flight < p->config.window && !p->stopping && !blocked)
+        {
+            pub_msg_t* msg = p->queue[p->head];
+
+            /* only the sender takes messages off the queue. The outbox
+             * calls on_puback() with its lock held, it is never asked for
+             * an id with ours. */
+            platform_mutex_unlock(&p->mutex);
+            unsigned short packet_id = outbox_packet_id();
+            platform_mutex_lock(&p->mutex);
+
+            /* all ids in use, the next PUBACK frees one */
+            if (!packet_id)
+            {
+                blocked = 1;
+                if (wait_ms < 0 || p->config.retry_ms < wait_ms)
+                    wait_ms = p->config.retry_ms;
+                break;
+            }
+            msg->packet_id = packet_id;
+            msg->packet[msg->id_pos] = (unsigned char)(packet_id >> 8);
+            msg->packet[msg->id_pos + 1] = (unsigned char)packet_id;
+
+            p->head = (p->head + 1) % p->config.queue_size;
+            p->count--;
+
+            p->window[p->in_flight++] = msg;
+            p->stats.in_flight = p->in_flight;
+            if (p->stats.in_flight > p->stats.max_in_flight)
+                p->stats.max_in_flight = p->stats.in_flight;
+
+            blocked = transmit(p, msg) != 0;
+            if (wait_ms < 0 || p->config.retry_ms < wait_ms)
+                wait_ms = p->config.retry_ms;
+        }
+
+        platform_mutex_unlock(&p->mutex);
+        platform_semaphore_wait(&p->wake, wait_ms);
+        platform_mutex_lock(&p->mutex);
+    }
+    platform_mutex_unlock(&p->mutex);
+}
+
+
+/* allocates a message with room for a packet of size bytes and extra
+ * bytes behind it */
+static pub_msg_t* msg_new(int size, int extra, evrythng_pub_ack_callback* callback, void* ctx)
+{
+    pub_msg_t* msg = (pub_msg_t*)platform_malloc(sizeof(pub_msg_t) + size + extra);
+    if (!msg)
+        return 0;
+
+    memset(msg, 0, sizeof(pub_msg_t));
+    msg->callback = callback;
+    msg->ctx = ctx;
+    msg->packet = (unsigned char*)(msg + 1);
+
+    return msg;
+}
+
+
+/* offset of the packet id in a QoS 1 PUBLISH packet, -1 if it is cut */
+static int packet_id_offset(const unsigned char* packet, int len)
+{
+    int i = 1;
+
+    /* remaining length */
+    while (i < len && i < 5 && (packet[i] & 128))
+        i++;
+    i++;
+
+    if (i + 2 > len)
+        return -1;
+    i += 2 + (packet[i] << 8 | packet[i + 1]);
+
+    return i + 2 <= len ? i : -1;
+}
+
+
+/* msg was serialized with packet id 0, the id is set in the window */
+static evrythng_return_t enqueue(evrythng_pipeline_t p, pub_msg_t* msg)
+{
+    if ((msg->id_pos = packet_id_offset(msg->packet, msg->len)) < 0)
+    {
+        platform_free(msg);
+        return EVRYTHNG_BAD_ARGS;
+    }
+
+    platform_mutex_lock(&p->mutex);
+    if (p->count == p->config.queue_size)
+    {
+        platform_mutex_unlock(&p->mutex);
+        platform_free(msg);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+    p->queue[(p->head + p->count) % p->config.queue_size] = msg;
+    p->count++;
+    p->stats.queued++;
+    platform_mutex_unlock(&p->mutex);
+
+    platform_semaphore_post(&p->wake);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+static evrythng_return_t enqueue_thng(evrythng_pipeline_t p,
+        pub_type_t type,
+        const char* thng_id,
+        const char* name,
+        const char* json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx)
+{
+    if (!p || !thng_id || !name || !json || !*thng_id || !*name)
+        return EVRYTHNG_BAD_ARGS;
+
+    const char* kind = type == PUB_THNG_PROPERTY ? "properties" : "actions";
+    int topic_len = strlen("thngs///") + strlen(thng_id) + strlen(kind) + strlen(name);
+    int json_len = strlen(json);
+
+    /* fixed header with up to 4 length bytes, topic, packet id, payload */
+    int size = 5 + 2 + topic_len + 2 + json_len;
+
+    pub_msg_t* msg = msg_new(size, topic_len + 1, callback, ctx);
+    if (!msg)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    /* the topic is built behind the packet buffer, MQTTSerialize_publish()
+     * copies it into the packet */
+    char* topic = (char*)msg->packet + size;
+    sprintf(topic, "thngs/%s/%s/%s", thng_id, kind, name);
+
+    MQTTString topic_name = MQTTString_initializer;
+    topic_name.cstring = topic;
+
+    msg->len = MQTTSerialize_publish(msg->packet, size, 0, 1, 0, 0,
+            topic_name, (unsigned char*)json, json_len);
+    if (msg->len <= 0)
+    {
+        platform_free(msg);
+        return EVRYTHNG_BAD_ARGS;
+    }
+
+    return enqueue(p, msg);
+}
+
+
+evrythng_return_t EvrythngPipelineCreate(evrythng_pipeline_t* pipeline,
+        evrythng_handle_t handle,
+        const evrythng_pipeline_config_t* config)
+{
+    if (!pipeline || !handle || !config ||
+            config->window <= 0 || config->queue_size <= 0 || config->max_attempts <= 0 ||
+            config->retry_ms <= 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    evrythng_pipeline_t p = (evrythng_pipeline_t)platform_malloc(sizeof(struct evrythng_pipeline_ctx_t));
+    if (!p)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    memset(p, 0, sizeof(struct evrythng_pipeline_ctx_t));
+    p->handle = handle;
+    p->config = *config;
+
+    p->queue = (pub_msg_t**)platform_malloc(config->queue_size * sizeof(pub_msg_t*));
+    p->window = (pub_msg_t**)platform_malloc(config->window * sizeof(pub_msg_t*));
+    if (!p->queue || !p->window)
+    {
+        if (p->queue) platform_free(p->queue);
+        if (p->window) platform_free(p->window);
+        platform_free(p);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    platform_mutex_init(&p->mutex);
+    platform_semaphore_init(&p->wake);
+
+    /* the outbox only sends on the connection of one handle */
+    if (outbox_claim(handle) != 0)
+    {
+        EvrythngPipelineDestroy(p);
+        return EVRYTHNG_BAD_ARGS;
+    }
+    p->claimed = 1;
+
+    if (outbox_add_listener(on_puback, p) != 0)
+    {
+        EvrythngPipelineDestroy(p);
+        return EVRYTHNG_FAILURE;
+    }
+    p->listening = 1;
+
+    if (platform_thread_create(&p->sender,
+                config->priority, "evt_pub", sender_thread, config->stack_size, p) != 0)
+    {
+        EvrythngPipelineDestroy(p);
+        return EVRYTHNG_FAILURE;
+    }
+    p->sender_started = 1;
+
+    *pipeline = p;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngPipelineDestroy(evrythng_pipeline_t p)
+{
+    int i;
+
+    if (!p) return;
+
+    platform_mutex_lock(&p->mutex);
+    p->stopping = 1;
+    platform_mutex_unlock(&p->mutex);
+
+    /* the sender never blocks in the client, it returns as soon as it
+     * sees stopping: wait for it before anything is freed */
+    if (p->sender_started)
+    {
+        platform_semaphore_post(&p->wake);
+        platform_thread_join(&p->sender, -1);
+        platform_thread_destroy(&p->sender);
+    }
+
+    /* no PUBACK is matched against the window after that */
+    if (p->listening)
+        outbox_remove_listener(on_puback, p);
+
+    for (i = 0; i < p->in_flight; i++)
+    {
+        if (!p->window[i]->acked)
+            outbox_release_packet_id(p->window[i]->packet_id);
+        ack(p->window[i], p->window[i]->acked ? EVRYTHNG_SUCCESS : EVRYTHNG_FAILURE);
+    }
+
+    while (p->count)
+    {
+        ack(p->queue[p->head], EVRYTHNG_FAILURE);
+        p->head = (p->head + 1) % p->config.queue_size;
+        p->count--;
+    }
+
+    if (p->claimed)
+        outbox_release(p->handle);
+
+    platform_semaphore_deinit(&p->wake);
+    platform_mutex_deinit(&p->mutex);
+
+    platform_free(p->window);
+    platform_free(p->queue);
+    platform_free(p);
+}
+
+
+evrythng_return_t EvrythngPipelinePubThngProperty(evrythng_pipeline_t pipeline,
+        const char* thng_id,
+        const char* property_name,
+        const char* property_json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx)
+{
+    return enqueue_thng(pipeline, PUB_THNG_PROPERTY, thng_id, property_name, property_json, callback, ctx);
+}
+
+
+evrythng_return_t EvrythngPipelinePubThngAction(evrythng_pipeline_t pipeline,
+        const char* thng_id,
+        const char* action_name,
+        const char* action_json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx)
+{
+    return enqueue_thng(pipeline, PUB_THNG_ACTION, thng_id, action_name, action_json, callback, ctx);
+}
+
+
+evrythng_return_t EvrythngPipelinePubPrepared(evrythng_pipeline_t pipeline,
+        const evrythng_prepared_t* prepared,
+        const char* json,
+        evrythng_pub_ack_callback* callback,
+        void* ctx)
+{
+    if (!pipeline || !prepared || !prepared->data || prepared->qos != 1 || !json ||
+            (prepared->handle && prepared->handle != pipeline->handle))
+        return EVRYTHNG_BAD_ARGS;
+
+    int json_len = strlen(json);
+    int size = 5 + (int)prepared->header_len + 2 + json_len;
+
+    pub_msg_t* msg = msg_new(size, 0, callback, ctx);
+    if (!msg)
+        return EVRYTHNG_MEMORY_ERROR;
+
+    msg->len = EvrythngPreparedSerialize(prepared, msg->packet, size, 0,
+            (const unsigned char*)json, json_len);
+    if (msg->len <= 0)
+    {
+        platform_free(msg);
+        return EVRYTHNG_BAD_ARGS;
+    }
+
+    return enqueue(pipeline, msg);
+}
+
+
+void EvrythngPipelineOnConnectionRestored(evrythng_pipeline_t p)
+{
+    if (!p) return;
+
+    platform_mutex_lock(&p->mutex);
+    p->restored = 1;
+    platform_mutex_unlock(&p->mutex);
+
+    platform_semaphore_post(&p->wake);
+}
+
+
+void EvrythngPipelineStats(evrythng_pipeline_t p, evrythng_pipeline_stats_t* stats)
+{
+    if (!p || !stats) return;
+
+    platform_mutex_lock(&p->mutex);
+    *stats = p->stats;
+    platform_mutex_unlock(&p->mutex);
+}
@@ -0,0 +1,176 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include "evrythng/prepared.h"
+#include "evrythng/outbox.h"
+#include "evrythng/platform_ext.h"
+
+#define MQTT_PUBLISH 0x30
+
+/* topic length is encoded in 2 bytes */
+#define MAX_TOPIC_LEN 0xFFFF
+
+
+evrythng_return_t EvrythngPrepare(evrythng_prepared_t* p,
+        evrythng_handle_t handle,
+        evrythng_prepared_type_t type,
+        const char* thng_id,
+        const char* name,
+        int qos)
+{
+    if (!p || !thng_id || !name || !*thng_id || !*name || qos < 0 || qos > 1)
+        return EVRYTHNG_BAD_ARGS;
+
+    const char* kind = type == EVRYTHNG_PREPARED_THNG_PROPERTY ? "properties" : "actions";
+
+    size_t thng_id_len = strlen(thng_id);
+    size_t name_len = strlen(name);
+    size_t topic_len = strlen("thngs/") + thng_id_len + 1 + strlen(kind) + 1 + name_len;
+
+    if (topic_len > MAX_TOPIC_LEN)
+        return EVRYTHNG_BAD_ARGS;
+
+    memset(p, 0, sizeof(evrythng_prepared_t));
+
+    /* the outbox only sends on the connection of one handle */
+    if (handle && outbox_claim(handle) != 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    p->data = (unsigned char*)platform_malloc(thng_id_len + 1 + name_len + 1 + 3 + topic_len + 1);
+    if (!p->data)
+    {
+        outbox_release(handle);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    p->handle = handle;
+    p->type = type;
+    p->qos = qos;
+
+    char* thng = (char*)p->data;
+    memcpy(thng, thng_id, thng_id_len + 1);
+    p->thng_id = thng;
+
+    char* n = thng + thng_id_len + 1;
+    memcpy(n, name, name_len + 1);
+    p->name = n;
+
+    p->header = (unsigned char*)(n + name_len + 1);
+    p->header[0] = MQTT_PUBLISH | (qos << 1);
+    p->header[1] = (unsigned char)(topic_len >> 8);
+    p->header[2] = (unsigned char)(topic_len & 0xFF);
+    p->header_len = 3 + topic_len;
+
+    char* topic = (char*)p->header + 3;
+    sprintf(topic, "thngs/%s/%s/%s", thng_id, kind, name);
+    p->topic = topic;
+    p->topic_len = topic_len;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngPreparedFree(evrythng_prepared_t* p)
+{
+    if (!p || !p->data) return;
+
+    outbox_release(p->handle);
+    platform_free(p->data);
+    memset(p, 0, sizeof(evrythng_prepared_t));
+}
+
+
+evrythng_return_t EvrythngPreparedPublish(const evrythng_prepared_t* p, const char* json)
+{
+    if (!p || !p->data || !p->handle || !json)
+        return EVRYTHNG_BAD_ARGS;
+
+    unsigned char stack_buf[EVRYTHNG_PREPARED_STACK_PACKET];
+    unsigned char* buf = stack_buf;
+    int json_len = strlen(json);
+
+    /* fixed header with up to 4 length bytes, topic, packet id, payload */
+    int size = 5 + (int)p->header_len + 2 + json_len;
+    if (size > (int)sizeof stack_buf && !(buf = (unsigned char*)platform_malloc(size)))
+        return EVRYTHNG_MEMORY_ERROR;
+
+    unsigned short packet_id = 0;
+    evrythng_return_t rc = EVRYTHNG_BAD_ARGS;
+
+    int len = EvrythngPreparedSerialize(p, buf, size, 0, (const unsigned char*)json, json_len);
+
+    /* all ids in use by the pipelines and other prepared publishes */
+    if (len > 0 && p->qos && !(packet_id = outbox_packet_id()))
+        rc = EVRYTHNG_FAILURE;
+    else if (len > 0)
+    {
+        int sent;
+
+        if (p->qos)
+        {
+            /* the packet id is right before the payload */
+            buf[len - json_len - 2] = (unsigned char)(packet_id >> 8);
+            buf[len - json_len - 1] = (unsigned char)(packet_id & 0xFF);
+            sent = outbox_send_wait(buf, len, packet_id, EVRYTHNG_PREPARED_TIMEOUT_MS);
+        }
+        else
+            sent = outbox_send(buf, len);
+
+        rc = sent == 0 ? EVRYTHNG_SUCCESS : EVRYTHNG_FAILURE;
+    }
+
+    if (buf != stack_buf)
+        platform_free(buf);
+
+    return rc;
+}
+
+
+int EvrythngPreparedSerialize(const evrythng_prepared_t* p,
+        unsigned char* buf, int buflen,
+        unsigned short packet_id,
+        const unsigned char* payload, int payload_len)
+{
+    if (!p || !p->data || !buf || (payload_len && !payload) || payload_len < 0)
+        return -1;
+
+    /* everything after the fixed header: topic, packet id, payload */
+    int remaining = (int)(p->header_len - 1) + (p->qos ? 2 : 0) + payload_len;
+
+    unsigned char len_bytes[4];
+    int len_size = 0;
+    int rem = remaining;
+    do {
+        unsigned char b = rem % 128;
+        rem /= 128;
+        if (rem) b |= 128;
+        len_bytes[len_size++] = b;
+    } while (rem && len_size < 4);
+
+    if (rem || 1 + len_size + remaining > buflen)
+        return -1;
+
+    unsigned char* ptr = buf;
+    *ptr++ = p->header[0];
+    memcpy(ptr, len_bytes, len_size);
+    ptr += len_size;
+    memcpy(ptr, p->header + 1, p->header_len - 1);
+    ptr += p->header_len - 1;
+
+    if (p->qos)
+    {
+        *ptr++ = (unsigned char)(packet_id >> 8);
+        *ptr++ = (unsigned char)(packet_id & 0xFF);
+    }
+
+    if (payload_len)
+        memcpy(ptr, payload, payload_len);
+    ptr += payload_len;
+
+    return (int)(ptr - buf);
+}
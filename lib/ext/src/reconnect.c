@@ -0,0 +1,258 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/reconnect.h"
+#include "evrythng/connect_backoff.h"
+#include "evrythng/platform_ext.h"
+
+/* paces the connections of the platform, see EvrythngReconnectPace().
+ * Guards the backoffs of all connections too: connects, reads and
+ * disconnects of one connection may run on different threads. */
+static Mutex mutex;
+static int mutex_state;         /* 0: none, 1: being created, 2: ready */
+
+static int pacing;
+static evrythng_reconnect_policy_t pace_policy;
+static evrythng_reconnect_stats_t pace_stats;
+
+
+/* created on first use by whichever thread gets there first */
+static void lock(void)
+{
+    int none = 0;
+
+    if (__atomic_load_n(&mutex_state, __ATOMIC_ACQUIRE) != 2)
+    {
+        if (__atomic_compare_exchange_n(&mutex_state, &none, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            platform_mutex_init(&mutex);
+            __atomic_store_n(&mutex_state, 2, __ATOMIC_RELEASE);
+        }
+        else
+        {
+            while (__atomic_load_n(&mutex_state, __ATOMIC_ACQUIRE) != 2)
+                platform_sleep(1);
+        }
+    }
+    platform_mutex_lock(&mutex);
+}
+
+
+static void unlock(void)
+{
+    platform_mutex_unlock(&mutex);
+}
+
+
+static void policy_init(evrythng_reconnect_policy_t* policy, const evrythng_reconnect_policy_t* from)
+{
+    static const evrythng_reconnect_policy_t default_policy = EVRYTHNG_RECONNECT_POLICY_DEFAULT;
+
+    *policy = from ? *from : default_policy;
+
+    if (policy->initial_ms <= 0) policy->initial_ms = 1;
+    if (policy->max_ms < policy->initial_ms) policy->max_ms = policy->initial_ms;
+}
+
+
+/* delay before the attempt after n failed ones */
+static int delay(const evrythng_reconnect_policy_t* policy, int n)
+{
+    if (policy->fast_retry)
+    {
+        if (!n) return 0;
+        n--;
+    }
+
+    /* initial_ms * 2^n without overflowing */
+    int ceiling = policy->initial_ms;
+    while (n-- > 0 && ceiling < policy->max_ms)
+        ceiling = ceiling > policy->max_ms / 2 ? policy->max_ms : ceiling * 2;
+
+    if (ceiling > policy->max_ms)
+        ceiling = policy->max_ms;
+
+    return (int)((unsigned)platform_rand() % (unsigned)(ceiling + 1));
+}
+
+
+void EvrythngReconnectInit(evrythng_reconnect_t* r, const evrythng_reconnect_policy_t* policy)
+{
+    if (!r) return;
+
+    memset(r, 0, sizeof(evrythng_reconnect_t));
+    policy_init(&r->policy, policy);
+
+    r->lost_at = platform_uptime_ms();
+}
+
+
+int EvrythngReconnectDelay(evrythng_reconnect_t* r)
+{
+    if (!r) return 0;
+
+    return delay(&r->policy, r->attempt++);
+}
+
+
+void EvrythngReconnectOnConnected(evrythng_reconnect_t* r)
+{
+    if (!r || r->connected) return;
+
+    uint32_t now = platform_uptime_ms();
+    uint32_t ttr = now - r->lost_at;
+
+    r->connected = 1;
+    r->connected_at = now;
+
+    r->stats.reconnects++;
+    r->stats.last_ttr_ms = ttr;
+    r->stats.total_ttr_ms += ttr;
+    if (ttr > r->stats.max_ttr_ms)
+        r->stats.max_ttr_ms = ttr;
+}
+
+
+void EvrythngReconnectOnLost(evrythng_reconnect_t* r)
+{
+    if (!r || !r->connected) return;
+
+    uint32_t now = platform_uptime_ms();
+
+    /* a flapping connection keeps backing off, a stable one starts over */
+    if ((int)(now - r->connected_at) >= r->policy.stable_ms)
+        r->attempt = 0;
+
+    r->connected = 0;
+    r->lost_at = now;
+}
+
+
+evrythng_return_t EvrythngReconnect(evrythng_handle_t handle, evrythng_reconnect_t* r, int max_attempts)
+{
+    evrythng_return_t rc = EVRYTHNG_FAILURE;
+    int attempts = 0;
+
+    if (!handle || !r) return EVRYTHNG_BAD_ARGS;
+
+    while (max_attempts <= 0 || attempts++ < max_attempts)
+    {
+        int delay_ms = EvrythngReconnectDelay(r);
+        if (delay_ms > 0)
+            platform_sleep(delay_ms);
+
+        r->stats.attempts++;
+
+        if ((rc = EvrythngConnect(handle)) == EVRYTHNG_SUCCESS)
+        {
+            EvrythngReconnectOnConnected(r);
+            break;
+        }
+
+        platform_printf("connection attempt %u failed (%d)\n", r->stats.attempts, rc);
+    }
+
+    return rc;
+}
+
+
+void EvrythngReconnectPace(const evrythng_reconnect_policy_t* policy)
+{
+    lock();
+    pacing = policy != 0;
+    if (policy)
+        policy_init(&pace_policy, policy);
+    unlock();
+}
+
+
+void EvrythngReconnectPaceStats(evrythng_reconnect_stats_t* stats)
+{
+    if (!stats) return;
+
+    lock();
+    *stats = pace_stats;
+    unlock();
+}
+
+
+int connect_backoff_before(ConnectBackoff* b)
+{
+    lock();
+    if (!pacing)
+    {
+        unlock();
+        return 0;
+    }
+
+    uint32_t now = platform_uptime_ms();
+    int32_t wait_ms = b->attempt ? (int32_t)(b->not_before_ms - now) : 0;
+    if (wait_ms > CONNECT_BACKOFF_MAX_WAIT_MS)
+    {
+        pace_stats.deferred++;
+        unlock();
+        return -1;
+    }
+    if (wait_ms < 0)
+        wait_ms = 0;
+
+    /* the delay before the next attempt is drawn now, a failed attempt
+     * just has to wait for it */
+    pace_stats.attempts++;
+    b->not_before_ms = now + wait_ms + delay(&pace_policy, b->attempt++);
+    unlock();
+
+    if (wait_ms)
+        platform_sleep(wait_ms);
+
+    return 0;
+}
+
+
+void connect_backoff_on_connected(ConnectBackoff* b)
+{
+    lock();
+    if (!b->connected)
+    {
+        uint32_t now = platform_uptime_ms();
+        uint32_t ttr = now - b->lost_at;
+
+        b->connected = 1;
+        b->connected_at = now;
+
+        /* the first connection is no reconnect */
+        if (b->lost_at)
+        {
+            pace_stats.reconnects++;
+            pace_stats.last_ttr_ms = ttr;
+            pace_stats.total_ttr_ms += ttr;
+            if (ttr > pace_stats.max_ttr_ms)
+                pace_stats.max_ttr_ms = ttr;
+        }
+    }
+    unlock();
+}
+
+
+void connect_backoff_on_closed(ConnectBackoff* b, int connected)
+{
+    if (!connected) return;
+
+    lock();
+    uint32_t now = platform_uptime_ms();
+
+    /* a flapping connection keeps backing off, a stable one starts over */
+    if ((int)(now - b->connected_at) >= pace_policy.stable_ms)
+    {
+        b->attempt = 0;
+        b->not_before_ms = now;
+    }
+
+    b->connected = 0;
+    b->lost_at = now ? now : 1;
+    unlock();
+}
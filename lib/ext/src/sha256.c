@@ -0,0 +1,148 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/sha256.h"
+
+#if defined(EVRYTHNG_USE_MBEDTLS_SHA256)
+
+void EvrythngSha256Init(evrythng_sha256_t* ctx)
+{
+    mbedtls_sha256_init(ctx);
+    mbedtls_sha256_starts(ctx, 0);
+}
+
+
+void EvrythngSha256Update(evrythng_sha256_t* ctx, const void* data, size_t len)
+{
+    mbedtls_sha256_update(ctx, (const unsigned char*)data, len);
+}
+
+
+void EvrythngSha256Finish(evrythng_sha256_t* ctx, unsigned char digest[EVRYTHNG_SHA256_SIZE])
+{
+    mbedtls_sha256_finish(ctx, digest);
+    mbedtls_sha256_free(ctx);
+}
+
+#else
+
+static const uint32_t k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+
+static void transform(evrythng_sha256_t* ctx, const unsigned char* p)
+{
+    uint32_t w[64], s[8];
+    int i;
+
+    for (i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+
+    for (; i < 64; i++)
+    {
+        uint32_t s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    memcpy(s, ctx->state, sizeof s);
+
+    for (i = 0; i < 64; i++)
+    {
+        uint32_t t1 = s[7] + (ROR(s[4], 6) ^ ROR(s[4], 11) ^ ROR(s[4], 25)) +
+            ((s[4] & s[5]) ^ (~s[4] & s[6])) + k[i] + w[i];
+        uint32_t t2 = (ROR(s[0], 2) ^ ROR(s[0], 13) ^ ROR(s[0], 22)) +
+            ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+        s[7] = s[6]; s[6] = s[5]; s[5] = s[4]; s[4] = s[3] + t1;
+        s[3] = s[2]; s[2] = s[1]; s[1] = s[0]; s[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++)
+        ctx->state[i] += s[i];
+}
+
+
+void EvrythngSha256Init(evrythng_sha256_t* ctx)
+{
+    static const uint32_t init[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+
+    memcpy(ctx->state, init, sizeof init);
+    ctx->length = 0;
+    ctx->block_len = 0;
+}
+
+
+void EvrythngSha256Update(evrythng_sha256_t* ctx, const void* data, size_t len)
+{
+    const unsigned char* p = (const unsigned char*)data;
+
+    ctx->length += len;
+
+    if (ctx->block_len)
+    {
+        size_t n = 64 - ctx->block_len < len ? 64 - ctx->block_len : len;
+        memcpy(ctx->block + ctx->block_len, p, n);
+        ctx->block_len += n;
+        p += n;
+        len -= n;
+
+        if (ctx->block_len < 64)
+            return;
+
+        transform(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    for (; len >= 64; p += 64, len -= 64)
+        transform(ctx, p);
+
+    memcpy(ctx->block, p, len);
+    ctx->block_len = len;
+}
+
+
+void EvrythngSha256Finish(evrythng_sha256_t* ctx, unsigned char digest[EVRYTHNG_SHA256_SIZE])
+{
+    uint64_t bits = ctx->length * 8;
+    int i;
+
+    ctx->block[ctx->block_len++] = 0x80;
+    if (ctx->block_len > 56)
+    {
+        memset(ctx->block + ctx->block_len, 0, 64 - ctx->block_len);
+        transform(ctx, ctx->block);
+        ctx->block_len = 0;
+    }
+
+    memset(ctx->block + ctx->block_len, 0, 56 - ctx->block_len);
+    for (i = 0; i < 8; i++)
+        ctx->block[56 + i] = (unsigned char)(bits >> (56 - 8 * i));
+    transform(ctx, ctx->block);
+
+    for (i = 0; i < 8; i++)
+    {
+        digest[4 * i] = (unsigned char)(ctx->state[i] >> 24);
+        digest[4 * i + 1] = (unsigned char)(ctx->state[i] >> 16);
+        digest[4 * i + 2] = (unsigned char)(ctx->state[i] >> 8);
+        digest[4 * i + 3] = (unsigned char)ctx->state[i];
+    }
+}
+
+#endif
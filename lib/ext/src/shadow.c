@@ -0,0 +1,413 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "evrythng/shadow.h"
+#include "evrythng/platform_ext.h"
+
+typedef struct shadow_slot_t
+{
+    int used;
+    uint64_t key;       /* hash of "<thng_id>/<property>" */
+    evrythng_shadow_callback* callback;
+    void* ctx;
+
+    int has_value;
+    size_t value_len;
+    char inline_value[EVRYTHNG_SHADOW_VALUE_SIZE];
+    char* value;        /* inline_value or, for longer values, a heap copy */
+    uint32_t received_ms;
+} shadow_slot_t;
+
+static Mutex shadow_mutex;
+static shadow_slot_t slots[EVRYTHNG_SHADOW_MAX_PROPERTIES];
+static evrythng_shadow_stats_t stats;
+
+
+static void on_update(int slot, const char* json, size_t len);
+
+/* one core callback per slot, the slot index is all the context there is */
+#define SHADOW_TRAMPOLINE(n) \
+    static void shadow_callback_##n(const char* json, size_t len) { on_update(n, json, len); }
+
+SHADOW_TRAMPOLINE(0)
+SHADOW_TRAMPOLINE(1)
+SHADOW_TRAMPOLINE(2)
+SHADOW_TRAMPOLINE(3)
+SHADOW_TRAMPOLINE(4)
+SHADOW_TRAMPOLINE(5)
+SHADOW_TRAMPOLINE(6)
+SHADOW_TRAMPOLINE(7)
+
+static sub_callback* const trampolines[] = {
+    shadow_callback_0, shadow_callback_1, shadow_callback_2, shadow_callback_3,
+    shadow_callback_4, shadow_callback_5, shadow_callback_6, shadow_callback_7,
+};
+
+/* fails to compile if the number of trampolines doesn't match */
+typedef char shadow_trampolines_check[
+    sizeof trampolines / sizeof trampolines[0] == EVRYTHNG_SHADOW_MAX_PROPERTIES ? 1 : -1];
+
+
+static uint64_t make_key(const char* thng_id, const char* property_name)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const char* s;
+
+    for (s = thng_id; *s; s++)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    h = (h ^ '/') * 0x100000001b3ULL;
+    for (s = property_name; *s; s++)
+        h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+
+    return h;
+}
+
+
+static void free_value(shadow_slot_t* s)
+{
+    if (s->value && s->value != s->inline_value)
+        platform_free(s->value);
+    s->value = 0;
+    s->has_value = 0;
+}
+
+
+/* keeps a copy of the value, the whole value so a change is never taken
+ * for a duplicate. Without memory for it the slot has no value and the
+ * next update is delivered whatever it is. */
+static void store_value(shadow_slot_t* s, const char* value, size_t len)
+{
+    free_value(s);
+
+    if (len < sizeof s->inline_value)
+        s->value = s->inline_value;
+    else if (!(s->value = (char*)platform_malloc(len + 1)))
+        return;
+
+    memcpy(s->value, value, len);
+    s->value[len] = '\0';
+    s->value_len = len;
+    s->has_value = 1;
+}
+
+
+static const char* skip_ws(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n'))
+        p++;
+    return p;
+}
+
+
+/* p points to the opening quote, returns the position after the closing one */
+static const char* skip_string(const char* p, const char* end)
+{
+    for (p++; p < end; p++)
+    {
+        if (*p == '\\')
+            p++;
+        else if (*p == '"')
+            return p + 1;
+    }
+    return 0;
+}
+
+
+static const char* skip_value(const char* p, const char* end)
+{
+    int depth = 0;
+
+    if (p >= end)
+        return 0;
+
+    if (*p == '"')
+        return skip_string(p, end);
+
+    if (*p != '{' && *p != '[')
+    {
+        /* number, true, false, null */
+        while (p < end && *p != ',' && *p != '}' && *p != ']' &&
+                *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n')
+            p++;
+        return p;
+    }
+
+    while (p < end)
+    {
+        if (*p == '"')
+        {
+            if (!(p = skip_string(p, end)))
+                return 0;
+            continue;
+        }
+
+        if (*p == '{' || *p == '[')
+            depth++;
+        else if ((*p == '}' || *p == ']') && --depth == 0)
+            return p + 1;
+        p++;
+    }
+
+    return 0;
+}
+
+
+/* finds the "value" member of [{"key":...,"value":...,"timestamp":...}] */
+static int find_value(const char* json, size_t len, const char** value, size_t* value_len)
+{
+    const char* end = json + len;
+    const char* p = skip_ws(json, end);
+
+    if (p < end && *p == '[')
+        p = skip_ws(p + 1, end);
+
+    if (p >= end || *p != '{')
+        return -1;
+    p++;
+
+    while (1)
+    {
+        p = skip_ws(p, end);
+        if (p >= end || *p != '"')
+            return -1;
+
+        const char* key = p + 1;
+        if (!(p = skip_string(p, end)))
+            return -1;
+        size_t key_len = p - 1 - key;
+
+        p = skip_ws(p, end);
+        if (p >= end || *p != ':')
+            return -1;
+        p = skip_ws(p + 1, end);
+
+        const char* v = p;
+        if (!(p = skip_value(p, end)) || p == v)
+            return -1;
+
+        if (key_len == 5 && !memcmp(key, "value", 5))
+        {
+            *value = v;
+            *value_len = p - v;
+            return 0;
+        }
+
+        p = skip_ws(p, end);
+        if (p >= end || *p != ',')
+            return -1;
+        p++;
+    }
+}
+
+
+static void on_update(int slot, const char* json, size_t len)
+{
+    shadow_slot_t* s = &slots[slot];
+    const char* value;
+    size_t value_len;
+
+    platform_mutex_lock(&shadow_mutex);
+
+    if (!s->used)
+    {
+        platform_mutex_unlock(&shadow_mutex);
+        return;
+    }
+
+    stats.updates++;
+
+    if (find_value(json, len, &value, &value_len))
+    {
+        stats.parse_errors++;
+        platform_mutex_unlock(&shadow_mutex);
+        return;
+    }
+
+    int duplicate = s->has_value && s->value_len == value_len && !memcmp(s->value, value, value_len);
+
+    s->received_ms = platform_uptime_ms();
+
+    if (duplicate)
+    {
+        stats.duplicates++;
+        platform_mutex_unlock(&shadow_mutex);
+        return;
+    }
+
+    store_value(s, value, value_len);
+
+    evrythng_shadow_callback* callback = s->callback;
+    void* ctx = s->ctx;
+
+    platform_mutex_unlock(&shadow_mutex);
+
+    if (callback)
+        (*callback)(ctx, json, len);
+}
+
+
+void EvrythngShadowInit(void)
+{
+    int i;
+
+    for (i = 0; i < EVRYTHNG_SHADOW_MAX_PROPERTIES; i++)
+        free_value(&slots[i]);
+    memset(slots, 0, sizeof slots);
+    memset(&stats, 0, sizeof stats);
+    platform_mutex_init(&shadow_mutex);
+}
+
+
+evrythng_return_t EvrythngShadowSubThngProperty(evrythng_handle_t handle,
+        const char* thng_id,
+        const char* property_name,
+        evrythng_shadow_callback* callback,
+        void* ctx,
+        int* slot)
+{
+    int i;
+
+    if (!thng_id || !property_name)
+        return EVRYTHNG_BAD_ARGS;
+
+    uint64_t key = make_key(thng_id, property_name);
+
+    platform_mutex_lock(&shadow_mutex);
+    for (i = 0; i < EVRYTHNG_SHADOW_MAX_PROPERTIES; i++)
+    {
+        if (slots[i].used && slots[i].key == key)
+        {
+            platform_mutex_unlock(&shadow_mutex);
+            return EVRYTHNG_BAD_ARGS;
+        }
+    }
+    for (i = 0; i < EVRYTHNG_SHADOW_MAX_PROPERTIES && slots[i].used; i++)
+        ;
+    if (i == EVRYTHNG_SHADOW_MAX_PROPERTIES)
+    {
+        platform_mutex_unlock(&shadow_mutex);
+        return EVRYTHNG_MEMORY_ERROR;
+    }
+
+    free_value(&slots[i]);
+    memset(&slots[i], 0, sizeof(shadow_slot_t));
+    slots[i].used = 1;
+    slots[i].key = key;
+    slots[i].callback = callback;
+    slots[i].ctx = ctx;
+    platform_mutex_unlock(&shadow_mutex);
+
+    evrythng_return_t rc = handle ?
+        EvrythngSubThngProperty(handle, thng_id, property_name, 0, trampolines[i]) : EVRYTHNG_SUCCESS;
+    if (rc != EVRYTHNG_SUCCESS)
+    {
+        platform_mutex_lock(&shadow_mutex);
+        slots[i].used = 0;
+        platform_mutex_unlock(&shadow_mutex);
+        return rc;
+    }
+
+    if (slot)
+        *slot = i;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngShadowDispatch(int slot, const char* json, size_t len)
+{
+    if (slot < 0 || slot >= EVRYTHNG_SHADOW_MAX_PROPERTIES || !json)
+        return;
+
+    on_update(slot, json, len);
+}
+
+
+int EvrythngShadowFind(const char* thng_id, const char* property_name)
+{
+    int i, slot = -1;
+
+    if (!thng_id || !property_name)
+        return -1;
+
+    uint64_t key = make_key(thng_id, property_name);
+
+    platform_mutex_lock(&shadow_mutex);
+    for (i = 0; i < EVRYTHNG_SHADOW_MAX_PROPERTIES; i++)
+    {
+        if (slots[i].used && slots[i].key == key)
+        {
+            slot = i;
+            break;
+        }
+    }
+    platform_mutex_unlock(&shadow_mutex);
+
+    return slot;
+}
+
+
+int EvrythngShadowGet(int slot, char* value, size_t size, uint32_t* received_ms)
+{
+    int len = -1;
+
+    if (slot < 0 || slot >= EVRYTHNG_SHADOW_MAX_PROPERTIES)
+        return -1;
+
+    shadow_slot_t* s = &slots[slot];
+
+    platform_mutex_lock(&shadow_mutex);
+    if (s->used && s->has_value && (!value || s->value_len < size))
+    {
+        if (value)
+            memcpy(value, s->value, s->value_len + 1);
+        len = (int)s->value_len;
+        if (received_ms)
+            *received_ms = s->received_ms;
+    }
+    platform_mutex_unlock(&shadow_mutex);
+
+    return len;
+}
+
+
+int EvrythngShadowGetInt(int slot, int64_t* value)
+{
+    char buf[EVRYTHNG_SHADOW_VALUE_SIZE];
+    char* p = buf;
+    char* end;
+
+    int len = EvrythngShadowGet(slot, buf, sizeof buf, NULL);
+    if (len <= 0 || !value)
+        return -1;
+
+    /* numbers published as strings are accepted too */
+    if (buf[0] == '"' && len > 2 && buf[len - 1] == '"')
+    {
+        buf[len - 1] = '\0';
+        p++;
+    }
+
+    long long v = strtoll(p, &end, 10);
+    if (end == p || *end)
+        return -1;
+
+    *value = v;
+
+    return 0;
+}
+
+
+void EvrythngShadowStats(evrythng_shadow_stats_t* s)
+{
+    if (!s) return;
+
+    platform_mutex_lock(&shadow_mutex);
+    *s = stats;
+    platform_mutex_unlock(&shadow_mutex);
+}
@@ -0,0 +1,273 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/stream.h"
+#include "evrythng/outbox.h"
+#include "evrythng/platform_ext.h"
+
+#define MQTT_PUBLISH 3
+#define MQTT_PUBACK 0x40
+#define MQTT_SUBACK 0x90
+#define MQTT_UNSUBACK 0xB0
+
+static size_t stream_threshold;
+static stream_callback* stream_cb;
+static void* stream_ctx;
+static StreamStats stats;
+
+
+void platform_stream_configure(size_t threshold, stream_callback* callback, void* ctx)
+{
+    stream_threshold = threshold;
+    stream_ctx = ctx;
+    stream_cb = callback;
+}
+
+
+void platform_stream_stats(StreamStats* s)
+{
+    if (!s)
+    {
+        platform_printf("%s: invalid stats\n", __func__);
+        return;
+    }
+
+    *s = stats;
+}
+
+
+void stream_filter_reset(StreamFilter* f)
+{
+    f->header_len = 0;
+    f->header_pos = 0;
+    f->header_complete = 0;
+    f->body_remaining = 0;
+    f->ahead_len = 0;
+    f->ahead_pos = 0;
+}
+
+
+int stream_filter_idle(const StreamFilter* f)
+{
+    return !f->header_len && !f->body_remaining;
+}
+
+
+/* hands out body bytes read ahead */
+static int take_ahead(StreamFilter* f, unsigned char* buffer, int len)
+{
+    int bytes = 0;
+
+    while (bytes < len && f->ahead_pos < f->ahead_len)
+        buffer[bytes++] = f->ahead[f->ahead_pos++];
+
+    if (f->ahead_pos == f->ahead_len)
+        f->ahead_len = f->ahead_pos = 0;
+
+    f->body_remaining = (uint32_t)bytes < f->body_remaining ? f->body_remaining - bytes : 0;
+
+    return bytes;
+}
+
+
+/* reads the fixed header byte by byte, keeping what was read so far over
+ * timeouts. Returns 1 once it is complete. */
+static int read_header(StreamFilter* f, stream_io* read, void* io, int timeout_ms, int* rc)
+{
+    while (!f->header_complete)
+    {
+        if (f->header_len == (int)sizeof f->header)
+        {
+            /* remaining length longer than 4 bytes, not MQTT */
+            *rc = 0;
+            return 0;
+        }
+
+        if ((*rc = (*read)(io, &f->header[f->header_len], 1, timeout_ms)) <= 0)
+            return 0;
+
+        f->header_len++;
+        if (f->header_len > 1 && !(f->header[f->header_len - 1] & 128))
+            f->header_complete = 1;
+    }
+
+    return 1;
+}
+
+
+static uint32_t remaining_length(const StreamFilter* f)
+{
+    uint32_t remaining = 0, multiplier = 1;
+    int i;
+
+    for (i = 1; i < f->header_len; i++, multiplier *= 128)
+        remaining += (f->header[i] & 127) * multiplier;
+
+    return remaining;
+}
+
+
+/* consumes the body of a PUBLISH packet, returns 1 on success */
+static int stream_publish(StreamFilter* f, stream_io* read, stream_io* write, void* io, uint32_t remaining)
+{
+    int qos = (f->header[0] >> 1) & 3;
+    unsigned char buf[2];
+    uint32_t topic_len, offset = 0, total;
+    unsigned short packet_id = 0;
+
+    if ((*read)(io, buf, 2, STREAM_READ_TIMEOUT_MS) != 2)
+        return 0;
+    topic_len = buf[0] << 8 | buf[1];
+
+    if (2 + topic_len + (qos ? 2 : 0) > remaining)
+        return 0;
+
+    /* the part of the topic not fitting into the buffer is dropped */
+    uint32_t i, kept = topic_len < STREAM_TOPIC_SIZE ? topic_len : STREAM_TOPIC_SIZE - 1;
+    for (i = 0; i < topic_len; )
+    {
+        int n = topic_len - i < STREAM_CHUNK_SIZE ? (int)(topic_len - i) : STREAM_CHUNK_SIZE;
+        if ((*read)(io, f->chunk, n, STREAM_READ_TIMEOUT_MS) != n)
+            return 0;
+        if (i < kept)
+            memcpy(f->topic + i, f->chunk, kept - i < (uint32_t)n ? kept - i : (uint32_t)n);
+        i += n;
+    }
+    f->topic[kept] = '\0';
+
+    if (qos)
+    {
+        if ((*read)(io, buf, 2, STREAM_READ_TIMEOUT_MS) != 2)
+            return 0;
+        packet_id = (unsigned short)(buf[0] << 8 | buf[1]);
+    }
+
+    total = remaining - 2 - topic_len - (qos ? 2 : 0);
+
+    while (offset < total)
+    {
+        int n = total - offset < STREAM_CHUNK_SIZE ? (int)(total - offset) : STREAM_CHUNK_SIZE;
+
+        if ((*read)(io, f->chunk, n, STREAM_READ_TIMEOUT_MS) != n)
+        {
+            stats.aborted++;
+            if (stream_cb)
+                (*stream_cb)(stream_ctx, f->topic, f->chunk, 0, offset, total);
+            return 0;
+        }
+
+        if (stream_cb)
+            (*stream_cb)(stream_ctx, f->topic, f->chunk, n, offset, total);
+        offset += n;
+    }
+
+    stats.messages++;
+    stats.bytes += total;
+    if (total > stats.max_message)
+        stats.max_message = total;
+
+    /* the client never saw the message, acknowledge it here. Reads and
+     * writes of the client happen under its lock, so this doesn't
+     * interleave with packets the client is sending. */
+    if (qos == 1)
+    {
+        unsigned char puback[4] = { MQTT_PUBACK, 2, (unsigned char)(packet_id >> 8), (unsigned char)packet_id };
+        if ((*write)(io, puback, sizeof puback, STREAM_READ_TIMEOUT_MS) != sizeof puback)
+            return 0;
+    }
+
+    return 1;
+}
+
+
+int stream_filter_read(StreamFilter* f, stream_io* read, stream_io* write, void* io,
+        unsigned char* buffer, int len, int timeout_ms)
+{
+    int rc, bytes = 0;
+
+    /* client in the middle of a packet body */
+    if (f->body_remaining)
+    {
+        if ((bytes = take_ahead(f, buffer, len)) == len)
+            return bytes;
+
+        rc = (*read)(io, buffer + bytes, len - bytes, timeout_ms);
+        if (rc <= 0)
+            return bytes ? bytes : rc;
+        f->body_remaining = (uint32_t)rc < f->body_remaining ? f->body_remaining - rc : 0;
+        return bytes + rc;
+    }
+
+    if (!f->header_complete)
+    {
+        if (!read_header(f, read, io, timeout_ms, &rc))
+        {
+            if (rc == 0)
+                stream_filter_reset(f);
+            return rc;
+        }
+
+        uint32_t remaining = remaining_length(f);
+
+        if (stream_cb && stream_threshold && (f->header[0] >> 4) == MQTT_PUBLISH &&
+                ((f->header[0] >> 1) & 3) < 2 && remaining > stream_threshold)
+        {
+            rc = stream_publish(f, read, write, io, remaining);
+            stream_filter_reset(f);
+
+            /* nothing for the client, looks like a read timeout */
+            return rc ? -1 : 0;
+        }
+
+        /* acknowledgements of the SDK's own publishes are consumed, the
+         * client's get their packet id back, see evrythng/outbox.h */
+        if ((f->header[0] == MQTT_PUBACK || f->header[0] == MQTT_SUBACK || f->header[0] == MQTT_UNSUBACK) &&
+                remaining >= 2)
+        {
+            if ((*read)(io, f->ahead, 2, STREAM_READ_TIMEOUT_MS) != 2)
+            {
+                stream_filter_reset(f);
+                return 0;
+            }
+
+            if (outbox_on_ack(io, f->header[0], f->ahead))
+            {
+                stream_filter_reset(f);
+                return -1;
+            }
+            f->ahead_len = 2;
+        }
+
+        f->header_pos = 0;
+    }
+
+    /* hand out the header read ahead, then continue with the body */
+    while (bytes < len && f->header_pos < f->header_len)
+        buffer[bytes++] = f->header[f->header_pos++];
+
+    if (f->header_pos == f->header_len)
+    {
+        f->body_remaining = remaining_length(f);
+        f->header_len = 0;
+        f->header_pos = 0;
+        f->header_complete = 0;
+    }
+
+    if (bytes < len && f->body_remaining)
+        bytes += take_ahead(f, buffer + bytes, len - bytes);
+
+    if (bytes < len)
+    {
+        rc = (*read)(io, buffer + bytes, len - bytes, timeout_ms);
+        if (rc <= 0)
+            return rc == 0 ? 0 : bytes;
+        bytes += rc;
+        f->body_remaining = (uint32_t)rc < f->body_remaining ? f->body_remaining - rc : 0;
+    }
+
+    return bytes;
+}
@@ -0,0 +1,221 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include <string.h>
+
+#include "evrythng/timesync.h"
+#include "evrythng/platform_ext.h"
+
+#define TIMESYNC_RETRY_MIN_MS 5000
+
+/* drift is only estimated over periods long enough to make it measurable */
+#define TIMESYNC_DRIFT_MIN_PERIOD_MS 60000
+
+static struct
+{
+    Mutex mutex;
+    Semaphore request;
+    Semaphore valid;
+    Thread thread;
+
+    int started;
+    int is_valid;
+    int interval_ms;
+
+    int64_t base_epoch_ms;
+    uint32_t base_uptime_ms;
+
+    evrythng_timesync_stats_t stats;
+} ts;
+
+
+static int64_t now_locked(uint32_t uptime)
+{
+    int64_t elapsed = (uint32_t)(uptime - ts.base_uptime_ms);
+    return ts.base_epoch_ms + elapsed + elapsed * ts.stats.drift_ppm / 1000000;
+}
+
+
+static int sync_once()
+{
+    int64_t epoch_ms;
+
+    if (platform_time_fetch(&epoch_ms) != 0)
+    {
+        platform_mutex_lock(&ts.mutex);
+        ts.stats.failures++;
+        platform_mutex_unlock(&ts.mutex);
+        return -1;
+    }
+
+    uint32_t uptime = platform_uptime_ms();
+
+    platform_mutex_lock(&ts.mutex);
+
+    int first = !ts.is_valid;
+    if (!first)
+    {
+        int64_t elapsed = (uint32_t)(uptime - ts.base_uptime_ms);
+
+        ts.stats.last_offset_ms = (int32_t)(epoch_ms - now_locked(uptime));
+
+        if (elapsed >= TIMESYNC_DRIFT_MIN_PERIOD_MS)
+        {
+            int64_t ppm = ((epoch_ms - ts.base_epoch_ms) - elapsed) * 1000000 / elapsed;
+
+            if (ppm > -EVRYTHNG_TIMESYNC_MAX_DRIFT_PPM && ppm < EVRYTHNG_TIMESYNC_MAX_DRIFT_PPM)
+            {
+                /* average with the previous estimate to smooth out the
+                 * network delay of the individual samples */
+                ts.stats.drift_ppm = ts.stats.syncs > 1 ?
+                    (int32_t)((ts.stats.drift_ppm + ppm) / 2) : (int32_t)ppm;
+            }
+        }
+    }
+
+    ts.base_epoch_ms = epoch_ms;
+    ts.base_uptime_ms = uptime;
+    ts.is_valid = 1;
+    ts.stats.syncs++;
+    ts.stats.last_sync_ms = uptime;
+
+    platform_mutex_unlock(&ts.mutex);
+
+    platform_time_set(epoch_ms);
+
+    if (first)
+        platform_semaphore_post(&ts.valid);
+
+    return 0;
+}
+
+
+static void timesync_thread(void* arg)
+{
+    int retry_ms = TIMESYNC_RETRY_MIN_MS;
+    int wait_ms;
+
+    (void)arg;
+
+    while (1)
+    {
+        if (sync_once() == 0)
+        {
+            retry_ms = TIMESYNC_RETRY_MIN_MS;
+            wait_ms = ts.interval_ms;
+        }
+        else
+        {
+            wait_ms = retry_ms;
+            retry_ms = retry_ms > ts.interval_ms / 2 ? ts.interval_ms : retry_ms * 2;
+        }
+
+        platform_semaphore_wait(&ts.request, wait_ms);
+    }
+}
+
+
+evrythng_return_t EvrythngTimeSyncStart(int interval_s, int priority, int stack_size)
+{
+    if (interval_s <= 0 || stack_size <= 0)
+        return EVRYTHNG_BAD_ARGS;
+
+    if (ts.started)
+        return EVRYTHNG_SUCCESS;
+
+    platform_mutex_init(&ts.mutex);
+    platform_semaphore_init(&ts.request);
+    platform_semaphore_init(&ts.valid);
+
+    ts.interval_ms = interval_s * 1000;
+
+    if (platform_thread_create(&ts.thread, priority, "timesync", timesync_thread, stack_size, 0) != 0)
+    {
+        platform_semaphore_deinit(&ts.valid);
+        platform_semaphore_deinit(&ts.request);
+        platform_mutex_deinit(&ts.mutex);
+        return EVRYTHNG_FAILURE;
+    }
+
+    ts.started = 1;
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+void EvrythngTimeSyncRequest(void)
+{
+    if (!ts.started)
+        return;
+
+    platform_mutex_lock(&ts.mutex);
+    int stale = !ts.is_valid ||
+        platform_uptime_ms() - ts.stats.last_sync_ms >= EVRYTHNG_TIMESYNC_MIN_INTERVAL_S * 1000U;
+    platform_mutex_unlock(&ts.mutex);
+
+    if (stale)
+        platform_semaphore_post(&ts.request);
+}
+
+
+evrythng_return_t EvrythngTimeSyncWait(int timeout_ms)
+{
+    if (EvrythngTimeIsValid())
+        return EVRYTHNG_SUCCESS;
+
+    if (!ts.started)
+        return EVRYTHNG_FAILURE;
+
+    if (platform_semaphore_wait(&ts.valid, timeout_ms) != 0)
+        return EVRYTHNG_TIMEOUT;
+
+    /* pass the wake up on to the next waiter */
+    platform_semaphore_post(&ts.valid);
+
+    return EVRYTHNG_SUCCESS;
+}
+
+
+int EvrythngTimeIsValid(void)
+{
+    if (!ts.started)
+        return 0;
+
+    platform_mutex_lock(&ts.mutex);
+    int valid = ts.is_valid;
+    platform_mutex_unlock(&ts.mutex);
+
+    return valid;
+}
+
+
+int64_t EvrythngTimeNowMs(void)
+{
+    if (!ts.started)
+        return 0;
+
+    platform_mutex_lock(&ts.mutex);
+    int64_t now = ts.is_valid ? now_locked(platform_uptime_ms()) : 0;
+    platform_mutex_unlock(&ts.mutex);
+
+    return now;
+}
+
+
+void EvrythngTimeSyncStats(evrythng_timesync_stats_t* stats)
+{
+    if (!stats)
+        return;
+
+    if (!ts.started)
+    {
+        memset(stats, 0, sizeof(evrythng_timesync_stats_t));
+        return;
+    }
+
+    platform_mutex_lock(&ts.mutex);
+    *stats = ts.stats;
+    platform_mutex_unlock(&ts.mutex);
+}
@@ -4,15 +4,104 @@
  */
 
 #include "evrythng/platform.h"
+#include "evrythng/platform_ext.h"
+#include "evrythng/capture.h"
+#include "evrythng/outbox.h"
+#include "evrythng/sha256.h"
 
 #include <stdint.h>
 #include <stdarg.h>
 
 #include <wm_net.h>
+#include <httpc.h>
+#include <wmtime.h>
+#include <json_parser.h>
+#include <partition.h>
+#include <flash.h>
+#include <rfget.h>
 #include <mbedtls/error.h>
 #include <mbedtls/net_sockets.h>
 
 
+/* deadlines of the armed SDK timers. A timer is only used as the key and
+ * never dereferenced: the core keeps timers on the stack of functions which
+ * may return without expiring or deinitializing them. Such a stale entry is
+ * reported as due once and dropped then. */
+#define TIMER_SLOTS 16
+
+static struct
+{
+    const Timer* timer;
+    uint32_t expiry_ms;
+} deadlines[TIMER_SLOTS];
+
+/* updated from the SDK and application tasks, see wakeup_count() */
+static WakeupStats wakeups;
+static uint32_t wakeups_period_start;
+
+
+uint32_t platform_uptime_ms(void)
+{
+    return os_ticks_to_msec(os_ticks_get());
+}
+
+
+uint32_t platform_uptime_us(void)
+{
+    /* free running counter, not limited to the tick resolution */
+    return os_get_timestamp();
+}
+
+
+static void deadline_set(const Timer* t, uint32_t expiry_ms)
+{
+    int i, slot = -1;
+    unsigned long state = os_enter_critical_section();
+
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (deadlines[i].timer == t)
+        {
+            slot = i;
+            break;
+        }
+        if (!deadlines[i].timer && slot < 0)
+            slot = i;
+    }
+
+    /* not tracked if all slots are taken, the max_ms of
+     * platform_sleep_until_deadline() bounds the sleep then */
+    if (slot >= 0)
+    {
+        deadlines[slot].timer = t;
+        deadlines[slot].expiry_ms = expiry_ms;
+    }
+
+    os_exit_critical_section(state);
+}
+
+
+static void deadline_clear(const Timer* t)
+{
+    int i;
+    unsigned long state = os_enter_critical_section();
+
+    for (i = 0; i < TIMER_SLOTS; i++)
+        if (deadlines[i].timer == t)
+            deadlines[i].timer = 0;
+
+    os_exit_critical_section(state);
+}
+
+
+static void wakeup_count(uint32_t* counter)
+{
+    unsigned long state = os_enter_critical_section();
+    (*counter)++;
+    os_exit_critical_section(state);
+}
+
+
 void platform_timer_init(Timer* t)
 {
     if (!t)
@@ -33,6 +122,8 @@ void platform_timer_deinit(Timer* t)
         platform_printf("%s: invalid timer\n", __func__);
         return;
     }
+
+    deadline_clear(t);
 }
 
 
@@ -44,7 +135,11 @@ char platform_timer_isexpired(Timer* t)
         return -1;
     }
 
-	return xTaskCheckForTimeOut(&t->xTimeOut, &t->xTicksToWait) == pdTRUE;
+	if (xTaskCheckForTimeOut(&t->xTimeOut, &t->xTicksToWait) != pdTRUE)
+        return 0;
+
+    deadline_clear(t);
+    return 1;
 }
 
 
@@ -58,6 +153,7 @@ void platform_timer_countdown(Timer* t, unsigned int ms)
 
     t->xTicksToWait = os_msec_to_ticks(ms);
     vTaskSetTimeOutState(&t->xTimeOut); /* Record the time at which this function was entered. */
+    deadline_set(t, platform_uptime_ms() + ms);
 }
 
 
@@ -71,11 +167,73 @@ int platform_timer_left(Timer* t)
 
     /* if true -> timeout, else updates xTicksToWait to the number left */
 	if (xTaskCheckForTimeOut(&t->xTimeOut, &t->xTicksToWait) == pdTRUE)
+    {
+        deadline_clear(t);
         return 0;
+    }
 	return (t->xTicksToWait <= 0) ? 0 : (os_ticks_to_msec(t->xTicksToWait));
 }
 
 
+int platform_timer_next_deadline(void)
+{
+    int i;
+    int32_t next = -1;
+    uint32_t now = platform_uptime_ms();
+    unsigned long state = os_enter_critical_section();
+
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (!deadlines[i].timer)
+            continue;
+
+        /* signed difference keeps working across the wrap around */
+        int32_t left = (int32_t)(deadlines[i].expiry_ms - now);
+        if (left <= 0)
+        {
+            /* due: reported once, the owner handles it on its next check or
+             * has abandoned the timer */
+            deadlines[i].timer = 0;
+            left = 0;
+        }
+
+        if (next < 0 || left < next)
+            next = left;
+    }
+
+    os_exit_critical_section(state);
+
+    return (int)next;
+}
+
+
+void platform_wakeup_stats(WakeupStats* stats)
+{
+    if (!stats)
+    {
+        platform_printf("%s: invalid stats\n", __func__);
+        return;
+    }
+
+    unsigned long state = os_enter_critical_section();
+    *stats = wakeups;
+    stats->period_ms = platform_uptime_ms() - wakeups_period_start;
+    os_exit_critical_section(state);
+
+    stats->per_minute = stats->period_ms ?
+        (uint32_t)(((uint64_t)(stats->sleeps + stats->read_timeouts + stats->reads) * 60000) / stats->period_ms) : 0;
+}
+
+
+void platform_wakeup_stats_reset(void)
+{
+    unsigned long state = os_enter_critical_section();
+    memset(&wakeups, 0, sizeof wakeups);
+    wakeups_period_start = platform_uptime_ms();
+    os_exit_critical_section(state);
+}
+
+
 void platform_network_init(Network* n)
 {
     if (!n)
@@ -104,47 +262,426 @@ void platform_network_securedinit(Network* n, const char* ca_buf, size_t ca_size
     n->tls_enabled = 1;
 }
 
+/* certificates signed with SHA-256 or better, RSA keys of 2048 bits or more */
 static const mbedtls_x509_crt_profile wm_mbedtls_x509_crt_profile_evrythng = {
-    MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_MD2)     |
-    MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_MD4)     |
-    MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_MD5)     |
-    MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_SHA1)    |
-    MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_SHA224)  |
 	MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_SHA256)  |
 	MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_SHA384)  |
-	MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_SHA512)  |
-    MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_RIPEMD160),
+	MBEDTLS_X509_ID_FLAG(MBEDTLS_MD_SHA512),
 	0xFFFFFFF, /* Any PK alg    */
 	0xFFFFFFF, /* Any curve     */
-	1024,
+	2048,
+};
+
+/*
+ * Max Fragment Length requested from the server in bytes (512, 1024, 2048
+ * or 4096, 0 to not request it). With MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH
+ * enabled in the mbedtls config of the SDK the 16 KB record buffers are
+ * shrunk to it after the handshake and stay full size if the server
+ * ignores the extension. Lowering MBEDTLS_SSL_MAX_CONTENT_LEN instead
+ * saves the RAM also during the handshake but requires a server honouring
+ * the extension.
+ */
+#if !defined(TLS_MAX_FRAG_LEN)
+#define TLS_MAX_FRAG_LEN 1024
+#endif
+
+/* without either of them the extension only limits what the server
+ * sends, the buffers are allocated full size anyway */
+#if TLS_MAX_FRAG_LEN && defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH) && \
+        !defined(MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH) && MBEDTLS_SSL_MAX_CONTENT_LEN > TLS_MAX_FRAG_LEN
+#warning "TLS_MAX_FRAG_LEN saves no RAM: enable MBEDTLS_SSL_VARIABLE_BUFFER_LENGTH or lower MBEDTLS_SSL_MAX_CONTENT_LEN"
+#endif
+
+/*
+ * Cipher suites offered by default, all with forward secrecy. The order
+ * is not benchmarked with mbedtls on the board: ECDHE-RSA goes first as
+ * the client then verifies an RSA signature rather than an ECDSA one,
+ * ChaCha20-Poly1305 before AES-GCM as it needs no AES engine, AES-GCM
+ * first if mbedtls uses the one of the SoC. bench_handshake measures
+ * OpenSSL on the host, whose AES instructions favour AES-GCM.
+ */
+#if defined(MBEDTLS_CHACHAPOLY_C) && !defined(MBEDTLS_AES_ALT)
+#define TLS_CHACHA_FIRST
+#endif
+
+static const int tls_default_ciphersuites[] = {
+#if defined(TLS_CHACHA_FIRST)
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+#endif
+    MBEDTLS_TLS_ECDHE_RSA_WITH_AES_128_GCM_SHA256,
+#if defined(MBEDTLS_CHACHAPOLY_C) && !defined(TLS_CHACHA_FIRST)
+    MBEDTLS_TLS_ECDHE_RSA_WITH_CHACHA20_POLY1305_SHA256,
+#endif
+#if defined(TLS_CHACHA_FIRST)
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+#endif
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+#if defined(MBEDTLS_CHACHAPOLY_C) && !defined(TLS_CHACHA_FIRST)
+    MBEDTLS_TLS_ECDHE_ECDSA_WITH_CHACHA20_POLY1305_SHA256,
+#endif
+    0
 };
 
-static int tls_connect(Network* n, const char* hostname)
+/* X25519 is the cheapest key exchange, P-256 and P-384 remain for the
+ * ECDSA certificates using them */
+static const int tls_default_curves[] = {
+#if defined(MBEDTLS_ECP_DP_CURVE25519_ENABLED)
+    MBEDTLS_ECP_DP_CURVE25519,
+#endif
+    MBEDTLS_ECP_DP_SECP256R1,
+    MBEDTLS_ECP_DP_SECP384R1,
+    MBEDTLS_ECP_DP_NONE
+};
+
+static const int* tls_ciphersuites = tls_default_ciphersuites;
+static const int* tls_curves = tls_default_curves;
+
+/* shared TLS configurations, kept after the last user disconnected */
+static TlsConfig* tls_configs;
+static TlsStats tls_stats;
+
+/* set once a server aborted the handshake because of the max fragment
+ * length, configs created afterwards don't request it */
+static int tls_mfl_rejected;
+
+/* SHA-256 of the server SubjectPublicKeyInfo, see platform_tls_pin() */
+static unsigned char tls_pin[EVRYTHNG_SHA256_SIZE];
+static int tls_pinned;
+
+/* DER encoded public key buffer, fits RSA 4096 */
+#define TLS_SPKI_MAX_SIZE 600
+
+
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+static unsigned char tls_mfl_code(int len)
 {
-    int rc = -1;
+    switch (len) {
+        case 512: return MBEDTLS_SSL_MAX_FRAG_LEN_512;
+        case 1024: return MBEDTLS_SSL_MAX_FRAG_LEN_1024;
+        case 2048: return MBEDTLS_SSL_MAX_FRAG_LEN_2048;
+        case 4096: return MBEDTLS_SSL_MAX_FRAG_LEN_4096;
+        default: return MBEDTLS_SSL_MAX_FRAG_LEN_NONE;
+    }
+}
+#endif
 
-    n->tls_cert.ca_chain = wm_mbedtls_parse_cert(
-            (const unsigned char*)n->ca_buf, n->ca_size);
-    if (!n->tls_cert.ca_chain) {
-        platform_printf("%s: failed to parse certificate chain\n", __func__);
-        return rc;
+
+static void tls_config_free(TlsConfig* c)
+{
+    if (c->config) wm_mbedtls_ssl_config_free(c->config);
+    if (c->cert.ca_chain) wm_mbedtls_free_cert(c->cert.ca_chain);
+    os_mem_free(c);
+}
+
+
+static TlsConfig* tls_config_find(const char* ca_buf, size_t ca_size)
+{
+    TlsConfig* c;
+
+    for (c = tls_configs; c; c = c->next)
+        if (c->ca_buf == ca_buf && c->ca_size == ca_size)
+            return c;
+
+    return 0;
+}
+
+
+static TlsConfig* tls_config_new(const char* ca_buf, size_t ca_size, int mfl)
+{
+    int i;
+
+    TlsConfig* c = (TlsConfig*)os_mem_alloc(sizeof(TlsConfig));
+    if (!c) {
+        platform_printf("%s: out of memory\n", __func__);
+        return 0;
     }
 
-    n->tls_config = wm_mbedtls_ssl_config_new(&n->tls_cert, 
-            MBEDTLS_SSL_IS_CLIENT, MBEDTLS_SSL_VERIFY_REQUIRED);
-    if (!n->tls_config) {
+    memset(c, 0, sizeof(TlsConfig));
+    c->ca_buf = ca_buf;
+    c->ca_size = ca_size;
+
+    /* without CA the server key is checked against the pin after the
+     * handshake, the chain is neither parsed nor verified */
+    if (ca_buf) {
+        c->cert.ca_chain = wm_mbedtls_parse_cert(
+                (const unsigned char*)ca_buf, ca_size);
+        if (!c->cert.ca_chain) {
+            platform_printf("%s: failed to parse certificate chain\n", __func__);
+            tls_config_free(c);
+            return 0;
+        }
+    }
+
+    c->config = wm_mbedtls_ssl_config_new(&c->cert, 
+            MBEDTLS_SSL_IS_CLIENT, ca_buf ? MBEDTLS_SSL_VERIFY_REQUIRED : MBEDTLS_SSL_VERIFY_NONE);
+    if (!c->config) {
         platform_printf("%s: failed to create tls config\n", __func__);
-        return rc;
+        tls_config_free(c);
+        return 0;
     }
 
-    mbedtls_ssl_conf_min_version(n->tls_config, 
+    mbedtls_ssl_conf_min_version(c->config, 
             MBEDTLS_SSL_MAJOR_VERSION_3,
             MBEDTLS_SSL_MINOR_VERSION_3);
 
-	mbedtls_ssl_conf_cert_profile(n->tls_config,
+	mbedtls_ssl_conf_cert_profile(c->config,
 			&wm_mbedtls_x509_crt_profile_evrythng);
 
-    n->tls_context = wm_mbedtls_ssl_new(n->tls_config, 
+    /* mbedtls keeps the pointers, the curves are converted to its type */
+    for (i = 0; i < TLS_MAX_CURVES; i++)
+        if ((c->curves[i] = (mbedtls_ecp_group_id)tls_curves[i]) == MBEDTLS_ECP_DP_NONE)
+            break;
+
+    mbedtls_ssl_conf_ciphersuites(c->config, tls_ciphersuites);
+#if defined(MBEDTLS_ECP_C)
+    mbedtls_ssl_conf_curves(c->config, c->curves);
+#endif
+
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+    if (mfl && tls_mfl_code(TLS_MAX_FRAG_LEN) != MBEDTLS_SSL_MAX_FRAG_LEN_NONE &&
+            mbedtls_ssl_conf_max_frag_len(c->config, tls_mfl_code(TLS_MAX_FRAG_LEN)) == 0)
+        c->max_frag_len = TLS_MAX_FRAG_LEN;
+#else
+    (void)mfl;
+#endif
+
+    return c;
+}
+
+
+/* The config is read only once set up and the WMSDK feeds it from the
+ * hardware RNG, so any number of ssl contexts can use it concurrently. */
+static TlsConfig* tls_config_acquire(const char* ca_buf, size_t ca_size)
+{
+    unsigned long state = os_enter_critical_section();
+    TlsConfig* c = tls_config_find(ca_buf, ca_size);
+    if (c) {
+        c->refs++;
+        tls_stats.connections++;
+        tls_stats.reused++;
+    }
+    int mfl = !tls_mfl_rejected;
+    os_exit_critical_section(state);
+
+    if (c)
+        return c;
+
+    /* parsing the chain takes long, not done in the critical section */
+    TlsConfig* created = tls_config_new(ca_buf, ca_size, mfl);
+    if (!created)
+        return 0;
+
+    state = os_enter_critical_section();
+    c = tls_config_find(ca_buf, ca_size);
+    if (!c) {
+        c = created;
+        c->next = tls_configs;
+        tls_configs = c;
+        tls_stats.configs++;
+        tls_stats.created++;
+        created = 0;
+    }
+    else
+        tls_stats.reused++;
+    c->refs++;
+    tls_stats.connections++;
+    os_exit_critical_section(state);
+
+    /* another connection was faster */
+    if (created)
+        tls_config_free(created);
+
+    return c;
+}
+
+
+static void tls_config_release(TlsConfig* c)
+{
+    unsigned long state = os_enter_critical_section();
+    int unused = --c->refs == 0 && c->retired;
+    tls_stats.connections--;
+    os_exit_critical_section(state);
+
+    if (unused)
+        tls_config_free(c);
+}
+
+
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+/* Other connections may be using the configs requesting the max fragment
+ * length, so they are not changed but taken out of the list: the next
+ * connections get new ones without it and the old ones are freed by the
+ * release of their last connection. */
+static void tls_mfl_fallback(void)
+{
+    TlsConfig** it;
+    TlsConfig* unused = 0;
+
+    unsigned long state = os_enter_critical_section();
+    if (!tls_mfl_rejected) {
+        tls_mfl_rejected = 1;
+        tls_stats.mfl_fallbacks++;
+    }
+    for (it = &tls_configs; *it; ) {
+        TlsConfig* c = *it;
+        if (!c->max_frag_len) {
+            it = &c->next;
+            continue;
+        }
+        *it = c->next;
+        tls_stats.configs--;
+        c->retired = 1;
+        if (!c->refs) {
+            c->next = unused;
+            unused = c;
+        }
+    }
+    os_exit_critical_section(state);
+
+    while (unused) {
+        TlsConfig* c = unused;
+        unused = c->next;
+        tls_config_free(c);
+    }
+}
+#endif
+
+
+int platform_tls_configure(const int* ciphersuites, const int* curves)
+{
+    int i;
+
+    if (!curves)
+        curves = tls_default_curves;
+
+    for (i = 0; curves[i] != MBEDTLS_ECP_DP_NONE; i++)
+    {
+        if (i == TLS_MAX_CURVES)
+        {
+            platform_printf("%s: more than %d curves\n", __func__, TLS_MAX_CURVES);
+            return -1;
+        }
+    }
+
+    unsigned long state = os_enter_critical_section();
+    tls_ciphersuites = ciphersuites ? ciphersuites : tls_default_ciphersuites;
+    tls_curves = curves;
+    os_exit_critical_section(state);
+
+    return 0;
+}
+
+
+int platform_tls_pin(const unsigned char* spki_sha256)
+{
+    unsigned long state = os_enter_critical_section();
+    if (spki_sha256)
+        memcpy(tls_pin, spki_sha256, sizeof tls_pin);
+    tls_pinned = spki_sha256 != 0;
+    os_exit_critical_section(state);
+
+    return 0;
+}
+
+
+/* compares the hash of the public key the server proved to own with the pin */
+static int tls_check_pin(mbedtls_ssl_context* ssl)
+{
+    unsigned char spki[TLS_SPKI_MAX_SIZE];
+    unsigned char digest[EVRYTHNG_SHA256_SIZE];
+    evrythng_sha256_t sha;
+
+    const mbedtls_x509_crt* crt = mbedtls_ssl_get_peer_cert(ssl);
+    if (!crt)
+        return -1;
+
+    /* written at the end of the buffer */
+    int len = mbedtls_pk_write_pubkey_der((mbedtls_pk_context*)&crt->pk, spki, sizeof spki);
+    if (len <= 0)
+        return -1;
+
+    EvrythngSha256Init(&sha);
+    EvrythngSha256Update(&sha, spki + sizeof spki - len, len);
+    EvrythngSha256Finish(&sha, digest);
+
+    return memcmp(digest, tls_pin, sizeof digest) ? -1 : 0;
+}
+
+
+int platform_tls_release_unused(void)
+{
+    TlsConfig** it;
+    TlsConfig* unused = 0;
+    int released = 0;
+
+    unsigned long state = os_enter_critical_section();
+    for (it = &tls_configs; *it; ) {
+        TlsConfig* c = *it;
+        if (c->refs) {
+            it = &c->next;
+            continue;
+        }
+        *it = c->next;
+        c->next = unused;
+        unused = c;
+        tls_stats.configs--;
+    }
+    os_exit_critical_section(state);
+
+    while (unused) {
+        TlsConfig* c = unused;
+        unused = c->next;
+        tls_config_free(c);
+        released++;
+    }
+
+    return released;
+}
+
+
+void platform_tls_stats(TlsStats* stats)
+{
+    if (!stats)
+    {
+        platform_printf("%s: invalid stats\n", __func__);
+        return;
+    }
+
+    unsigned long state = os_enter_critical_section();
+    *stats = tls_stats;
+    os_exit_critical_section(state);
+}
+
+
+/* releases what tls_connect() allocated */
+static void tls_close(Network* n)
+{
+    if (n->tls_context) {
+        mbedtls_ssl_close_notify(n->tls_context);
+        wm_mbedtls_ssl_free(n->tls_context);
+    }
+    if (n->tls_config) tls_config_release(n->tls_config);
+
+    n->tls_context = 0;
+    n->tls_config = 0;
+}
+
+
+/* retry is set if the handshake should be repeated on a new connection */
+static int tls_connect(Network* n, const char* hostname, int* retry)
+{
+    int rc = -1;
+
+    *retry = 0;
+
+    /* still held if the last connect failed without a disconnect */
+    if (!n->tls_config)
+        n->tls_config = tls_pinned ?
+            tls_config_acquire(0, 0) : tls_config_acquire(n->ca_buf, n->ca_size);
+    if (!n->tls_config)
+        return rc;
+
+    n->tls_context = wm_mbedtls_ssl_new(n->tls_config->config, 
             n->socket, (const char*) hostname);
     if (!n->tls_context) {
         platform_printf("Failed to create tls context\n");
@@ -154,13 +691,45 @@ static int tls_connect(Network* n, const char* hostname)
     rc = wm_mbedtls_ssl_connect(n->tls_context);
     if (rc != 0) {
         platform_printf("tls connection failed: 0x%02x\n", rc);
+
+#if defined(MBEDTLS_SSL_MAX_FRAGMENT_LENGTH)
+        /* some servers abort the handshake on the max fragment length
+         * extension instead of ignoring it, go on without it */
+        if (n->tls_config->max_frag_len &&
+                (rc == MBEDTLS_ERR_SSL_FATAL_ALERT_MESSAGE || rc == MBEDTLS_ERR_SSL_BAD_HS_SERVER_HELLO)) {
+            platform_printf("%s: disabling max fragment length %d\n", __func__, n->tls_config->max_frag_len);
+            tls_mfl_fallback();
+            *retry = 1;
+        }
+#endif
         return rc;
     }
 
+    if (!n->tls_config->ca_buf)
+        rc = tls_check_pin(n->tls_context);
+
+    unsigned long state = os_enter_critical_section();
+    if (!n->tls_config->ca_buf) {
+        if (rc)
+            tls_stats.pin_failures++;
+        else
+            tls_stats.pinned++;
+    }
+    if (!rc)
+        tls_stats.max_frag_len = n->tls_config->max_frag_len;
+    os_exit_critical_section(state);
+
+    if (rc) {
+        platform_printf("%s: server key doesn't match the pin\n", __func__);
+        return -1;
+    }
+
     return 0;
 }
 
 
+#define DNS_RETRY_BASE_MS 250
+
 static int tcp_connect(Network* n, const char* hostname, int port)
 {
 	int rc = -1;
@@ -172,6 +741,10 @@ static int tcp_connect(Network* n, const char* hostname, int port)
 	struct addrinfo hints = {0, AF_UNSPEC, SOCK_STREAM, IPPROTO_TCP, 0, NULL, NULL, NULL};
 
     do {
+        /* back off with jitter rather than hammering the resolver */
+        if (attempt > 1)
+            platform_sleep(platform_rand() % ((DNS_RETRY_BASE_MS << (attempt - 2)) + 1));
+
         platform_printf("trying to resolve hostname (attempt %d)\n", attempt);
 
         if ((rc = getaddrinfo(hostname, NULL, &hints, &result)) == 0) {
@@ -217,80 +790,74 @@ static int tcp_connect(Network* n, const char* hostname, int port)
 }
 
 
-int platform_network_connect(Network* n, char* hostname, int port)
+static int tcp_read(void* io, unsigned char* buffer, int len, int timeout_ms)
 {
+    Network* n = (Network*)io;
     int rc;
 
-    if (!n) {
-        platform_printf("%s: invalid network\n", __func__);
+    rc = setsockopt(n->socket, SOL_SOCKET, SO_RCVTIMEO, (void*)&timeout_ms, sizeof timeout_ms);
+    if (rc != 0) {
+        platform_printf("%s: failed to set socket option SO_RCVTIMEO, rc = %d\n", __func__, rc);
         return -1;
     }
 
-    rc = tcp_connect(n, hostname, port); 
+	int bytes = 0;
+	while (bytes < len)
+	{
+        rc = recv(n->socket, &buffer[bytes], (size_t)(len - bytes), 0);
 
-    if (!rc && n->tls_enabled) {
-        rc = tls_connect(n, hostname);
+        if (rc == 0)
+        {
+            bytes = 0;
+            break;
+        }
+        else if (rc < 0)
+        {   
+            if (errno != ENOTCONN && errno != ECONNRESET)
+            {
+                bytes = -1;
+                break;
+            }
+        }
+        else
+            bytes += rc;
     }
 
-	return rc;
+    return bytes;
 }
 
 
-void platform_network_disconnect(Network* n)
+static int tcp_write(void* io, unsigned char* buffer, int len, int timeout_ms)
 {
-    if (!n)
-    {
-        platform_printf("%s: invalid network\n", __func__);
-        return;
-    }
+    Network* n = (Network*)io;
 
-    if (n->tls_enabled) {
-		if (n->tls_context) {
-            mbedtls_ssl_close_notify(n->tls_context);
-            wm_mbedtls_ssl_free(n->tls_context);
-        }
-        if (n->tls_config) wm_mbedtls_ssl_config_free(n->tls_config);
-        if (n->tls_cert.ca_chain) wm_mbedtls_free_cert(n->tls_cert.ca_chain);
+	setsockopt(n->socket, SOL_SOCKET, SO_SNDTIMEO, (void*)&timeout_ms, sizeof timeout_ms);
 
-        n->tls_context = 0;
-        n->tls_config = 0;
-        n->tls_cert.ca_chain = 0;
-    }
+    return send(n->socket, buffer, len, 0);
+}
+
+
+static void tcp_close(void* io)
+{
+    Network* n = (Network*)io;
 
     shutdown(n->socket, SHUT_RDWR);
 	close(n->socket);
 }
 
 
-int platform_network_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+static int tls_read(void* io, unsigned char* buffer, int len, int timeout_ms)
 {
+    Network* n = (Network*)io;
     int rc;
 
-    if (!n)
-    {
-        platform_printf("%s: invalid network\n", __func__);
-        return -1;
-    }
-
-    if (!n->tls_enabled) {
-        rc = setsockopt(n->socket, SOL_SOCKET, SO_RCVTIMEO, (void*)&timeout_ms, sizeof timeout_ms);
-        if (rc != 0) {
-            platform_printf("%s: failed to set socket option SO_RCVTIMEO, rc = %d\n", __func__, rc);
-            return -1;
-        }
-    } else {
-        wm_mbedtls_reset_read_timer(n->tls_context);
-        wm_mbedtls_set_read_timeout(n->tls_context, timeout_ms);
-    }
+    wm_mbedtls_reset_read_timer(n->tls_context);
+    wm_mbedtls_set_read_timeout(n->tls_context, timeout_ms);
 
 	int bytes = 0;
 	while (bytes < len)
 	{
-        if (!n->tls_enabled)
-            rc = recv(n->socket, &buffer[bytes], (size_t)(len - bytes), 0);
-        else {
-            rc = mbedtls_ssl_read(n->tls_context, &buffer[bytes], (size_t)(len - bytes));
-        }
+        rc = mbedtls_ssl_read(n->tls_context, &buffer[bytes], (size_t)(len - bytes));
 
         if (rc == 0)
         {
@@ -299,33 +866,217 @@ int platform_network_read(Network* n, unsigned char* buffer, int len, int timeou
         }
         else if (rc < 0)
         {   
-            if (n->tls_enabled)
+            if (rc == MBEDTLS_ERR_SSL_TIMEOUT ||
+                    rc == MBEDTLS_ERR_NET_RECV_FAILED)
             {
-                if (rc == MBEDTLS_ERR_SSL_TIMEOUT ||
-                        rc == MBEDTLS_ERR_NET_RECV_FAILED)
-                {
-                    bytes = -1;
-                    break;
-                }
-                else
-                    platform_printf("mbedtls_ssl_read ret: -0x%02X\n", -rc);
+                bytes = -1;
+                break;
             }
             else
-            {
-                if (errno != ENOTCONN && errno != ECONNRESET)
-                {
-                    bytes = -1;
-                    break;
-                }
-            }
+                platform_printf("mbedtls_ssl_read ret: -0x%02X\n", -rc);
         }
         else
             bytes += rc;
     }
 
+    return bytes;
+}
+
+
+static int tls_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+
+	setsockopt(n->socket, SOL_SOCKET, SO_SNDTIMEO, (void*)&timeout_ms, sizeof timeout_ms);
+
+    return mbedtls_ssl_write(n->tls_context, buffer, len);
+}
+
+
+static void tls_transport_close(void* io)
+{
+    tls_close((Network*)io);
+    tcp_close(io);
+}
+
+
+static const Transport tcp_transport = { "tcp", tcp_read, tcp_write, tcp_close };
+static const Transport tls_transport = { "tls", tls_read, tls_write, tls_transport_close };
+
+
+int platform_network_connect(Network* n, char* hostname, int port)
+{
+    int rc;
+
+    if (!n) {
+        platform_printf("%s: invalid network\n", __func__);
+        return -1;
+    }
+
+    /* a replayed capture takes precedence over the network, see replay_start() */
+    void* replay = replay_connect();
+    if (replay) {
+        n->transport = &replay_transport;
+        n->transport_io = replay;
+        return 0;
+    }
+
+    /* backoff and jitter for the core's reconnects too, see EvrythngReconnectPace() */
+    if (connect_backoff_before(&n->backoff) != 0)
+        return -1;
+
+    /* so does a local listener, see loopback_listen() */
+    LoopbackEnd* end = loopback_connect(hostname);
+    if (end) {
+        n->transport = &loopback_transport;
+        n->transport_io = end;
+        return capture_wrap(&n->transport, &n->transport_io);
+    }
+
+    rc = tcp_connect(n, hostname, port); 
+    if (rc)
+        return rc;
+
+    n->transport = n->tls_enabled ? &tls_transport : &tcp_transport;
+    n->transport_io = n;
+
+    if (n->tls_enabled) {
+        int retry;
+
+        rc = tls_connect(n, hostname, &retry);
+        if (rc && retry) {
+            tls_close(n);
+            tcp_close(n);
+
+            rc = tcp_connect(n, hostname, port);
+            if (!rc)
+                rc = tls_connect(n, hostname, &retry);
+        }
+    }
+
+    /* records the traffic after TLS, see capture_start() */
+    if (!rc)
+        rc = capture_wrap(&n->transport, &n->transport_io);
+
+	return rc;
+}
+
+
+void platform_network_disconnect(Network* n)
+{
+    if (!n)
+    {
+        platform_printf("%s: invalid network\n", __func__);
+        return;
+    }
+
+    if (n->transport)
+        n->transport->close(n->transport_io);
+    n->transport = 0;
+    n->transport_io = 0;
+
+    /* the client gives up on a connection whose ping was not answered */
+    int was_connected = n->monitor.connected;
+    ping_monitor_on_closed(&n->monitor);
+    stream_filter_reset(&n->stream);
+    outbox_on_closed(n, was_connected);
+    connect_backoff_on_closed(&n->backoff, was_connected);
+}
+
+
+static int raw_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+
+    return n->transport->read(n->transport_io, buffer, len, timeout_ms);
+}
+
+
+/* writes of the SDK itself: queued packets, PUBACKs and pings */
+static int raw_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+
+    int rc = n->transport->write(n->transport_io, buffer, len, timeout_ms);
+
+    //platform_printf("%s: send rc = %d\n", __func__, rc);
+
+    if (rc > 0)
+        ping_monitor_on_write(&n->monitor, buffer, rc);
+
+    return rc;
+}
+
+
+int platform_network_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    if (!n || !n->transport)
+    {
+        platform_printf("%s: invalid network\n", __func__);
+        return -1;
+    }
+
+    /* packets of the SDK's own publishes go out here, under the client's lock */
+    /* answer to a ping of the client */
+    int bytes = ping_monitor_take_pingresp(&n->monitor, buffer, len);
+    if (bytes)
+    {
+        wakeup_count(&wakeups.reads);
+        return bytes;
+    }
+
+    outbox_flush(n, raw_write, n);
+
+    /* between packets the read returns for the next SDK timer (keepalive,
+     * retransmits) instead of sleeping past it, a read in the middle of a
+     * packet would fail if it returned early */
+    int next_ms = platform_timer_next_deadline();
+    if (next_ms >= 0 && (timeout_ms < 0 || next_ms < timeout_ms) && stream_filter_idle(&n->stream))
+        timeout_ms = next_ms;
+
+    /* large PUBLISH payloads are streamed to the application here */
+    bytes = stream_filter_read(&n->stream, raw_read, raw_write, n, buffer, len, timeout_ms);
+
     if (!bytes)
+    {
         platform_printf("%s:%d: connection closed by the peer\n", 
                 __func__, __LINE__);
+        int was_connected = n->monitor.connected;
+        ping_monitor_on_closed(&n->monitor);
+        outbox_on_closed(n, was_connected);
+        connect_backoff_on_closed(&n->backoff, was_connected);
+    }
+    else if (bytes < 0)
+    {
+        wakeup_count(&wakeups.read_timeouts);
+
+        /* keepalive pings at the probed interval, see ping_monitor_on_idle() */
+        switch (ping_monitor_on_idle(&n->monitor))
+        {
+            case PING_MONITOR_SEND_PING:
+            {
+                unsigned char pingreq[2] = { 0xC0, 0 };
+                raw_write(n, pingreq, sizeof pingreq, timeout_ms);
+                break;
+            }
+            case PING_MONITOR_LOST:
+                platform_printf("%s: ping timed out\n", __func__);
+                return 0;
+            default:
+                break;
+        }
+    }
+    else
+    {
+        wakeup_count(&wakeups.reads);
+        int was_connected = n->monitor.connected;
+        ping_monitor_on_read(&n->monitor, buffer, bytes);
+        if (!was_connected && n->monitor.connected)
+        {
+            outbox_on_connected(n);
+            connect_backoff_on_connected(&n->backoff);
+        }
+    }
 
 	return bytes;
 }
@@ -333,21 +1084,36 @@ int platform_network_read(Network* n, unsigned char* buffer, int len, int timeou
 
 int platform_network_write(Network* n, unsigned char* buffer, int length, int timeout_ms)
 {
-    if (!n)
+    if (!n || !n->transport)
     {
         platform_printf("%s: invalid network\n", __func__);
         return -1;
     }
 
-    int rc;
-	setsockopt(n->socket, SOL_SOCKET, SO_SNDTIMEO, (void*)&timeout_ms, sizeof timeout_ms);
+    /* the probe pings at the keepalive interval it searches, the client's
+     * pings are answered here, see ping_monitor_absorb() */
+    if (stream_filter_idle(&n->stream) && ping_monitor_absorb(&n->monitor, buffer, length))
+        return length;
 
-    if (!n->tls_enabled)
-        rc = send(n->socket, buffer, length, 0);
-    else
-		rc = mbedtls_ssl_write(n->tls_context, buffer, length);
+    unsigned short keepalive_s;
+    int keepalive_pos = ping_monitor_on_connect(&n->monitor, buffer, length, &keepalive_s);
 
-    //platform_printf("%s: send rc = %d\n", __func__, rc);
+    /* the client's packet ids may collide with the ones the SDK reserved */
+    unsigned short client_id;
+    int id_pos = outbox_on_write(n, buffer, length, &client_id);
+
+    int rc = raw_write(n, buffer, length, timeout_ms);
+
+    if (id_pos >= 0)
+    {
+        buffer[id_pos] = client_id >> 8;
+        buffer[id_pos + 1] = client_id & 0xFF;
+    }
+    if (keepalive_pos >= 0)
+    {
+        buffer[keepalive_pos] = keepalive_s >> 8;
+        buffer[keepalive_pos + 1] = keepalive_s & 0xFF;
+    }
 
 	return rc;
 }
@@ -475,7 +1241,8 @@ int platform_semaphore_wait(Semaphore* s, int timeout_ms)
         return -1;
     }
 
-    if (os_semaphore_get(&s->sem, timeout_ms) != WM_SUCCESS)
+    /* a negative timeout waits forever, as on the other ports */
+    if (os_semaphore_get(&s->sem, timeout_ms < 0 ? OS_WAIT_FOREVER : (unsigned long)timeout_ms) != WM_SUCCESS)
     {
         return -1;
     }
@@ -572,6 +1339,167 @@ void platform_free(void* memory)
 void platform_sleep(int ms)
 {
     os_thread_sleep(os_msec_to_ticks(ms));
+    wakeup_count(&wakeups.sleeps);
+}
+
+
+int platform_sleep_until_deadline(int max_ms)
+{
+    int ms = platform_timer_next_deadline();
+
+    if (ms < 0 || (max_ms >= 0 && ms > max_ms))
+        ms = max_ms;
+
+    /* nothing is scheduled and no limit given, there is nothing to wait for */
+    if (ms < 0)
+        return 0;
+
+    uint32_t start = platform_uptime_ms();
+    platform_sleep(ms);
+
+    return (int)(platform_uptime_ms() - start);
+}
+
+
+static struct partition_entry* ota_partition;
+static flash_desc_t ota_flash;
+static mdev_t* ota_dev;
+
+int platform_ota_begin(uint32_t size)
+{
+    if (ota_dev)
+        platform_ota_finish(0);
+
+    ota_partition = rfget_get_passive_firmware();
+    if (!ota_partition)
+    {
+        platform_printf("%s: no passive firmware partition\n", __func__);
+        return -1;
+    }
+
+    part_to_flash_desc(ota_partition, &ota_flash);
+    if (size > ota_flash.fl_size)
+    {
+        platform_printf("%s: image of %u bytes exceeds the partition\n", __func__, size);
+        return -1;
+    }
+
+    ota_dev = flash_drv_open(ota_flash.fl_dev);
+    if (!ota_dev)
+    {
+        platform_printf("%s: failed to open flash\n", __func__);
+        return -1;
+    }
+
+    /* erased up front so that chunks are only written, one after another */
+    if (flash_drv_erase(ota_dev, ota_flash.fl_start, size) != WM_SUCCESS)
+    {
+        platform_printf("%s: failed to erase the partition\n", __func__);
+        flash_drv_close(ota_dev);
+        ota_dev = 0;
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int platform_ota_write(uint32_t offset, const void* data, size_t len)
+{
+    if (!ota_dev || offset + len > ota_flash.fl_size)
+        return -1;
+
+    if (flash_drv_write(ota_dev, (uint8_t*)data, len, ota_flash.fl_start + offset) != WM_SUCCESS)
+        return -1;
+
+    return 0;
+}
+
+
+int platform_ota_finish(int commit)
+{
+    int rc = 0;
+
+    if (!ota_dev)
+        return -1;
+
+    flash_drv_close(ota_dev);
+    ota_dev = 0;
+
+    if (commit && part_set_active_partition(ota_partition) != WM_SUCCESS)
+    {
+        platform_printf("%s: failed to activate the new firmware\n", __func__);
+        rc = -1;
+    }
+
+    return rc;
+}
+
+
+#if !defined(EVRYTHNG_TIME_URL)
+#define EVRYTHNG_TIME_URL "http://time.evrythng.com/time"
+#endif
+
+#define TIME_RESPONSE_MAX_LEN 150
+
+int platform_time_fetch(int64_t* epoch_ms)
+{
+	http_session_t handle;
+	http_resp_t *resp = NULL;
+	char buf[TIME_RESPONSE_MAX_LEN];
+	int64_t timestamp, offset;
+	int size;
+	int rc = -1;
+
+    if (!epoch_ms)
+    {
+        platform_printf("%s: bad args\n", __func__);
+        return -1;
+    }
+
+	if (httpc_get(EVRYTHNG_TIME_URL, &handle, &resp, NULL) != WM_SUCCESS) {
+		platform_printf("%s: getting %s failed\n", __func__, EVRYTHNG_TIME_URL);
+		return -1;
+	}
+
+	size = http_read_content(handle, buf, sizeof buf);
+	if (size <= 0) {
+		platform_printf("%s: reading time failed\n", __func__);
+		goto out;
+	}
+
+	/*
+	  The response looks like this
+	  {
+	  "timestamp":1429514751927
+	  }
+	  and when requested with ?tz=<timezone> it additionally carries
+	  "offset":-18000000
+	*/
+	jobj_t json;
+	if (json_parse_start(&json, buf, size) != WM_SUCCESS) {
+		platform_printf("%s: wrong json string\n", __func__);
+		goto out;
+	}
+
+	if (json_get_val_int64(&json, "timestamp", &timestamp) == WM_SUCCESS) {
+		if (json_get_val_int64(&json, "offset", &offset) != WM_SUCCESS)
+			offset = 0;
+		*epoch_ms = timestamp + offset;
+		rc = 0;
+	}
+
+	json_parse_stop(&json);
+
+out:
+	http_close_session(&handle);
+	return rc;
+}
+
+
+void platform_time_set(int64_t epoch_ms)
+{
+	wmtime_time_set_posix(epoch_ms / 1000);
 }
 
 
@@ -13,12 +13,37 @@
 #include "FreeRTOS.h"
 #include "task.h"
 
+#include "evrythng/connect_backoff.h"
+#include "evrythng/keepalive.h"
+#include "evrythng/stream.h"
+#include "evrythng/transport.h"
+
 typedef struct Timer
 {
 	portTickType xTicksToWait;
 	xTimeOutType xTimeOut;
 } Timer;
 
+/* TLS configuration (CA chain, settings, RNG) shared by all networks
+ * connecting with the same CA, see platform_tls_release_unused() */
+/* elliptic curves a TLS configuration can hold */
+#define TLS_MAX_CURVES 8
+
+typedef struct TlsConfig
+{
+    const char* ca_buf;
+    size_t ca_size;
+
+    wm_mbedtls_cert_t cert;
+    mbedtls_ssl_config* config;
+    int max_frag_len;       /* requested from the server, 0 if not */
+    mbedtls_ecp_group_id curves[TLS_MAX_CURVES + 1];
+
+    int refs;               /* networks currently connected with it */
+    int retired;            /* out of the list, freed with the last ref */
+    struct TlsConfig* next;
+} TlsConfig;
+
 typedef struct Network
 {
     int socket;
@@ -27,9 +52,17 @@ typedef struct Network
     const char* ca_buf;
     size_t ca_size;
 
-    wm_mbedtls_cert_t tls_cert;
-    mbedtls_ssl_config* tls_config;
+    /* only the ssl context is per connection */
+    TlsConfig* tls_config;
     mbedtls_ssl_context* tls_context;
+
+    /* selected by platform_network_connect() */
+    const Transport* transport;
+    void* transport_io;
+
+    PingMonitor monitor;
+    StreamFilter stream;
+    ConnectBackoff backoff;
 } Network;
 
 typedef struct Mutex
@@ -0,0 +1,509 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include "evrythng/platform.h"
+#include "netsim.h"
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+
+/* how long the link threads sleep at most before checking for a close */
+#define POLL_MS 50
+
+typedef struct Segment
+{
+    struct Segment* next;
+    uint64_t due_us;        /* when it arrives at the other side */
+    int len;                /* 0 marks the end of the stream */
+    int off;
+    unsigned char data[];
+} Segment;
+
+/* one direction of a connection */
+typedef struct Link
+{
+    Segment* head;
+    Segment* tail;
+    uint64_t free_us;       /* until then the link is busy serializing */
+    uint64_t last_due_us;   /* segments arrive in order */
+    int bps;
+} Link;
+
+typedef struct NetsimConn
+{
+    const Transport* inner;
+    void* inner_io;
+
+    uint32_t rand;
+    uint64_t reset_us;      /* 0 if the connection is never reset */
+
+    Mutex mutex;
+    Link up;
+    Link down;
+    Semaphore up_ready;     /* posted when a segment is queued */
+    Semaphore down_ready;
+    volatile int reset;
+    volatile int closing;
+    volatile int sending;   /* a segment is being written to inner */
+    volatile int sender_done;
+
+    Thread sender;
+    Thread receiver;
+} NetsimConn;
+
+static NetsimConfig config;
+static int enabled;
+static uint32_t connections;
+
+static NetsimStats stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+
+/* ms to wait for a point in time, at most POLL_MS */
+static int wait_ms(uint64_t until_us)
+{
+    uint64_t now = now_us();
+    if (until_us <= now)
+        return 0;
+    uint64_t ms = (until_us - now + 999) / 1000;
+    return ms < POLL_MS ? (int)ms : POLL_MS;
+}
+
+
+/* xorshift32, deterministic per connection */
+static uint32_t next_rand(NetsimConn* c)
+{
+    uint32_t x = c->rand;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return c->rand = x;
+}
+
+
+void netsim_configure(const NetsimConfig* cfg)
+{
+    pthread_mutex_lock(&stats_mutex);
+
+    enabled = cfg != 0;
+    if (cfg)
+        config = *cfg;
+    connections = 0;
+    memset(&stats, 0, sizeof stats);
+
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+int netsim_enabled(void)
+{
+    return enabled;
+}
+
+
+void netsim_stats(NetsimStats* s)
+{
+    pthread_mutex_lock(&stats_mutex);
+    *s = stats;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+
+/* arrival time of a segment sent now, called with the connection locked */
+static uint64_t schedule(NetsimConn* c, Link* l, int len)
+{
+    uint64_t now = now_us();
+    uint64_t start = l->free_us > now ? l->free_us : now;
+
+    l->free_us = start + (l->bps ? (uint64_t)len * 8 * 1000000 / l->bps : 0);
+
+    uint64_t due = l->free_us + (uint64_t)config.latency_ms * 1000;
+    if (config.jitter_ms)
+        due += (uint64_t)(next_rand(c) % (uint32_t)(config.jitter_ms * 1000 + 1));
+
+    if (config.loss_permille && (int)(next_rand(c) % 1000) < config.loss_permille)
+    {
+        int rto = 2 * config.latency_ms + 4 * config.jitter_ms;
+        due += (uint64_t)(rto > NETSIM_MIN_RTO_MS ? rto : NETSIM_MIN_RTO_MS) * 1000;
+
+        pthread_mutex_lock(&stats_mutex);
+        stats.lost++;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    if (due < l->last_due_us)
+        due = l->last_due_us;
+    l->last_due_us = due;
+
+    return due;
+}
+
+
+static void link_push(Link* l, Segment* s)
+{
+    s->next = 0;
+    if (l->tail)
+        l->tail->next = s;
+    else
+        l->head = s;
+    l->tail = s;
+}
+
+
+static void link_pop(Link* l)
+{
+    Segment* s = l->head;
+
+    l->head = s->next;
+    if (!l->head)
+        l->tail = 0;
+    platform_free(s);
+}
+
+
+static void link_clear(Link* l)
+{
+    while (l->head)
+        link_pop(l);
+}
+
+
+/* queues a segment, returns 0 on success */
+static int send_segment(NetsimConn* c, Link* l, Semaphore* ready, const unsigned char* data, int len)
+{
+    Segment* s = (Segment*)platform_malloc(sizeof(Segment) + len);
+    if (!s)
+        return -1;
+
+    memcpy(s->data, data, len);
+    s->len = len;
+    s->off = 0;
+
+    platform_mutex_lock(&c->mutex);
+    s->due_us = schedule(c, l, len);
+    link_push(l, s);
+    platform_mutex_unlock(&c->mutex);
+
+    platform_semaphore_post(ready);
+
+    pthread_mutex_lock(&stats_mutex);
+    if (l == &c->up)
+    {
+        stats.segments_up++;
+        stats.bytes_up += len;
+    }
+    else
+    {
+        stats.segments_down++;
+        stats.bytes_down += len;
+    }
+    pthread_mutex_unlock(&stats_mutex);
+
+    return 0;
+}
+
+
+/* returns non-zero once the connection is reset */
+static int check_reset(NetsimConn* c)
+{
+    if (c->reset)
+        return 1;
+    if (!c->reset_us || now_us() < c->reset_us)
+        return 0;
+
+    platform_mutex_lock(&c->mutex);
+    int first = !c->reset;
+    c->reset = 1;
+    link_clear(&c->up);
+    link_clear(&c->down);
+    platform_mutex_unlock(&c->mutex);
+
+    /* wakes up a blocked reader */
+    platform_semaphore_post(&c->down_ready);
+    platform_semaphore_post(&c->up_ready);
+
+    if (first)
+    {
+        pthread_mutex_lock(&stats_mutex);
+        stats.resets++;
+        pthread_mutex_unlock(&stats_mutex);
+    }
+
+    return 1;
+}
+
+
+/* writes uplink segments to the inner transport when they are due */
+static void sender_run(void* arg)
+{
+    NetsimConn* c = (NetsimConn*)arg;
+
+    while (!c->closing && !check_reset(c))
+    {
+        platform_mutex_lock(&c->mutex);
+        Segment* s = c->up.head;
+        uint64_t due = s ? s->due_us : now_us() + POLL_MS * 1000;
+        platform_mutex_unlock(&c->mutex);
+
+        int ms = wait_ms(due);
+        if (!s || ms)
+        {
+            platform_semaphore_wait(&c->up_ready, ms ? ms : POLL_MS);
+            continue;
+        }
+
+        /* taken off the link so a reset can't free it meanwhile */
+        platform_mutex_lock(&c->mutex);
+        s = c->up.head;
+        if (s)
+        {
+            c->up.head = s->next;
+            if (!c->up.head)
+                c->up.tail = 0;
+            c->sending = 1;
+        }
+        platform_mutex_unlock(&c->mutex);
+        if (!s)
+            continue;
+
+        int len = s->len;
+        int rc = c->inner->write(c->inner_io, s->data, len, 1000);
+        c->sending = 0;
+        platform_free(s);
+
+        if (rc != len)
+            break;
+    }
+
+    c->sender_done = 1;
+}
+
+
+/* reads what the peer sent and queues it as downlink segments */
+static void receiver_run(void* arg)
+{
+    NetsimConn* c = (NetsimConn*)arg;
+    unsigned char buf[NETSIM_MSS];
+
+    while (!c->closing && !check_reset(c))
+    {
+        int rc = c->inner->read(c->inner_io, buf, 1, POLL_MS);
+        if (rc < 0)
+            continue;
+
+        if (rc == 0)
+        {
+            /* the end of the stream arrives after the data */
+            send_segment(c, &c->down, &c->down_ready, buf, 0);
+            break;
+        }
+
+        /* whatever else has arrived goes into the same segment */
+        int len = 1;
+        while (len < NETSIM_MSS && c->inner->read(c->inner_io, buf + len, 1, 0) == 1)
+            len++;
+
+        if (send_segment(c, &c->down, &c->down_ready, buf, len) != 0)
+            break;
+    }
+}
+
+
+void* netsim_open(const Transport* inner, void* inner_io)
+{
+    NetsimConn* c = (NetsimConn*)platform_malloc(sizeof(NetsimConn));
+    if (!c)
+        return 0;
+    memset(c, 0, sizeof(NetsimConn));
+
+    c->inner = inner;
+    c->inner_io = inner_io;
+    c->up.bps = config.uplink_bps;
+    c->down.bps = config.downlink_bps;
+
+    pthread_mutex_lock(&stats_mutex);
+    uint32_t number = ++connections;
+    stats.connections++;
+    pthread_mutex_unlock(&stats_mutex);
+
+    c->rand = (config.seed * 2654435761u) ^ (number * 0x9E3779B9u);
+    if (!c->rand)
+        c->rand = 1;
+
+    /* TCP handshake */
+    uint64_t rtt_us = (uint64_t)config.latency_ms * 2000;
+    if (config.jitter_ms)
+        rtt_us += next_rand(c) % (uint32_t)(config.jitter_ms * 1000 + 1);
+    platform_sleep((int)(rtt_us / 1000));
+
+    /* uniform in 0..2 * mean */
+    if (config.reset_mean_ms)
+        c->reset_us = now_us() + (uint64_t)(next_rand(c) % (uint32_t)(2 * config.reset_mean_ms + 1)) * 1000;
+
+    platform_mutex_init(&c->mutex);
+    platform_semaphore_init(&c->up_ready);
+    platform_semaphore_init(&c->down_ready);
+
+    if (platform_thread_create(&c->sender, 0, "netsim_up", sender_run, 0, c) != 0)
+        goto fail;
+    if (platform_thread_create(&c->receiver, 0, "netsim_down", receiver_run, 0, c) != 0)
+    {
+        c->closing = 1;
+        platform_thread_join(&c->sender, -1);
+        platform_thread_destroy(&c->sender);
+        goto fail;
+    }
+
+    return c;
+
+fail:
+    platform_semaphore_deinit(&c->up_ready);
+    platform_semaphore_deinit(&c->down_ready);
+    platform_mutex_deinit(&c->mutex);
+    platform_free(c);
+    return 0;
+}
+
+
+static int netsim_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    NetsimConn* c = (NetsimConn*)io;
+    uint64_t deadline = now_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+
+    for (;;)
+    {
+        if (check_reset(c))
+            return 0;
+
+        platform_mutex_lock(&c->mutex);
+
+        /* bytes arrived, consumed only once len of them are there */
+        uint64_t now = now_us();
+        uint64_t next_due = deadline;
+        int avail = 0, eof = 0;
+        Segment* s;
+        for (s = c->down.head; s && avail < len; s = s->next)
+        {
+            if (s->due_us > now)
+            {
+                next_due = s->due_us;
+                break;
+            }
+            if (!s->len)
+            {
+                eof = 1;
+                break;
+            }
+            avail += s->len - s->off;
+        }
+
+        if (avail >= len)
+        {
+            int bytes = 0;
+            while (bytes < len)
+            {
+                s = c->down.head;
+                int n = s->len - s->off < len - bytes ? s->len - s->off : len - bytes;
+                memcpy(buffer + bytes, s->data + s->off, n);
+                s->off += n;
+                bytes += n;
+                if (s->off == s->len)
+                    link_pop(&c->down);
+            }
+            platform_mutex_unlock(&c->mutex);
+            return bytes;
+        }
+
+        platform_mutex_unlock(&c->mutex);
+
+        if (eof)
+            return 0;
+        if (now >= deadline)
+            return -1;
+
+        if (next_due > deadline)
+            next_due = deadline;
+        platform_semaphore_wait(&c->down_ready, wait_ms(next_due));
+    }
+}
+
+
+static int netsim_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    NetsimConn* c = (NetsimConn*)io;
+    uint64_t deadline = now_us() + (uint64_t)(timeout_ms > 0 ? timeout_ms : 0) * 1000;
+    int bytes = 0;
+
+    while (bytes < len)
+    {
+        if (check_reset(c))
+            return -1;
+
+        /* blocks while the uplink is NETSIM_SEND_BUFFER behind */
+        if (c->up.bps)
+        {
+            platform_mutex_lock(&c->mutex);
+            uint64_t drained = c->up.free_us > (uint64_t)NETSIM_SEND_BUFFER * 8 * 1000000 / c->up.bps ?
+                c->up.free_us - (uint64_t)NETSIM_SEND_BUFFER * 8 * 1000000 / c->up.bps : 0;
+            platform_mutex_unlock(&c->mutex);
+
+            if (drained > now_us())
+            {
+                if (now_us() >= deadline)
+                    break;
+                platform_sleep(wait_ms(drained < deadline ? drained : deadline));
+                continue;
+            }
+        }
+
+        int n = len - bytes < NETSIM_MSS ? len - bytes : NETSIM_MSS;
+        if (send_segment(c, &c->up, &c->up_ready, buffer + bytes, n) != 0)
+            break;
+        bytes += n;
+    }
+
+    return bytes ? bytes : -1;
+}
+
+
+static void netsim_close(void* io)
+{
+    NetsimConn* c = (NetsimConn*)io;
+
+    /* like TCP, data written before the close is still delivered */
+    while ((c->up.head || c->sending) && !c->sender_done && !check_reset(c))
+        platform_sleep(1);
+
+    c->closing = 1;
+    platform_semaphore_post(&c->up_ready);
+    platform_semaphore_post(&c->down_ready);
+
+    platform_thread_join(&c->sender, -1);
+    platform_thread_destroy(&c->sender);
+    platform_thread_join(&c->receiver, -1);
+    platform_thread_destroy(&c->receiver);
+
+    /* the peer sees the connection closed only now */
+    c->inner->close(c->inner_io);
+
+    link_clear(&c->up);
+    link_clear(&c->down);
+    platform_semaphore_deinit(&c->up_ready);
+    platform_semaphore_deinit(&c->down_ready);
+    platform_mutex_deinit(&c->mutex);
+    platform_free(c);
+}
+
+
+const Transport netsim_transport = { "netsim", netsim_read, netsim_write, netsim_close };
@@ -0,0 +1,76 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_NETSIM_H_)
+#define _NETSIM_H_
+
+#include <stdint.h>
+
+#include "evrythng/transport.h"
+
+/*
+ * Network condition simulator of the host port. Once configured, every
+ * connection made by platform_network_connect() (TCP or loopback) is wrapped
+ * into a transport adding latency, jitter, a bandwidth cap, segment loss
+ * and connection resets.
+ *
+ * Data is cut into segments of up to NETSIM_MSS bytes. A lost segment is
+ * retransmitted after the retransmission timeout, as TCP would, so loss
+ * shows as delay and head-of-line blocking rather than missing data. A
+ * reset drops everything in flight: reads return 0, writes fail.
+ *
+ * Loss, jitter and reset times are drawn from a random generator seeded
+ * per connection from the configured seed and the connection number, so a
+ * run is repeated exactly with the same seed.
+ */
+
+#define NETSIM_MSS 1460
+
+/* minimum retransmission timeout, as Linux */
+#define NETSIM_MIN_RTO_MS 200
+
+/* bytes a writer can queue beyond what the uplink has sent */
+#define NETSIM_SEND_BUFFER 8192
+
+typedef struct NetsimConfig
+{
+    int latency_ms;         /* one way */
+    int jitter_ms;          /* added to the latency, uniform in 0..jitter_ms */
+    int uplink_bps;         /* bits per second, 0 for unlimited */
+    int downlink_bps;
+    int loss_permille;      /* segments lost per 1000 */
+    int reset_mean_ms;      /* mean connection lifetime, 0 for no resets */
+    uint32_t seed;
+} NetsimConfig;
+
+typedef struct NetsimStats
+{
+    uint32_t connections;
+    uint32_t resets;
+    uint32_t segments_up;
+    uint32_t segments_down;
+    uint32_t lost;          /* segments retransmitted */
+    uint64_t bytes_up;
+    uint64_t bytes_down;
+} NetsimStats;
+
+extern const Transport netsim_transport;
+
+/** @brief Simulates config on connections made from now on, NULL turns
+ *         the simulation off. Resets the connection numbering and stats.
+ */
+void netsim_configure(const NetsimConfig* config);
+
+int netsim_enabled(void);
+
+/** @brief Wraps a connected transport, taking one round trip for the TCP
+ *         handshake. Returns the io of netsim_transport or NULL. Closing
+ *         it closes inner.
+ */
+void* netsim_open(const Transport* inner, void* inner_io);
+
+void netsim_stats(NetsimStats* stats);
+
+#endif //_NETSIM_H_
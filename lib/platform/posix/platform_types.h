@@ -0,0 +1,58 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#if !defined(_MQTT_POSIX_)
+#define _MQTT_POSIX_
+
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#include "evrythng/connect_backoff.h"
+#include "evrythng/keepalive.h"
+#include "evrythng/stream.h"
+#include "evrythng/transport.h"
+
+/* Host (Linux) port used for benchmarks, tools and tests. */
+
+typedef struct Timer
+{
+    struct timespec end_time;
+} Timer;
+
+typedef struct Network
+{
+    int socket;
+    int tls_enabled;
+
+    /* selected by platform_network_connect() */
+    const Transport* transport;
+    void* transport_io;
+
+    PingMonitor monitor;
+    StreamFilter stream;
+    ConnectBackoff backoff;
+} Network;
+
+typedef struct Mutex
+{
+    pthread_mutex_t mutex;
+} Mutex;
+
+typedef struct Semaphore
+{
+    sem_t sem;
+} Semaphore;
+
+typedef struct Thread
+{
+    pthread_t tid;
+    void* arg;
+    void (*func)(void*);
+    Semaphore join_sem;
+} Thread;
+
+#endif //_MQTT_POSIX_
@@ -0,0 +1,1074 @@
+/*
+ * (c) Copyright 2012 EVRYTHNG Ltd London / Zurich
+ * www.evrythng.com
+ */
+
+#include "evrythng/platform.h"
+#include "evrythng/platform_ext.h"
+#include "evrythng/capture.h"
+#include "evrythng/outbox.h"
+#include "netsim.h"
+
+#include <stdint.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+/* deadlines of the armed SDK timers, see the Marvell port */
+#define TIMER_SLOTS 16
+
+static struct
+{
+    const Timer* timer;
+    uint32_t expiry_ms;
+} deadlines[TIMER_SLOTS];
+static pthread_mutex_t deadlines_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static WakeupStats wakeups;
+static uint32_t wakeups_period_start;
+static pthread_mutex_t wakeups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void now(struct timespec* ts)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+
+/* a - b in ms */
+static long timespec_diff_ms(const struct timespec* a, const struct timespec* b)
+{
+    return (a->tv_sec - b->tv_sec) * 1000 + (a->tv_nsec - b->tv_nsec) / 1000000;
+}
+
+
+uint32_t platform_uptime_ms(void)
+{
+    struct timespec ts;
+    now(&ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+
+uint32_t platform_uptime_us(void)
+{
+    struct timespec ts;
+    now(&ts);
+    return (uint32_t)(ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+
+static void deadline_set(const Timer* t, uint32_t expiry_ms)
+{
+    int i, slot = -1;
+
+    pthread_mutex_lock(&deadlines_mutex);
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (deadlines[i].timer == t)
+        {
+            slot = i;
+            break;
+        }
+        if (!deadlines[i].timer && slot < 0)
+            slot = i;
+    }
+
+    if (slot >= 0)
+    {
+        deadlines[slot].timer = t;
+        deadlines[slot].expiry_ms = expiry_ms;
+    }
+    pthread_mutex_unlock(&deadlines_mutex);
+}
+
+
+static void deadline_clear(const Timer* t)
+{
+    int i;
+
+    pthread_mutex_lock(&deadlines_mutex);
+    for (i = 0; i < TIMER_SLOTS; i++)
+        if (deadlines[i].timer == t)
+            deadlines[i].timer = 0;
+    pthread_mutex_unlock(&deadlines_mutex);
+}
+
+
+static void wakeup_count(uint32_t* counter)
+{
+    pthread_mutex_lock(&wakeups_mutex);
+    (*counter)++;
+    pthread_mutex_unlock(&wakeups_mutex);
+}
+
+
+void platform_timer_init(Timer* t)
+{
+    if (!t)
+    {
+        platform_printf("%s: invalid timer\n", __func__);
+        return;
+    }
+
+    memset(&t->end_time, 0, sizeof(t->end_time));
+}
+
+
+void platform_timer_deinit(Timer* t)
+{
+    if (!t)
+    {
+        platform_printf("%s: invalid timer\n", __func__);
+        return;
+    }
+
+    deadline_clear(t);
+}
+
+
+char platform_timer_isexpired(Timer* t)
+{
+    if (!t)
+    {
+        platform_printf("%s: invalid timer\n", __func__);
+        return -1;
+    }
+
+    return platform_timer_left(t) == 0;
+}
+
+
+void platform_timer_countdown(Timer* t, unsigned int ms)
+{
+    if (!t)
+    {
+        platform_printf("%s: invalid timer\n", __func__);
+        return;
+    }
+
+    now(&t->end_time);
+    t->end_time.tv_sec += ms / 1000;
+    t->end_time.tv_nsec += (ms % 1000) * 1000000L;
+    if (t->end_time.tv_nsec >= 1000000000L)
+    {
+        t->end_time.tv_sec++;
+        t->end_time.tv_nsec -= 1000000000L;
+    }
+    deadline_set(t, platform_uptime_ms() + ms);
+}
+
+
+int platform_timer_left(Timer* t)
+{
+    struct timespec ts;
+
+    if (!t)
+    {
+        platform_printf("%s: invalid timer\n", __func__);
+        return 0;
+    }
+
+    now(&ts);
+    long left = timespec_diff_ms(&t->end_time, &ts);
+    if (left > 0)
+        return (int)left;
+
+    deadline_clear(t);
+    return 0;
+}
+
+
+int platform_timer_next_deadline(void)
+{
+    int i;
+    int32_t next = -1;
+    uint32_t now = platform_uptime_ms();
+
+    pthread_mutex_lock(&deadlines_mutex);
+    for (i = 0; i < TIMER_SLOTS; i++)
+    {
+        if (!deadlines[i].timer)
+            continue;
+
+        int32_t left = (int32_t)(deadlines[i].expiry_ms - now);
+        if (left <= 0)
+        {
+            /* reported as due once */
+            deadlines[i].timer = 0;
+            left = 0;
+        }
+
+        if (next < 0 || left < next)
+            next = left;
+    }
+    pthread_mutex_unlock(&deadlines_mutex);
+
+    return (int)next;
+}
+
+
+void platform_wakeup_stats(WakeupStats* stats)
+{
+    if (!stats)
+    {
+        platform_printf("%s: invalid stats\n", __func__);
+        return;
+    }
+
+    pthread_mutex_lock(&wakeups_mutex);
+    *stats = wakeups;
+    stats->period_ms = platform_uptime_ms() - wakeups_period_start;
+    pthread_mutex_unlock(&wakeups_mutex);
+
+    stats->per_minute = stats->period_ms ?
+        (uint32_t)(((uint64_t)(stats->sleeps + stats->read_timeouts + stats->reads) * 60000) / stats->period_ms) : 0;
+}
+
+
+void platform_wakeup_stats_reset(void)
+{
+    pthread_mutex_lock(&wakeups_mutex);
+    memset(&wakeups, 0, sizeof wakeups);
+    wakeups_period_start = platform_uptime_ms();
+    pthread_mutex_unlock(&wakeups_mutex);
+}
+
+
+void platform_network_init(Network* n)
+{
+    if (!n)
+    {
+        platform_printf("%s: invalid network\n", __func__);
+        return;
+    }
+
+    memset(n, 0, sizeof(Network));
+    n->socket = -1;
+}
+
+
+void platform_network_securedinit(Network* n, const char* ca_buf, size_t ca_size)
+{
+    if (!n || !ca_buf || !ca_size)
+    {
+        platform_printf("%s: bad args\n", __func__);
+        return;
+    }
+
+    memset(n, 0, sizeof(Network));
+    n->socket = -1;
+    n->tls_enabled = 1;
+}
+
+
+static int tcp_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+    struct timespec start, ts;
+    int bytes = 0;
+
+    now(&start);
+
+    while (bytes < len)
+    {
+        now(&ts);
+        long left = timeout_ms - timespec_diff_ms(&ts, &start);
+        if (left < 0) left = 0;
+
+        struct pollfd pfd = { n->socket, POLLIN, 0 };
+        int rc = poll(&pfd, 1, (int)left);
+        if (rc == 0)
+        {
+            /* timeout */
+            bytes = -1;
+            break;
+        }
+        if (rc < 0)
+        {
+            if (errno == EINTR) continue;
+            bytes = -1;
+            break;
+        }
+
+        rc = recv(n->socket, &buffer[bytes], (size_t)(len - bytes), 0);
+        if (rc == 0)
+        {
+            bytes = 0;
+            break;
+        }
+        else if (rc < 0)
+        {
+            if (errno == EINTR || errno == EAGAIN) continue;
+            bytes = 0;
+            break;
+        }
+
+        bytes += rc;
+    }
+
+    return bytes;
+}
+
+
+static int tcp_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+    struct timeval tv;
+
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(n->socket, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof tv);
+
+    return send(n->socket, buffer, len, MSG_NOSIGNAL);
+}
+
+
+static void tcp_close(void* io)
+{
+    Network* n = (Network*)io;
+
+    shutdown(n->socket, SHUT_RDWR);
+    close(n->socket);
+    n->socket = -1;
+}
+
+
+static const Transport tcp_transport = { "tcp", tcp_read, tcp_write, tcp_close };
+
+
+/* puts the network condition simulator between the SDK and the connection */
+static int netsim_wrap(Network* n)
+{
+    if (!netsim_enabled())
+        return 0;
+
+    void* io = netsim_open(n->transport, n->transport_io);
+    if (!io) {
+        n->transport->close(n->transport_io);
+        n->transport = 0;
+        n->transport_io = 0;
+        return -1;
+    }
+
+    n->transport = &netsim_transport;
+    n->transport_io = io;
+
+    return 0;
+}
+
+
+static FILE* capture_file;
+
+
+static void capture_file_sink(void* ctx, const uint8_t* header, const uint8_t* data, size_t len)
+{
+    FILE* f = (FILE*)ctx;
+
+    fwrite(header, 1, CAPTURE_HEADER_SIZE, f);
+    fwrite(data, 1, len, f);
+    fflush(f);
+}
+
+
+/* EVRYTHNG_CAPTURE_PATH records the connections of the process to a file,
+ * EVRYTHNG_REPLAY_PATH replays one instead of connecting */
+static void capture_env_init(void)
+{
+    static int done;
+    const char* path;
+
+    if (done)
+        return;
+    done = 1;
+
+    if ((path = getenv("EVRYTHNG_CAPTURE_PATH")) != NULL) {
+        capture_file = fopen(path, "wb");
+        if (!capture_file || capture_start(capture_file_sink, capture_file) != 0)
+            platform_printf("%s: failed to capture to %s\n", __func__, path);
+    }
+
+    if ((path = getenv("EVRYTHNG_REPLAY_PATH")) != NULL) {
+        FILE* f = fopen(path, "rb");
+        uint8_t* data = NULL;
+        long len = -1;
+
+        if (f && fseek(f, 0, SEEK_END) == 0 && (len = ftell(f)) >= 0 && fseek(f, 0, SEEK_SET) == 0 &&
+                (data = (uint8_t*)malloc(len ? len : 1)) != NULL && fread(data, 1, len, f) == (size_t)len &&
+                replay_start(data, len) == 0) {
+            platform_printf("%s: replaying %s\n", __func__, path);
+        } else {
+            platform_printf("%s: failed to replay %s\n", __func__, path);
+            free(data);
+        }
+        if (f)
+            fclose(f);
+    }
+}
+
+
+/* layers over the connection just made */
+static int connected(Network* n)
+{
+    if (netsim_wrap(n) != 0)
+        return -1;
+
+    return capture_wrap(&n->transport, &n->transport_io);
+}
+
+
+int platform_network_connect(Network* n, char* hostname, int port)
+{
+    int rc;
+    char service[8];
+    struct addrinfo* result = NULL;
+    struct addrinfo* res;
+    struct addrinfo hints;
+
+    if (!n) {
+        platform_printf("%s: invalid network\n", __func__);
+        return -1;
+    }
+
+    capture_env_init();
+
+    /* a replayed capture takes precedence over the network, see replay_start() */
+    void* replay = replay_connect();
+    if (replay) {
+        n->transport = &replay_transport;
+        n->transport_io = replay;
+        return 0;
+    }
+
+    /* backoff and jitter for the core's reconnects too, see EvrythngReconnectPace() */
+    if (connect_backoff_before(&n->backoff) != 0)
+        return -1;
+
+    /* so does a local listener, see loopback_listen() */
+    LoopbackEnd* end = loopback_connect(hostname);
+    if (end) {
+        n->transport = &loopback_transport;
+        n->transport_io = end;
+        return connected(n);
+    }
+
+    if (n->tls_enabled) {
+        platform_printf("%s: TLS is not supported by the host port\n", __func__);
+        return -1;
+    }
+
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    snprintf(service, sizeof service, "%d", port);
+
+    if ((rc = getaddrinfo(hostname, service, &hints, &result)) != 0) {
+        platform_printf("failed to resolve hostname %s: %s\n", hostname, gai_strerror(rc));
+        return -1;
+    }
+
+    rc = -1;
+    for (res = result; res; res = res->ai_next) {
+        n->socket = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+        if (n->socket == -1)
+            continue;
+
+        if ((rc = connect(n->socket, res->ai_addr, res->ai_addrlen)) == 0)
+            break;
+
+        close(n->socket);
+        n->socket = -1;
+    }
+    freeaddrinfo(result);
+
+    if (rc != 0) {
+        platform_printf("failed to connect to %s:%d, errno = %d\n", hostname, port, errno);
+        return rc;
+    }
+
+    int one = 1;
+    setsockopt(n->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof one);
+
+    n->transport = &tcp_transport;
+    n->transport_io = n;
+
+    return connected(n);
+}
+
+
+void platform_network_disconnect(Network* n)
+{
+    if (!n)
+    {
+        platform_printf("%s: invalid network\n", __func__);
+        return;
+    }
+
+    if (n->transport)
+        n->transport->close(n->transport_io);
+    n->transport = 0;
+    n->transport_io = 0;
+
+    int was_connected = n->monitor.connected;
+    ping_monitor_on_closed(&n->monitor);
+    stream_filter_reset(&n->stream);
+    outbox_on_closed(n, was_connected);
+    connect_backoff_on_closed(&n->backoff, was_connected);
+}
+
+
+static int raw_read(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+
+    return n->transport->read(n->transport_io, buffer, len, timeout_ms);
+}
+
+
+/* writes of the SDK itself: queued packets, PUBACKs and pings */
+static int raw_write(void* io, unsigned char* buffer, int len, int timeout_ms)
+{
+    Network* n = (Network*)io;
+
+    int rc = n->transport->write(n->transport_io, buffer, len, timeout_ms);
+
+    if (rc > 0)
+        ping_monitor_on_write(&n->monitor, buffer, rc);
+
+    return rc;
+}
+
+
+int platform_network_read(Network* n, unsigned char* buffer, int len, int timeout_ms)
+{
+    if (!n || !n->transport)
+    {
+        platform_printf("%s: invalid network\n", __func__);
+        return -1;
+    }
+
+    /* packets of the SDK's own publishes go out here, under the client's lock */
+    /* answer to a ping of the client */
+    int bytes = ping_monitor_take_pingresp(&n->monitor, buffer, len);
+    if (bytes)
+    {
+        wakeup_count(&wakeups.reads);
+        return bytes;
+    }
+
+    outbox_flush(n, raw_write, n);
+
+    /* between packets the read returns for the next SDK timer (keepalive,
+     * retransmits) instead of sleeping past it, a read in the middle of a
+     * packet would fail if it returned early */
+    int next_ms = platform_timer_next_deadline();
+    if (next_ms >= 0 && (timeout_ms < 0 || next_ms < timeout_ms) && stream_filter_idle(&n->stream))
+        timeout_ms = next_ms;
+
+    bytes = stream_filter_read(&n->stream, raw_read, raw_write, n, buffer, len, timeout_ms);
+
+    if (!bytes)
+    {
+        platform_printf("%s:%d: connection closed by the peer\n", __func__, __LINE__);
+        int was_connected = n->monitor.connected;
+        ping_monitor_on_closed(&n->monitor);
+        outbox_on_closed(n, was_connected);
+        connect_backoff_on_closed(&n->backoff, was_connected);
+    }
+    else if (bytes < 0)
+    {
+        wakeup_count(&wakeups.read_timeouts);
+
+        /* keepalive pings at the probed interval, see ping_monitor_on_idle() */
+        switch (ping_monitor_on_idle(&n->monitor))
+        {
+            case PING_MONITOR_SEND_PING:
+            {
+                unsigned char pingreq[2] = { 0xC0, 0 };
+                raw_write(n, pingreq, sizeof pingreq, timeout_ms);
+                break;
+            }
+            case PING_MONITOR_LOST:
+                platform_printf("%s: ping timed out\n", __func__);
+                return 0;
+            default:
+                break;
+        }
+    }
+    else
+    {
+        wakeup_count(&wakeups.reads);
+        int was_connected = n->monitor.connected;
+        ping_monitor_on_read(&n->monitor, buffer, bytes);
+        if (!was_connected && n->monitor.connected)
+        {
+            outbox_on_connected(n);
+            connect_backoff_on_connected(&n->backoff);
+        }
+    }
+
+    return bytes;
+}
+
+
+int platform_network_write(Network* n, unsigned char* buffer, int length, int timeout_ms)
+{
+    if (!n || !n->transport)
+    {
+        platform_printf("%s: invalid network\n", __func__);
+        return -1;
+    }
+
+    /* the probe pings at the keepalive interval it searches, the client's
+     * pings are answered here, see ping_monitor_absorb() */
+    if (stream_filter_idle(&n->stream) && ping_monitor_absorb(&n->monitor, buffer, length))
+        return length;
+
+    unsigned short keepalive_s;
+    int keepalive_pos = ping_monitor_on_connect(&n->monitor, buffer, length, &keepalive_s);
+
+    /* the client's packet ids may collide with the ones the SDK reserved */
+    unsigned short client_id;
+    int id_pos = outbox_on_write(n, buffer, length, &client_id);
+
+    int rc = raw_write(n, buffer, length, timeout_ms);
+
+    if (id_pos >= 0)
+    {
+        buffer[id_pos] = client_id >> 8;
+        buffer[id_pos + 1] = client_id & 0xFF;
+    }
+    if (keepalive_pos >= 0)
+    {
+        buffer[keepalive_pos] = keepalive_s >> 8;
+        buffer[keepalive_pos + 1] = keepalive_s & 0xFF;
+    }
+
+    return rc;
+}
+
+
+void platform_mutex_init(Mutex* m)
+{
+    if (!m)
+    {
+        platform_printf("%s: invalid mutex %p\n", __func__, m);
+        return;
+    }
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setprotocol(&attr, PTHREAD_PRIO_INHERIT);
+
+    if (pthread_mutex_init(&m->mutex, &attr) != 0)
+        platform_printf("%s: failed to create mutex\n", __func__);
+
+    pthread_mutexattr_destroy(&attr);
+}
+
+
+int platform_mutex_lock(Mutex* m)
+{
+    if (!m)
+    {
+        platform_printf("%s: invalid mutex %p\n", __func__, m);
+        return -1;
+    }
+
+    if (pthread_mutex_lock(&m->mutex) != 0)
+    {
+        platform_printf("%s: failed to lock mutex %p\n", __func__, m);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int platform_mutex_unlock(Mutex* m)
+{
+    if (!m)
+    {
+        platform_printf("%s: invalid mutex %p\n", __func__, m);
+        return -1;
+    }
+
+    if (pthread_mutex_unlock(&m->mutex) != 0)
+    {
+        platform_printf("%s: failed to UNlock mutex %p\n", __func__, m);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+void platform_mutex_deinit(Mutex* m)
+{
+    if (!m)
+    {
+        platform_printf("%s: invalid mutex %p\n", __func__, m);
+        return;
+    }
+
+    pthread_mutex_destroy(&m->mutex);
+}
+
+
+void platform_semaphore_init(Semaphore* s)
+{
+    if (!s)
+    {
+        platform_printf("%s: invalid semaphore %p\n", __func__, s);
+        return;
+    }
+
+    if (sem_init(&s->sem, 0, 0) != 0)
+        platform_printf("%s: failed to create semaphore\n", __func__);
+}
+
+
+void platform_semaphore_deinit(Semaphore* s)
+{
+    if (!s)
+    {
+        platform_printf("%s: invalid semaphore %p\n", __func__, s);
+        return;
+    }
+
+    if (sem_destroy(&s->sem) != 0)
+        platform_printf("%s: failed to delete semaphore\n", __func__);
+}
+
+
+int platform_semaphore_post(Semaphore* s)
+{
+    if (!s)
+    {
+        platform_printf("%s: invalid semaphore %p\n", __func__, s);
+        return -1;
+    }
+
+    if (sem_post(&s->sem) != 0)
+    {
+        platform_printf("%s: failed to post semaphore\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int platform_semaphore_wait(Semaphore* s, int timeout_ms)
+{
+    struct timespec ts;
+    int rc;
+
+    if (!s)
+    {
+        platform_printf("%s: invalid semaphore %p\n", __func__, s);
+        return -1;
+    }
+
+    if (timeout_ms < 0)
+    {
+        while ((rc = sem_wait(&s->sem)) != 0 && errno == EINTR);
+        return rc ? -1 : 0;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+
+    while ((rc = sem_timedwait(&s->sem, &ts)) != 0 && errno == EINTR);
+
+    return rc ? -1 : 0;
+}
+
+
+static void* func_wrapper(void* arg)
+{
+    Thread* t = (Thread*)arg;
+    (*t->func)(t->arg);
+
+    platform_semaphore_post(&t->join_sem);
+
+    return 0;
+}
+
+
+int platform_thread_create(Thread* t,
+        int priority,
+        const char* name,
+        void (*func)(void*),
+        size_t stack_size,
+        void* arg)
+{
+    pthread_attr_t attr;
+
+    (void)priority;
+    (void)name;
+
+    if (!t) return -1;
+
+    t->func = func;
+    t->arg = arg;
+
+    platform_semaphore_init(&t->join_sem);
+
+    if (stack_size < PTHREAD_STACK_MIN)
+        stack_size = PTHREAD_STACK_MIN;
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, stack_size);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+    int rc = pthread_create(&t->tid, &attr, func_wrapper, t);
+    pthread_attr_destroy(&attr);
+
+    if (rc != 0)
+    {
+        platform_semaphore_deinit(&t->join_sem);
+        platform_printf("%s: failed to create thread: rc = %d\n", __func__, rc);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int platform_thread_join(Thread* t, int timeout_ms)
+{
+    if (!t) return -1;
+
+    if (platform_semaphore_wait(&t->join_sem, timeout_ms) != 0)
+    {
+        platform_printf("%s: timeout waiting for join\n", __func__);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int platform_thread_destroy(Thread* t)
+{
+    if (!t) return -1;
+
+    /* threads are detached, there is nothing to reclaim */
+    platform_semaphore_deinit(&t->join_sem);
+
+    return 0;
+}
+
+
+void* platform_malloc(size_t bytes)
+{
+    return malloc(bytes);
+}
+
+
+void* platform_realloc(void* ptr, size_t bytes)
+{
+    return realloc(ptr, bytes);
+}
+
+
+void platform_free(void* memory)
+{
+    free(memory);
+}
+
+
+void platform_sleep(int ms)
+{
+    struct timespec ts = { ms / 1000, (ms % 1000) * 1000000L };
+
+    while (nanosleep(&ts, &ts) != 0 && errno == EINTR);
+    wakeup_count(&wakeups.sleeps);
+}
+
+
+int platform_sleep_until_deadline(int max_ms)
+{
+    int ms = platform_timer_next_deadline();
+
+    if (ms < 0 || (max_ms >= 0 && ms > max_ms))
+        ms = max_ms;
+
+    if (ms < 0)
+        return 0;
+
+    uint32_t start = platform_uptime_ms();
+    platform_sleep(ms);
+
+    return (int)(platform_uptime_ms() - start);
+}
+
+
+/* the host clock is kept in sync by the operating system */
+int platform_time_fetch(int64_t* epoch_ms)
+{
+    struct timespec ts;
+
+    if (!epoch_ms)
+    {
+        platform_printf("%s: bad args\n", __func__);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    *epoch_ms = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+    return 0;
+}
+
+
+void platform_time_set(int64_t epoch_ms)
+{
+    (void)epoch_ms;
+}
+
+
+/* no TLS on the host, see bench_handshake for comparing suites */
+int platform_tls_configure(const int* ciphersuites, const int* curves)
+{
+    (void)ciphersuites;
+    (void)curves;
+
+    return 0;
+}
+
+
+int platform_tls_pin(const unsigned char* spki_sha256)
+{
+    (void)spki_sha256;
+
+    return 0;
+}
+
+
+int platform_tls_release_unused(void)
+{
+    return 0;
+}
+
+
+void platform_tls_stats(TlsStats* stats)
+{
+    if (!stats)
+    {
+        platform_printf("%s: invalid stats\n", __func__);
+        return;
+    }
+
+    memset(stats, 0, sizeof(TlsStats));
+}
+
+
+/* the firmware "partition" is a file, renamed to its final name on commit */
+#if !defined(POSIX_OTA_PATH)
+#define POSIX_OTA_PATH "evrythng_ota.bin"
+#endif
+
+static FILE* ota_file;
+
+static const char* ota_path(void)
+{
+    const char* path = getenv("EVRYTHNG_OTA_PATH");
+    return path ? path : POSIX_OTA_PATH;
+}
+
+
+int platform_ota_begin(uint32_t size)
+{
+    char tmp[PATH_MAX];
+    (void)size;
+
+    if (ota_file)
+        platform_ota_finish(0);
+
+    snprintf(tmp, sizeof tmp, "%s.part", ota_path());
+    if (!(ota_file = fopen(tmp, "wb")))
+    {
+        platform_printf("%s: failed to open %s\n", __func__, tmp);
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int platform_ota_write(uint32_t offset, const void* data, size_t len)
+{
+    if (!ota_file || fseek(ota_file, offset, SEEK_SET) || fwrite(data, 1, len, ota_file) != len)
+        return -1;
+
+    return 0;
+}
+
+
+int platform_ota_finish(int commit)
+{
+    char tmp[PATH_MAX];
+
+    if (!ota_file)
+        return -1;
+
+    int rc = fclose(ota_file) ? -1 : 0;
+    ota_file = NULL;
+
+    snprintf(tmp, sizeof tmp, "%s.part", ota_path());
+    if (commit && !rc)
+        rc = rename(tmp, ota_path()) ? -1 : 0;
+    else
+        remove(tmp);
+
+    return rc;
+}
+
+
+int platform_printf(const char* fmt, ...)
+{
+    va_list vl;
+    va_start(vl, fmt);
+
+    int rc = vprintf(fmt, vl);
+
+    va_end(vl);
+
+    fflush(stdout);
+
+    return rc;
+}
+
+
+int platform_rand()
+{
+    static int seeded;
+
+    if (!seeded)
+    {
+        srand((unsigned)time(NULL) ^ (unsigned)getpid());
+        seeded = 1;
+    }
+
+    return rand();
+}